@@ -1,8 +1,12 @@
 #include "cmd_options.h"
 #include <glib.h>
 
-AppFlags app_flags = { NULL, NULL, NULL, FALSE, NULL };
-DebugFlags debug_flags = { FALSE, FALSE, FALSE };
+AppFlags app_flags = {
+    NULL, NULL, NULL, FALSE, NULL, NULL, FALSE, FALSE, FALSE
+};
+DebugFlags debug_flags = {
+    FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, FALSE, NULL
+};
 
 const GOptionEntry cmd_options[] = { // freed before exit
     { "version",
@@ -31,7 +35,7 @@ const GOptionEntry cmd_options[] = { // freed before exit
       0,
       G_OPTION_ARG_FILENAME,
       &app_flags.json_path,
-      "Specify the path to the JSON file",
+      "Specify the path to the JSON file, gzipped if it ends in .gz",
       NULL },
     { "debug",
       'd',
@@ -45,8 +49,36 @@ const GOptionEntry cmd_options[] = { // freed before exit
       0,
       G_OPTION_ARG_FILENAME_ARRAY,
       &app_flags.import_paths,
-      "Import file(s) or directory(ies)",
+      "Import file(s) or directory(ies), .jsonl/.ndjson files as records",
       "File..." },
+    { "export",
+      'e',
+      0,
+      G_OPTION_ARG_FILENAME,
+      &app_flags.export_path,
+      "Export as JSON (JSON Lines for .jsonl/.ndjson, gzipped for .gz)",
+      "File" },
+    { "append",
+      'a',
+      0,
+      G_OPTION_ARG_NONE,
+      &app_flags.append,
+      "Append to the JSON Lines export file instead of replacing it",
+      NULL },
+    { "compact",
+      'z',
+      0,
+      G_OPTION_ARG_NONE,
+      &app_flags.compact,
+      "Compress the cache: smaller on disk, slower to load",
+      NULL },
+    { "compress-abstracts",
+      0,
+      0,
+      G_OPTION_ARG_NONE,
+      &app_flags.compress_abstracts,
+      "Keep abstracts compressed in memory: smaller, slower to search",
+      NULL },
     { "list",
       'l',
       0,
@@ -61,5 +93,40 @@ const GOptionEntry cmd_options[] = { // freed before exit
       &debug_flags.mock_data,
       "Use mock data for testing",
       NULL },
+    { "bench-loom",
+      0,
+      0,
+      G_OPTION_ARG_NONE,
+      &debug_flags.bench_loom,
+      "Benchmark the Loom schedulers and parallel loops and exit",
+      NULL },
+    { "bench-json",
+      0,
+      0,
+      G_OPTION_ARG_NONE,
+      &debug_flags.bench_json,
+      "Benchmark loading a generated JSON export against cJSON and exit",
+      NULL },
+    { "bench-load",
+      0,
+      0,
+      G_OPTION_ARG_NONE,
+      &debug_flags.bench_load,
+      "Benchmark cold and warm loads of JSON, gzipped JSON and caches and exit",
+      NULL },
+    { "bench-abstracts",
+      0,
+      0,
+      G_OPTION_ARG_NONE,
+      &debug_flags.bench_abstracts,
+      "Benchmark memory and search latency of deflated abstracts and exit",
+      NULL },
+    { "loom-stats",
+      0,
+      0,
+      G_OPTION_ARG_FILENAME,
+      &debug_flags.loom_stats_path,
+      "Write Loom telemetry as JSON to File on exit and on SIGUSR1",
+      "File" },
     { 0 }
 };
@@ -9,6 +9,10 @@ typedef struct
     gchar* json_path;
     gboolean list;
     gchar** import_paths;
+    gchar* export_path;
+    gboolean append;
+    gboolean compact;
+    gboolean compress_abstracts;
 } AppFlags;
 
 typedef struct
@@ -16,6 +20,11 @@ typedef struct
     gboolean version;
     gboolean debug;
     gboolean mock_data;
+    gboolean bench_loom;
+    gboolean bench_json;
+    gboolean bench_load;
+    gboolean bench_abstracts;
+    gchar* loom_stats_path;
 } DebugFlags;
 
 extern AppFlags app_flags;
@@ -18,3 +18,76 @@
 /* database files */
 #define CACHE_PATH "pp.cache"
 #define JSON_PATH "ppdb.json"
+
+/* persistence: write once changes have been quiet for PERSIST_QUIET_MS, but
+ * at least every PERSIST_MAX_INTERVAL_MS during a burst */
+#define PERSIST_QUIET_MS 500
+#define PERSIST_MAX_INTERVAL_MS 5000
+
+/* mutation journal next to the JSON file, folded into a new snapshot once it
+ * grows past JOURNAL_COMPACT_BYTES */
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_COMPACTING_SUFFIX ".journal.compacting"
+#define JOURNAL_COMPACT_BYTES (4 * 1024 * 1024)
+
+/* cold loads of JSON files past JSON_PARALLEL_LOAD_BYTES are split into
+ * JSON_CHUNKS_PER_THREAD chunks per Loom thread (at least JSON_CHUNK_MIN_BYTES
+ * each) and parsed in parallel */
+#define JSON_PARALLEL_LOAD_BYTES (8 * 1024 * 1024)
+#define JSON_CHUNKS_PER_THREAD 4
+#define JSON_CHUNK_MIN_BYTES (1024 * 1024)
+
+/* compression: database files named *.gz are gzipped at JSON_GZIP_LEVEL;
+ * the cache stores each chunk's strings deflated at CACHE_COMPRESSION_LEVEL
+ * when CACHE_COMPRESS is set (or --compact is given). Off by default, as a
+ * plain cache maps straight into memory and loads fastest. */
+#define JSON_GZIP_LEVEL 6
+#define CACHE_COMPRESSION_LEVEL 1
+#define CACHE_COMPRESS FALSE
+
+/* gzipped JSON is written in members of GZIP_BLOCK_BYTES uncompressed,
+ * which load in parallel like plain JSON, see gzip_blocks.h */
+#define GZIP_BLOCK_BYTES (1024 * 1024)
+
+/* abstracts loaded from the cache stay on disk until they are read; at most
+ * TEXT_STORE_BUDGET_BYTES of them are kept in memory, see text_store.c */
+#define TEXT_STORE_BUDGET_BYTES (64 * 1024 * 1024)
+
+/* abstracts of all other papers are kept deflated in memory when
+ * ABSTRACT_COMPRESS is set (or --compress-abstracts is given), with a
+ * dictionary trained on the library; at most ABSTRACT_POOL_BUDGET_BYTES of
+ * them are kept inflated for searching and display, see text_store.c */
+#define ABSTRACT_COMPRESS FALSE
+#define ABSTRACT_POOL_BUDGET_BYTES (16 * 1024 * 1024)
+
+/* Loom runs tasks on work-stealing workers with a deque per priority lane when
+ * LOOM_WORK_STEALING is set, on a priority-sorted GThreadPool otherwise, see
+ * loom_sched.c. --bench-loom compares the two. */
+#define LOOM_WORK_STEALING TRUE
+
+/* a Loom runs at most LOOM_*_CAP_PERCENT of its threads (at least one) on a
+ * resource class at once, and classes with threads ready share free threads
+ * in proportion to LOOM_*_WEIGHT, see LoomResource in loom.h. Threads of a
+ * more urgent priority lane still go first. */
+#define LOOM_CPU_CAP_PERCENT 100
+#define LOOM_CPU_WEIGHT 4
+#define LOOM_IO_CAP_PERCENT 50
+#define LOOM_IO_WEIGHT 2
+#define LOOM_SUBPROCESS_CAP_PERCENT 50
+#define LOOM_SUBPROCESS_WEIGHT 1
+#define LOOM_ML_CAP_PERCENT 50
+#define LOOM_ML_WEIGHT 1
+
+/* with PP_TRACE defined (make trace), every thread keeps its last
+ * TRACE_RING_EVENTS trace events, written to TRACE_PATH on exit and on
+ * SIGUSR2 for chrome://tracing or Perfetto, see trace.h */
+#define TRACE_RING_EVENTS (1 << 15)
+#define TRACE_PATH "paperpusher.trace.json"
+
+/* progress reported by Loom shuttles reaches the main loop at most once every
+ * LOOM_PROGRESS_INTERVAL_MS, i.e. about once per frame */
+#define LOOM_PROGRESS_INTERVAL_MS 16
+
+/* a search scores papers on all Loom workers in slices of at least
+ * SEARCH_SCORE_GRAIN papers, see loom_parallel_for() */
+#define SEARCH_SCORE_GRAIN 64
@@ -6,6 +6,7 @@
 #include "loom.h"
 #include "paper.h"
 #include "parser.h"
+#include "persist.h"
 #include "search.h"
 
 #include <gdk/gdkkeysyms.h>
@@ -24,6 +25,8 @@ static GtkEntry* search_entry;
 static GtkWidget* main_window;
 static GtkListBox* results_list;
 static GtkLabel* pdf_preview;
+static GtkProgressBar* import_progress;
+static LoomGroup* current_import; // ref dropped by on_import_progress()
 static AppContext app_context;
 
 /**
@@ -35,6 +38,7 @@ on_shutdown(GApplication* app, gpointer user_data)
     (void)app;
     (void)user_data;
     loom_disassemble(gui_loom);
+    g_clear_pointer(&current_import, loom_group_unref);
     // g_free(app_context);
 }
 
@@ -52,6 +56,31 @@ sanitize_label_text(const char* orig)
     return g_utf8_make_valid(safe, -1);
 }
 
+/* Result tooltip: the abstract, only read from the cache when hovered */
+static gboolean
+on_result_query_tooltip(GtkWidget* row,
+                        gint x,
+                        gint y,
+                        gboolean keyboard_mode,
+                        GtkTooltip* tooltip,
+                        gpointer user_data)
+{
+    (void)x;
+    (void)y;
+    (void)keyboard_mode;
+    (void)user_data;
+
+    Paper* p = g_object_get_data(G_OBJECT(row), "paper"); // owned by db
+    g_autofree gchar* abstract =
+      p ? paper_dup_abstract(p) : NULL; // freed on function return
+    if (!abstract || !*abstract)
+        return FALSE;
+    g_autofree gchar* safe_abstract =
+      sanitize_label_text(abstract); // freed on function return
+    gtk_tooltip_set_text(tooltip, safe_abstract);
+    return TRUE;
+}
+
 /* Search event: repopulate result list */
 // TODO: make this async?
 static void
@@ -115,8 +144,8 @@ on_search_changed(GtkEntry* entry, gpointer user_data)
           g_string_new(NULL); // freed before return
         g_string_append(safe_authors_string, "　");
         for (int j = 0; j < p->authors_count; j++) {
-            gchar* safe_author =
-              sanitize_label_text(p->authors[j]); // freed before return
+            gchar* safe_author = // freed before return
+              sanitize_label_text(paper_get_author(p, j));
             if (j > 0)
                 g_string_append_printf(
                   safe_authors_string, ", %s", safe_author);
@@ -149,6 +178,9 @@ on_search_changed(GtkEntry* entry, gpointer user_data)
           GTK_BOX(hbox), year, TRUE, TRUE, 0); // year owned by hbox now
 
         g_object_set_data(G_OBJECT(row), "paper", p);
+        gtk_widget_set_has_tooltip(row, TRUE);
+        g_signal_connect(
+          row, "query-tooltip", G_CALLBACK(on_result_query_tooltip), NULL);
 
         gtk_list_box_insert(results_list, row, -1);
         gtk_widget_show_all(row);
@@ -255,8 +287,13 @@ parser_task_callback(PaperDatabase* db,
                      GError* error)
 {
     (void)user_data;
-    (void)db;
 
+    if (g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_EXIST)) {
+        // same content as a Paper we have, nothing was parsed
+        g_message("%s, skipping it.\n", error->message);
+        g_error_free(error);
+        return;
+    }
     if (!p || error) {
         gchar* pdf_file = NULL;
         if (p && p->pdf_file)
@@ -272,27 +309,42 @@ parser_task_callback(PaperDatabase* db,
         return;
     }
 
-    // logic to update the progress bar goes here.
-    // For now just print success message in the terminal.
+    // progress is shown per import, see on_import_progress()
     g_debug("Successfully parsed '%s'.\n", p->pdf_file);
-    // TODO: update progress bar
+    // written out once the whole import is done, see on_pdf_dropped()
 
     // (p is owned by the PaperDatabase now, do not free)
 }
 
-/* Background parser thread */
+/* Import progress bar, shown while the latest import runs */
+static void
+on_import_progress(LoomGroup* group, gdouble fraction, gpointer user_data)
+{
+    (void)user_data;
+    if (group != current_import)
+        return;
+    gtk_progress_bar_set_fraction(import_progress, fraction);
+    gtk_widget_set_visible(GTK_WIDGET(import_progress), fraction < 1.0);
+    if (fraction >= 1.0)
+        g_clear_pointer(&current_import, loom_group_unref);
+}
+
+/* Background parser thread, unless the file is a duplicate */
 static void
-fire_parser_task(gchar* path)
+fire_parser_task(gchar* path, LoomGroup* import)
 {
     if (!path)
         return;
-    g_debug("Parsing '%s'...\n", path);
-    async_parser_run(
-      s_db, path, parser_task_callback, NULL); // takes ownership of path
+    g_debug("Importing '%s'...\n", path);
+    async_import_pdf(s_db,
+                     path,
+                     import,
+                     parser_task_callback,
+                     NULL); // takes ownership of path
 }
 
 static void
-import_pdfs_from_directory(const gchar* path)
+import_pdfs_from_directory(const gchar* path, LoomGroup* import)
 {
     GDir* dir = g_dir_open(path, 0, NULL);
     if (!dir)
@@ -303,11 +355,11 @@ import_pdfs_from_directory(const gchar* path)
         gchar* full_path =
           g_build_filename(path, name, NULL); // freed in callback
         if (g_file_test(full_path, G_FILE_TEST_IS_DIR)) {
-            import_pdfs_from_directory(full_path);
+            import_pdfs_from_directory(full_path, import);
             g_free(full_path);
         }
         else if (g_file_test(full_path, G_FILE_TEST_IS_REGULAR)) {
-            fire_parser_task(full_path);
+            fire_parser_task(full_path, import);
         }
     }
     g_dir_close(dir);
@@ -335,7 +387,12 @@ on_pdf_dropped(GtkWidget* widget,
     if (!uris)
         return;
 
-    // fire off a task for each URI
+    // fire off a task for each URI, all in one group that is written out
+    // once it is done
+    LoomGroup* import = loom_group_new("import"); // freed below
+    loom_group_set_progress_func(import, on_import_progress, NULL);
+    g_clear_pointer(&current_import, loom_group_unref);
+    current_import = loom_group_ref(import);
     for (int i = 0; uris && uris[i]; ++i) {
         // free path when the task returns
         gchar* path = g_filename_from_uri(
@@ -346,15 +403,16 @@ on_pdf_dropped(GtkWidget* widget,
             continue;
         if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
             // recursively scan dir for pdfs
-            import_pdfs_from_directory(path);
+            import_pdfs_from_directory(path, import);
             g_free(path);
         } else if (g_file_test(path, G_FILE_TEST_IS_REGULAR)) {
             // import single file
-            fire_parser_task(path); // takes ownership of path
+            fire_parser_task(path, import); // takes ownership of path
         } else
             g_free(path);
     }
-    sync_json_and_cache(s_db);
+    sync_json_and_cache_after(s_db, import);
+    loom_group_unref(import);
 
     g_strfreev(uris);
     gtk_drag_finish(context, TRUE, FALSE, time);
@@ -443,6 +501,7 @@ gui_run(GtkApplication* app, PaperDatabase* db)
     // int max_threads = g_settings_get_int(app_flags.settings, "gui-threads");
     int max_threads = MIN(4, g_get_num_processors() / 2);
     gui_loom = loom_new(max_threads);
+    loom_set_name(gui_loom, "gui");
 
     // load Glade UI
     GtkBuilder* b = gtk_builder_new_from_file("src/gui/main_window.ui");
@@ -463,6 +522,8 @@ gui_run(GtkApplication* app, PaperDatabase* db)
     // grab widgets
     search_entry = GTK_ENTRY(gtk_builder_get_object(b, "search_entry"));
     results_list = GTK_LIST_BOX(gtk_builder_get_object(b, "results_list"));
+    import_progress =
+      GTK_PROGRESS_BAR(gtk_builder_get_object(b, "import_progress"));
     // pdf_preview = GTK_LABEL(gtk_builder_get_object(b, "pdf_placeholder"));
     focus_search_entry();
 
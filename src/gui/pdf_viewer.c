@@ -7,6 +7,7 @@
 #include "loom.h"
 #include "poppler-document.h"
 #include "poppler-page.h"
+#include "trace.h"
 #include <glib.h>
 #include <gtk/gtk.h>
 #include <pango/pangocairo.h>
@@ -31,6 +32,7 @@ struct _PdfViewer
     // cache
     GHashTable* page_cache; // keys: page numbers (gpointer), values: GdkPixbuf*
     GHashTable* rendering_pages; // keys: page numbers (gpointer), values: dummy
+    guint generation; // bumped when queued renders go stale
 };
 
 typedef struct
@@ -102,6 +104,7 @@ typedef struct
     double scale;
     double width_pts;
     double height_pts;
+    guint generation; // of the viewer when queued
 } RenderTaskData;
 
 /**
@@ -119,6 +122,9 @@ render_page_shuttle(gpointer shuttle_data, GError** error)
           G_IO_ERROR, G_IO_ERROR_FAILED, "Document is NULL");
         return NULL;
     }
+    // snipped by pdf_render_invalidate() before it got here
+    if (g_cancellable_set_error_if_cancelled(loom_get_cancellable(), error))
+        return NULL;
 
     PopplerPage* page =
       poppler_document_get_page(data->doc,
@@ -139,9 +145,12 @@ render_page_shuttle(gpointer shuttle_data, GError** error)
     cairo_set_source_rgb(cr, 1.0, 1.0, 1.0);
     cairo_paint(cr);
     cairo_scale(cr, data->scale, data->scale);
+    // the gap before this slice is the wait for the mutex
     g_mutex_lock(&poppler_render_mutex); // sadly has to be serialized
+    TRACE_BEGIN("render", "poppler_page_render");
     g_debug("poppler rendering page %d \n", data->page_num);
     poppler_page_render(page, cr);
+    TRACE_END("render", "poppler_page_render");
     g_mutex_unlock(&poppler_render_mutex);
 
     cairo_destroy(cr);
@@ -163,26 +172,44 @@ render_page_knot(gpointer knot_data,
     PdfViewer* viewer = knot_data;
     RenderTaskData* data = shuttle_data;
     cairo_surface_t* surface = result; // we own this
-    // only insert into cache if the document hasn't changed
-    if (viewer->doc == data->doc && (!error || result)) {
-        g_hash_table_insert(viewer->page_cache, // takes ownership
-                            GINT_TO_POINTER(data->page_num),
-                            surface); // freed by g_hash_table_destroy()
-        // redraw
-        gtk_widget_queue_draw(viewer->drawing_area);
+    // only insert into cache if neither document nor scale have changed
+    if (data->generation == viewer->generation) {
+        if (surface) {
+            g_hash_table_insert(viewer->page_cache, // takes ownership
+                                GINT_TO_POINTER(data->page_num),
+                                surface); // freed by g_hash_table_destroy()
+            // redraw
+            gtk_widget_queue_draw(viewer->drawing_area);
+        }
         // mark as done
         g_debug("marking page %d as done\n", data->page_num);
         g_hash_table_remove(viewer->rendering_pages,
                             GINT_TO_POINTER(data->page_num));
-    } else { // discard surface
+    } else if (surface) { // discard surface
         cairo_surface_destroy(surface);
     }
+    if (error)
+        g_error_free(error);
 
     g_object_unref(
       data->doc); // done with the doc, so unref it (should free it)
     g_free(data);
 }
 
+/**
+ * Makes the renders queued so far stale, e.g. when the document or the scale
+ * changes, and snips the ones that haven't started yet.
+ */
+static void
+pdf_render_invalidate(PdfViewer* viewer)
+{
+    viewer->generation++;
+    if (viewer->rendering_pages)
+        g_hash_table_remove_all(viewer->rendering_pages);
+    if (gui_loom)
+        loom_snip_stale(gui_loom, "pdf-page-render", viewer->generation);
+}
+
 /**
  * Pushes a page to the render queue.
  */
@@ -203,6 +230,7 @@ pdf_render_enqueue(PdfViewer* viewer, int page_num)
     data->scale = viewer->scale;
     data->width_pts = viewer->page_width_pts;
     data->height_pts = viewer->page_height_pts;
+    data->generation = viewer->generation;
 
     LoomThreadSpec spec = loom_thread_spec_default(); // on stack
     spec.tag = "pdf-page-render";
@@ -214,6 +242,7 @@ pdf_render_enqueue(PdfViewer* viewer, int page_num)
     spec.is_lifo = TRUE;
     static const gchar* deps[] = { "pdf-page-render", NULL };
     spec.dependencies = deps;
+    spec.generation = viewer->generation;
     // use gui_loom if default loom is busy
     loom_queue_thread(gui_loom, &spec, NULL);
 }
@@ -286,6 +315,7 @@ on_pdf_draw(GtkWidget* widget, cairo_t* cr, gpointer user_data)
     if (viewer->page_cache && last_scale != scale) {
         g_hash_table_destroy(viewer->page_cache);
         viewer->page_cache = NULL;
+        pdf_render_invalidate(viewer);
     }
     last_scale = scale;
 
@@ -486,6 +516,7 @@ pdf_viewer_load(const gchar* filepath)
         return;
 
     // Clean up previous doc/page
+    pdf_render_invalidate(pdf_viewer);
     if (pdf_viewer->doc) {
         g_object_unref(pdf_viewer->doc);
         pdf_viewer->doc = NULL;
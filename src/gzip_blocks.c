@@ -0,0 +1,275 @@
+/* gzip_blocks.c */
+#define _POSIX_C_SOURCE 200809L // for pread()
+#define G_LOG_DOMAIN "gzip"
+
+#include "gzip_blocks.h"
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* Member header: the gzip header with FEXTRA set and one 'P' 'P' subfield
+ * holding the member size, little endian */
+#define HEADER_BYTES 20
+#define TRAILER_BYTES 8 // CRC-32 and uncompressed size
+#define SIZE_OFFSET 16
+
+static const guint8 header_template[HEADER_BYTES] = {
+    0x1f, 0x8b, 8, 4, // magic, deflate, FEXTRA
+    0,    0,    0, 0, // no mtime
+    0,    3,          // no extra flags, Unix
+    8,    0,          // XLEN
+    'P',  'P',  4, 0, // subfield ID and length
+    0,    0,    0, 0, // member size
+};
+
+static void
+put_le32(guint8* p, guint32 value)
+{
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+static guint32
+get_le32(const guint8* p)
+{
+    return (guint32)p[0] | (guint32)p[1] << 8 | (guint32)p[2] << 16 |
+           (guint32)p[3] << 24;
+}
+
+struct _GzipBlockWriter
+{
+    int fd;
+    gchar* path;
+    z_stream stream; // raw deflate, reset for every block
+    GByteArray* block;
+    guint8* member;     // compressed block, header and trailer included
+    gsize member_size;  // allocated
+    int saved_errno;    // of the first failed write, 0 if none
+};
+
+GzipBlockWriter*
+gzip_block_writer_new(int fd, const gchar* path, gint level)
+{
+    GzipBlockWriter* writer =
+      g_new0(GzipBlockWriter, 1); // freed by gzip_block_writer_close()
+    if (deflateInit2(&writer->stream,
+                     level,
+                     Z_DEFLATED,
+                     -MAX_WBITS,
+                     8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        g_free(writer);
+        return NULL;
+    }
+    writer->fd = fd;
+    writer->path = g_strdup(path);
+    writer->block = g_byte_array_sized_new(GZIP_BLOCK_BYTES);
+    return writer;
+}
+
+static gboolean
+write_all(int fd, const guint8* data, gsize length)
+{
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return FALSE;
+        data += n;
+        length -= n;
+    }
+    return TRUE;
+}
+
+/* Compresses the buffered block into one member and writes it out */
+static gboolean
+flush_block(GzipBlockWriter* writer)
+{
+    GByteArray* block = writer->block;
+    if (block->len == 0 || writer->saved_errno != 0)
+        return writer->saved_errno == 0;
+
+    z_stream* stream = &writer->stream;
+    gsize bound = HEADER_BYTES + deflateBound(stream, block->len) +
+                  TRAILER_BYTES;
+    if (bound > writer->member_size) {
+        writer->member = g_realloc(writer->member, bound);
+        writer->member_size = bound;
+    }
+    deflateReset(stream);
+    stream->next_in = block->data;
+    stream->avail_in = block->len;
+    stream->next_out = writer->member + HEADER_BYTES;
+    stream->avail_out = bound - HEADER_BYTES - TRAILER_BYTES;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+        writer->saved_errno = ENOMEM;
+        return FALSE;
+    }
+
+    gsize length = HEADER_BYTES + stream->total_out + TRAILER_BYTES;
+    memcpy(writer->member, header_template, HEADER_BYTES);
+    put_le32(writer->member + SIZE_OFFSET, (guint32)length);
+    guint8* trailer = writer->member + length - TRAILER_BYTES;
+    put_le32(trailer, crc32(crc32(0, NULL, 0), block->data, block->len));
+    put_le32(trailer + 4, block->len);
+    g_byte_array_set_size(block, 0);
+    if (!write_all(writer->fd, writer->member, length)) {
+        writer->saved_errno = errno;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+gboolean
+gzip_block_writer_write(gpointer sink, const gchar* data, gsize length)
+{
+    GzipBlockWriter* writer = sink;
+    while (length > 0) {
+        gsize n = MIN(length, GZIP_BLOCK_BYTES - writer->block->len);
+        g_byte_array_append(writer->block, (const guint8*)data, n);
+        data += n;
+        length -= n;
+        if (writer->block->len == GZIP_BLOCK_BYTES && !flush_block(writer))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+gboolean
+gzip_block_writer_close(GzipBlockWriter* writer, GError** error)
+{
+    flush_block(writer);
+    if (close(writer->fd) != 0 && writer->saved_errno == 0)
+        writer->saved_errno = errno;
+    gboolean ok = writer->saved_errno == 0;
+    if (!ok)
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(writer->saved_errno),
+                    "Failed to compress %s: %s",
+                    writer->path,
+                    g_strerror(writer->saved_errno));
+    deflateEnd(&writer->stream);
+    g_byte_array_free(writer->block, TRUE);
+    g_free(writer->member);
+    g_free(writer->path);
+    g_free(writer);
+    return ok;
+}
+
+gboolean
+gzip_blocks_is_blocked(const gchar* path)
+{
+    int fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return TRUE;
+    guint8 header[SIZE_OFFSET];
+    ssize_t n = read(fd, header, sizeof(header));
+    close(fd);
+    return n <= 0 || memcmp(header, header_template, n) == 0;
+}
+
+gboolean
+gzip_blocks_read_index(int fd,
+                       const gchar* path,
+                       GArray* blocks,
+                       goffset* out_end,
+                       gboolean* out_blocked,
+                       GError** error)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        goto io_error;
+
+    goffset offset = 0;
+    gsize inflated = 0;
+    *out_blocked = TRUE;
+    while (offset < st.st_size) {
+        guint8 header[HEADER_BYTES];
+        gsize want = MIN((goffset)sizeof(header), st.st_size - offset);
+        ssize_t n = pread(fd, header, want, offset);
+        if (n != (ssize_t)want)
+            goto io_error;
+        // a header cut short is torn, anything else isn't ours
+        if (memcmp(header, header_template, MIN(want, SIZE_OFFSET)) != 0) {
+            *out_blocked = FALSE;
+            break;
+        }
+        if (want < sizeof(header))
+            break;
+        guint32 length = get_le32(header + SIZE_OFFSET);
+        if (length < HEADER_BYTES + TRAILER_BYTES) {
+            *out_blocked = FALSE;
+            break;
+        }
+        if (offset + length > st.st_size)
+            break;
+
+        guint8 trailer[TRAILER_BYTES];
+        goffset trailer_offset = offset + length - TRAILER_BYTES;
+        if (pread(fd, trailer, sizeof(trailer), trailer_offset) !=
+            (ssize_t)sizeof(trailer))
+            goto io_error;
+        GzipBlock block = { offset, length, inflated, get_le32(trailer + 4) };
+        g_array_append_val(blocks, block);
+        inflated += block.inflated_length;
+        offset += length;
+    }
+    *out_end = offset;
+    return TRUE;
+
+io_error:
+    g_set_error(error,
+                G_FILE_ERROR,
+                g_file_error_from_errno(errno),
+                "Failed to read %s: %s",
+                path,
+                g_strerror(errno));
+    return FALSE;
+}
+
+gboolean
+gzip_block_inflate(const guint8* data,
+                   const GzipBlock* block,
+                   gchar* out,
+                   GError** error)
+{
+    const guint8* member = data + block->offset;
+    z_stream stream = { 0 };
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_NOMEM,
+                    "Failed to set up zlib");
+        return FALSE;
+    }
+    stream.next_in = (guint8*)member + HEADER_BYTES;
+    stream.avail_in = block->length - HEADER_BYTES - TRAILER_BYTES;
+    stream.next_out = (guint8*)out;
+    stream.avail_out = block->inflated_length;
+    int zerr = inflate(&stream, Z_FINISH);
+    gboolean ok = zerr == Z_STREAM_END &&
+                  stream.total_out == block->inflated_length;
+    inflateEnd(&stream);
+
+    const guint8* trailer = member + block->length - TRAILER_BYTES;
+    ok = ok && crc32(crc32(0, NULL, 0), (const guint8*)out,
+                     block->inflated_length) == get_le32(trailer);
+    if (!ok)
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_FAILED,
+                    "Corrupted gzip block at offset %lld",
+                    (long long)block->offset);
+    return ok;
+}
@@ -0,0 +1,83 @@
+/* gzip_blocks.h */
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Blocked gzip: a run of independent gzip members of at most
+ * GZIP_BLOCK_BYTES uncompressed each, which any gzip reader takes for one
+ * stream. Every member's header has its compressed size in an extra field
+ * (subfield 'P' 'P'), so the members can be found without inflating any of
+ * them, then inflated in parallel. Like BGZF, with bigger blocks.
+ */
+
+/* One member of a blocked gzip file */
+typedef struct
+{
+    goffset offset; // of the member in the file
+    gsize length;   // of the whole member, header and trailer included
+    gsize inflated_offset; // of its data in the uncompressed stream
+    gsize inflated_length;
+} GzipBlock;
+
+/* Writes blocked gzip to a file descriptor */
+typedef struct _GzipBlockWriter GzipBlockWriter;
+
+/**
+ * Creates a writer compressing at @level to @fd, which is @path and closed
+ * by gzip_block_writer_close(). Returns NULL if zlib can't be set up.
+ */
+GzipBlockWriter*
+gzip_block_writer_new(int fd, const gchar* path, gint level);
+
+/**
+ * Buffers @length bytes at @data, writing out a member whenever a block
+ * fills up. A #JsonWriteFunc.
+ */
+gboolean
+gzip_block_writer_write(gpointer writer, const gchar* data, gsize length);
+
+/**
+ * Writes out the last block, closes the file descriptor and frees @writer.
+ * Returns FALSE and sets *error if any write failed.
+ */
+gboolean
+gzip_block_writer_close(GzipBlockWriter* writer, GError** error);
+
+/**
+ * Returns TRUE unless the file at @path starts with something other than a
+ * block, like plain gzip does. Empty and missing files can take blocks.
+ */
+gboolean
+gzip_blocks_is_blocked(const gchar* path);
+
+/**
+ * Reads the index of the blocked gzip file open at @fd into @blocks.
+ * Stops at the first member that isn't a block, or that runs past the end of
+ * the file, as an append cut short leaves it; *out_end is where that member
+ * starts, or the file size. *out_blocked is cleared if a member without the
+ * index was found, i.e. one written by plain gzip.
+ * Returns FALSE and sets *error on I/O errors.
+ */
+gboolean
+gzip_blocks_read_index(int fd,
+                       const gchar* path,
+                       GArray* blocks,
+                       goffset* out_end,
+                       gboolean* out_blocked,
+                       GError** error);
+
+/**
+ * Inflates @block of the file mapped at @data into @out, which has room for
+ * block->inflated_length bytes. Thread safe.
+ * Returns FALSE and sets *error if the block is corrupted.
+ */
+gboolean
+gzip_block_inflate(const guint8* data,
+                   const GzipBlock* block,
+                   gchar* out,
+                   GError** error);
+
+G_END_DECLS
@@ -0,0 +1,280 @@
+/* hash.c */
+#define _POSIX_C_SOURCE 200809L // for O_CLOEXEC
+#define G_LOG_DOMAIN "hash"
+
+#include "hash.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Files are hashed and compared HASH_CHUNK_BYTES at a time */
+#define HASH_CHUNK_BYTES (256 * 1024)
+
+/* XXH64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md */
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v)); // unaligned-safe, little endian assumed
+    return v;
+}
+
+static inline uint32_t
+read32(const uint8_t* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t
+xxh64_merge_round(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh64_round(0, val);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+/* consume one 32 byte stripe */
+static inline void
+xxh64_stripe(uint64_t acc[4], const uint8_t* p)
+{
+    acc[0] = xxh64_round(acc[0], read64(p));
+    acc[1] = xxh64_round(acc[1], read64(p + 8));
+    acc[2] = xxh64_round(acc[2], read64(p + 16));
+    acc[3] = xxh64_round(acc[3], read64(p + 24));
+}
+
+void
+xxh64_init(Xxh64State* state, uint64_t seed)
+{
+    memset(state, 0, sizeof(*state));
+    state->seed = seed;
+    state->acc[0] = seed + PRIME64_1 + PRIME64_2;
+    state->acc[1] = seed + PRIME64_2;
+    state->acc[2] = seed;
+    state->acc[3] = seed - PRIME64_1;
+}
+
+void
+xxh64_update(Xxh64State* state, const void* data, gsize length)
+{
+    const uint8_t* p = data;
+    const uint8_t* end = p + length;
+    state->total_len += length;
+
+    // top up a partially filled stripe first
+    if (state->buffer_len) {
+        gsize fill = MIN(length, 32 - (gsize)state->buffer_len);
+        memcpy(state->buffer + state->buffer_len, p, fill);
+        state->buffer_len += (uint32_t)fill;
+        p += fill;
+        if (state->buffer_len < 32)
+            return;
+        xxh64_stripe(state->acc, state->buffer);
+        state->buffer_len = 0;
+    }
+    while (end - p >= 32) {
+        xxh64_stripe(state->acc, p);
+        p += 32;
+    }
+    if (p < end) {
+        memcpy(state->buffer, p, end - p);
+        state->buffer_len = (uint32_t)(end - p);
+    }
+}
+
+uint64_t
+xxh64_digest(const Xxh64State* state)
+{
+    uint64_t h;
+    if (state->total_len >= 32) {
+        const uint64_t* acc = state->acc;
+        h = rotl64(acc[0], 1) + rotl64(acc[1], 7) + rotl64(acc[2], 12) +
+            rotl64(acc[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = xxh64_merge_round(h, acc[i]);
+    } else {
+        h = state->seed + PRIME64_5;
+    }
+    h += state->total_len;
+
+    const uint8_t* p = state->buffer;
+    const uint8_t* end = p + state->buffer_len;
+    while (end - p >= 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t)read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p++) * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+    }
+
+    /* avalanche */
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t
+xxh64(const void* data, gsize length, uint64_t seed)
+{
+    Xxh64State state; // on stack
+    xxh64_init(&state, seed);
+    xxh64_update(&state, data, length);
+    return xxh64_digest(&state);
+}
+
+/* Reads up to @length bytes from @fd, fewer only at the end of the file.
+ * Returns -1 and sets errno on errors. */
+static gssize
+read_chunk(int fd, guint8* buffer, gsize length)
+{
+    gsize total = 0;
+    while (total < length) {
+        ssize_t n = read(fd, buffer + total, length - total);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+static void
+set_read_error(GError** error, const gchar* path, int saved_errno)
+{
+    g_set_error(error,
+                G_FILE_ERROR,
+                g_file_error_from_errno(saved_errno),
+                "Failed to read '%s': %s",
+                path,
+                g_strerror(saved_errno));
+}
+
+static int
+open_for_reading(const gchar* path, GError** error)
+{
+    int fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        int saved_errno = errno;
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(saved_errno),
+                    "Failed to open '%s': %s",
+                    path,
+                    g_strerror(saved_errno));
+    }
+    return fd;
+}
+
+gboolean
+hash_file(const gchar* path,
+          uint64_t* out_hash,
+          uint64_t* out_size,
+          GError** error)
+{
+    int fd = open_for_reading(path, error);
+    if (fd < 0)
+        return FALSE;
+    guint8* buffer = g_malloc(HASH_CHUNK_BYTES); // freed below
+    Xxh64State state; // on stack
+    xxh64_init(&state, 0);
+    uint64_t size = 0;
+    gssize n;
+    while ((n = read_chunk(fd, buffer, HASH_CHUNK_BYTES)) > 0) {
+        xxh64_update(&state, buffer, n);
+        size += n;
+    }
+    if (n < 0)
+        set_read_error(error, path, errno);
+    close(fd);
+    g_free(buffer);
+    if (n < 0)
+        return FALSE;
+    if (out_hash)
+        *out_hash = xxh64_digest(&state);
+    if (out_size)
+        *out_size = size;
+    return TRUE;
+}
+
+gboolean
+files_equal(const gchar* path_a,
+            const gchar* path_b,
+            gboolean* out_equal,
+            GError** error)
+{
+    int fd_a = open_for_reading(path_a, error);
+    if (fd_a < 0)
+        return FALSE;
+    int fd_b = open_for_reading(path_b, error);
+    if (fd_b < 0) {
+        close(fd_a);
+        return FALSE;
+    }
+    guint8* buffer_a = g_malloc(2 * HASH_CHUNK_BYTES); // freed below
+    guint8* buffer_b = buffer_a + HASH_CHUNK_BYTES;
+    gboolean ok = TRUE;
+    *out_equal = TRUE;
+    for (;;) {
+        gssize n_a = read_chunk(fd_a, buffer_a, HASH_CHUNK_BYTES);
+        if (n_a < 0) {
+            set_read_error(error, path_a, errno);
+            ok = FALSE;
+            break;
+        }
+        gssize n_b = read_chunk(fd_b, buffer_b, HASH_CHUNK_BYTES);
+        if (n_b < 0) {
+            set_read_error(error, path_b, errno);
+            ok = FALSE;
+            break;
+        }
+        if (n_a != n_b || memcmp(buffer_a, buffer_b, n_a) != 0) {
+            *out_equal = FALSE;
+            break;
+        }
+        if (n_a == 0)
+            break;
+    }
+    close(fd_a);
+    close(fd_b);
+    g_free(buffer_a);
+    return ok;
+}
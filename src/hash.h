@@ -0,0 +1,58 @@
+/* hash.h */
+#pragma once
+
+#include <glib.h>
+#include <stdint.h>
+
+G_BEGIN_DECLS
+
+/**
+ * Streaming XXH64 state. Initialize with xxh64_init(), feed data with
+ * xxh64_update() and read the hash with xxh64_digest().
+ */
+typedef struct
+{
+    uint64_t acc[4];
+    uint64_t total_len;
+    uint8_t buffer[32];
+    uint32_t buffer_len;
+    uint64_t seed;
+} Xxh64State;
+
+void
+xxh64_init(Xxh64State* state, uint64_t seed);
+
+void
+xxh64_update(Xxh64State* state, const void* data, gsize length);
+
+uint64_t
+xxh64_digest(const Xxh64State* state);
+
+/**
+ * One-shot XXH64 of @length bytes at @data.
+ */
+uint64_t
+xxh64(const void* data, gsize length, uint64_t seed);
+
+/**
+ * Hash the whole file at @path with XXH64 (seed 0) and report its size.
+ * The file is read in chunks, so memory use doesn't grow with its size.
+ * Returns FALSE and sets *error if the file can't be read.
+ */
+gboolean
+hash_file(const gchar* path,
+          uint64_t* out_hash,
+          uint64_t* out_size,
+          GError** error);
+
+/**
+ * Compares the files at @path_a and @path_b byte by byte, setting
+ * *out_equal. Returns FALSE and sets *error if either can't be read.
+ */
+gboolean
+files_equal(const gchar* path_a,
+            const gchar* path_b,
+            gboolean* out_equal,
+            GError** error);
+
+G_END_DECLS
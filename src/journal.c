@@ -0,0 +1,555 @@
+/* journal.c */
+#define _POSIX_C_SOURCE 200809L // for fsync(), ftruncate()
+#define G_LOG_DOMAIN "journal"
+
+#include "journal.h"
+#include "config.h"
+#include "hash.h"
+#include "paper.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Journal layout: JOURNAL_MAGIC, then records of
+ *
+ *   JournalRecordHeader | payload[length]
+ *
+ * The checksum is XXH64 of the payload seeded with the op, so a torn or
+ * corrupted tail is detected on replay. The payload is a sequence of uint32,
+ * uint64 and length-prefixed strings (NULL_STRING_LEN for NULL):
+ *
+ *   add, remove: pdf_file
+ *   update:      pdf_file, year, title, authors_count, authors...,
+ *                keyword_count, keywords..., abstract, arxiv_id, doi
+ *   hash:        pdf_file, content_hash (uint64)
+ *   reset:       (empty)
+ *
+ * Replaying a record is idempotent, so records that already made it into the
+ * snapshot can safely be replayed again.
+ */
+#define JOURNAL_MAGIC "PPJRNL1"
+#define NULL_STRING_LEN G_MAXUINT32
+
+typedef struct
+{
+    uint32_t op;
+    uint32_t length;
+    uint64_t checksum;
+} JournalRecordHeader;
+
+struct _PaperJournal
+{
+    gchar* path;
+    gchar* compacting_path; // records moved aside by a running compaction
+    int fd;
+    gsize size;
+    GMutex lock;       // guards fd and size, held while writing
+    GByteArray* queue; // records not written yet, see journal_queue()
+    GMutex queue_lock; // guards queue, never held while writing
+};
+
+/* Encoding helpers */
+
+static void
+put_u32(GByteArray* buffer, uint32_t value)
+{
+    g_byte_array_append(buffer, (const guint8*)&value, sizeof(value));
+}
+
+static void
+put_u64(GByteArray* buffer, uint64_t value)
+{
+    g_byte_array_append(buffer, (const guint8*)&value, sizeof(value));
+}
+
+static void
+put_string(GByteArray* buffer, const gchar* s)
+{
+    if (!s) {
+        put_u32(buffer, NULL_STRING_LEN);
+        return;
+    }
+    uint32_t len = (uint32_t)strlen(s);
+    put_u32(buffer, len);
+    g_byte_array_append(buffer, (const guint8*)s, len);
+}
+
+static gboolean
+get_u32(const guint8* data, gsize length, gsize* offset, uint32_t* out)
+{
+    if (length - *offset < sizeof(uint32_t))
+        return FALSE;
+    memcpy(out, data + *offset, sizeof(uint32_t));
+    *offset += sizeof(uint32_t);
+    return TRUE;
+}
+
+static gboolean
+get_u64(const guint8* data, gsize length, gsize* offset, uint64_t* out)
+{
+    if (length - *offset < sizeof(uint64_t))
+        return FALSE;
+    memcpy(out, data + *offset, sizeof(uint64_t));
+    *offset += sizeof(uint64_t);
+    return TRUE;
+}
+
+static gboolean
+get_string(const guint8* data, gsize length, gsize* offset, gchar** out)
+{
+    uint32_t len;
+    *out = NULL;
+    if (!get_u32(data, length, offset, &len))
+        return FALSE;
+    if (len == NULL_STRING_LEN)
+        return TRUE;
+    if (length - *offset < len)
+        return FALSE;
+    *out = g_strndup((const gchar*)data + *offset, len); // caller owns out
+    *offset += len;
+    return TRUE;
+}
+
+static void
+free_strings(gchar** strings, uint32_t count)
+{
+    if (!strings)
+        return;
+    for (uint32_t i = 0; i < count; ++i)
+        g_free(strings[i]);
+    g_free(strings);
+}
+
+static gboolean
+get_strings(const guint8* data,
+            gsize length,
+            gsize* offset,
+            gchar*** out,
+            uint32_t* count)
+{
+    *out = NULL;
+    if (!get_u32(data, length, offset, count))
+        return FALSE;
+    // every string takes at least its length prefix
+    if (*count > (length - *offset) / sizeof(uint32_t))
+        return FALSE;
+    if (*count == 0)
+        return TRUE;
+    *out = g_new0(gchar*, *count); // caller owns out
+    for (uint32_t i = 0; i < *count; ++i) {
+        if (!get_string(data, length, offset, &(*out)[i])) {
+            free_strings(*out, *count);
+            *out = NULL;
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static gboolean
+write_all(int fd, const guint8* data, gsize length)
+{
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return FALSE;
+        }
+        data += written;
+        length -= written;
+    }
+    return TRUE;
+}
+
+/* Replay */
+
+static Paper*
+lookup_or_add(PaperDatabase* db, const gchar* pdf_file)
+{
+    Paper* paper = find_paper_by_file(db, pdf_file);
+    if (!paper)
+        paper = initialize_paper(db, pdf_file, NULL); // owned by db
+    return paper;
+}
+
+static gboolean
+journal_apply_update(PaperDatabase* db,
+                     const gchar* pdf_file,
+                     const guint8* payload,
+                     gsize length,
+                     gsize offset)
+{
+    uint32_t year = 0, authors_count = 0, keyword_count = 0;
+    gchar *title = NULL, *abstract = NULL, *arxiv_id = NULL, *doi = NULL;
+    gchar** authors = NULL;
+    gchar** keywords = NULL;
+    // all freed before return
+    gboolean valid =
+      get_u32(payload, length, &offset, &year) &&
+      get_string(payload, length, &offset, &title) &&
+      get_strings(payload, length, &offset, &authors, &authors_count) &&
+      get_strings(payload, length, &offset, &keywords, &keyword_count) &&
+      get_string(payload, length, &offset, &abstract) &&
+      get_string(payload, length, &offset, &arxiv_id) &&
+      get_string(payload, length, &offset, &doi);
+    if (valid) {
+        Paper* paper = lookup_or_add(db, pdf_file);
+        update_paper(paper,
+                     title,
+                     authors,
+                     (gint)authors_count,
+                     (gint)year,
+                     keywords,
+                     (gint)keyword_count,
+                     abstract,
+                     arxiv_id,
+                     doi,
+                     NULL);
+    }
+    g_free(title);
+    free_strings(authors, authors_count);
+    free_strings(keywords, keyword_count);
+    g_free(abstract);
+    g_free(arxiv_id);
+    g_free(doi);
+    return valid;
+}
+
+static gboolean
+journal_apply(PaperDatabase* db,
+              uint32_t op,
+              const guint8* payload,
+              gsize length)
+{
+    if (op == JOURNAL_RESET) {
+        reset_database(db);
+        return TRUE;
+    }
+
+    gsize offset = 0;
+    g_autofree gchar* pdf_file = NULL; // freed on function return
+    if (!get_string(payload, length, &offset, &pdf_file) || !pdf_file)
+        return FALSE;
+
+    switch (op) {
+        case JOURNAL_ADD:
+            lookup_or_add(db, pdf_file);
+            return TRUE;
+        case JOURNAL_UPDATE:
+            return journal_apply_update(db, pdf_file, payload, length, offset);
+        case JOURNAL_HASH: {
+            uint64_t content_hash = 0;
+            if (!get_u64(payload, length, &offset, &content_hash))
+                return FALSE;
+            paper_set_content_hash(lookup_or_add(db, pdf_file), content_hash);
+            return TRUE;
+        }
+        case JOURNAL_REMOVE: {
+            Paper* paper = find_paper_by_file(db, pdf_file);
+            if (paper)
+                remove_paper(db, paper);
+            return TRUE;
+        }
+        default:
+            return FALSE;
+    }
+}
+
+/**
+ * Replays the journal at @path into @db.
+ * Returns the length of the valid prefix of the file, or 0 if it is missing
+ * or not a journal.
+ */
+static gsize
+journal_replay_file(PaperDatabase* db, const gchar* path)
+{
+    GMappedFile* map = g_mapped_file_new(path, FALSE, NULL); // freed on return
+    if (!map)
+        return 0;
+    const guint8* data = (const guint8*)g_mapped_file_get_contents(map);
+    gsize length = g_mapped_file_get_length(map);
+    if (length < sizeof(JOURNAL_MAGIC) ||
+        memcmp(data, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+        if (length > 0)
+            g_warning("Ignoring journal '%s' with unknown format\n", path);
+        g_mapped_file_unref(map);
+        return 0;
+    }
+
+    gsize offset = sizeof(JOURNAL_MAGIC);
+    guint applied = 0;
+    while (length - offset >= sizeof(JournalRecordHeader)) {
+        JournalRecordHeader header;
+        memcpy(&header, data + offset, sizeof(header));
+        const guint8* payload = data + offset + sizeof(header);
+        if (header.length > length - offset - sizeof(header) ||
+            xxh64(payload, header.length, header.op) != header.checksum ||
+            !journal_apply(db, header.op, payload, header.length))
+            break;
+        offset += sizeof(header) + header.length;
+        applied++;
+    }
+    if (offset < length)
+        g_warning("Dropping %zu bytes of torn or corrupted journal '%s'\n",
+                  length - offset,
+                  path);
+    g_debug("Replayed %u journal records from '%s'\n", applied, path);
+    g_mapped_file_unref(map);
+    return offset;
+}
+
+/**
+ * Opens a fresh, empty journal at journal->path.
+ */
+static gboolean
+journal_reopen_empty(PaperJournal* journal, GError** error)
+{
+    if (journal->fd >= 0)
+        close(journal->fd);
+    journal->fd = open(
+      journal->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (journal->fd < 0 ||
+        !write_all(journal->fd,
+                   (const guint8*)JOURNAL_MAGIC,
+                   sizeof(JOURNAL_MAGIC))) {
+        int saved_errno = errno;
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(saved_errno),
+                    "Could not create journal '%s': %s",
+                    journal->path,
+                    g_strerror(saved_errno));
+        return FALSE;
+    }
+    journal->size = sizeof(JOURNAL_MAGIC);
+    return TRUE;
+}
+
+static void
+journal_free(PaperJournal* journal)
+{
+    if (journal->fd >= 0)
+        close(journal->fd);
+    g_free(journal->path);
+    g_free(journal->compacting_path);
+    g_byte_array_unref(journal->queue);
+    g_mutex_clear(&journal->queue_lock);
+    g_mutex_clear(&journal->lock);
+    g_free(journal);
+}
+
+/* Public API */
+
+gboolean
+journal_load(PaperDatabase* db, GError** error)
+{
+    g_return_val_if_fail(db != NULL && db->path != NULL, FALSE);
+
+    PaperJournal* journal = g_new0(PaperJournal, 1); // freed by journal_close()
+    journal->path = g_strconcat(db->path, JOURNAL_SUFFIX, NULL);
+    journal->compacting_path =
+      g_strconcat(db->path, JOURNAL_COMPACTING_SUFFIX, NULL);
+    journal->fd = -1;
+    g_mutex_init(&journal->lock);
+    journal->queue = g_byte_array_new(); // freed by journal_free()
+    g_mutex_init(&journal->queue_lock);
+
+    /* Replay on top of the snapshot, papers are found by pdf_file */
+    // an interrupted compaction left its records aside, they come first
+    journal_replay_file(db, journal->compacting_path);
+    gsize valid = journal_replay_file(db, journal->path);
+
+    if (valid == 0) {
+        if (!journal_reopen_empty(journal, error)) {
+            journal_free(journal);
+            return FALSE;
+        }
+    } else {
+        journal->fd =
+          open(journal->path, O_WRONLY | O_APPEND | O_CLOEXEC, 0644);
+        // cut off a torn tail so new records follow the valid ones
+        if (journal->fd < 0 || ftruncate(journal->fd, (off_t)valid) != 0) {
+            int saved_errno = errno;
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        g_file_error_from_errno(saved_errno),
+                        "Could not open journal '%s': %s",
+                        journal->path,
+                        g_strerror(saved_errno));
+            journal_free(journal);
+            return FALSE;
+        }
+        journal->size = valid;
+    }
+
+    db->journal = journal; // freed by free_database()
+    return TRUE;
+}
+
+GByteArray*
+journal_encode(JournalOp op, const Paper* paper, const gchar* abstract)
+{
+    if (op != JOURNAL_RESET && (!paper || !paper->pdf_file))
+        return NULL;
+
+    GByteArray* record = g_byte_array_new(); // freed by journal_queue()
+    JournalRecordHeader header = { .op = op };
+    g_byte_array_append(record, (const guint8*)&header, sizeof(header));
+    if (op != JOURNAL_RESET)
+        put_string(record, paper->pdf_file);
+    if (op == JOURNAL_UPDATE) {
+        put_u32(record, (uint32_t)paper->year);
+        put_string(record, paper->title);
+        put_u32(record, (uint32_t)paper->authors_count);
+        for (int i = 0; i < paper->authors_count; ++i)
+            put_string(record, paper_get_author(paper, i));
+        put_u32(record, (uint32_t)paper->keyword_count);
+        for (int i = 0; i < paper->keyword_count; ++i)
+            put_string(record, paper_get_keyword(paper, i));
+        put_string(record, abstract);
+        put_string(record, paper->arxiv_id);
+        put_string(record, paper->doi);
+    } else if (op == JOURNAL_HASH)
+        put_u64(record, paper->content_hash);
+    header.length = record->len - sizeof(header);
+    header.checksum = xxh64(record->data + sizeof(header), header.length, op);
+    memcpy(record->data, &header, sizeof(header));
+    return record;
+}
+
+void
+journal_queue(PaperJournal* journal, GByteArray* record)
+{
+    if (!record)
+        return;
+    if (journal) {
+        g_mutex_lock(&journal->queue_lock);
+        g_byte_array_append(journal->queue, record->data, record->len);
+        g_mutex_unlock(&journal->queue_lock);
+    }
+    g_byte_array_unref(record);
+}
+
+/* Writes what is queued, call with journal->lock held */
+static void
+journal_write_queue(PaperJournal* journal)
+{
+    // swapped out, so queueing goes on while this writes
+    g_mutex_lock(&journal->queue_lock);
+    GByteArray* records = journal->queue; // freed below
+    journal->queue = g_byte_array_new();
+    g_mutex_unlock(&journal->queue_lock);
+
+    if (records->len > 0) {
+        if (journal->fd >= 0 &&
+            write_all(journal->fd, records->data, records->len))
+            journal->size += records->len;
+        else
+            g_warning("Could not append to journal '%s'\n", journal->path);
+    }
+    g_byte_array_unref(records);
+}
+
+void
+journal_flush(PaperJournal* journal)
+{
+    if (!journal)
+        return;
+    g_mutex_lock(&journal->lock);
+    journal_write_queue(journal);
+    g_mutex_unlock(&journal->lock);
+}
+
+gsize
+journal_size(PaperJournal* journal)
+{
+    g_mutex_lock(&journal->lock);
+    gsize size = journal->size;
+    g_mutex_unlock(&journal->lock);
+    return size;
+}
+
+gboolean
+journal_sync(PaperJournal* journal, GError** error)
+{
+    g_mutex_lock(&journal->lock);
+    journal_write_queue(journal);
+    gboolean success = journal->fd >= 0 && fsync(journal->fd) == 0;
+    if (!success) {
+        int saved_errno = errno;
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(saved_errno),
+                    "Could not sync journal '%s': %s",
+                    journal->path,
+                    g_strerror(saved_errno));
+    }
+    g_mutex_unlock(&journal->lock);
+    return success;
+}
+
+gboolean
+journal_begin_compaction(PaperJournal* journal, GError** error)
+{
+    g_mutex_lock(&journal->lock);
+    gboolean success = TRUE;
+    if (g_file_test(journal->compacting_path, G_FILE_TEST_EXISTS)) {
+        // an earlier compaction didn't finish, keep its records and add ours
+        g_autofree gchar* data = NULL; // freed on function return
+        gsize length = 0;
+        success = g_file_get_contents(journal->path, &data, &length, error);
+        if (success && length > sizeof(JOURNAL_MAGIC)) {
+            int fd = open(journal->compacting_path, O_WRONLY | O_APPEND);
+            success = fd >= 0 &&
+                      write_all(fd,
+                                (const guint8*)data + sizeof(JOURNAL_MAGIC),
+                                length - sizeof(JOURNAL_MAGIC)) &&
+                      fsync(fd) == 0;
+            if (fd >= 0)
+                close(fd);
+            if (!success)
+                g_set_error(error,
+                            G_FILE_ERROR,
+                            G_FILE_ERROR_IO,
+                            "Could not extend '%s'",
+                            journal->compacting_path);
+        }
+    } else if (fsync(journal->fd) != 0 ||
+               g_rename(journal->path, journal->compacting_path) != 0) {
+        int saved_errno = errno;
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(saved_errno),
+                    "Could not move journal '%s' aside: %s",
+                    journal->path,
+                    g_strerror(saved_errno));
+        success = FALSE;
+    }
+    if (success)
+        success = journal_reopen_empty(journal, error);
+    g_mutex_unlock(&journal->lock);
+    return success;
+}
+
+void
+journal_finish_compaction(PaperJournal* journal)
+{
+    g_mutex_lock(&journal->lock);
+    g_unlink(journal->compacting_path);
+    g_mutex_unlock(&journal->lock);
+}
+
+void
+journal_close(PaperJournal* journal)
+{
+    if (!journal)
+        return;
+    journal_free(journal);
+}
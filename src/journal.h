@@ -0,0 +1,84 @@
+/* journal.h */
+#pragma once
+
+#include "paper.h"
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum
+{
+    JOURNAL_ADD = 1,
+    JOURNAL_UPDATE = 2,
+    JOURNAL_REMOVE = 3,
+    JOURNAL_RESET = 4,
+    JOURNAL_HASH = 5,
+} JournalOp;
+
+/**
+ * Replays the journal next to db->path over the snapshot already loaded into
+ * @db, then opens it for appending and stores it in db->journal.
+ * A torn or corrupted tail is dropped. Returns FALSE and sets *error if the
+ * journal can't be opened; @db is left without a journal then.
+ */
+gboolean
+journal_load(PaperDatabase* db, GError** error);
+
+/**
+ * Encodes an @op record for @paper (NULL for JOURNAL_RESET), which is
+ * identified by its pdf_file. Call with @paper locked, or still detached.
+ * Update records take @abstract instead of the Paper's, which may be lazy.
+ * Returns NULL for a Paper without a pdf_file, the journal can't name it.
+ */
+GByteArray*
+journal_encode(JournalOp op, const Paper* paper, const gchar* abstract);
+
+/**
+ * Queues @record (consumed, may be NULL) behind those queued before. Call
+ * while the change it describes is still locked in, so the records queue in
+ * the order the changes happened. No I/O. Thread-safe.
+ */
+void
+journal_queue(PaperJournal* journal, GByteArray* record);
+
+/**
+ * Writes the queued records with one write(2), no fsync. Call once the
+ * locks they were queued under are dropped. Thread-safe.
+ */
+void
+journal_flush(PaperJournal* journal);
+
+/**
+ * Returns the current size of the journal in bytes.
+ */
+gsize
+journal_size(PaperJournal* journal);
+
+/**
+ * Writes the queued records and flushes the journal to disk.
+ */
+gboolean
+journal_sync(PaperJournal* journal, GError** error);
+
+/**
+ * Starts a compaction: moves the current records aside and continues with an
+ * empty journal. Everything up to here must be in the next snapshot before
+ * journal_finish_compaction() drops the old records.
+ */
+gboolean
+journal_begin_compaction(PaperJournal* journal, GError** error);
+
+/**
+ * Drops the records moved aside by journal_begin_compaction(), once the new
+ * snapshot has been written.
+ */
+void
+journal_finish_compaction(PaperJournal* journal);
+
+/**
+ * Closes the journal and frees it.
+ */
+void
+journal_close(PaperJournal* journal);
+
+G_END_DECLS
@@ -0,0 +1,706 @@
+/* json_stream.c */
+#define G_LOG_DOMAIN "json"
+
+#include "json_stream.h"
+#include "hash.h"
+
+#include <errno.h>
+#include <glib.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Container on the reader's stack */
+typedef struct
+{
+    gchar kind;          // '[' or '{'
+    gboolean has_member; // a value was read, a comma must come next
+    gboolean after_key;  // object member name read, value comes next
+} JsonLevel;
+
+struct _JsonReader
+{
+    JsonReadFunc read; // NULL when reading from memory
+    gpointer source;
+    gchar* buffer;     // refill buffer for read, NULL otherwise
+    const gchar* data; // current window
+    gsize length;
+    gsize pos;
+    gsize consumed; // bytes before the current window
+    gboolean io_error;
+
+    JsonLevel stack[JSON_READER_MAX_DEPTH];
+    guint depth;
+    gboolean done;     // top-level value read
+    gboolean sequence; // more top-level values may follow
+    gboolean comma_separated;
+
+    GString* string; // reused for every key and string
+    gdouble number;
+};
+
+/* Buffer helpers */
+
+static gboolean
+refill(JsonReader* reader)
+{
+    if (!reader->read)
+        return FALSE;
+    reader->consumed += reader->length;
+    reader->pos = 0;
+    gssize n =
+      reader->read(reader->source, reader->buffer, JSON_READER_BUFFER_SIZE);
+    if (n < 0)
+        reader->io_error = TRUE;
+    reader->length = n > 0 ? (gsize)n : 0;
+    return reader->length > 0;
+}
+
+/* Returns the next byte without consuming it, or -1 at the end */
+static inline int
+peek(JsonReader* reader)
+{
+    if (reader->pos >= reader->length && !refill(reader))
+        return -1;
+    return (guchar)reader->data[reader->pos];
+}
+
+static inline int
+advance(JsonReader* reader)
+{
+    int c = peek(reader);
+    if (c >= 0)
+        reader->pos++;
+    return c;
+}
+
+static void
+skip_whitespace(JsonReader* reader)
+{
+    for (;;) {
+        int c = peek(reader);
+        if (c != ' ' && c != '\n' && c != '\r' && c != '\t')
+            return;
+        reader->pos++;
+    }
+}
+
+static JsonToken
+fail(JsonReader* reader, GError** error, const gchar* what)
+{
+    if (reader->io_error)
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_IO,
+                    "Failed to read JSON at offset %zu",
+                    json_reader_get_offset(reader));
+    else
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_FAILED,
+                    "Failed to parse JSON at offset %zu: %s",
+                    json_reader_get_offset(reader),
+                    what);
+    return JSON_TOKEN_ERROR;
+}
+
+/* Scalars */
+
+static int
+hex_value(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+static gboolean
+read_hex4(JsonReader* reader, gunichar* out)
+{
+    gunichar value = 0;
+    for (int i = 0; i < 4; ++i) {
+        int digit = hex_value(advance(reader));
+        if (digit < 0)
+            return FALSE;
+        value = (value << 4) | (gunichar)digit;
+    }
+    *out = value;
+    return TRUE;
+}
+
+/* Reads a string after its opening quote into reader->string */
+static gboolean
+read_string(JsonReader* reader)
+{
+    g_string_truncate(reader->string, 0);
+    for (;;) {
+        // copy runs of plain characters in one go
+        gsize start = reader->pos;
+        while (reader->pos < reader->length) {
+            gchar c = reader->data[reader->pos];
+            if (c == '"' || c == '\\')
+                break;
+            reader->pos++;
+        }
+        g_string_append_len(
+          reader->string, reader->data + start, reader->pos - start);
+
+        int c = advance(reader); // refills if the window ended
+        if (c < 0)
+            return FALSE;
+        if (c == '"')
+            return TRUE;
+        if (c != '\\') {
+            // only reached when the window ended right before c
+            g_string_append_c(reader->string, (gchar)c);
+            continue;
+        }
+
+        c = advance(reader);
+        switch (c) {
+            case '"':
+            case '\\':
+            case '/':
+                g_string_append_c(reader->string, (gchar)c);
+                break;
+            case 'b':
+                g_string_append_c(reader->string, '\b');
+                break;
+            case 'f':
+                g_string_append_c(reader->string, '\f');
+                break;
+            case 'n':
+                g_string_append_c(reader->string, '\n');
+                break;
+            case 'r':
+                g_string_append_c(reader->string, '\r');
+                break;
+            case 't':
+                g_string_append_c(reader->string, '\t');
+                break;
+            case 'u': {
+                gunichar ch;
+                if (!read_hex4(reader, &ch))
+                    return FALSE;
+                // surrogate pair
+                if (ch >= 0xD800 && ch <= 0xDBFF) {
+                    gunichar low;
+                    if (advance(reader) != '\\' || advance(reader) != 'u' ||
+                        !read_hex4(reader, &low) || low < 0xDC00 ||
+                        low > 0xDFFF)
+                        return FALSE;
+                    ch = 0x10000 + ((ch - 0xD800) << 10) + (low - 0xDC00);
+                } else if (ch >= 0xDC00 && ch <= 0xDFFF)
+                    return FALSE;
+                g_string_append_unichar(reader->string, ch);
+                break;
+            }
+            default:
+                return FALSE;
+        }
+    }
+}
+
+static gboolean
+read_number(JsonReader* reader)
+{
+    gchar text[64];
+    gsize len = 0;
+    for (;;) {
+        int c = peek(reader);
+        if (!((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+              c == 'e' || c == 'E'))
+            break;
+        if (len >= sizeof(text) - 1)
+            return FALSE;
+        text[len++] = (gchar)c;
+        reader->pos++;
+    }
+    text[len] = '\0';
+    gchar* end = NULL;
+    reader->number = g_ascii_strtod(text, &end);
+    return len > 0 && end == text + len;
+}
+
+static gboolean
+read_literal(JsonReader* reader, const gchar* literal)
+{
+    // first character was already consumed
+    for (const gchar* p = literal + 1; *p; ++p)
+        if (advance(reader) != *p)
+            return FALSE;
+    return TRUE;
+}
+
+/* Reads any value starting at the current position */
+static JsonToken
+read_value(JsonReader* reader, GError** error)
+{
+    int c = advance(reader);
+    switch (c) {
+        case '[':
+        case '{':
+            if (reader->depth >= JSON_READER_MAX_DEPTH)
+                return fail(reader, error, "nested too deeply");
+            reader->stack[reader->depth++] =
+              (JsonLevel){ .kind = (gchar)c, .has_member = FALSE };
+            return c == '[' ? JSON_TOKEN_BEGIN_ARRAY : JSON_TOKEN_BEGIN_OBJECT;
+        case '"':
+            if (!read_string(reader))
+                return fail(reader, error, "invalid string");
+            return JSON_TOKEN_STRING;
+        case 't':
+            if (!read_literal(reader, "true"))
+                return fail(reader, error, "invalid literal");
+            return JSON_TOKEN_TRUE;
+        case 'f':
+            if (!read_literal(reader, "false"))
+                return fail(reader, error, "invalid literal");
+            return JSON_TOKEN_FALSE;
+        case 'n':
+            if (!read_literal(reader, "null"))
+                return fail(reader, error, "invalid literal");
+            return JSON_TOKEN_NULL;
+        default:
+            if (c == '-' || (c >= '0' && c <= '9')) {
+                reader->pos--; // c is part of the number
+                if (!read_number(reader))
+                    return fail(reader, error, "invalid number");
+                return JSON_TOKEN_NUMBER;
+            }
+            return fail(reader,
+                        error,
+                        c < 0 ? "unexpected end of input"
+                              : "unexpected character");
+    }
+}
+
+static gssize
+read_file(gpointer source, gchar* buffer, gsize size)
+{
+    FILE* file = source;
+    gsize n = fread(buffer, 1, size, file);
+    return n == 0 && ferror(file) ? -1 : (gssize)n;
+}
+
+/* Public API */
+
+JsonReader*
+json_reader_new_from_file(FILE* file)
+{
+    return json_reader_new(read_file, file);
+}
+
+JsonReader*
+json_reader_new(JsonReadFunc read, gpointer source)
+{
+    JsonReader* reader = g_new0(JsonReader, 1); // freed by json_reader_free()
+    reader->read = read;
+    reader->source = source;
+    reader->buffer =
+      g_malloc(JSON_READER_BUFFER_SIZE); // freed by json_reader_free()
+    reader->data = reader->buffer;
+    reader->string = g_string_new(NULL); // freed by json_reader_free()
+    return reader;
+}
+
+JsonReader*
+json_reader_new_from_data(const gchar* data, gsize length)
+{
+    JsonReader* reader = g_new0(JsonReader, 1); // freed by json_reader_free()
+    reader->data = data;
+    reader->length = length;
+    reader->string = g_string_new(NULL); // freed by json_reader_free()
+    return reader;
+}
+
+void
+json_reader_free(JsonReader* reader)
+{
+    if (!reader)
+        return;
+    g_free(reader->buffer);
+    g_string_free(reader->string, TRUE);
+    g_free(reader);
+}
+
+void
+json_reader_set_sequence(JsonReader* reader, gboolean comma_separated)
+{
+    reader->sequence = TRUE;
+    reader->comma_separated = comma_separated;
+}
+
+JsonToken
+json_reader_next(JsonReader* reader, GError** error)
+{
+    skip_whitespace(reader);
+
+    /* Top level: one value, or several in sequence mode */
+    if (reader->depth == 0) {
+        if (peek(reader) < 0) {
+            if (reader->io_error)
+                return fail(reader, error, "read error");
+            return JSON_TOKEN_EOF;
+        }
+        if (reader->done && !reader->sequence)
+            return fail(reader, error, "trailing data");
+        if (reader->done && reader->comma_separated) {
+            if (advance(reader) != ',')
+                return fail(reader, error, "expected ','");
+            skip_whitespace(reader);
+        }
+        reader->done = TRUE;
+        return read_value(reader, error);
+    }
+
+    JsonLevel* level = &reader->stack[reader->depth - 1];
+    int c = peek(reader);
+
+    /* Close the container, unless a value is due after ',' or ':' */
+    if (!level->after_key && c == (level->kind == '[' ? ']' : '}')) {
+        reader->pos++;
+        reader->depth--;
+        return level->kind == '[' ? JSON_TOKEN_END_ARRAY
+                                  : JSON_TOKEN_END_OBJECT;
+    }
+
+    if (level->after_key) {
+        level->after_key = FALSE;
+        level->has_member = TRUE;
+        return read_value(reader, error);
+    }
+
+    if (level->has_member) {
+        if (c != ',')
+            return fail(reader, error, "expected ','");
+        reader->pos++;
+        skip_whitespace(reader);
+    }
+
+    if (level->kind == '[') {
+        level->has_member = TRUE;
+        return read_value(reader, error);
+    }
+
+    /* Object member name */
+    if (advance(reader) != '"' || !read_string(reader))
+        return fail(reader, error, "expected member name");
+    skip_whitespace(reader);
+    if (advance(reader) != ':')
+        return fail(reader, error, "expected ':'");
+    level->after_key = TRUE;
+    return JSON_TOKEN_KEY;
+}
+
+const gchar*
+json_reader_get_string(JsonReader* reader, gsize* length)
+{
+    if (length)
+        *length = reader->string->len;
+    return reader->string->str;
+}
+
+gchar*
+json_reader_dup_string(JsonReader* reader)
+{
+    return g_strndup(reader->string->str, reader->string->len);
+}
+
+gdouble
+json_reader_get_number(JsonReader* reader)
+{
+    return reader->number;
+}
+
+gboolean
+json_reader_skip(JsonReader* reader, JsonToken token, GError** error)
+{
+    if (token != JSON_TOKEN_BEGIN_ARRAY && token != JSON_TOKEN_BEGIN_OBJECT)
+        return token != JSON_TOKEN_ERROR;
+    guint depth = 1;
+    while (depth > 0) {
+        token = json_reader_next(reader, error);
+        switch (token) {
+            case JSON_TOKEN_BEGIN_ARRAY:
+            case JSON_TOKEN_BEGIN_OBJECT:
+                depth++;
+                break;
+            case JSON_TOKEN_END_ARRAY:
+            case JSON_TOKEN_END_OBJECT:
+                depth--;
+                break;
+            case JSON_TOKEN_ERROR:
+                return FALSE;
+            case JSON_TOKEN_EOF:
+                fail(reader, error, "unexpected end of input");
+                return FALSE;
+            default:
+                break;
+        }
+    }
+    return TRUE;
+}
+
+gsize
+json_reader_get_offset(JsonReader* reader)
+{
+    return reader->consumed + reader->pos;
+}
+
+/* Writer */
+
+struct _JsonWriter
+{
+    JsonWriteFunc write;
+    gpointer sink;
+    FILE* file; // flushed by json_writer_finish(), NULL for custom sinks
+    gchar* buffer;
+    gsize length;
+    gboolean io_error;
+    Xxh64State hash; // of everything written
+    uint64_t written;
+    // per level: a value was written, the next one needs a comma
+    gboolean has_member[JSON_READER_MAX_DEPTH + 1];
+    guint depth;
+    gboolean after_key;
+    gboolean sequence; // newline after each top-level value, no commas
+};
+
+static void
+writer_write(JsonWriter* writer, const gchar* data, gsize length)
+{
+    if (!writer->write(writer->sink, data, length))
+        writer->io_error = TRUE;
+    xxh64_update(&writer->hash, data, length);
+    writer->written += length;
+}
+
+static void
+writer_flush(JsonWriter* writer)
+{
+    if (writer->length > 0)
+        writer_write(writer, writer->buffer, writer->length);
+    writer->length = 0;
+}
+
+static inline void
+writer_put(JsonWriter* writer, const gchar* data, gsize length)
+{
+    if (writer->length + length > JSON_WRITER_BUFFER_SIZE) {
+        writer_flush(writer);
+        if (length > JSON_WRITER_BUFFER_SIZE) {
+            writer_write(writer, data, length);
+            return;
+        }
+    }
+    memcpy(writer->buffer + writer->length, data, length);
+    writer->length += length;
+}
+
+static inline void
+writer_put_c(JsonWriter* writer, gchar c)
+{
+    if (writer->length == JSON_WRITER_BUFFER_SIZE)
+        writer_flush(writer);
+    writer->buffer[writer->length++] = c;
+}
+
+/* Ends the line after a top-level value in sequence mode */
+static inline void
+writer_end_value(JsonWriter* writer)
+{
+    if (writer->sequence && writer->depth == 0)
+        writer_put_c(writer, '\n');
+}
+
+/* Emits the comma before a value or member name if one is due */
+static void
+writer_separate(JsonWriter* writer)
+{
+    if (writer->after_key) {
+        writer->after_key = FALSE;
+        return;
+    }
+    if (writer->has_member[writer->depth] &&
+        !(writer->sequence && writer->depth == 0))
+        writer_put_c(writer, ',');
+    writer->has_member[writer->depth] = TRUE;
+}
+
+static void
+writer_push(JsonWriter* writer, gchar c)
+{
+    writer_separate(writer);
+    writer_put_c(writer, c);
+    g_return_if_fail(writer->depth < JSON_READER_MAX_DEPTH);
+    writer->has_member[++writer->depth] = FALSE;
+}
+
+static void
+writer_pop(JsonWriter* writer, gchar c)
+{
+    g_return_if_fail(writer->depth > 0);
+    writer->depth--;
+    writer_put_c(writer, c);
+    writer_end_value(writer);
+}
+
+static void
+writer_put_escaped(JsonWriter* writer, const gchar* value)
+{
+    writer_put_c(writer, '"');
+    const gchar* run = value;
+    for (const gchar* p = value; *p; ++p) {
+        guchar c = (guchar)*p;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+        // flush the plain run before the character that needs escaping
+        writer_put(writer, run, p - run);
+        run = p + 1;
+        switch (c) {
+            case '"':
+                writer_put(writer, "\\\"", 2);
+                break;
+            case '\\':
+                writer_put(writer, "\\\\", 2);
+                break;
+            case '\b':
+                writer_put(writer, "\\b", 2);
+                break;
+            case '\f':
+                writer_put(writer, "\\f", 2);
+                break;
+            case '\n':
+                writer_put(writer, "\\n", 2);
+                break;
+            case '\r':
+                writer_put(writer, "\\r", 2);
+                break;
+            case '\t':
+                writer_put(writer, "\\t", 2);
+                break;
+            default: {
+                gchar escaped[7];
+                g_snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                writer_put(writer, escaped, 6);
+            }
+        }
+    }
+    writer_put(writer, run, strlen(run));
+    writer_put_c(writer, '"');
+}
+
+static gboolean
+write_file(gpointer sink, const gchar* data, gsize length)
+{
+    return fwrite(data, 1, length, sink) == length;
+}
+
+JsonWriter*
+json_writer_new(FILE* file)
+{
+    JsonWriter* writer = json_writer_new_with_func(write_file, file);
+    writer->file = file;
+    return writer;
+}
+
+JsonWriter*
+json_writer_new_with_func(JsonWriteFunc write, gpointer sink)
+{
+    JsonWriter* writer = g_new0(JsonWriter, 1); // freed by json_writer_finish()
+    writer->write = write;
+    writer->sink = sink;
+    writer->buffer =
+      g_malloc(JSON_WRITER_BUFFER_SIZE); // freed by json_writer_finish()
+    xxh64_init(&writer->hash, 0);
+    return writer;
+}
+
+gboolean
+json_writer_finish(JsonWriter* writer,
+                   uint64_t* out_size,
+                   uint64_t* out_hash,
+                   GError** error)
+{
+    writer_flush(writer);
+    if (out_size)
+        *out_size = writer->written;
+    if (out_hash)
+        *out_hash = xxh64_digest(&writer->hash);
+    gboolean ok =
+      !writer->io_error && (!writer->file || fflush(writer->file) == 0);
+    if (!ok)
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_IO,
+                    "Failed to write JSON: %s",
+                    g_strerror(errno));
+    g_free(writer->buffer);
+    g_free(writer);
+    return ok;
+}
+
+void
+json_writer_set_sequence(JsonWriter* writer)
+{
+    writer->sequence = TRUE;
+}
+
+void
+json_writer_begin_array(JsonWriter* writer)
+{
+    writer_push(writer, '[');
+}
+
+void
+json_writer_end_array(JsonWriter* writer)
+{
+    writer_pop(writer, ']');
+}
+
+void
+json_writer_begin_object(JsonWriter* writer)
+{
+    writer_push(writer, '{');
+}
+
+void
+json_writer_end_object(JsonWriter* writer)
+{
+    writer_pop(writer, '}');
+}
+
+void
+json_writer_key(JsonWriter* writer, const gchar* key)
+{
+    writer_separate(writer);
+    writer_put_escaped(writer, key);
+    writer_put_c(writer, ':');
+    writer->after_key = TRUE;
+}
+
+void
+json_writer_string(JsonWriter* writer, const gchar* value)
+{
+    writer_separate(writer);
+    if (value)
+        writer_put_escaped(writer, value);
+    else
+        writer_put(writer, "null", 4);
+    writer_end_value(writer);
+}
+
+void
+json_writer_int(JsonWriter* writer, gint64 value)
+{
+    gchar text[24];
+    writer_separate(writer);
+    gint length =
+      g_snprintf(text, sizeof(text), "%" G_GINT64_FORMAT, value);
+    writer_put(writer, text, length);
+    writer_end_value(writer);
+}
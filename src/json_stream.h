@@ -0,0 +1,181 @@
+/* json_stream.h */
+#pragma once
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+
+G_BEGIN_DECLS
+
+#define JSON_READER_BUFFER_SIZE (64 * 1024)
+#define JSON_READER_MAX_DEPTH 64
+#define JSON_WRITER_BUFFER_SIZE (64 * 1024)
+
+typedef enum
+{
+    JSON_TOKEN_ERROR,
+    JSON_TOKEN_EOF,
+    JSON_TOKEN_BEGIN_ARRAY,
+    JSON_TOKEN_END_ARRAY,
+    JSON_TOKEN_BEGIN_OBJECT,
+    JSON_TOKEN_END_OBJECT,
+    JSON_TOKEN_KEY, // object member name, text in json_reader_get_string()
+    JSON_TOKEN_STRING,
+    JSON_TOKEN_NUMBER,
+    JSON_TOKEN_TRUE,
+    JSON_TOKEN_FALSE,
+    JSON_TOKEN_NULL,
+} JsonToken;
+
+/* Pull-style JSON tokenizer, see json_reader_next() */
+typedef struct _JsonReader JsonReader;
+
+/**
+ * Creates a reader that streams from @file through a fixed-size buffer, so
+ * memory use doesn't depend on the size of the document.
+ * The caller keeps ownership of @file.
+ */
+JsonReader*
+json_reader_new_from_file(FILE* file);
+
+/**
+ * Fills @buffer with up to @size bytes from @source. Returns the number of
+ * bytes read, 0 at the end of the input or -1 on error.
+ */
+typedef gssize (*JsonReadFunc)(gpointer source, gchar* buffer, gsize size);
+
+/**
+ * Like json_reader_new_from_file(), for inputs that aren't a FILE, e.g. a
+ * decompressor. @source is passed to @read and must outlive the reader.
+ */
+JsonReader*
+json_reader_new(JsonReadFunc read, gpointer source);
+
+/**
+ * Creates a reader over @length bytes at @data, which must outlive the reader.
+ */
+JsonReader*
+json_reader_new_from_data(const gchar* data, gsize length);
+
+void
+json_reader_free(JsonReader* reader);
+
+/**
+ * Lets @reader return any number of top-level values instead of exactly one,
+ * separated by commas if @comma_separated (a slice of an array's elements),
+ * or by whitespace otherwise (NDJSON).
+ */
+void
+json_reader_set_sequence(JsonReader* reader, gboolean comma_separated);
+
+/**
+ * Returns the next token of the document, validating structure on the way.
+ * Commas and colons are consumed internally. After the top-level value only
+ * JSON_TOKEN_EOF follows, unless json_reader_set_sequence() was called.
+ * On malformed input or I/O errors returns JSON_TOKEN_ERROR and sets *error.
+ */
+JsonToken
+json_reader_next(JsonReader* reader, GError** error);
+
+/**
+ * Text of the last JSON_TOKEN_KEY or JSON_TOKEN_STRING, unescaped.
+ * Owned by the reader, valid until the next call to json_reader_next().
+ */
+const gchar*
+json_reader_get_string(JsonReader* reader, gsize* length);
+
+/**
+ * Copies the text of the last JSON_TOKEN_KEY or JSON_TOKEN_STRING.
+ */
+gchar*
+json_reader_dup_string(JsonReader* reader);
+
+/**
+ * Value of the last JSON_TOKEN_NUMBER.
+ */
+gdouble
+json_reader_get_number(JsonReader* reader);
+
+/**
+ * Skips the rest of the value that started with @token (no-op for scalars).
+ * Returns FALSE and sets *error on malformed input.
+ */
+gboolean
+json_reader_skip(JsonReader* reader, JsonToken token, GError** error);
+
+/**
+ * Number of bytes consumed so far, for error messages.
+ */
+gsize
+json_reader_get_offset(JsonReader* reader);
+
+/* Streaming JSON emitter writing through a fixed-size buffer */
+typedef struct _JsonWriter JsonWriter;
+
+/**
+ * Creates a writer emitting compact JSON to @file.
+ * The caller keeps ownership of @file.
+ */
+JsonWriter*
+json_writer_new(FILE* file);
+
+/* Writes all @length bytes at @data to @sink, returns FALSE on error */
+typedef gboolean (*JsonWriteFunc)(gpointer sink,
+                                  const gchar* data,
+                                  gsize length);
+
+/**
+ * Creates a writer emitting through @write, e.g. into a compressor.
+ * The size and hash reported by json_writer_finish() are of the bytes passed
+ * to @write, not of what ends up on disk.
+ */
+JsonWriter*
+json_writer_new_with_func(JsonWriteFunc write, gpointer sink);
+
+/**
+ * Flushes what is left in the buffer and frees @writer.
+ * If non-NULL, *out_size and *out_hash receive the number of bytes written and
+ * their XXH64 (seed 0), i.e. what hash_file() would report for a new file.
+ * Returns FALSE and sets *error if any write failed.
+ */
+gboolean
+json_writer_finish(JsonWriter* writer,
+                   uint64_t* out_size,
+                   uint64_t* out_hash,
+                   GError** error);
+
+/**
+ * Lets @writer emit any number of top-level values, each on its own line
+ * (NDJSON).
+ */
+void
+json_writer_set_sequence(JsonWriter* writer);
+
+void
+json_writer_begin_array(JsonWriter* writer);
+
+void
+json_writer_end_array(JsonWriter* writer);
+
+void
+json_writer_begin_object(JsonWriter* writer);
+
+void
+json_writer_end_object(JsonWriter* writer);
+
+/**
+ * Writes an object member name; the next value belongs to it.
+ */
+void
+json_writer_key(JsonWriter* writer, const gchar* key);
+
+/**
+ * Writes @value escaped as a JSON string, or null if @value is NULL.
+ */
+void
+json_writer_string(JsonWriter* writer, const gchar* value);
+
+void
+json_writer_int(JsonWriter* writer, gint64 value);
+
+G_END_DECLS
@@ -0,0 +1,543 @@
+/* load_bench.c */
+#define _POSIX_C_SOURCE 200809L // for posix_fadvise(), fdatasync()
+#define G_LOG_DOMAIN "loader"
+
+#include "load_bench.h"
+#include "cJSON/cJSON.h"
+#include "loader.h"
+#include "paper.h"
+#include "search.h"
+#include "serializer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+/* About 1.3 KB of JSON per paper, so a few hundred MB in total, with
+ * authors and keywords drawn from pools the size of a large library's */
+#define BENCH_JSON_PAPERS 250000
+#define BENCH_ABSTRACT_WORDS 180
+#define BENCH_AUTHOR_POOL 20000
+#define BENCH_KEYWORD_POOL 2000
+#define BENCH_BATCH_SIZE 1024
+#define BENCH_SEARCH_RUNS 3
+#define BENCH_SEARCH_RESULTS 100
+
+static const gchar* const bench_words[] = {
+    "we",        "propose",  "a",         "novel",     "method",
+    "for",       "learning", "sparse",    "graph",     "models",
+    "under",     "noise",    "results",   "show",      "that",
+    "the",       "approach", "improves",  "accuracy",  "on",
+    "benchmark", "datasets", "while",     "reducing",  "memory",
+    "and",       "latency",  "of",        "inference", "transformer",
+};
+
+/* Queries that have to read every abstract, and one that never does */
+static const gchar* const bench_queries[] = {
+    "sparse graph",
+    "transformer latency",
+    "generated paper",
+};
+
+/* Resident and peak resident set size of this process in KiB */
+typedef struct
+{
+    gsize rss_kb;
+    gsize peak_kb;
+} BenchMemory;
+
+static gsize
+status_field_kb(const gchar* status, const gchar* field)
+{
+    const gchar* line = strstr(status, field);
+    return line ? g_ascii_strtoull(line + strlen(field), NULL, 10) : 0;
+}
+
+static BenchMemory
+read_memory(void)
+{
+    BenchMemory memory = { 0 };
+    gchar* status = NULL; // freed before return
+    if (g_file_get_contents("/proc/self/status", &status, NULL, NULL)) {
+        memory.rss_kb = status_field_kb(status, "VmRSS:");
+        memory.peak_kb = status_field_kb(status, "VmHWM:");
+    }
+    g_free(status);
+    return memory;
+}
+
+/* Hands freed memory back and lowers the peak RSS to the current one, so
+ * every load gets its own peak. Linux only; without it the peak is the
+ * process's so far. */
+static void
+reset_peak_memory(void)
+{
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    FILE* file = fopen("/proc/self/clear_refs", "w"); // closed before return
+    if (!file)
+        return;
+    fputs("5", file);
+    fclose(file);
+}
+
+static void
+print_load(const gchar* what,
+           gint papers,
+           gdouble seconds,
+           const BenchMemory* before,
+           gsize size)
+{
+    BenchMemory after = read_memory();
+    g_print("%-22s %d papers in %.2f s (%.0f MB/s), peak RSS %.0f MB "
+            "(+%.0f MB)\n",
+            what,
+            papers,
+            seconds,
+            size / 1048576.0 / seconds,
+            after.peak_kb / 1024.0,
+            (after.peak_kb - MIN(before->rss_kb, after.peak_kb)) / 1024.0);
+}
+
+static gchar*
+bench_abstract(GRand* rand)
+{
+    GString* text = g_string_sized_new(BENCH_ABSTRACT_WORDS * 8);
+    for (guint i = 0; i < BENCH_ABSTRACT_WORDS; ++i) {
+        if (i > 0)
+            g_string_append_c(text, ' ');
+        g_string_append(
+          text,
+          bench_words[g_rand_int_range(rand, 0, G_N_ELEMENTS(bench_words))]);
+    }
+    return g_string_free(text, FALSE); // freed by the Paper
+}
+
+/**
+ * Returns a database of @count generated papers, not backed by any file.
+ * Free with free_database().
+ */
+static PaperDatabase*
+generate_database(gint count)
+{
+    PaperDatabase* db = create_database(1, NULL, NULL); // freed by the caller
+    GRand* rand = g_rand_new_with_seed(1); // freed before return
+    Paper* batch[BENCH_BATCH_SIZE];
+    gint batch_count = 0;
+    for (gint i = 0; i < count; ++i) {
+        gint authors_count = g_rand_int_range(rand, 1, 6);
+        gchar** authors = g_new(gchar*, authors_count); // freed by the Paper
+        for (gint j = 0; j < authors_count; ++j)
+            authors[j] = g_strdup_printf(
+              "Author %d", g_rand_int_range(rand, 0, BENCH_AUTHOR_POOL));
+        gchar** keywords = g_new(gchar*, 3); // freed by the Paper
+        for (gint j = 0; j < 3; ++j)
+            keywords[j] = g_strdup_printf(
+              "keyword %d", g_rand_int_range(rand, 0, BENCH_KEYWORD_POOL));
+        batch[batch_count++] =
+          build_paper(g_strdup_printf("A generated paper, number %d", i),
+                      authors,
+                      authors_count,
+                      g_rand_int_range(rand, 1990, 2026),
+                      keywords,
+                      3,
+                      bench_abstract(rand),
+                      g_strdup_printf("%04d.%05d", 2000 + i / 100000, i),
+                      g_strdup_printf("10.1000/bench.%d", i),
+                      g_strdup_printf("/papers/bench-%d.pdf", i));
+        if (batch_count == BENCH_BATCH_SIZE || i == count - 1) {
+            insert_papers(db, batch, batch_count);
+            batch_count = 0;
+        }
+    }
+    g_rand_free(rand);
+    return db;
+}
+
+/**
+ * Writes a library of @count generated papers to @path, in any format
+ * write_json_snapshot() supports.
+ */
+static gboolean
+generate_library(const gchar* path, gint count, GError** error)
+{
+    PaperDatabase* db = generate_database(count); // freed before return
+    PaperSnapshot* snapshot = snapshot_database(db); // freed before return
+    gboolean ok = write_json_snapshot(snapshot, path, NULL, NULL, error);
+    free_snapshot(snapshot);
+    free_database(db);
+    return ok;
+}
+
+/* Copies string @key of @item, or NULL */
+static gchar*
+dup_string_item(const cJSON* item, const gchar* key)
+{
+    cJSON* value = cJSON_GetObjectItem(item, key);
+    return cJSON_IsString(value) ? g_strdup(value->valuestring) : NULL;
+}
+
+static gchar**
+dup_string_array(const cJSON* item, const gchar* key, gint* count)
+{
+    cJSON* array = cJSON_GetObjectItem(item, key);
+    *count = cJSON_IsArray(array) ? cJSON_GetArraySize(array) : 0;
+    gchar** strings = g_new0(gchar*, MAX(*count, 1)); // freed by the Paper
+    gint n = 0;
+    cJSON* element = NULL;
+    cJSON_ArrayForEach(element, array)
+    {
+        if (cJSON_IsString(element))
+            strings[n++] = g_strdup(element->valuestring);
+    }
+    *count = n;
+    return strings;
+}
+
+/**
+ * Loads @path into @db the way the loader did before the streaming reader:
+ * read the whole file, build a cJSON tree of it, then copy out every paper.
+ */
+static gboolean
+load_with_cjson(PaperDatabase* db, const gchar* path, GError** error)
+{
+    gchar* data = NULL; // freed before return
+    if (!g_file_get_contents(path, &data, NULL, error))
+        return FALSE;
+    cJSON* json = cJSON_Parse(data); // freed by cJSON_Delete()
+    g_free(data);
+    if (!json) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_FAILED,
+                    "Failed to parse %s with cJSON",
+                    path);
+        return FALSE;
+    }
+
+    Paper* batch[BENCH_BATCH_SIZE];
+    gint batch_count = 0;
+    cJSON* item = NULL;
+    cJSON_ArrayForEach(item, json)
+    {
+        gint authors_count = 0;
+        gint keyword_count = 0;
+        gchar** authors = dup_string_array(item, "authors", &authors_count);
+        gchar** keywords = dup_string_array(item, "keywords", &keyword_count);
+        cJSON* year = cJSON_GetObjectItem(item, "year");
+        batch[batch_count++] =
+          build_paper(dup_string_item(item, "title"),
+                      authors,
+                      authors_count,
+                      cJSON_IsNumber(year) ? year->valueint : 0,
+                      keywords,
+                      keyword_count,
+                      dup_string_item(item, "abstract"),
+                      dup_string_item(item, "arxiv_id"),
+                      dup_string_item(item, "doi"),
+                      dup_string_item(item, "pdf_file"));
+        if (batch_count == BENCH_BATCH_SIZE) {
+            insert_papers(db, batch, batch_count);
+            batch_count = 0;
+        }
+    }
+    insert_papers(db, batch, batch_count);
+    cJSON_Delete(json);
+    return TRUE;
+}
+
+void
+load_bench_json(void)
+{
+    GError* error = NULL;
+    gchar* dir = g_dir_make_tmp("paperpusher-bench-XXXXXX",
+                                &error); // freed before return
+    if (!dir) {
+        g_printerr("Error creating bench directory: %s\n", error->message);
+        g_clear_error(&error);
+        return;
+    }
+    gchar* path = g_build_filename(dir, "ppdb.json", NULL); // freed below
+
+    g_print("Generating %d papers...\n", BENCH_JSON_PAPERS);
+    GStatBuf st;
+    if (!generate_library(path, BENCH_JSON_PAPERS, &error) ||
+        g_stat(path, &st) != 0) {
+        g_printerr("Error generating %s: %s\n",
+                   path,
+                   error ? error->message : g_strerror(errno));
+        g_clear_error(&error);
+        goto out;
+    }
+    g_print("JSON load of %.0f MB\n", st.st_size / 1048576.0);
+
+    // streaming reader, as on a cold start
+    reset_peak_memory();
+    BenchMemory before = read_memory();
+    GTimer* timer = g_timer_new(); // freed before return
+    PaperDatabase* db =
+      create_database(1, path, NULL); // freed by free_database()
+    if (load_papers_from_json(db, &error))
+        print_load("streaming reader",
+                   db->count,
+                   g_timer_elapsed(timer, NULL),
+                   &before,
+                   st.st_size);
+    else {
+        g_printerr("Error loading %s: %s\n", path, error->message);
+        g_clear_error(&error);
+    }
+    free_database(db);
+
+    // the whole file and its cJSON tree in memory
+    reset_peak_memory();
+    before = read_memory();
+    g_timer_start(timer);
+    db = create_database(1, path, NULL); // freed by free_database()
+    if (load_with_cjson(db, path, &error))
+        print_load("cJSON DOM parse",
+                   db->count,
+                   g_timer_elapsed(timer, NULL),
+                   &before,
+                   st.st_size);
+    else {
+        g_printerr("Error loading %s: %s\n", path, error->message);
+        g_clear_error(&error);
+    }
+    free_database(db);
+    g_timer_destroy(timer);
+
+out:
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
+
+/* Evicts @path from the page cache, so the next load reads it from disk */
+static void
+drop_page_cache(const gchar* path)
+{
+    int fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return;
+    // only clean pages can be dropped
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+typedef gboolean (*BenchLoadFunc)(PaperDatabase* db, GError** error);
+
+static gboolean
+load_json_file(PaperDatabase* db, GError** error)
+{
+    return load_papers_from_json(db, error);
+}
+
+static gboolean
+load_cache_file(PaperDatabase* db, GError** error)
+{
+    return load_cache(db, NULL, error);
+}
+
+/**
+ * Loads @cache_path, or @json_path if it's NULL, with @load: once with the
+ * file dropped from the page cache and once with it still there.
+ */
+static void
+bench_cold_and_warm(const gchar* what,
+                    const gchar* json_path,
+                    const gchar* cache_path,
+                    BenchLoadFunc load)
+{
+    const gchar* file = cache_path ? cache_path : json_path;
+    GStatBuf st;
+    if (g_stat(file, &st) != 0) {
+        g_printerr("Error reading %s: %s\n", file, g_strerror(errno));
+        return;
+    }
+    for (gint warm = 0; warm <= 1; ++warm) {
+        if (!warm)
+            drop_page_cache(file);
+        reset_peak_memory();
+        BenchMemory before = read_memory();
+        GTimer* timer = g_timer_new(); // freed below
+        PaperDatabase* db = create_database(
+          1, (gchar*)json_path, (gchar*)cache_path); // freed below
+        GError* error = NULL;
+        gchar* label = g_strdup_printf(
+          "%s, %s", what, warm ? "warm" : "cold"); // freed below
+        if (load(db, &error))
+            print_load(label,
+                       db->count,
+                       g_timer_elapsed(timer, NULL),
+                       &before,
+                       st.st_size);
+        else {
+            g_printerr("Error loading %s: %s\n", file, error->message);
+            g_clear_error(&error);
+        }
+        g_free(label);
+        free_database(db);
+        g_timer_destroy(timer);
+    }
+}
+
+void
+load_bench_files(void)
+{
+    GError* error = NULL;
+    gchar* dir = g_dir_make_tmp("paperpusher-bench-XXXXXX",
+                                &error); // freed before return
+    if (!dir) {
+        g_printerr("Error creating bench directory: %s\n", error->message);
+        g_clear_error(&error);
+        return;
+    }
+    // all freed before return
+    gchar* json = g_build_filename(dir, "ppdb.json", NULL);
+    gchar* gzip = g_build_filename(dir, "ppdb.json.gz", NULL);
+    gchar* cache = g_build_filename(dir, "pp.cache", NULL);
+    gchar* compressed = g_build_filename(dir, "pp-compressed.cache", NULL);
+
+    g_print("Generating %d papers...\n", BENCH_JSON_PAPERS);
+    PaperDatabase* db = generate_database(BENCH_JSON_PAPERS); // freed below
+    PaperSnapshot* snapshot = snapshot_database(db);          // ditto
+    gboolean ok =
+      write_json_snapshot(snapshot, json, NULL, NULL, &error) &&
+      write_json_snapshot(snapshot, gzip, NULL, NULL, &error) &&
+      write_cache_snapshot(snapshot, json, cache, FALSE, &error) &&
+      write_cache_snapshot(snapshot, json, compressed, TRUE, &error);
+    free_snapshot(snapshot);
+    free_database(db);
+    if (!ok) {
+        g_printerr("Error generating files: %s\n", error->message);
+        g_clear_error(&error);
+        goto out;
+    }
+
+    bench_cold_and_warm("JSON", json, NULL, load_json_file);
+    bench_cold_and_warm("gzipped JSON", gzip, NULL, load_json_file);
+    bench_cold_and_warm("cache", json, cache, load_cache_file);
+    bench_cold_and_warm("compressed cache", json, compressed, load_cache_file);
+
+out:
+    g_unlink(json);
+    g_unlink(gzip);
+    g_unlink(cache);
+    g_unlink(compressed);
+    g_rmdir(dir);
+    g_free(json);
+    g_free(gzip);
+    g_free(cache);
+    g_free(compressed);
+    g_free(dir);
+}
+
+/* Bytes the abstracts of @db take in memory */
+static gsize
+abstract_bytes(PaperDatabase* db)
+{
+    gsize stored = 0;
+    if (db->abstract_pool)
+        text_store_get_sizes(db->abstract_pool, NULL, &stored);
+    for (gint i = 0; i < db->count; ++i)
+        if (db->papers[i]->abstract)
+            stored += strlen(db->papers[i]->abstract) + 1;
+    return stored;
+}
+
+/**
+ * Loads @path with abstracts plain or, with @compress, deflated in the pool,
+ * and prints resident memory and search latency.
+ */
+static void
+bench_abstracts(const gchar* path, gboolean compress)
+{
+    const gchar* what = compress ? "deflated" : "plain";
+    reset_peak_memory();
+    BenchMemory before = read_memory();
+    PaperDatabase* db =
+      create_database(1, (gchar*)path, NULL); // freed before return
+    if (compress)
+        enable_abstract_compression(db);
+    GError* error = NULL;
+    if (!load_papers_from_json(db, &error)) {
+        g_printerr("Error loading %s: %s\n", path, error->message);
+        g_clear_error(&error);
+        free_database(db);
+        return;
+    }
+    // what stays resident once the loader's garbage is handed back
+    reset_peak_memory();
+    BenchMemory after = read_memory();
+    g_print("%-8s abstracts take %.1f MB, RSS +%.0f MB\n",
+            what,
+            abstract_bytes(db) / 1048576.0,
+            (after.rss_kb - MIN(before.rss_kb, after.rss_kb)) / 1024.0);
+
+    const Paper* results[BENCH_SEARCH_RESULTS];
+    GTimer* timer = g_timer_new(); // freed before return
+    for (guint q = 0; q < G_N_ELEMENTS(bench_queries); ++q) {
+        gdouble first = 0, total = 0;
+        gint found = 0;
+        for (gint run = 0; run < BENCH_SEARCH_RUNS; ++run) {
+            g_timer_start(timer);
+            found = search_papers(
+              db, db->count, bench_queries[q], results, BENCH_SEARCH_RESULTS);
+            gdouble elapsed = g_timer_elapsed(timer, NULL);
+            if (run == 0)
+                first = elapsed;
+            total += elapsed;
+        }
+        g_print("%-8s \"%s\": %d results, first %.1f ms, mean %.1f ms\n",
+                what,
+                bench_queries[q],
+                found,
+                first * 1000,
+                total * 1000 / BENCH_SEARCH_RUNS);
+    }
+    if (db->abstract_pool)
+        g_print("%-8s %.1f MB of abstracts inflated after searching\n",
+                what,
+                text_store_get_resident(db->abstract_pool) / 1048576.0);
+    g_timer_destroy(timer);
+    free_database(db);
+}
+
+void
+load_bench_abstracts(void)
+{
+    GError* error = NULL;
+    gchar* dir = g_dir_make_tmp("paperpusher-bench-XXXXXX",
+                                &error); // freed before return
+    if (!dir) {
+        g_printerr("Error creating bench directory: %s\n", error->message);
+        g_clear_error(&error);
+        return;
+    }
+    gchar* path = g_build_filename(dir, "ppdb.json", NULL); // freed below
+
+    g_print("Generating %d papers...\n", BENCH_JSON_PAPERS);
+    if (!generate_library(path, BENCH_JSON_PAPERS, &error)) {
+        g_printerr("Error generating %s: %s\n", path, error->message);
+        g_clear_error(&error);
+    } else {
+        bench_abstracts(path, FALSE);
+        bench_abstracts(path, TRUE);
+    }
+
+    g_unlink(path);
+    g_rmdir(dir);
+    g_free(path);
+    g_free(dir);
+}
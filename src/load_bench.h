@@ -0,0 +1,33 @@
+/* load_bench.h */
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * Generates a JSON export of BENCH_JSON_PAPERS papers in a temporary
+ * directory and loads it with load_papers_from_json() and with a cJSON DOM
+ * parse like the loader used to do, printing time and peak RSS of each.
+ * For --bench-json.
+ */
+void
+load_bench_json(void);
+
+/**
+ * Writes the generated library as JSON, gzipped JSON, cache and compressed
+ * cache, then loads each of them with its file dropped from the page cache
+ * (cold, disk-bound) and again with it cached (warm). For --bench-load.
+ */
+void
+load_bench_files(void);
+
+/**
+ * Loads the generated library with abstracts kept plain and deflated in
+ * memory (see --compress-abstracts), printing the memory they take and the
+ * latency of searches that read them. For --bench-abstracts.
+ */
+void
+load_bench_abstracts(void);
+
+G_END_DECLS
@@ -1,199 +1,1263 @@
 /* loader.c */
+#define _POSIX_C_SOURCE 200809L // for fdopen(), fsync()
 #define G_LOG_DOMAIN "loader"
 
 #include "loader.h"
-#include "cJSON/cJSON.h"
+#include "config.h"
+#include "gzip_blocks.h"
+#include "hash.h"
+#include "json_stream.h"
+#include "loom.h"
 #include "paper.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <gio/gio.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <zlib.h>
 
 static GMutex json_mutex;
 
+#define LOAD_BATCH_SIZE 1024
+
 /**
- * Read entire file at db->path into memory and parse JSON.
- * Populate db with the resulting Paper objects.
- * TODO: use async task
+ * Reads an array of strings into a newly allocated, NULL-terminated vector.
+ * Non-string entries become "", like the old loader did.
+ * Returns FALSE and sets *error on malformed input.
  */
-bool
-load_papers_from_json(PaperDatabase* db, GError** error)
+static gboolean
+read_string_array(JsonReader* reader,
+                  JsonToken token,
+                  gchar*** out,
+                  gint* out_count,
+                  GError** error)
 {
-    g_return_val_if_fail(db != NULL, FALSE);
+    *out = NULL;
+    *out_count = 0;
+    if (token != JSON_TOKEN_BEGIN_ARRAY)
+        return json_reader_skip(reader, token, error);
 
-    g_autofree gchar* data = NULL; // freed on function return
-    gsize length = 0;
-    /* Read entire file into memory */
-    g_mutex_lock(&json_mutex);
-    if (!g_file_get_contents(db->path, &data, &length, error)) {
-        g_mutex_unlock(&json_mutex);
-        return FALSE;
+    GPtrArray* values = g_ptr_array_new(); // freed before return
+    for (;;) {
+        token = json_reader_next(reader, error);
+        if (token == JSON_TOKEN_END_ARRAY)
+            break;
+        if (token == JSON_TOKEN_STRING)
+            g_ptr_array_add(values, json_reader_dup_string(reader));
+        else if (json_reader_skip(reader, token, error) &&
+                 token != JSON_TOKEN_EOF)
+            g_ptr_array_add(values, g_strdup(""));
+        else {
+            g_ptr_array_set_free_func(values, g_free);
+            g_ptr_array_free(values, TRUE);
+            return FALSE;
+        }
     }
-    g_mutex_unlock(&json_mutex);
+    *out_count = values->len;
+    if (values->len > 0)
+        g_ptr_array_add(values, NULL); // so g_strfreev() works on it
+    *out = (gchar**)g_ptr_array_free(values, *out_count == 0);
+    return TRUE;
+}
+
+/**
+ * Reads one paper object, after its JSON_TOKEN_BEGIN_OBJECT, straight into a
+ * detached Paper. Unknown members are skipped.
+ * Sets *out to NULL for entries without a pdf_file.
+ * Returns FALSE and sets *error on malformed input.
+ */
+static gboolean
+read_paper(JsonReader* reader, Paper** out, GError** error)
+{
+    gchar* title = NULL;
+    gchar** authors = NULL;
+    gint authors_count = 0;
+    gint year = 0;
+    gchar** keywords = NULL;
+    gint keyword_count = 0;
+    gchar* abstract = NULL;
+    gchar* arxiv_id = NULL;
+    gchar* doi = NULL;
+    gchar* pdf_file = NULL;
+    guint64 content_hash = 0;
+    gboolean ok = TRUE;
 
-    if (length == 0) {
+    *out = NULL;
+    for (;;) {
+        JsonToken token = json_reader_next(reader, error);
+        if (token == JSON_TOKEN_END_OBJECT)
+            break;
+        if (token != JSON_TOKEN_KEY) {
+            ok = FALSE;
+            break;
+        }
+        g_autofree gchar* key = json_reader_dup_string(reader);
+        token = json_reader_next(reader, error);
+
+        gchar** field = NULL;
+        if (g_strcmp0(key, "title") == 0)
+            field = &title;
+        else if (g_strcmp0(key, "abstract") == 0)
+            field = &abstract;
+        else if (g_strcmp0(key, "arxiv_id") == 0)
+            field = &arxiv_id;
+        else if (g_strcmp0(key, "doi") == 0)
+            field = &doi;
+        else if (g_strcmp0(key, "pdf_file") == 0)
+            field = &pdf_file;
+
+        if (field && token == JSON_TOKEN_STRING) {
+            g_free(*field);
+            *field = json_reader_dup_string(reader);
+        } else if (g_strcmp0(key, "year") == 0 && token == JSON_TOKEN_NUMBER)
+            year = (gint)json_reader_get_number(reader);
+        else if (g_strcmp0(key, "content_hash") == 0 &&
+                 token == JSON_TOKEN_STRING) {
+            // hex, as JSON numbers can't hold 64 bits
+            g_autofree gchar* hex = json_reader_dup_string(reader);
+            content_hash = g_ascii_strtoull(hex, NULL, 16);
+        }
+        else if (g_strcmp0(key, "authors") == 0) {
+            g_strfreev(authors);
+            ok = read_string_array(
+              reader, token, &authors, &authors_count, error);
+        } else if (g_strcmp0(key, "keywords") == 0) {
+            g_strfreev(keywords);
+            ok = read_string_array(
+              reader, token, &keywords, &keyword_count, error);
+        } else
+            ok = json_reader_skip(reader, token, error) &&
+                 token != JSON_TOKEN_EOF;
+        if (!ok)
+            break;
+    }
+
+    if (ok && pdf_file) {
+        *out = build_paper(title,
+                           authors,
+                           authors_count,
+                           year,
+                           keywords,
+                           keyword_count,
+                           abstract,
+                           arxiv_id,
+                           doi,
+                           pdf_file);
+        (*out)->content_hash = content_hash;
         return TRUE;
     }
+    if (ok)
+        g_warning("Skipping JSON entry without pdf_file (title: %s)\n",
+                  title ? title : "none");
+    g_free(title);
+    g_strfreev(authors);
+    g_strfreev(keywords);
+    g_free(abstract);
+    g_free(arxiv_id);
+    g_free(doi);
+    g_free(pdf_file);
+    return ok;
+}
+
+gboolean
+is_jsonl_path(const gchar* path)
+{
+    if (!path)
+        return FALSE;
+    g_autofree gchar* plain = g_strdup(path); // freed on function return
+    if (g_str_has_suffix(plain, ".gz"))
+        plain[strlen(plain) - 3] = '\0';
+    return g_str_has_suffix(plain, ".jsonl") ||
+           g_str_has_suffix(plain, ".ndjson");
+}
+
+/* Files ending in .gz are read and written through gzip */
+static gboolean
+is_gzip_path(const gchar* path)
+{
+    return path && g_str_has_suffix(path, ".gz");
+}
 
-    cJSON* json = cJSON_Parse(data); // freed by cJSON_Delete()
-    if (!json) {
+static gssize
+read_gzip(gpointer source, gchar* buffer, gsize size)
+{
+    return gzread(source, buffer, (unsigned)size);
+}
+
+static gboolean
+is_blank(const gchar* data, gsize length)
+{
+    for (gsize i = 0; i < length; ++i)
+        if (!g_ascii_isspace(data[i]))
+            return FALSE;
+    return TRUE;
+}
+
+/* JSON Lines input handed to the reader a whole line at a time */
+typedef struct
+{
+    gzFile file;
+    GByteArray* data; // read from file, not handed out yet
+    gsize ready;      // leading bytes of data up to the last newline
+    gsize torn;       // bytes of an unterminated last line, dropped
+} LineSource;
+
+/**
+ * A JsonReadFunc that holds back what follows the last newline until the
+ * next one arrives. An append cut short by a crash leaves an unterminated
+ * last line (or gzip member), which is dropped and counted in torn instead.
+ */
+static gssize
+read_whole_lines(gpointer source, gchar* buffer, gsize size)
+{
+    LineSource* lines = source;
+    while (lines->ready == 0) {
+        gsize old_length = lines->data->len;
+        g_byte_array_set_size(lines->data,
+                              old_length + JSON_READER_BUFFER_SIZE);
+        int n = gzread(
+          lines->file, lines->data->data + old_length, JSON_READER_BUFFER_SIZE);
+        int zerr = Z_OK;
+        if (n < 0)
+            gzerror(lines->file, &zerr);
+        g_byte_array_set_size(lines->data, old_length + MAX(n, 0));
+        // Z_BUF_ERROR: the last gzip member ends early
+        if (n < 0 && zerr != Z_BUF_ERROR)
+            return -1;
+        if (n <= 0) {
+            if (!is_blank((const gchar*)lines->data->data, lines->data->len))
+                lines->torn = lines->data->len;
+            g_byte_array_set_size(lines->data, 0);
+            return 0;
+        }
+        for (gsize i = lines->data->len; i > old_length; --i) {
+            if (lines->data->data[i - 1] == '\n') {
+                lines->ready = i;
+                break;
+            }
+        }
+    }
+    gsize n = MIN(size, lines->ready);
+    memcpy(buffer, lines->data->data, n);
+    g_byte_array_remove_range(lines->data, 0, (guint)n);
+    lines->ready -= n;
+    return (gssize)n;
+}
+
+/* pdf_files and content hashes seen so far, to tell duplicates apart */
+typedef struct
+{
+    GHashTable* files;  // owned pdf_file strings
+    GHashTable* hashes; // owned guint64s, never 0 (not hashed yet)
+} PaperKeys;
+
+static void
+paper_keys_init(PaperKeys* keys)
+{
+    keys->files = g_hash_table_new_full(
+      g_str_hash, g_str_equal, g_free, NULL); // freed by paper_keys_clear()
+    keys->hashes = g_hash_table_new_full(
+      g_int64_hash, g_int64_equal, g_free, NULL); // ditto
+}
+
+static void
+paper_keys_clear(PaperKeys* keys)
+{
+    g_hash_table_destroy(keys->files);
+    g_hash_table_destroy(keys->hashes);
+}
+
+static void
+paper_keys_add(PaperKeys* keys, const gchar* pdf_file, guint64 content_hash)
+{
+    if (pdf_file)
+        g_hash_table_add(keys->files, g_strdup(pdf_file));
+    if (content_hash)
+        g_hash_table_add(keys->hashes,
+                         g_memdup2(&content_hash, sizeof(content_hash)));
+}
+
+static gboolean
+paper_keys_contain(const PaperKeys* keys,
+                   const gchar* pdf_file,
+                   guint64 content_hash)
+{
+    return (pdf_file && g_hash_table_contains(keys->files, pdf_file)) ||
+           (content_hash && g_hash_table_contains(keys->hashes, &content_hash));
+}
+
+/**
+ * Stream the papers in the file at @path into @db in one pass, inserting them
+ * in batches so memory stays bounded by the batch, not the file.
+ * JSON Lines files (see is_jsonl_path()) hold one object per line, all others
+ * one array of objects.
+ * With @keys, papers whose pdf_file or content_hash are in it are skipped and
+ * the others added to it. A NULL @db only collects the keys of the file.
+ */
+static bool
+read_papers_from_file(PaperDatabase* db,
+                      const gchar* path,
+                      PaperKeys* keys,
+                      GError** error)
+{
+    // gzread() passes uncompressed files through unchanged
+    int fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+    gzFile file = fd >= 0 ? gzdopen(fd, "rb") : NULL; // closed before return
+    if (!file) {
+        int saved_errno = fd >= 0 ? ENOMEM : errno;
+        if (fd >= 0)
+            close(fd);
+        if (saved_errno == ENOENT)
+            return TRUE;
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(saved_errno),
+                    "Failed to open %s: %s",
+                    path,
+                    g_strerror(saved_errno));
+        return FALSE;
+    }
+    gzbuffer(file, JSON_READER_BUFFER_SIZE);
+
+    GTimer* timer = g_timer_new(); // freed before return
+    gboolean lines = is_jsonl_path(path);
+    LineSource line_source = { 0 };
+    line_source.file = file;
+    line_source.data = g_byte_array_new(); // freed before return
+    JsonReader* reader = // freed by json_reader_free()
+      lines ? json_reader_new(read_whole_lines, &line_source)
+            : json_reader_new(read_gzip, file);
+    Paper* batch[LOAD_BATCH_SIZE];
+    gint batch_count = 0;
+    gint total = 0;
+    gint skipped = 0;
+    gboolean ok = TRUE;
+
+    /* Opening bracket, unless it's one object per line */
+    JsonToken end = JSON_TOKEN_EOF; // token after the last object
+    gboolean empty = FALSE;
+    if (lines)
+        json_reader_set_sequence(reader, FALSE);
+    else {
+        JsonToken token = json_reader_next(reader, error);
+        if (token == JSON_TOKEN_BEGIN_ARRAY)
+            end = JSON_TOKEN_END_ARRAY;
+        else if (token == JSON_TOKEN_EOF) // empty file is an empty database
+            empty = TRUE;
+        else
+            ok = FALSE;
+    }
+
+    while (ok && !empty) {
+        JsonToken token = json_reader_next(reader, error);
+        if (token == end)
+            break;
+        Paper* paper = NULL;
+        if (token != JSON_TOKEN_BEGIN_OBJECT ||
+            !read_paper(reader, &paper, error)) {
+            ok = FALSE;
+            break;
+        }
+        if (!paper)
+            continue;
+        if (keys &&
+            paper_keys_contain(keys, paper->pdf_file, paper->content_hash)) {
+            discard_paper(paper);
+            skipped++;
+            continue;
+        }
+        if (keys)
+            paper_keys_add(keys, paper->pdf_file, paper->content_hash);
+        if (!db) {
+            discard_paper(paper);
+            total++;
+            continue;
+        }
+        batch[batch_count++] = paper;
+        if (batch_count == LOAD_BATCH_SIZE) {
+            insert_papers(db, batch, batch_count);
+            total += batch_count;
+            batch_count = 0;
+        }
+    }
+    if (end == JSON_TOKEN_END_ARRAY)
+        ok = ok && json_reader_next(reader, error) == JSON_TOKEN_EOF;
+
+    if (ok && db) {
+        insert_papers(db, batch, batch_count);
+        total += batch_count;
+    } else
+        for (gint i = 0; i < batch_count; ++i)
+            discard_paper(batch[i]);
+
+    // malformed tokens set *error already
+    if (!ok && error && !*error)
         g_set_error(error,
                     G_FILE_ERROR,
                     G_FILE_ERROR_FAILED,
-                    "Failed to parse JSON: %s",
-                    cJSON_GetErrorPtr());
+                    "Failed to parse JSON at offset %zu: unexpected value",
+                    json_reader_get_offset(reader));
+
+    if (ok && line_source.torn > 0)
+        g_warning("Dropped %zu bytes of a torn last line in %s\n",
+                  line_source.torn,
+                  path);
+    json_reader_free(reader);
+    g_byte_array_free(line_source.data, TRUE);
+    gzclose(file);
+    g_debug("Read %d papers from %s in %.3f s\n",
+            total,
+            path,
+            g_timer_elapsed(timer, NULL));
+    if (skipped > 0)
+        g_message("Skipped %d duplicate papers in %s\n", skipped, path);
+    g_timer_destroy(timer);
+    return ok;
+}
+
+bool
+import_papers_from_jsonl(PaperDatabase* db, const gchar* path, GError** error)
+{
+    g_return_val_if_fail(db != NULL && path != NULL, FALSE);
+    if (!is_jsonl_path(path)) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_INVAL,
+                    "Not a JSON Lines file (.jsonl or .ndjson): %s",
+                    path);
         return FALSE;
     }
 
-    int count = cJSON_GetArraySize(json);
-    for (int i = 0; i < count; ++i) {
-        cJSON* item = cJSON_GetArrayItem(json, i); // freed by cJSON_Delete()
-
-        gchar* title = cJSON_IsString(cJSON_GetObjectItem(
-                         item, "title")) // freed by cJSON_Delete()
-                         ? cJSON_GetObjectItem(item, "title")->valuestring
-                         : NULL;
-
-        /* Authors array */
-        cJSON* arr =
-          cJSON_GetObjectItem(item, "authors"); // freed by cJSON_Delete()
-        int authors_count = cJSON_IsArray(arr) ? cJSON_GetArraySize(arr) : 0;
-        g_autofree gchar** authors = NULL; //
-        if (authors_count > 0) {
-            authors = g_new0(
-              gchar*, authors_count); // auto freed before function return
-            for (int j = 0; j < authors_count; ++j) {
-                cJSON* a =
-                  cJSON_GetArrayItem(arr, j); // freed by cJSON_Delete()
-                authors[j] =                  // freed by cJSON_Delete()
-                  a && a->valuestring ? a->valuestring : "";
-            }
+    PaperKeys keys;
+    paper_keys_init(&keys);
+    WITH_DB_READ_LOCK(db, {
+        for (gint i = 0; i < db->count; ++i) {
+            Paper* p = db->papers[i];
+            WITH_PAPER_LOCK(
+              p, { paper_keys_add(&keys, p->pdf_file, p->content_hash); });
         }
+    });
+    gboolean ok = read_papers_from_file(db, path, &keys, error);
+    paper_keys_clear(&keys);
+    return ok;
+}
+
+/* Parallel loading */
+
+/* Slice of the top-level array holding whole, comma-separated elements */
+typedef struct
+{
+    const gchar* data;
+    gsize offset; // of data in the file, for error messages
+    gsize length;
+    GPtrArray* papers; // detached Papers, in file order
+    PaperDatabase* db; // whose abstract pool the Papers' abstracts go to
+    GError* error;
+} JsonChunk;
+
+static void
+add_json_chunk(GArray* chunks, const gchar* data, gsize start, gsize end)
+{
+    JsonChunk chunk = { 0 };
+    chunk.data = data + start;
+    chunk.offset = start;
+    chunk.length = end - start;
+    g_array_append_val(chunks, chunk);
+}
 
-        int year = cJSON_IsNumber(cJSON_GetObjectItem(item, "year"))
-                     ? cJSON_GetObjectItem(item, "year")->valueint
-                     : 0;
-
-        /* Keywords array */
-        arr = cJSON_GetObjectItem(item, "keywords"); // freed by cJSON_Delete()
-        int kw_count = cJSON_IsArray(arr) ? cJSON_GetArraySize(arr) : 0;
-        g_autofree gchar** keywords = NULL; //
-        if (kw_count > 0) {
-            keywords =
-              g_new0(gchar*, kw_count); // auto freed before function return
-            for (int j = 0; j < kw_count; ++j) {
-                cJSON* k =
-                  cJSON_GetArrayItem(arr, j); // freed by cJSON_Delete()
-                keywords[j] =                 // freed by cJSON_Delete()
-                  k && k->valuestring ? k->valuestring : "";
+/**
+ * Splits the elements of the top-level array in @data into chunks of about
+ * @target bytes, cutting only at top-level commas. Only nesting and string
+ * boundaries are tracked, validation is left to the chunk parsers, except
+ * for a trailing comma at a cut, which leaves them an empty last chunk.
+ * Returns FALSE and sets *error if @data is not one complete array.
+ */
+static gboolean
+split_json_array(const gchar* data,
+                 gsize length,
+                 gsize target,
+                 GArray* chunks,
+                 GError** error)
+{
+    gsize i = 0;
+    while (i < length && g_ascii_isspace(data[i]))
+        i++;
+    if (i == length)
+        return TRUE; // empty file is an empty database
+    if (data[i] != '[') {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_FAILED,
+                    "Failed to parse JSON at offset %zu: expected '['",
+                    i);
+        return FALSE;
+    }
+
+    gsize start = ++i;
+    gboolean cut = FALSE; // start follows a comma
+    gint depth = 0;
+    for (; i < length; ++i) {
+        switch (data[i]) {
+            case '"': {
+                // jump to the closing quote, skipping escaped ones
+                const gchar* quote = data + i;
+                for (;;) {
+                    quote = memchr(quote + 1, '"', data + length - quote - 1);
+                    if (!quote)
+                        goto truncated;
+                    gsize backslashes = 0;
+                    while (quote[-1 - (gssize)backslashes] == '\\')
+                        backslashes++;
+                    if (backslashes % 2 == 0)
+                        break;
+                }
+                i = quote - data;
+                break;
             }
+            case '[':
+            case '{':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                if (depth-- > 0)
+                    break;
+                if (data[i] == '}')
+                    goto unbalanced;
+                // a comma needs an element after it, like in the reader
+                if (cut && is_blank(data + start, i - start))
+                    goto unbalanced;
+                // end of the top-level array, only whitespace may follow
+                add_json_chunk(chunks, data, start, i);
+                while (++i < length)
+                    if (!g_ascii_isspace(data[i]))
+                        goto unbalanced;
+                return TRUE;
+            case ',':
+                if (depth == 0 && i - start >= target) {
+                    add_json_chunk(chunks, data, start, i);
+                    start = i + 1;
+                    cut = TRUE;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+truncated:
+    g_set_error(error,
+                G_FILE_ERROR,
+                G_FILE_ERROR_FAILED,
+                "Failed to parse JSON: unexpected end of input");
+    return FALSE;
+unbalanced:
+    g_set_error(error,
+                G_FILE_ERROR,
+                G_FILE_ERROR_FAILED,
+                "Failed to parse JSON at offset %zu: unexpected character",
+                i);
+    return FALSE;
+}
+
+/* Errors stay with the chunk, see load_papers_parallel() */
+static void
+parse_json_chunk(JsonChunk* chunk)
+{
+    JsonReader* reader = json_reader_new_from_data(
+      chunk->data, chunk->length); // freed by json_reader_free()
+    json_reader_set_sequence(reader, TRUE);
+
+    for (;;) {
+        JsonToken token = json_reader_next(reader, &chunk->error);
+        if (token == JSON_TOKEN_EOF)
+            break;
+        Paper* paper = NULL;
+        if (token != JSON_TOKEN_BEGIN_OBJECT ||
+            !read_paper(reader, &paper, &chunk->error)) {
+            if (!chunk->error)
+                g_set_error(&chunk->error,
+                            G_FILE_ERROR,
+                            G_FILE_ERROR_FAILED,
+                            "Failed to parse JSON at offset %zu: "
+                            "unexpected value",
+                            json_reader_get_offset(reader));
+            break;
         }
+        if (!paper)
+            continue;
+        // right away, the abstracts of the whole file would all be resident
+        // at once and leave their holes in the heap behind
+        pool_abstract(chunk->db, paper);
+        g_ptr_array_add(chunk->papers, paper);
+    }
+    json_reader_free(reader);
+}
+
+static void
+parse_json_chunks(gsize begin, gsize end, gpointer user_data)
+{
+    GArray* chunks = user_data;
+    for (gsize i = begin; i < end; ++i)
+        parse_json_chunk(&g_array_index(chunks, JsonChunk, i));
+}
+
+/* Blocks of a mapped gzip file, inflated next to each other into out */
+typedef struct
+{
+    const guint8* data;
+    GArray* blocks;
+    gchar* out;
+    GError** errors; // one per block
+} InflateJob;
+
+static void
+inflate_blocks(gsize begin, gsize end, gpointer user_data)
+{
+    InflateJob* job = user_data;
+    for (gsize i = begin; i < end; ++i) {
+        GzipBlock* block = &g_array_index(job->blocks, GzipBlock, i);
+        gzip_block_inflate(
+          job->data, block, job->out + block->inflated_offset, &job->errors[i]);
+    }
+}
 
-        gchar* abstract = cJSON_IsString(cJSON_GetObjectItem(item, "abstract"))
-                            ? cJSON_GetObjectItem(item, "abstract")->valuestring
-                            : NULL; // freed by cJSON_Delete()
-        gchar* arxiv_id = cJSON_IsString(cJSON_GetObjectItem(item, "arxiv_id"))
-                            ? cJSON_GetObjectItem(item, "arxiv_id")->valuestring
-                            : NULL; // freed by cJSON_Delete()
-        gchar* doi = cJSON_IsString(cJSON_GetObjectItem(item, "doi"))
-                       ? cJSON_GetObjectItem(item, "doi")->valuestring
-                       : NULL; // freed by cJSON_Delete()
-        const gchar* pdf_file =
-          cJSON_IsString(cJSON_GetObjectItem(item, "pdf_file"))
-            ? cJSON_GetObjectItem(item, "pdf_file")->valuestring
-            : NULL; // freed by cJSON_Delete()
-
-        Paper* p = create_paper(db, // hard copies values, so need free all
-                                title,
-                                authors,
-                                authors_count,
-                                year,
-                                keywords,
-                                kw_count,
-                                abstract,
-                                arxiv_id,
-                                doi,
-                                pdf_file,
-                                error);
-
-        /* Cleanup temporary arrays */
-        if (authors) {
-            // for (int j = 0; j < authors_count; ++j)
-            //     g_free(authors[j]);
-            // g_free(authors);
-        }
-        if (keywords) {
-            // for (int j = 0; j < kw_count; ++j)
-            //     g_free(keywords[j]);
-            // g_free(keywords);
-        }
-        if (!p) {
-            cJSON_Delete(json);
+/**
+ * Inflates all @blocks of @data with loom_parallel_for(), returns the
+ * uncompressed stream (freed with g_free()) and its length in *out_length,
+ * or NULL if a block is corrupted.
+ */
+static gchar*
+inflate_gzip_blocks(const gchar* data,
+                    GArray* blocks,
+                    gsize* out_length,
+                    GError** error)
+{
+    gsize length = 0;
+    if (blocks->len > 0) {
+        GzipBlock* last = &g_array_index(blocks, GzipBlock, blocks->len - 1);
+        length = last->inflated_offset + last->inflated_length;
+    }
+    InflateJob job = { (const guint8*)data,
+                       blocks,
+                       g_malloc(MAX(length, 1)),
+                       g_new0(GError*, MAX(blocks->len, 1)) };
+    loom_parallel_for(
+      loom_get_default(), 0, blocks->len, 1, inflate_blocks, &job);
+
+    gboolean ok = TRUE;
+    for (guint i = 0; i < blocks->len; ++i) {
+        if (job.errors[i] && ok) {
+            g_propagate_error(error, job.errors[i]);
+            job.errors[i] = NULL;
+            ok = FALSE;
+        }
+        g_clear_error(&job.errors[i]);
+    }
+    g_free(job.errors);
+    if (!ok) {
+        g_free(job.out);
+        return NULL;
+    }
+    *out_length = length;
+    return job.out;
+}
+
+/**
+ * Maps the JSON file, splits the top-level array at element boundaries and
+ * parses the chunks with loom_parallel_for(). Once all are parsed, inserts
+ * everything in file order with a single insert_papers().
+ * With @blocks, the file is blocked gzip and inflated in parallel first.
+ * Nothing is inserted if any chunk fails. Call with json_mutex held.
+ */
+static bool
+load_papers_parallel(PaperDatabase* db, GArray* blocks, GError** error)
+{
+    GTimer* timer = g_timer_new(); // freed before return
+    GMappedFile* file =
+      g_mapped_file_new(db->path, FALSE, error); // freed before return
+    if (!file) {
+        g_timer_destroy(timer);
+        return FALSE;
+    }
+    const gchar* data = g_mapped_file_get_contents(file);
+    gsize length = g_mapped_file_get_length(file);
+    gchar* inflated = NULL; // freed before return
+    if (blocks) {
+        inflated = inflate_gzip_blocks(data, blocks, &length, error);
+        if (!inflated) {
+            g_mapped_file_unref(file);
+            g_timer_destroy(timer);
             return FALSE;
         }
+        g_debug("Inflated %u gzip blocks into %zu bytes in %.3f s\n",
+                blocks->len,
+                length,
+                g_timer_elapsed(timer, NULL));
+        data = inflated;
     }
 
-    cJSON_Delete(json);
-    return TRUE;
+    Loom* loom = loom_get_default();
+    gsize target = MAX(length / (loom->max_threads * JSON_CHUNKS_PER_THREAD),
+                       JSON_CHUNK_MIN_BYTES);
+    GArray* chunks =
+      g_array_new(FALSE, FALSE, sizeof(JsonChunk)); // freed before return
+    if (!split_json_array(data, length, target, chunks, error)) {
+        g_array_unref(chunks);
+        g_free(inflated);
+        g_mapped_file_unref(file);
+        g_timer_destroy(timer);
+        return FALSE;
+    }
+    g_debug("Split %zu bytes of JSON into %u chunks in %.3f s\n",
+            length,
+            chunks->len,
+            g_timer_elapsed(timer, NULL));
+
+    /* Parse all chunks concurrently */
+    for (guint i = 0; i < chunks->len; ++i) {
+        JsonChunk* chunk = &g_array_index(chunks, JsonChunk, i);
+        chunk->papers = g_ptr_array_new(); // freed before return
+        chunk->db = db;
+    }
+    loom_parallel_for(loom, 0, chunks->len, 1, parse_json_chunks, chunks);
+
+    /* Merge in file order */
+    gboolean ok = TRUE;
+    guint total = 0;
+    for (guint i = 0; i < chunks->len; ++i) {
+        JsonChunk* chunk = &g_array_index(chunks, JsonChunk, i);
+        if (chunk->error && ok) {
+            g_prefix_error(&chunk->error,
+                           "In bytes %zu-%zu: ",
+                           chunk->offset,
+                           chunk->offset + chunk->length);
+            g_propagate_error(error, chunk->error);
+            chunk->error = NULL;
+            ok = FALSE;
+        }
+        g_clear_error(&chunk->error);
+        total += chunk->papers->len;
+    }
+    Paper** papers = g_new(Paper*, MAX(total, 1)); // freed before return
+    guint n = 0;
+    for (guint i = 0; i < chunks->len; ++i) {
+        JsonChunk* chunk = &g_array_index(chunks, JsonChunk, i);
+        for (guint j = 0; j < chunk->papers->len; ++j)
+            papers[n++] = g_ptr_array_index(chunk->papers, j);
+        g_ptr_array_free(chunk->papers, TRUE);
+    }
+    if (ok)
+        insert_papers(db, papers, n);
+    else
+        for (guint i = 0; i < n; ++i)
+            discard_paper(papers[i]);
+    g_free(papers);
+    g_array_unref(chunks);
+    g_free(inflated);
+    g_mapped_file_unref(file);
+
+    g_debug("Loaded %u papers from %s on %u threads in %.3f s\n",
+            ok ? n : 0,
+            db->path,
+            loom->max_threads,
+            g_timer_elapsed(timer, NULL));
+    g_timer_destroy(timer);
+    return ok;
 }
 
 /**
- * Write the database out as JSON to db->path.
+ * Returns the index of the gzip file at @path if all of it is blocked, or
+ * NULL if it has to be streamed, see gzip_blocks.h.
+ * *out_length receives the uncompressed size.
+ */
+static GArray*
+read_gzip_index(const gchar* path, gsize* out_length)
+{
+    int fd = g_open(path, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0)
+        return NULL;
+    GArray* blocks = // freed by the caller
+      g_array_new(FALSE, FALSE, sizeof(GzipBlock));
+    goffset end = 0;
+    gboolean blocked = FALSE;
+    GStatBuf st;
+    gboolean ok =
+      gzip_blocks_read_index(fd, path, blocks, &end, &blocked, NULL) &&
+      blocked && fstat(fd, &st) == 0 && end == st.st_size;
+    close(fd);
+    if (!ok) {
+        g_array_unref(blocks);
+        return NULL;
+    }
+    *out_length = 0;
+    if (blocks->len > 0) {
+        GzipBlock* last = &g_array_index(blocks, GzipBlock, blocks->len - 1);
+        *out_length = last->inflated_offset + last->inflated_length;
+    }
+    return blocks;
+}
+
+/**
+ * Large JSON arrays are parsed in parallel, everything else is streamed.
+ * Blocked gzip counts by its uncompressed size, plain gzip is streamed.
  */
 bool
-write_json(const PaperDatabase* db, GError** error)
+load_papers_from_json(PaperDatabase* db, GError** error)
 {
     g_return_val_if_fail(db != NULL, FALSE);
 
-    g_debug("Writing JSON to %s\n", db->path);
+    g_mutex_lock(&json_mutex);
+    bool ok;
+    GStatBuf st;
+    gsize length = 0;
+    GArray* blocks = NULL; // freed below
+    gboolean parallel =
+      !is_jsonl_path(db->path) && loom_get_default()->max_threads > 1;
+    if (parallel && is_gzip_path(db->path))
+        blocks = read_gzip_index(db->path, &length);
+    else if (parallel && g_stat(db->path, &st) == 0)
+        length = st.st_size;
+    // plain gzip has no index and length 0, it's streamed
+    if (parallel && length >= JSON_PARALLEL_LOAD_BYTES)
+        ok = load_papers_parallel(db, blocks, error);
+    else
+        ok = read_papers_from_file(db, db->path, NULL, error);
+    if (blocks)
+        g_array_unref(blocks);
+    g_mutex_unlock(&json_mutex);
+    return ok;
+}
+
+/* Writes one paper object, leaving out missing fields like cJSON did */
+static void
+write_paper(JsonWriter* writer,
+            const PaperSnapshot* snapshot,
+            const PaperRecord* r)
+{
+    json_writer_begin_object(writer);
+    if (r->title) {
+        json_writer_key(writer, "title");
+        json_writer_string(writer, r->title);
+    }
+    json_writer_key(writer, "authors");
+    json_writer_begin_array(writer);
+    for (gint j = 0; j < r->authors_count; ++j)
+        json_writer_string(writer,
+                           string_dict_get(author_dict(), r->author_ids[j]));
+    json_writer_end_array(writer);
+    json_writer_key(writer, "year");
+    json_writer_int(writer, r->year);
+    json_writer_key(writer, "keywords");
+    json_writer_begin_array(writer);
+    for (gint j = 0; j < r->keyword_count; ++j)
+        json_writer_string(writer,
+                           string_dict_get(keyword_dict(), r->keyword_ids[j]));
+    json_writer_end_array(writer);
+    g_autofree gchar* abstract =
+      snapshot_dup_abstract(snapshot, r); // freed on function return
+    if (abstract) {
+        json_writer_key(writer, "abstract");
+        json_writer_string(writer, abstract);
+    }
+    if (r->arxiv_id) {
+        json_writer_key(writer, "arxiv_id");
+        json_writer_string(writer, r->arxiv_id);
+    }
+    if (r->doi) {
+        json_writer_key(writer, "doi");
+        json_writer_string(writer, r->doi);
+    }
+    if (r->pdf_file) {
+        json_writer_key(writer, "pdf_file");
+        json_writer_string(writer, r->pdf_file);
+    }
+    if (r->content_hash) {
+        gchar hex[17];
+        g_snprintf(
+          hex, sizeof(hex), "%016" G_GINT64_MODIFIER "x", r->content_hash);
+        json_writer_key(writer, "content_hash");
+        json_writer_string(writer, hex);
+    }
+    json_writer_end_object(writer);
+}
+
+/**
+ * Writes all of @snapshot to @fd, as one array or one object per line and
+ * gzipped if @gzip is set, then syncs it. The caller closes @fd; @file_path is
+ * the file behind it.
+ * *out_size and *out_hash (optional) describe the bytes that end up in the
+ * file, i.e. what hash_file() reports for it.
+ */
+static gboolean
+write_papers(int fd,
+             const gchar* file_path,
+             gboolean gzip,
+             const PaperSnapshot* snapshot,
+             gboolean lines,
+             uint64_t* out_size,
+             uint64_t* out_hash,
+             GError** error)
+{
+    int out_fd = dup(fd); // closed along with the stream
+    FILE* file = NULL;
+    GzipBlockWriter* gz = NULL;
+    JsonWriter* writer = NULL; // freed by json_writer_finish()
+    if (out_fd >= 0 && gzip) {
+        gz = gzip_block_writer_new(out_fd, file_path, JSON_GZIP_LEVEL);
+        if (gz)
+            writer = json_writer_new_with_func(gzip_block_writer_write, gz);
+    } else if (out_fd >= 0) {
+        file = fdopen(out_fd, "wb");
+        if (file)
+            writer = json_writer_new(file);
+    }
+    if (!writer) {
+        int saved_errno = out_fd >= 0 && gzip ? ENOMEM : errno;
+        if (out_fd >= 0)
+            close(out_fd);
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(saved_errno),
+                    "Failed to open %s for writing: %s",
+                    file_path,
+                    g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    if (lines)
+        json_writer_set_sequence(writer);
+    else
+        json_writer_begin_array(writer);
+    for (gint i = 0; i < snapshot->count; ++i)
+        write_paper(writer, snapshot, &snapshot->records[i]);
+    if (!lines)
+        json_writer_end_array(writer);
+    gboolean ok = json_writer_finish(writer, out_size, out_hash, error);
+
+    if (gz) {
+        if (!gzip_block_writer_close(gz, ok ? error : NULL))
+            ok = FALSE;
+    } else if (fclose(file) != 0 && ok) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Failed to close %s: %s",
+                    file_path,
+                    g_strerror(errno));
+        ok = FALSE;
+    }
+    if (ok && fsync(fd) != 0) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Failed to sync %s: %s",
+                    file_path,
+                    g_strerror(errno));
+        ok = FALSE;
+    }
+    // the writer saw uncompressed bytes, the cache binds to what's on disk
+    if (ok && gzip && (out_size || out_hash)) {
+        uint64_t size, hash;
+        ok = hash_file(file_path, &hash, &size, error);
+        if (out_size)
+            *out_size = size;
+        if (out_hash)
+            *out_hash = hash;
+    }
+    return ok;
+}
+
+/**
+ * Finds where the last complete line of the JSON Lines file open at @fd ends,
+ * or with @gzip, the last complete gzip member, and the size of the file.
+ * Blocked gzip is walked by its index, plain gzip has to be inflated.
+ * Whatever follows was left by an append cut short. Returns FALSE and sets
+ * *error on I/O errors.
+ */
+static gboolean
+find_complete_length(int fd,
+                     const gchar* path,
+                     gboolean gzip,
+                     off_t* out_length,
+                     off_t* out_size,
+                     GError** error)
+{
+    GStatBuf st;
+    if (fstat(fd, &st) != 0)
+        goto io_error;
+    *out_size = st.st_size;
+    guint8 buffer[JSON_READER_BUFFER_SIZE];
+    off_t complete = 0;
+    if (!gzip) {
+        // back to the last newline
+        for (off_t end = st.st_size; end > 0 && complete == 0;) {
+            off_t start = MAX(end - (off_t)sizeof(buffer), 0);
+            ssize_t n = pread(fd, buffer, (size_t)(end - start), start);
+            if (n != end - start)
+                goto io_error;
+            for (ssize_t i = n; i > 0 && complete == 0; --i)
+                if (buffer[i - 1] == '\n')
+                    complete = start + i;
+            end = start;
+        }
+        *out_length = complete;
+        return TRUE;
+    }
+
+    GArray* blocks = // freed below
+      g_array_new(FALSE, FALSE, sizeof(GzipBlock));
+    goffset end = 0;
+    gboolean blocked = TRUE;
+    gboolean ok =
+      gzip_blocks_read_index(fd, path, blocks, &end, &blocked, error);
+    g_array_unref(blocks);
+    if (!ok || blocked) {
+        *out_length = end;
+        return ok;
+    }
 
+    // inflate the rest member by member, each is a complete gzip stream
+    guint8 out[JSON_READER_BUFFER_SIZE];
+    z_stream stream = { 0 };
+    if (inflateInit2(&stream, 16 + MAX_WBITS) != Z_OK)
+        goto io_error;
+    off_t offset = end;
+    complete = end;
+    int zerr = Z_OK;
+    while (offset < st.st_size) {
+        if (stream.avail_in == 0) {
+            ssize_t n = pread(fd, buffer, sizeof(buffer), offset);
+            if (n <= 0) {
+                inflateEnd(&stream);
+                goto io_error;
+            }
+            stream.next_in = buffer;
+            stream.avail_in = (uInt)n;
+        }
+        uInt before = stream.avail_in;
+        stream.next_out = out;
+        stream.avail_out = sizeof(out);
+        zerr = inflate(&stream, Z_NO_FLUSH);
+        offset += before - stream.avail_in;
+        if (zerr == Z_STREAM_END) {
+            complete = offset;
+            inflateReset(&stream);
+        } else if (zerr != Z_OK)
+            break;
+    }
+    inflateEnd(&stream);
+    *out_length = complete;
+    return TRUE;
+
+io_error:
+    g_set_error(error,
+                G_FILE_ERROR,
+                g_file_error_from_errno(errno),
+                "Failed to read %s: %s",
+                path,
+                g_strerror(errno));
+    return FALSE;
+}
+
+/**
+ * Appends @count @records of @snapshot to the JSON Lines file at @path,
+ * creating it if needed. *out_size and *out_hash (optional) describe the
+ * whole file afterwards. Takes json_mutex.
+ */
+static gboolean
+append_records(const PaperSnapshot* snapshot,
+               PaperRecord* records,
+               gint count,
+               const gchar* path,
+               uint64_t* out_size,
+               uint64_t* out_hash,
+               GError** error)
+{
     g_mutex_lock(&json_mutex);
-    g_rw_lock_reader_lock((GRWLock*)&db->lock);
-
-    cJSON* root = cJSON_CreateArray(); // freed by cJSON_Delete()
-    for (int i = 0; i < db->count; ++i) {
-        const Paper* p = db->papers[i];
-        g_mutex_lock((GMutex*)&p->lock);
-        cJSON* obj = cJSON_CreateObject(); // freed by cJSON_Delete()
-        cJSON_AddStringToObject(obj, "title", p->title);
-
-        /* Authors */
-        cJSON* auth_arr = cJSON_CreateArray(); // freed by cJSON_Delete()
-        for (int j = 0; j < p->authors_count; ++j)
-            cJSON_AddItemToArray(auth_arr, cJSON_CreateString(p->authors[j]));
-        cJSON_AddItemToObject(obj, "authors", auth_arr);
-
-        cJSON_AddNumberToObject(obj, "year", p->year);
-
-        /* Keywords */
-        cJSON* kw_arr = cJSON_CreateArray(); // freed by cJSON_Delete()
-        for (int j = 0; j < p->keyword_count; ++j)
-            cJSON_AddItemToArray(kw_arr, cJSON_CreateString(p->keywords[j]));
-        cJSON_AddItemToObject(obj, "keywords", kw_arr);
-
-        cJSON_AddStringToObject(obj, "abstract", p->abstract);
-        if (p->arxiv_id)
-            cJSON_AddStringToObject(obj, "arxiv_id", p->arxiv_id);
-        if (p->doi)
-            cJSON_AddStringToObject(obj, "doi", p->doi);
-        if (p->pdf_file)
-            cJSON_AddStringToObject(obj, "pdf_file", p->pdf_file);
-
-        cJSON_AddItemToArray(root, obj);
-        g_mutex_unlock((GMutex*)&p->lock);
-    }
-    g_rw_lock_reader_unlock((GRWLock*)&db->lock);
-
-    g_autofree char* text = cJSON_PrintUnformatted(root); // freed before return
-    g_autofree GError* io_err = NULL; // freed before return
-    if (!g_file_set_contents(db->path, text, strlen(text), &io_err)) {
-        g_propagate_error(error, io_err);
-        cJSON_Delete(root);
+    int fd = g_open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        int saved_errno = errno;
         g_mutex_unlock(&json_mutex);
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(saved_errno),
+                    "Failed to open %s for appending: %s",
+                    path,
+                    g_strerror(saved_errno));
         return FALSE;
     }
-    cJSON_Delete(root);
+
+    // cut off what an append cut short left, so the new records start on a
+    // line of their own; gzipped files get a new gzip member, which readers
+    // concatenate
+    gboolean gzip = is_gzip_path(path);
+    off_t complete = 0, size = 0;
+    gboolean ok =
+      find_complete_length(fd, path, gzip, &complete, &size, error);
+    if (ok && complete < size) {
+        g_warning("Cutting off %lld bytes of a torn append in %s\n",
+                  (long long)(size - complete),
+                  path);
+        if (ftruncate(fd, complete) != 0) {
+            g_set_error(error,
+                        G_FILE_ERROR,
+                        g_file_error_from_errno(errno),
+                        "Failed to truncate %s: %s",
+                        path,
+                        g_strerror(errno));
+            ok = FALSE;
+        }
+    }
+
+    // the records to write, with the rest of the snapshot they belong to
+    PaperSnapshot view = *snapshot;
+    view.records = records;
+    view.count = count;
+    ok = ok && (count == 0 ||
+                write_papers(fd, path, gzip, &view, TRUE, NULL, NULL, error));
+    close(fd);
+    if (ok && (out_size || out_hash)) {
+        uint64_t size, hash;
+        ok = hash_file(path, &hash, &size, error);
+        if (out_size)
+            *out_size = size;
+        if (out_hash)
+            *out_hash = hash;
+    }
     g_mutex_unlock(&json_mutex);
-    g_debug("Successfully wrote JSON to %s\n", db->path);
-    return TRUE;
+    if (ok)
+        g_debug("Appended %d papers to %s\n", count, path);
+    return ok;
+}
+
+bool
+write_json_snapshot(const PaperSnapshot* snapshot,
+                    const gchar* path,
+                    uint64_t* out_size,
+                    uint64_t* out_hash,
+                    GError** error)
+{
+    g_return_val_if_fail(snapshot != NULL && path != NULL, FALSE);
+
+    // the first records are in the file already, as long as it's there;
+    // plain gzip is rewritten, finding a torn member in it means inflating
+    // all of them
+    GStatBuf st;
+    gint from = snapshot->append_from;
+    if (from >= 0 && from <= snapshot->count && is_jsonl_path(path) &&
+        (!is_gzip_path(path) || gzip_blocks_is_blocked(path)) &&
+        (from == 0 || (g_stat(path, &st) == 0 && st.st_size > 0)))
+        return append_records(snapshot,
+                              snapshot->records + from,
+                              snapshot->count - from,
+                              path,
+                              out_size,
+                              out_hash,
+                              error);
+
+    g_debug("Writing JSON to %s\n", path);
+    GTimer* timer = g_timer_new(); // freed before return
+
+    g_mutex_lock(&json_mutex);
+    g_autofree gchar* tmp_path =
+      g_strdup_printf("%s.XXXXXX", path); // freed on function return
+    int fd = g_mkstemp_full(tmp_path, O_RDWR | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        int saved_errno = errno;
+        g_mutex_unlock(&json_mutex);
+        g_timer_destroy(timer);
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(saved_errno),
+                    "Failed to create temporary file for %s: %s",
+                    path,
+                    g_strerror(saved_errno));
+        return FALSE;
+    }
+
+    /* Write, sync and swap in the new file */
+    gboolean ok = write_papers(fd,
+                               tmp_path,
+                               is_gzip_path(path),
+                               snapshot,
+                               is_jsonl_path(path),
+                               out_size,
+                               out_hash,
+                               error);
+    close(fd);
+    if (ok && g_rename(tmp_path, path) != 0) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Failed to rename %s to %s: %s",
+                    tmp_path,
+                    path,
+                    g_strerror(errno));
+        ok = FALSE;
+    }
+    if (!ok)
+        g_unlink(tmp_path);
+    g_mutex_unlock(&json_mutex);
+
+    if (ok)
+        g_debug("Successfully wrote %d papers to %s in %.3f s\n",
+                snapshot->count,
+                path,
+                g_timer_elapsed(timer, NULL));
+    g_timer_destroy(timer);
+    return ok;
+}
+
+bool
+append_papers_to_jsonl(const PaperSnapshot* snapshot,
+                       const gchar* path,
+                       gint* out_count,
+                       GError** error)
+{
+    g_return_val_if_fail(snapshot != NULL && path != NULL, FALSE);
+
+    // what an earlier export left there doesn't go in again
+    PaperKeys keys;
+    paper_keys_init(&keys);
+    if (!read_papers_from_file(NULL, path, &keys, error)) {
+        paper_keys_clear(&keys);
+        return FALSE;
+    }
+    PaperRecord* records =
+      g_new(PaperRecord, MAX(snapshot->count, 1)); // freed before return
+    gint count = 0;
+    for (gint i = 0; i < snapshot->count; ++i) {
+        const PaperRecord* r = &snapshot->records[i];
+        if (!paper_keys_contain(&keys, r->pdf_file, r->content_hash))
+            records[count++] = *r;
+    }
+    paper_keys_clear(&keys);
+
+    gboolean ok =
+      append_records(snapshot, records, count, path, NULL, NULL, error);
+    g_free(records);
+    if (ok && out_count)
+        *out_count = count;
+    return ok;
+}
+
+/**
+ * Write the database out as JSON to db->path.
+ * Only the snapshot is taken under the database locks, the file is written
+ * without holding any.
+ */
+bool
+write_json(const PaperDatabase* db, GError** error)
+{
+    g_return_val_if_fail(db != NULL, FALSE);
+
+    PaperSnapshot* snapshot =
+      snapshot_database((PaperDatabase*)db); // freed by free_snapshot()
+    gboolean ok = write_json_snapshot(snapshot, db->path, NULL, NULL, error);
+    free_snapshot(snapshot);
+    return ok;
 }
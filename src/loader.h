@@ -4,6 +4,7 @@
 #include "paper.h"
 #include <glib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
 G_BEGIN_DECLS
@@ -16,14 +17,31 @@ G_BEGIN_DECLS
 FILE*
 open_file_read_or_create(const char* path);
 
+/**
+ * Returns TRUE if @path names a JSON Lines file (.jsonl or .ndjson), which
+ * holds one paper object per line instead of a single array.
+ */
+gboolean
+is_jsonl_path(const gchar* path);
+
 /**
  * Load papers from JSON file at db->path into the given PaperDatabase.
+ * Both a JSON array and JSON Lines (see is_jsonl_path()) are accepted.
  * On success returns TRUE. If the file is empty or missing, returns TRUE.
  * On parse or I/O error, returns FALSE and sets *error.
  */
 bool
 load_papers_from_json(PaperDatabase* db, GError** error);
 
+/**
+ * Stream the papers of the JSON Lines file at @path into @db, in batches so
+ * memory stays bounded. Papers whose pdf_file or content_hash @db (or an
+ * earlier line) has already are skipped. The file isn't modified.
+ * Returns FALSE and sets *error on parse or I/O error.
+ */
+bool
+import_papers_from_jsonl(PaperDatabase* db, const gchar* path, GError** error);
+
 /**
  * Synchronously write the database out as JSON to db->path.
  * Returns TRUE on success, or FALSE on failure (sets *error).
@@ -31,6 +49,36 @@ load_papers_from_json(PaperDatabase* db, GError** error);
 bool
 write_json(const PaperDatabase* db, GError** error);
 
+/**
+ * Write @snapshot as JSON to a temporary file next to @path, sync it and
+ * rename it over @path. JSON Lines paths get one paper per line, paths ending
+ * in .gz are gzipped. If snapshot->append_from is set, a JSON Lines @path
+ * holds those records already and only the rest is appended.
+ * No database locks are taken. If non-NULL, *out_size and *out_hash receive
+ * size and XXH64 of the new file, hashed while it was written (or re-read
+ * once compressed or appended to).
+ * Returns TRUE on success, or FALSE on failure (sets *error).
+ */
+bool
+write_json_snapshot(const PaperSnapshot* snapshot,
+                    const gchar* path,
+                    uint64_t* out_size,
+                    uint64_t* out_hash,
+                    GError** error);
+
+/**
+ * Append the papers in @snapshot that aren't in the JSON Lines file at @path
+ * yet (by pdf_file or content_hash) to it, one per line, without rewriting
+ * what is already there. Creates the file if needed. *out_count (optional)
+ * receives the number of papers appended.
+ * Returns TRUE on success, or FALSE on failure (sets *error).
+ */
+bool
+append_papers_to_jsonl(const PaperSnapshot* snapshot,
+                       const gchar* path,
+                       gint* out_count,
+                       GError** error);
+
 /**
  * Launch write_json() in a detached background thread.
  */
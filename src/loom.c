@@ -3,26 +3,205 @@
 #define G_LOG_DOMAIN "loom"
 
 #include "loom.h"
+#include "config.h"
+#include "loom_heap.h"
+#include "loom_sched.h"
+#include "loom_stats.h"
+#include "trace.h"
 #include <gio/gio.h>
 #include <glib.h>
 
-typedef struct
+/* A queued thread is a node of the dependency DAG: it waits for the running
+ * threads and non-empty groups it has an edge from, and is released by the
+ * last of them. Edges are only ever added towards running threads and groups,
+ * so the graph stays acyclic.
+ * The DAG and the rest of the bookkeeping are guarded by the Loom's lock. To
+ * queue a thread without waiting for it, e.g. while the main thread runs a
+ * knot, it is pushed onto the lock-free submitted stack instead. Whoever holds
+ * the lock takes submitted threads in before unlocking, see loom_unlock().
+ * Woven threads are held back per resource class and handed to the scheduler
+ * while their class is under its cap and fewer than max_threads run, so the
+ * scheduler's workers are never all taken by one class. */
+
+/* What the scheduler runs: a thread's shuttle or a share of a parallel loop */
+typedef enum
+{
+    LOOM_WORK_THREAD,
+    LOOM_WORK_PARALLEL
+} LoomWorkKind;
+
+typedef struct _LoomActiveThread
 {
+    LoomWorkKind kind; // LOOM_WORK_THREAD
     Loom* owning_loom;
+    struct _LoomActiveThread* next_submitted; // in owning_loom->submitted
     const LoomThreadSpec* spec;
-    GTask* thread;
+    LoomTaskId id;
+    GTask* thread; // NULL until woven
     GCancellable* snippable;
     guint timeout_id;
+    gboolean timed_out;
+    gint indegree;         // atomic, running threads this one waits for
+    GPtrArray* successors; // LoomActiveThread* waiting for this one
+    gboolean snipped;      // cancelled while waiting, freed once released
+    gint progress;         // atomic, in 1 / LOOM_PROGRESS_SCALE
+    gint progress_changed; // atomic, since it was last delivered
+    LoomTagStats* stats;   // of its tag, owned by owning_loom
+    gint64 queued_at;      // monotonic
+    gint64 dispatched_at;  // monotonic, handed to the scheduler
 } LoomActiveThread;
 
+struct _LoomGroup
+{
+    gint refcount; // atomic
+    Loom* loom;    // atomic, the Loom its threads are queued on
+    gchar* name;
+    GHashTable* members;   // set of LoomActiveThread*, queued or running
+    GPtrArray* successors; // LoomActiveThread* waiting for the group to empty
+    guint joined;          // threads that ever joined
+    guint left;            // threads that were tied off or snipped
+    LoomGroupProgressFunc progress;
+    gpointer progress_data;
+};
+
+/* A loop run by loom_parallel_for() or loom_parallel_reduce(). Its caller and
+ * the helpers queued on the scheduler claim slices until none are left, then
+ * the caller waits for the ones others still run. Helpers count as
+ * dispatched LOOM_RESOURCE_CPU threads until they return. Helpers that start
+ * late find nothing to do, so the loop is refcounted. */
+typedef struct
+{
+    LoomWorkKind kind; // LOOM_WORK_PARALLEL
+    Loom* loom;
+    gint refcount;     // atomic, the caller and queued helpers
+    gsize next;        // atomic, first unclaimed index
+    gsize end;
+    gsize grain;
+    gsize split; // a slice is at least 1 / split of what is left
+    LoomRangeFunc func;
+    LoomReduceFunc reduce;
+    LoomCombineFunc combine;
+    gpointer identity; // copy of result on entry
+    gsize result_size;
+    gpointer user_data;
+    LoomActiveThread* caller; // whose shuttle runs the loop, or NULL
+    GMutex lock;
+    GCond done;
+    gsize remaining; // under lock, indices not done yet
+    gpointer result; // under lock
+} LoomParallel;
+
+/* fixed point for the progress reported by shuttles */
+#define LOOM_PROGRESS_SCALE 1000000
+
 /* Global Loom object */
 static Loom* global_loom = NULL;
+static gsize global_loom_initialized = 0;
+
+/* LoomActiveThread* whose shuttle the calling worker runs */
+static GPrivate current_thread;
+
+/* Every Loom that isn't disassembled, for loom_dump_stats() */
+static GSList* all_looms = NULL;
+static GMutex all_looms_mutex;
+
+static const gchar* const resource_names[LOOM_RESOURCE_COUNT] = {
+    "cpu",
+    "io",
+    "subprocess",
+    "ml",
+};
 
 /* Static helper functions */
 
 // Forward declarations
 static void
 loom_tie_off(GObject* source, GAsyncResult* result, gpointer knot_data);
+static void
+loom_admit(Loom* loom, LoomActiveThread* active_thread);
+static gboolean
+loom_deliver_progress(gpointer user_data);
+
+/**
+ * Takes in the threads pushed onto the submitted stack, in the order they
+ * were pushed. Needs the lock.
+ */
+static void
+loom_take_submitted(Loom* loom)
+{
+    LoomActiveThread* stack;
+    do
+        stack = g_atomic_pointer_get(&loom->submitted);
+    while (stack && !g_atomic_pointer_compare_and_exchange(
+                      &loom->submitted, stack, NULL));
+
+    // the stack has the newest thread on top
+    LoomActiveThread* oldest = NULL;
+    while (stack) {
+        LoomActiveThread* next = stack->next_submitted;
+        stack->next_submitted = oldest;
+        oldest = stack;
+        stack = next;
+    }
+    while (oldest) {
+        LoomActiveThread* next = oldest->next_submitted;
+        oldest->next_submitted = NULL;
+        loom_admit(loom, oldest);
+        oldest = next;
+    }
+}
+
+static void
+loom_lock(Loom* loom)
+{
+    g_rec_mutex_lock(&loom->lock);
+    loom_take_submitted(loom);
+}
+
+/**
+ * Unlocks the Loom after taking in the submitted threads. A submitter that
+ * found the Loom locked leaves its thread to us, so we check once more after
+ * unlocking.
+ */
+static void
+loom_unlock(Loom* loom)
+{
+    do {
+        loom_take_submitted(loom);
+        g_rec_mutex_unlock(&loom->lock);
+    } while (g_atomic_pointer_get(&loom->submitted) &&
+             g_rec_mutex_trylock(&loom->lock));
+}
+
+/**
+ * Makes sure progress is delivered on the next tick. Thread-safe.
+ */
+static void
+loom_schedule_progress(Loom* loom)
+{
+    if (g_atomic_int_compare_and_exchange(&loom->progress_scheduled, 0, 1))
+        g_timeout_add(LOOM_PROGRESS_INTERVAL_MS, loom_deliver_progress, loom);
+}
+
+/**
+ * Marks the group's progress as changed, to be delivered on the next tick.
+ * Needs the lock.
+ */
+static void
+loom_mark_group(Loom* loom, LoomGroup* group)
+{
+    if (group && group->progress &&
+        !g_hash_table_contains(loom->dirty_groups, group))
+        g_hash_table_add(loom->dirty_groups, loom_group_ref(group));
+}
+
+static void
+loom_touch_group(Loom* loom, LoomGroup* group)
+{
+    loom_mark_group(loom, group);
+    if (group && group->progress)
+        loom_schedule_progress(loom);
+}
 
 static void
 free_loom_thread_spec(const LoomThreadSpec* spec)
@@ -30,6 +209,10 @@ free_loom_thread_spec(const LoomThreadSpec* spec)
     // shuttle_data and knot_data are owned by the caller
     g_free((gchar*)spec->tag);
     g_strfreev((gchar**)spec->dependencies);
+    if (spec->group)
+        loom_group_unref(spec->group);
+    if (spec->after_group)
+        loom_group_unref(spec->after_group);
     g_free((gpointer)spec);
 }
 
@@ -37,40 +220,302 @@ static void
 free_loom_active_thread(LoomActiveThread* active_thread)
 {
     free_loom_thread_spec(active_thread->spec);
+    g_ptr_array_free(active_thread->successors, TRUE);
+    g_clear_object(&active_thread->snippable);
     g_free(active_thread);
 }
 
-// TODO: unimplemented
+/**
+ * Snips a thread that ran out of time. Only the GCancellable is cancelled,
+ * the thread is still tied off once its shuttle returns, see loom_tie_off().
+ */
 static gboolean
 loom_thread_snapped(gpointer user_data)
 {
     LoomActiveThread* active_thread = user_data;
-    g_task_return_error(
-      active_thread->thread,
-      g_error_new_literal(G_IO_ERROR, G_IO_ERROR_TIMED_OUT, "Task timed out"));
+    Loom* loom = active_thread->owning_loom;
+    g_debug("thread '%s' timed out after %u ms\n",
+            active_thread->spec->tag,
+            active_thread->spec->timeout_ms);
+    // the worker that started it may not have stored timeout_id yet
+    loom_lock(loom);
+    active_thread->timeout_id = 0;
+    active_thread->timed_out = TRUE;
+    loom_unlock(loom);
+    g_cancellable_cancel(active_thread->snippable);
     return G_SOURCE_REMOVE;
 }
 
+static void
+loom_parallel_unref(LoomParallel* loop)
+{
+    if (!g_atomic_int_dec_and_test(&loop->refcount))
+        return;
+    g_free(loop->identity);
+    g_mutex_clear(&loop->lock);
+    g_cond_clear(&loop->done);
+    g_free(loop);
+}
+
 /**
- * Shuttles the thread through the Loom using the given shuttle.
+ * Claims the next slice of the loop. Returns FALSE once all are claimed.
+ */
+static gboolean
+loom_parallel_claim(LoomParallel* loop, gsize* out_begin, gsize* out_end)
+{
+    gsize begin;
+    gsize size;
+    do {
+        begin = g_atomic_pointer_get(&loop->next);
+        if (begin >= loop->end)
+            return FALSE;
+        gsize left = loop->end - begin;
+        size = MIN(left, MAX(loop->grain, left / loop->split));
+    } while (!g_atomic_pointer_compare_and_exchange(
+      &loop->next, begin, begin + size));
+    *out_begin = begin;
+    *out_end = begin + size;
+    return TRUE;
+}
+
+/**
+ * Runs slices of the loop until none are left, on its caller or a helper.
+ */
+static void
+loom_parallel_work(LoomParallel* loop)
+{
+    gpointer partial = NULL; // freed before return
+    gsize done = 0;
+    gsize begin;
+    gsize end;
+    gpointer outer = g_private_get(&current_thread);
+    g_private_set(&current_thread, loop->caller);
+    while (loom_parallel_claim(loop, &begin, &end)) {
+        if (loop->reduce) {
+            if (!partial)
+                partial = g_memdup2(loop->identity, loop->result_size);
+            loop->reduce(begin, end, partial, loop->user_data);
+        } else
+            loop->func(begin, end, loop->user_data);
+        done += end - begin;
+    }
+    g_private_set(&current_thread, outer);
+    if (done == 0)
+        return;
+
+    g_mutex_lock(&loop->lock);
+    if (partial)
+        loop->combine(loop->result, partial, loop->user_data);
+    loop->remaining -= done;
+    if (loop->remaining == 0)
+        g_cond_signal(&loop->done);
+    g_mutex_unlock(&loop->lock);
+    g_free(partial);
+}
+
+/**
+ * Queues helpers for the loop, takes part in it and waits for it to finish.
+ * Consumes the caller's reference.
+ */
+static void
+loom_parallel_run(Loom* loom, LoomParallel* loop, gsize begin)
+{
+    gsize total = loop->end - begin;
+    loop->next = begin;
+    loop->remaining = total;
+    loop->grain = MAX(loop->grain, 1);
+    loop->caller = g_private_get(&current_thread);
+    loop->loom = loom;
+    g_mutex_init(&loop->lock);
+    g_cond_init(&loop->done);
+
+    // no point in more helpers than slices, nor in more than the CPU class
+    // and the workers have room for, the caller does the rest itself
+    gsize slices = (total + loop->grain - 1) / loop->grain;
+    guint helpers = (guint)MIN(loom->max_threads, slices ? slices - 1 : 0);
+    loom_lock(loom);
+    LoomResourceClass* cpu = &loom->resources[LOOM_RESOURCE_CPU];
+    guint cpu_room = cpu->running < cpu->cap ? cpu->cap - cpu->running : 0;
+    guint worker_room = loom->dispatched < loom->max_threads
+                          ? loom->max_threads - loom->dispatched
+                          : 0;
+    helpers = MIN(helpers, MIN(cpu_room, worker_room));
+    cpu->running += helpers;
+    loom->dispatched += helpers;
+    loom_unlock(loom);
+    loop->split = 2 * (helpers + 1);
+    loop->refcount = 1 + helpers;
+    // the caller blocks on the loop, so it is as urgent as the caller
+    gint priority = loop->caller ? loop->caller->spec->priority : -1;
+    for (guint i = 0; i < helpers; ++i)
+        loom_sched_push(loom->sched, loop, priority, FALSE);
+
+    loom_parallel_work(loop);
+    g_mutex_lock(&loop->lock);
+    while (loop->remaining > 0)
+        g_cond_wait(&loop->done, &loop->lock);
+    g_mutex_unlock(&loop->lock);
+    loom_parallel_unref(loop);
+}
+
+/**
+ * Returns the class whose first held-back thread runs next, or -1 if none can:
+ * the one in the most urgent lane, then the one using least of its share of
+ * threads, then the first in Loom order. Needs the lock.
+ */
+static gint
+loom_pick_resource(Loom* loom)
+{
+    gint best = -1;
+    const LoomHeapEntry* best_entry = NULL;
+    for (gint i = 0; i < LOOM_RESOURCE_COUNT; ++i) {
+        const LoomResourceClass* rclass = &loom->resources[i];
+        const LoomHeapEntry* entry = loom_heap_peek(&rclass->held_back);
+        if (!entry || (rclass->running >= rclass->cap && !loom->draining))
+            continue;
+        if (best >= 0) {
+            const LoomResourceClass* best_rclass = &loom->resources[best];
+            guint lane = loom_sched_get_lane(entry->priority);
+            guint best_lane = loom_sched_get_lane(best_entry->priority);
+            // running / weight, cross-multiplied
+            guint64 share = (guint64)rclass->running * best_rclass->weight;
+            guint64 best_share = (guint64)best_rclass->running * rclass->weight;
+            if (lane > best_lane || (lane == best_lane && share > best_share) ||
+                (lane == best_lane && share == best_share &&
+                 !loom_heap_entry_before(entry, best_entry)))
+                continue;
+        }
+        best = i;
+        best_entry = entry;
+    }
+    return best;
+}
+
+/**
+ * Hands held-back threads to the scheduler while there are threads to run
+ * them. Needs the lock.
+ */
+static void
+loom_dispatch(Loom* loom)
+{
+    gboolean first = TRUE;
+    while (loom->dispatched < loom->max_threads || loom->draining) {
+        gint resource = loom_pick_resource(loom);
+        if (resource < 0)
+            return;
+        LoomResourceClass* rclass = &loom->resources[resource];
+        LoomActiveThread* active_thread = loom_heap_pop(&rclass->held_back);
+        rclass->running++;
+        loom->dispatched++;
+        active_thread->dispatched_at = g_get_monotonic_time();
+        loom_histogram_record(
+          &active_thread->stats->wait,
+          active_thread->dispatched_at - active_thread->queued_at);
+        // Loom hands out no more threads than there are workers, so its
+        // order is all there is to keep: the first goes to the deque of the
+        // worker vacating, if any, which runs it next with warm caches; the
+        // rest go through the shared heap, the deque would reverse them
+        if (first)
+            loom_sched_push(loom->sched,
+                            active_thread,
+                            active_thread->spec->priority,
+                            active_thread->spec->is_lifo);
+        else
+            loom_sched_inject(loom->sched,
+                              active_thread,
+                              active_thread->spec->priority,
+                              active_thread->spec->is_lifo);
+        first = FALSE;
+    }
+}
+
+/**
+ * Gives back the thread a shuttle ran on and dispatches the next one.
+ * run_time is negative if the shuttle didn't run.
+ */
+static void
+loom_vacate(Loom* loom,
+            LoomActiveThread* active_thread,
+            gint64 started_at,
+            gint64 run_time)
+{
+    loom_lock(loom);
+    LoomTagStats* stats = active_thread->stats;
+    loom_histogram_record(&stats->sched,
+                          started_at - active_thread->dispatched_at);
+    if (run_time >= 0)
+        loom_histogram_record(&stats->run, run_time);
+    loom->resources[active_thread->spec->resource].running--;
+    loom->dispatched--;
+    loom_dispatch(loom);
+    loom_unlock(loom);
+}
+
+/**
+ * Gives back the CPU thread a parallel loop's helper ran on and dispatches
+ * the next thread.
+ */
+static void
+loom_vacate_helper(Loom* loom)
+{
+    loom_lock(loom);
+    loom->resources[LOOM_RESOURCE_CPU].running--;
+    loom->dispatched--;
+    loom_dispatch(loom);
+    loom_unlock(loom);
+}
+
+/**
+ * Shuttles the thread through the Loom using the given shuttle, or helps
+ * with a parallel loop.
  */
 static void
 loom_shuttle_wrapper(gpointer thread, gpointer e)
 {
     (void)e;
-    // TODO: implement cancellable
+    if (*(LoomWorkKind*)thread == LOOM_WORK_PARALLEL) {
+        TRACE_BEGIN("loom", "parallel loop");
+        LoomParallel* loop = thread;
+        loom_parallel_work(loop);
+        TRACE_END("loom", "parallel loop");
+        loom_vacate_helper(loop->loom);
+        loom_parallel_unref(loop);
+        return;
+    }
     LoomActiveThread* active_thread = thread;
 
     GError* error = NULL; // to be handled by knot
-    // TODO: progress
-    // If you want progress, do it manually in the shuttle
-    // g_print("Shuttle start--");
-    gpointer result =
-      active_thread->spec->shuttle(active_thread->spec->shuttle_data, &error);
-    // g_print("Shuttle end\n");
-
-    if (active_thread->timeout_id)
-        g_source_remove(active_thread->timeout_id);
+    // without a shuttle, the thread only ties off its knot
+    const LoomThreadSpec* spec = active_thread->spec;
+    gpointer result = NULL;
+    gint64 started_at = g_get_monotonic_time();
+    gint64 run_time = -1;
+    // snipped while queued, don't start it
+    if (!g_cancellable_set_error_if_cancelled(active_thread->snippable,
+                                              &error) &&
+        spec->shuttle) {
+        // the timeout counts from here, time spent queued doesn't count
+        if (spec->timeout_ms > 0) {
+            guint timeout_id = g_timeout_add(
+              spec->timeout_ms, loom_thread_snapped, active_thread);
+            loom_lock(active_thread->owning_loom);
+            // once snapped, the source is gone already
+            if (!active_thread->timed_out)
+                active_thread->timeout_id = timeout_id;
+            loom_unlock(active_thread->owning_loom);
+        }
+        // shuttles may run other threads' shuttles, e.g. while they wait
+        gpointer outer = g_private_get(&current_thread);
+        g_private_set(&current_thread, active_thread);
+        TRACE_BEGIN("loom", g_intern_string(spec->tag));
+        result = spec->shuttle(spec->shuttle_data, &error);
+        TRACE_END("loom", g_intern_string(spec->tag));
+        g_private_set(&current_thread, outer);
+        run_time = g_get_monotonic_time() - started_at;
+    }
+    // before returning, the knot may free active_thread once we have
+    loom_vacate(
+      active_thread->owning_loom, active_thread, started_at, run_time);
 
     if (error)
         g_task_return_error(active_thread->thread, error);
@@ -86,66 +531,268 @@ loom_shuttle_wrapper(gpointer thread, gpointer e)
  * If the thread times out, it is snapped and tied off.
  */
 static void
-loom_weave(Loom* loom, LoomThreadSpec* thread_spec)
+loom_weave(Loom* loom, LoomActiveThread* active_thread)
 {
-    // Create the thread
-    LoomActiveThread* active_thread =
-      g_new0(LoomActiveThread, 1);     // freed in loom_tie_off
-    active_thread->spec = thread_spec; // freed in loom_tie_off
-    active_thread->owning_loom = loom;
+    const LoomThreadSpec* thread_spec = active_thread->spec;
 
-    active_thread->snippable = g_cancellable_new(); // freed in loom_tie_off
     active_thread->thread = // gets cleaned up when loom_tie_off returns
       g_task_new(NULL, active_thread->snippable, loom_tie_off, active_thread);
-
-    // start timeout
-    if (thread_spec->timeout_ms > 0) {
-        active_thread->timeout_id = g_timeout_add(
-          thread_spec->timeout_ms, loom_thread_snapped, active_thread);
-    }
+    // the knot gets whatever the shuttle returned, even once cancelled
+    g_task_set_check_cancellable(active_thread->thread, FALSE);
 
     g_task_set_task_data(active_thread->thread, active_thread, NULL);
 
     g_debug("Weaving thread '%s'\n", active_thread->spec->tag);
-    g_hash_table_insert(
-      loom->running_threads, g_strdup(active_thread->spec->tag), active_thread);
+    // until tied off, across the threads it runs on
+    TRACE_ASYNC_BEGIN(
+      "loom", g_intern_string(thread_spec->tag), active_thread->id);
+    GPtrArray* running =
+      g_hash_table_lookup(loom->running_threads, thread_spec->tag);
+    if (!running) {
+        running = g_ptr_array_new(); // freed by running_threads
+        g_hash_table_insert(
+          loom->running_threads, g_strdup(thread_spec->tag), running);
+    }
+    g_ptr_array_add(running, active_thread);
+    loom->running_count++;
 
-    // pass thread off to shuttle
-    g_thread_pool_push(loom->pool, active_thread, NULL);
+    // pass thread off to shuttle once its class has room
+    LoomResourceClass* rclass = &loom->resources[thread_spec->resource];
+    loom_heap_push(&rclass->held_back,
+                   active_thread,
+                   thread_spec->priority,
+                   (gint64)active_thread->id,
+                   thread_spec->is_lifo);
+    if (rclass->running >= rclass->cap)
+        g_debug("thread '%s' waits for a free '%s' thread\n",
+                thread_spec->tag,
+                resource_names[thread_spec->resource]);
+    loom_dispatch(loom);
+}
+
+static void
+loom_add_edge(GPtrArray* successors, LoomActiveThread* active_thread)
+{
+    g_ptr_array_add(successors, active_thread);
+    g_atomic_int_inc(&active_thread->indegree);
+}
+
+/**
+ * Adds an edge from every running thread with a tag that active_thread
+ * depends on, and from its after_group unless that is empty.
+ * Returns TRUE if there was any, active_thread is then released by the last
+ * of them to be tied off.
+ */
+static gboolean
+loom_wait_for_dependencies(Loom* loom, LoomActiveThread* active_thread)
+{
+    const LoomThreadSpec* spec = active_thread->spec;
+    for (const gchar** dep = spec->dependencies; dep && *dep; ++dep) {
+        GPtrArray* running = g_hash_table_lookup(loom->running_threads, *dep);
+        if (!running)
+            continue;
+        g_debug(
+          "thread '%s' waits for %u '%s'\n", spec->tag, running->len, *dep);
+        for (guint i = 0; i < running->len; ++i)
+            loom_add_edge(
+              ((LoomActiveThread*)g_ptr_array_index(running, i))->successors,
+              active_thread);
+    }
+
+    LoomGroup* group = spec->after_group;
+    if (group) {
+        // a member can't wait for itself
+        guint others = g_hash_table_size(group->members);
+        if (g_hash_table_contains(group->members, active_thread))
+            others--;
+        if (others > 0) {
+            g_debug("thread '%s' waits for group '%s'\n",
+                    spec->tag,
+                    group->name);
+            loom_add_edge(group->successors, active_thread);
+        }
+    }
+    return g_atomic_int_get(&active_thread->indegree) > 0;
+}
+
+/**
+ * Removes a thread that was tied off or snipped from all bookkeeping but the
+ * DAG.
+ */
+static void
+loom_forget(Loom* loom, LoomActiveThread* active_thread)
+{
+    g_hash_table_remove(loom->threads, &active_thread->id);
+    g_hash_table_remove(loom->waiting_threads, active_thread);
 }
 
 /**
- * Picks up threads from the queued_threads hash table.
- * If a thread is ready, it is weaved into the Loom pool.
+ * Releases the threads in successors, which waited for a thread or group that
+ * is done, and weaves the ones that are ready, most urgent first. One woven in
+ * the meantime under a tag a released thread depends on holds it back again,
+ * so same-tag threads still run one after the other.
  */
 static void
-loom_pick_up_ready(Loom* loom)
-{
-    g_debug("loom_pick_up_ready\n");
-    // walk queue to find ready threads
-    GList* iter = loom->queued_threads->head; // just a pointer, no need free
-    while (iter) {
-        GList* next = iter->next;
-        LoomThreadSpec* thread_spec = iter->data;
-
-        // check weather all dependencies are done
-        gboolean ready = TRUE;
-        for (const char** dep = thread_spec->dependencies; dep && *dep; ++dep) {
-            if (g_hash_table_contains(loom->running_threads, *dep)) {
-                ready = FALSE;
-                g_debug("thread '%s' not ready\n", thread_spec->tag);
-                break;
-            }
+loom_release(Loom* loom, GPtrArray* successors)
+{
+    if (successors->len == 0)
+        return;
+
+    LoomHeap ready;
+    loom_heap_init(&ready);
+    for (guint i = 0; i < successors->len; ++i) {
+        LoomActiveThread* successor = g_ptr_array_index(successors, i);
+        if (g_atomic_int_dec_and_test(&successor->indegree))
+            loom_heap_push(&ready,
+                           successor,
+                           successor->spec->priority,
+                           (gint64)successor->id,
+                           successor->spec->is_lifo);
+    }
+    g_ptr_array_set_size(successors, 0);
+
+    LoomActiveThread* successor;
+    while ((successor = loom_heap_pop(&ready))) {
+        if (successor->snipped) {
+            g_hash_table_remove(loom->waiting_threads, successor);
+            free_loom_active_thread(successor);
+            continue;
         }
-        if (ready) {
-            g_debug("weaving ready thread '%s'\n", thread_spec->tag);
-            g_queue_delete_link(
-              loom->queued_threads,
-              iter); // only removes and frees iter, not the data
-            loom_weave(loom, thread_spec);
+        if (loom_wait_for_dependencies(loom, successor))
+            continue;
+        g_debug("weaving ready thread '%s'\n", successor->spec->tag);
+        g_hash_table_remove(loom->waiting_threads, successor);
+        loom_weave(loom, successor);
+    }
+    loom_heap_clear(&ready);
+}
+
+/**
+ * Takes active_thread out of its group, which releases the threads waiting
+ * for the group once it is empty.
+ */
+static void
+loom_leave_group(Loom* loom, LoomActiveThread* active_thread)
+{
+    LoomGroup* group = active_thread->spec->group;
+    if (!group || !g_hash_table_remove(group->members, active_thread))
+        return;
+    group->left++;
+    loom_touch_group(loom, group);
+    if (g_hash_table_size(group->members) == 0) {
+        g_debug("group '%s' is done\n", group->name);
+        loom_release(loom, group->successors);
+    }
+}
+
+/**
+ * Drops a thread that is still waiting and adds it to snipped, whose knots
+ * loom_tie_off_snipped() runs once the lock is dropped. Running threads only
+ * get their GCancellable cancelled. Needs the lock.
+ */
+static void
+loom_snip_thread(Loom* loom,
+                 LoomActiveThread* active_thread,
+                 GPtrArray* snipped)
+{
+    if (active_thread->snipped)
+        return;
+    g_cancellable_cancel(active_thread->snippable);
+    if (active_thread->thread)
+        return;
+    active_thread->snipped = TRUE;
+    g_debug("Snipping waiting thread '%s'\n", active_thread->spec->tag);
+
+    g_hash_table_remove(loom->threads, &active_thread->id);
+    active_thread->stats->cancelled++;
+    // the DAG may release the node while its knot runs, this keeps it
+    g_atomic_int_inc(&active_thread->indegree);
+    g_ptr_array_add(snipped, active_thread);
+}
+
+/**
+ * Gives the knots of the threads loom_snip_thread() collected in snipped
+ * G_IO_ERROR_CANCELLED, then takes the threads out of their groups. Call
+ * without the lock, knots may queue or snip threads. Frees snipped.
+ */
+static void
+loom_tie_off_snipped(Loom* loom, GPtrArray* snipped)
+{
+    if (snipped->len == 0) {
+        g_ptr_array_free(snipped, TRUE);
+        return;
+    }
+    gint64* knot_times = g_new(gint64, snipped->len); // freed before return
+    for (guint i = 0; i < snipped->len; ++i) {
+        LoomActiveThread* active_thread = g_ptr_array_index(snipped, i);
+        const LoomThreadSpec* spec = active_thread->spec;
+        gint64 knot_start = g_get_monotonic_time();
+        if (spec->knot)
+            spec->knot(
+              spec->knot_data,
+              spec->shuttle_data,
+              NULL,
+              g_error_new_literal(G_IO_ERROR,
+                                  G_IO_ERROR_CANCELLED,
+                                  "Task was cancelled")); // freed by knot
+        knot_times[i] = g_get_monotonic_time() - knot_start;
+        if (spec->task_data_destroy)
+            spec->task_data_destroy(spec->shuttle_data);
+    }
+
+    loom_lock(loom);
+    for (guint i = 0; i < snipped->len; ++i) {
+        LoomActiveThread* active_thread = g_ptr_array_index(snipped, i);
+        loom_histogram_record(&active_thread->stats->knot, knot_times[i]);
+        loom_leave_group(loom, active_thread);
+        // the DAG released it while the knot ran
+        if (g_atomic_int_dec_and_test(&active_thread->indegree)) {
+            g_hash_table_remove(loom->waiting_threads, active_thread);
+            free_loom_active_thread(active_thread);
         }
-        iter = next;
     }
+    loom_unlock(loom);
+    g_free(knot_times);
+    g_ptr_array_free(snipped, TRUE);
+}
+
+/**
+ * Enters a submitted thread into the bookkeeping and weaves it, unless it has
+ * to wait for dependencies. Needs the lock.
+ */
+static void
+loom_admit(Loom* loom, LoomActiveThread* active_thread)
+{
+    const LoomThreadSpec* thread_spec = active_thread->spec;
+    g_hash_table_insert(loom->threads, &active_thread->id, active_thread);
+    active_thread->stats = g_hash_table_lookup(loom->stats, thread_spec->tag);
+    if (!active_thread->stats) {
+        active_thread->stats = loom_tag_stats_new(); // freed by loom->stats
+        g_hash_table_insert(
+          loom->stats, g_strdup(thread_spec->tag), active_thread->stats);
+    }
+    active_thread->stats->queued++;
+    LoomGroup* group = thread_spec->group;
+    if (group) {
+        if (!g_atomic_pointer_compare_and_exchange(&group->loom, NULL, loom) &&
+            g_atomic_pointer_get(&group->loom) != loom)
+            g_warning("thread '%s' joins group '%s' of another Loom",
+                      thread_spec->tag,
+                      group->name);
+        g_hash_table_add(group->members, active_thread);
+        group->joined++;
+        loom_touch_group(loom, group);
+    }
+
+    // if it has to wait for dependencies, the last one weaves it
+    if (loom_wait_for_dependencies(loom, active_thread)) {
+        g_debug("thread '%s' waits for dependencies\n", thread_spec->tag);
+        g_hash_table_add(loom->waiting_threads, active_thread);
+        return;
+    }
+
+    g_debug("no dependencies, weaving thread '%s'\n", thread_spec->tag);
+    loom_weave(loom, active_thread);
 }
 
 /**
@@ -156,7 +803,6 @@ static void
 loom_tie_off(GObject* source, GAsyncResult* result, gpointer tie_off_data)
 {
     (void)source;
-    gchar* test = g_new0(gchar, 1);
     LoomActiveThread* active_thread = tie_off_data;
     Loom* loom = active_thread->owning_loom;
     GTask* thread = G_TASK(result);
@@ -166,53 +812,142 @@ loom_tie_off(GObject* source, GAsyncResult* result, gpointer tie_off_data)
     gpointer shuttle_data =
       active_thread->spec->shuttle_data; // transferred to knot
 
+    // sources must be removed from the thread that owns their context
+    if (active_thread->timeout_id)
+        g_source_remove(active_thread->timeout_id);
+    if (active_thread->timed_out &&
+        g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        g_clear_error(&error);
+        error = g_error_new(G_IO_ERROR,
+                            G_IO_ERROR_TIMED_OUT,
+                            "Task timed out after %u ms",
+                            active_thread->spec->timeout_ms);
+    }
+
+    // the knot frees the error
+    guint64* outcome = NULL;
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT) &&
+        active_thread->timed_out)
+        outcome = &active_thread->stats->timed_out;
+    else if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        outcome = &active_thread->stats->cancelled;
+    else if (error)
+        outcome = &active_thread->stats->failed;
+
+    gint64 knot_start = g_get_monotonic_time();
+    TRACE_BEGIN("knot", g_intern_string(active_thread->spec->tag));
     if (active_thread->spec->knot)
         active_thread->spec->knot(
           active_thread->spec->knot_data, shuttle_data, result_pointer, error);
     else
         g_warning("loom_tie_off: knot is NULL");
+    TRACE_END("knot", g_intern_string(active_thread->spec->tag));
+    TRACE_ASYNC_END(
+      "loom", g_intern_string(active_thread->spec->tag), active_thread->id);
+    gint64 knot_time = g_get_monotonic_time() - knot_start;
 
-    // g_mutex_lock(&loom->lock);
-    // all use of hash_tables is in main thread so no need lock
-    g_hash_table_remove(loom->running_threads,
-                        (gpointer)active_thread->spec->tag);
+    // the knot ran unlocked, so shuttles can queue threads meanwhile
+    loom_lock(loom);
+    loom_histogram_record(&active_thread->stats->knot, knot_time);
+    if (outcome)
+        (*outcome)++;
+    GPtrArray* running =
+      g_hash_table_lookup(loom->running_threads, active_thread->spec->tag);
+    g_ptr_array_remove_fast(running, active_thread);
+    if (running->len == 0)
+        g_hash_table_remove(loom->running_threads, active_thread->spec->tag);
+    loom->running_count--;
+    loom_forget(loom, active_thread);
     // TODO: implement completed_tags (or remove it)
     // g_hash_table_insert(loom->completed_tags,
     // g_strdup(active_thread->spec->tag),GINT_TO_POINTER(TRUE));
 
-    loom_pick_up_ready(loom);
-    // g_mutex_unlock(&loom->lock);
+    loom_release(loom, active_thread->successors);
+    // only now, so threads the knot queued in the group keep it busy
+    loom_leave_group(loom, active_thread);
+    loom_unlock(loom);
 
     if (active_thread->spec->task_data_destroy)
         active_thread->spec->task_data_destroy(
           active_thread->spec->shuttle_data);
 
     // active_thread->thread is freed automatically after return
-    g_clear_object(&active_thread->snippable);
     free_loom_active_thread(active_thread);
-    g_free(test);
 }
 
 /**
- * Returns TRUE if spec has a higher priority than compare_spec.
- * If spec and compare_thread have the same priority, returns FALSE.
+ * Returns how much of the group is done. Needs the lock.
+ */
+static gdouble
+loom_group_progress(LoomGroup* group)
+{
+    if (group->joined == 0 || group->left == group->joined)
+        return 1.0;
+    gint64 done = (gint64)group->left * LOOM_PROGRESS_SCALE;
+    GHashTableIter iter;
+    gpointer member;
+    g_hash_table_iter_init(&iter, group->members);
+    while (g_hash_table_iter_next(&iter, &member, NULL))
+        done += g_atomic_int_get(&((LoomActiveThread*)member)->progress);
+    return (gdouble)done / LOOM_PROGRESS_SCALE / group->joined;
+}
+
+/**
+ * Hands the progress reported since the last tick to the progress callbacks.
+ * They run unlocked, so they may queue or snip threads.
  */
 static gboolean
-thread_has_priority(const LoomThreadSpec* spec,
-                    const LoomThreadSpec* compare_spec)
-{
-    g_debug("Comparing priority of thread '%s' with '%s'\n",
-            spec->tag,
-            compare_spec->tag);
-    // if LIFO, return TRUE as soon as we have a thread with same priority
-    if (spec->is_lifo && spec->priority == compare_spec->priority) {
-        g_debug("LiFo thread '%s' has prio over older thread '%s'\n",
-                spec->tag,
-                compare_spec->tag);
-        return TRUE;
+loom_deliver_progress(gpointer user_data)
+{
+    Loom* loom = user_data;
+    g_atomic_int_set(&loom->progress_scheduled, 0);
+
+    GPtrArray* changed = g_ptr_array_new(); // freed before return
+    loom_lock(loom);
+    GHashTableIter iter;
+    gpointer value;
+    g_hash_table_iter_init(&iter, loom->running_threads);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        GPtrArray* running = value;
+        for (guint i = 0; i < running->len; ++i) {
+            LoomActiveThread* active_thread = g_ptr_array_index(running, i);
+            if (!g_atomic_int_compare_and_exchange(
+                  &active_thread->progress_changed, 1, 0))
+                continue;
+            if (active_thread->spec->progress)
+                g_ptr_array_add(changed, active_thread);
+            loom_mark_group(loom, active_thread->spec->group);
+        }
+    }
+    GList* groups = g_hash_table_get_keys(loom->dirty_groups); // freed below
+    gdouble* fractions = // freed before return
+      g_new(gdouble, g_list_length(groups) + 1);
+    guint n = 0;
+    for (GList* iter = groups; iter; iter = iter->next)
+        fractions[n++] = loom_group_progress(iter->data);
+    // refs are dropped below
+    g_hash_table_steal_all(loom->dirty_groups);
+    loom_unlock(loom);
+
+    // threads are only tied off on the main thread, so they are still around
+    for (guint i = 0; i < changed->len; ++i) {
+        LoomActiveThread* active_thread = g_ptr_array_index(changed, i);
+        const LoomThreadSpec* spec = active_thread->spec;
+        spec->progress(spec->knot_data,
+                       spec->shuttle_data,
+                       (gdouble)g_atomic_int_get(&active_thread->progress) /
+                         LOOM_PROGRESS_SCALE);
     }
-    // lower value is higher priority
-    return spec->priority < compare_spec->priority;
+    n = 0;
+    for (GList* iter = groups; iter; iter = iter->next) {
+        LoomGroup* group = iter->data;
+        group->progress(group, fractions[n++], group->progress_data);
+        loom_group_unref(group);
+    }
+    g_list_free(groups);
+    g_free(fractions);
+    g_ptr_array_free(changed, TRUE);
+    return G_SOURCE_REMOVE;
 }
 
 /**
@@ -227,6 +962,10 @@ loom_thread_spec_dup(const LoomThreadSpec* spec)
     spec_copy->tag = g_strdup(spec->tag);
     spec_copy->dependencies =
       (const gchar**)g_strdupv((gchar**)spec->dependencies);
+    if (spec->group)
+        loom_group_ref(spec->group);
+    if (spec->after_group)
+        loom_group_ref(spec->after_group);
     return spec_copy; // transfer ownership to caller
 }
 
@@ -235,131 +974,518 @@ loom_thread_spec_dup(const LoomThreadSpec* spec)
 gboolean
 loom_is_busy(Loom* loom)
 {
-    return g_hash_table_size(loom->running_threads) >= loom->max_threads;
+    loom_lock(loom);
+    gboolean busy = loom->running_count >= loom->max_threads;
+    loom_unlock(loom);
+    return busy;
 }
 
-void
+LoomTaskId
 loom_queue_thread(Loom* loom,
                   const LoomThreadSpec* thread_spec,
                   GCancellable** out_cancellable)
 {
-    // TODO: implement cancellable
-    (void)out_cancellable;
-    // g_mutex_lock(&loom->lock);
-
-    // check if thread has to wait for dependencies
-    gboolean has_dependencies_running = FALSE;
-    if (thread_spec->dependencies) {
-        for (const gchar** dep = thread_spec->dependencies; *dep; ++dep) {
-            if (!thread_spec->tag) {
-                g_warning("loom_queue_thread: thread_spec->tag is NULL!");
-                // g_mutex_unlock(&loom->lock);
-                return;
-            }
-            if (!loom->running_threads) {
-                g_warning("loom_queue_thread: loom->running_threads is NULL!");
-                // g_mutex_unlock(&loom->lock);
-                return;
-            }
-            if (!*dep)
-                g_warning("loom_queue_thread: dep is NULL!");
-            g_debug("Checking dependency '%s'\n", *dep);
-            // TODO: optional, check whether a dependency is queued
-            if (g_hash_table_contains(loom->running_threads, *dep)) {
-                has_dependencies_running = TRUE;
-                g_debug("thread %s has dependencies\n", thread_spec->tag);
-                break;
-            }
-        }
+    if (!thread_spec->tag) {
+        g_warning("loom_queue_thread: thread_spec->tag is NULL!");
+        return 0;
+    }
+    if ((guint)thread_spec->resource >= LOOM_RESOURCE_COUNT) {
+        g_warning("loom_queue_thread: thread '%s' has no valid resource",
+                  thread_spec->tag);
+        return 0;
     }
+    LoomActiveThread* active_thread =
+      g_new0(LoomActiveThread, 1); // freed in loom_tie_off
+    active_thread->kind = LOOM_WORK_THREAD;
+    active_thread->owning_loom = loom;
+    active_thread->queued_at = g_get_monotonic_time();
+    LoomTaskId id = (LoomTaskId)g_atomic_pointer_add(&loom->last_id, 1) + 1;
+    active_thread->id = id;
+    // hard copy, in case thread_spec lives on stack
+    active_thread->spec =
+      loom_thread_spec_dup(thread_spec); // freed in loom_tie_off
+    active_thread->successors = g_ptr_array_new();
+    // created here, so threads can be snipped while they wait
+    active_thread->snippable = g_cancellable_new(); // freed with active_thread
+    if (out_cancellable)
+        *out_cancellable = g_object_ref(active_thread->snippable);
 
-    // if so, push to queue
-    if (has_dependencies_running) {
-        g_debug("pushing thread '%s' to queue\n", thread_spec->tag);
-        LoomThreadSpec* thread_spec_copy =
-          loom_thread_spec_dup(thread_spec); // freed by loom_tie_off
-        GQueue* queue = loom->queued_threads;
-        guint i = 0;
-        // push to right position in queue
-        if (queue->length == 0)
-            g_queue_push_tail(queue, thread_spec_copy);
-        else {
-            g_debug("queue length: %d\n", queue->length);
-            for (; i < queue->length; ++i) {
-                LoomThreadSpec* spec = g_queue_peek_nth(queue, i);
-                if (thread_has_priority(thread_spec_copy, spec)) {
-                    g_queue_insert_before(
-                      queue, g_queue_peek_nth_link(queue, i), thread_spec_copy);
-                    break;
-                }
-                if (i == queue->length - 1) {
-                    g_queue_push_tail(queue, thread_spec_copy);
-                    break;
-                }
-            }
-        }
-        // g_mutex_unlock(&loom->lock);
+    LoomActiveThread* top;
+    do {
+        top = g_atomic_pointer_get(&loom->submitted);
+        active_thread->next_submitted = top;
+    } while (!g_atomic_pointer_compare_and_exchange(
+      &loom->submitted, top, active_thread));
+    // whoever holds the lock takes it in, it may be tied off by now
+    if (g_rec_mutex_trylock(&loom->lock))
+        loom_unlock(loom);
+    return id;
+}
+
+/**
+ * Snips the threads with the given tag that were queued with a generation
+ * below the given one.
+ */
+static void
+loom_snip_older(Loom* loom, const char* tag, guint64 generation)
+{
+    // snipping removes threads from loom->threads, so not while iterating
+    GPtrArray* matches = g_ptr_array_new(); // freed before return
+    GPtrArray* snipped = g_ptr_array_new(); // freed by loom_tie_off_snipped()
+    GHashTableIter iter;
+    gpointer value;
+    loom_lock(loom);
+    g_hash_table_iter_init(&iter, loom->threads);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        LoomActiveThread* active_thread = value;
+        if (active_thread->spec->generation < generation &&
+            g_str_equal(active_thread->spec->tag, tag))
+            g_ptr_array_add(matches, active_thread);
+    }
+    g_debug("Snipping %u threads '%s'\n", matches->len, tag);
+    for (guint i = 0; i < matches->len; ++i)
+        loom_snip_thread(loom, g_ptr_array_index(matches, i), snipped);
+    loom_unlock(loom);
+    g_ptr_array_free(matches, TRUE);
+    loom_tie_off_snipped(loom, snipped);
+}
+
+GCancellable*
+loom_get_cancellable(void)
+{
+    LoomActiveThread* active_thread = g_private_get(&current_thread);
+    return active_thread ? active_thread->snippable : NULL;
+}
+
+void
+loom_report_progress(gdouble fraction)
+{
+    LoomActiveThread* active_thread = g_private_get(&current_thread);
+    if (!active_thread)
         return;
+    const LoomThreadSpec* spec = active_thread->spec;
+    if (!spec->progress && !(spec->group && spec->group->progress))
+        return;
+    g_atomic_int_set(&active_thread->progress,
+                     (gint)(CLAMP(fraction, 0.0, 1.0) * LOOM_PROGRESS_SCALE));
+    if (g_atomic_int_compare_and_exchange(
+          &active_thread->progress_changed, 0, 1))
+        loom_schedule_progress(active_thread->owning_loom);
+}
+
+void
+loom_set_resource_limits(Loom* loom,
+                         LoomResource resource,
+                         guint cap,
+                         guint weight)
+{
+    g_return_if_fail(resource < LOOM_RESOURCE_COUNT);
+    loom_lock(loom);
+    LoomResourceClass* rclass = &loom->resources[resource];
+    rclass->cap = CLAMP(cap, 1, loom->max_threads);
+    rclass->weight = MAX(weight, 1);
+    // a higher cap may let held-back threads run
+    loom_dispatch(loom);
+    loom_unlock(loom);
+}
+
+guint
+loom_get_occupancy(Loom* loom, LoomResource resource, guint* out_queued)
+{
+    g_return_val_if_fail(resource < LOOM_RESOURCE_COUNT, 0);
+    loom_lock(loom);
+    const LoomResourceClass* rclass = &loom->resources[resource];
+    guint running = rclass->running;
+    if (out_queued)
+        *out_queued = loom_heap_get_size(&rclass->held_back);
+    loom_unlock(loom);
+    return running;
+}
+
+const gchar*
+loom_resource_get_name(LoomResource resource)
+{
+    g_return_val_if_fail(resource < LOOM_RESOURCE_COUNT, NULL);
+    return resource_names[resource];
+}
+
+void
+loom_set_name(Loom* loom, const gchar* name)
+{
+    loom_lock(loom);
+    g_free(loom->name);
+    loom->name = g_strdup(name);
+    loom_unlock(loom);
+}
+
+static gint
+compare_tags(gconstpointer a, gconstpointer b)
+{
+    return g_strcmp0(a, b);
+}
+
+/**
+ * Returns the Loom's tags, sorted. Needs the lock.
+ */
+static GList*
+loom_get_stats_tags(Loom* loom)
+{
+    return g_list_sort(g_hash_table_get_keys(loom->stats), compare_tags);
+}
+
+/**
+ * Returns how many threads are held back by resource classes. Needs the lock.
+ */
+static guint
+loom_get_held_back(Loom* loom)
+{
+    guint held_back = 0;
+    for (guint i = 0; i < LOOM_RESOURCE_COUNT; ++i)
+        held_back += loom_heap_get_size(&loom->resources[i].held_back);
+    return held_back;
+}
+
+void
+loom_dump_stats(void)
+{
+    GString* out = g_string_new(NULL); // freed before return
+    g_mutex_lock(&all_looms_mutex);
+    for (GSList* iter = all_looms; iter; iter = iter->next) {
+        Loom* loom = iter->data;
+        loom_lock(loom);
+        g_string_append_printf(out,
+                               "Loom '%s': %u running, %u held back, "
+                               "%u waiting for dependencies\n",
+                               loom->name,
+                               loom->dispatched,
+                               loom_get_held_back(loom),
+                               g_hash_table_size(loom->waiting_threads));
+        GList* tags = loom_get_stats_tags(loom); // freed below
+        for (GList* tag = tags; tag; tag = tag->next)
+            loom_tag_stats_format(
+              g_hash_table_lookup(loom->stats, tag->data), tag->data, out);
+        g_list_free(tags);
+        loom_unlock(loom);
     }
+    g_mutex_unlock(&all_looms_mutex);
+    g_print("%s", out->str);
+    g_string_free(out, TRUE);
+}
 
-    g_debug("no dependencies, weaving thread '%s'\n", thread_spec->tag);
-    // if not, weave hard copy (in case thread_spec lives on stack)
-    loom_weave(
-      loom,
-      loom_thread_spec_dup(thread_spec)); // spec dup freed by loom_tie_off
-    // g_mutex_unlock(&loom->lock);
+static gboolean
+write_to_string(gpointer sink, const gchar* data, gsize length)
+{
+    g_string_append_len(sink, data, length);
+    return TRUE;
+}
+
+gboolean
+loom_export_stats(const gchar* path, GError** error)
+{
+    GString* json = g_string_new(NULL); // freed before return
+    JsonWriter* writer = // freed by json_writer_finish()
+      json_writer_new_with_func(write_to_string, json);
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "looms");
+    json_writer_begin_array(writer);
+    g_mutex_lock(&all_looms_mutex);
+    for (GSList* iter = all_looms; iter; iter = iter->next) {
+        Loom* loom = iter->data;
+        loom_lock(loom);
+        json_writer_begin_object(writer);
+        json_writer_key(writer, "name");
+        json_writer_string(writer, loom->name);
+        json_writer_key(writer, "running");
+        json_writer_int(writer, loom->dispatched);
+        json_writer_key(writer, "held_back");
+        json_writer_int(writer, loom_get_held_back(loom));
+        json_writer_key(writer, "waiting");
+        json_writer_int(writer, g_hash_table_size(loom->waiting_threads));
+        json_writer_key(writer, "tags");
+        json_writer_begin_object(writer);
+        GList* tags = loom_get_stats_tags(loom); // freed below
+        for (GList* tag = tags; tag; tag = tag->next) {
+            json_writer_key(writer, tag->data);
+            loom_tag_stats_write_json(
+              g_hash_table_lookup(loom->stats, tag->data), writer);
+        }
+        g_list_free(tags);
+        json_writer_end_object(writer);
+        json_writer_end_object(writer);
+        loom_unlock(loom);
+    }
+    g_mutex_unlock(&all_looms_mutex);
+    json_writer_end_array(writer);
+    json_writer_end_object(writer);
+
+    gboolean ok = json_writer_finish(writer, NULL, NULL, error) &&
+                  g_file_set_contents(path, json->str, json->len, error);
+    g_string_free(json, TRUE);
+    return ok;
 }
 
-// TODO: unimplemented
 void
 loom_snip(Loom* loom, const char* tag)
 {
-    // g_mutex_lock(&loom->lock);
-    LoomActiveThread* active_thread =
-      g_hash_table_lookup(loom->running_threads, tag);
-    if (active_thread && active_thread->snippable)
-        g_cancellable_cancel(active_thread->snippable);
-    // g_mutex_unlock(&loom->lock);
+    loom_snip_older(loom, tag, G_MAXUINT64);
+}
+
+void
+loom_snip_stale(Loom* loom, const char* tag, guint generation)
+{
+    loom_snip_older(loom, tag, generation);
+}
+
+void
+loom_snip_id(Loom* loom, LoomTaskId id)
+{
+    GPtrArray* snipped = g_ptr_array_new(); // freed by loom_tie_off_snipped()
+    loom_lock(loom);
+    LoomActiveThread* active_thread = g_hash_table_lookup(loom->threads, &id);
+    if (active_thread)
+        loom_snip_thread(loom, active_thread, snipped);
+    loom_unlock(loom);
+    loom_tie_off_snipped(loom, snipped);
+}
+
+gboolean
+loom_is_pending(Loom* loom, LoomTaskId id)
+{
+    loom_lock(loom);
+    gboolean pending = g_hash_table_contains(loom->threads, &id);
+    loom_unlock(loom);
+    return pending;
+}
+
+LoomGroup*
+loom_group_new(const gchar* name)
+{
+    LoomGroup* group = g_new0(LoomGroup, 1); // freed by loom_group_unref()
+    group->refcount = 1;
+    group->name = g_strdup(name);
+    group->members = g_hash_table_new(NULL, NULL);
+    group->successors = g_ptr_array_new();
+    return group;
+}
+
+LoomGroup*
+loom_group_ref(LoomGroup* group)
+{
+    g_atomic_int_inc(&group->refcount);
+    return group;
+}
+
+void
+loom_group_unref(LoomGroup* group)
+{
+    if (!g_atomic_int_dec_and_test(&group->refcount))
+        return;
+    // members and waiters hold references, so both are empty here
+    g_hash_table_destroy(group->members);
+    g_ptr_array_free(group->successors, TRUE);
+    g_free(group->name);
+    g_free(group);
+}
+
+void
+loom_group_set_progress_func(LoomGroup* group,
+                             LoomGroupProgressFunc func,
+                             gpointer user_data)
+{
+    group->progress = func;
+    group->progress_data = user_data;
+}
+
+guint
+loom_group_get_size(LoomGroup* group)
+{
+    Loom* loom = g_atomic_pointer_get(&group->loom);
+    if (!loom)
+        return 0; // no thread has joined yet
+    loom_lock(loom);
+    guint size = g_hash_table_size(group->members);
+    loom_unlock(loom);
+    return size;
+}
+
+void
+loom_group_snip(LoomGroup* group)
+{
+    Loom* loom = g_atomic_pointer_get(&group->loom);
+    if (!loom)
+        return;
+    GPtrArray* snipped = g_ptr_array_new(); // freed by loom_tie_off_snipped()
+    loom_lock(loom);
+    GList* members = g_hash_table_get_keys(group->members); // freed below
+    g_debug("Snipping %u threads of group '%s'\n",
+            g_hash_table_size(group->members),
+            group->name);
+    for (GList* iter = members; iter; iter = iter->next)
+        loom_snip_thread(loom, iter->data, snipped);
+    loom_unlock(loom);
+    g_list_free(members);
+    loom_tie_off_snipped(loom, snipped);
+}
+
+void
+loom_parallel_for(Loom* loom,
+                  gsize begin,
+                  gsize end,
+                  gsize grain,
+                  LoomRangeFunc func,
+                  gpointer user_data)
+{
+    g_return_if_fail(begin <= end);
+    if (begin == end)
+        return;
+    LoomParallel* loop = g_new0(LoomParallel, 1); // freed by its last ref
+    loop->kind = LOOM_WORK_PARALLEL;
+    loop->end = end;
+    loop->grain = grain;
+    loop->func = func;
+    loop->user_data = user_data;
+    loom_parallel_run(loom, loop, begin);
+}
+
+void
+loom_parallel_reduce(Loom* loom,
+                     gsize begin,
+                     gsize end,
+                     gsize grain,
+                     LoomReduceFunc reduce,
+                     LoomCombineFunc combine,
+                     gpointer result,
+                     gsize result_size,
+                     gpointer user_data)
+{
+    g_return_if_fail(begin <= end);
+    if (begin == end)
+        return;
+    LoomParallel* loop = g_new0(LoomParallel, 1); // freed by its last ref
+    loop->kind = LOOM_WORK_PARALLEL;
+    loop->end = end;
+    loop->grain = grain;
+    loop->reduce = reduce;
+    loop->combine = combine;
+    loop->result = result;
+    loop->result_size = result_size;
+    loop->identity =
+      g_memdup2(result, result_size); // freed by loom_parallel_unref()
+    loop->user_data = user_data;
+    loom_parallel_run(loom, loop, begin);
 }
 
 void
 loom_disassemble(Loom* loom)
 {
-    g_thread_pool_free(loom->pool, FALSE, TRUE);
+    g_mutex_lock(&all_looms_mutex);
+    all_looms = g_slist_remove(all_looms, loom);
+    g_mutex_unlock(&all_looms_mutex);
+
+    // the scheduler runs what it was handed before it stops
+    loom_lock(loom);
+    loom->draining = TRUE;
+    loom_dispatch(loom);
+    loom_unlock(loom);
+    loom_sched_free(loom->sched);
+    for (guint i = 0; i < LOOM_RESOURCE_COUNT; ++i)
+        loom_heap_clear(&loom->resources[i].held_back);
+    // threads submitted by the last shuttles were never taken in
+    LoomActiveThread* submitted = g_atomic_pointer_get(&loom->submitted);
+    while (submitted) {
+        LoomActiveThread* next = submitted->next_submitted;
+        free_loom_active_thread(submitted);
+        submitted = next;
+    }
     g_hash_table_destroy(loom->running_threads);
     g_hash_table_destroy(loom->completed_tags);
-    // TODO: if quitting mid processing, the queued threads need to be freed.
-    // unimplemented.
-    while (!g_queue_is_empty(loom->queued_threads)) {
-        LoomThreadSpec* spec = g_queue_pop_head(loom->queued_threads);
-        free_loom_thread_spec(spec);
-    }
-    g_queue_free(loom->queued_threads);
-    // g_mutex_clear(&loom->lock);
+    // threads still waiting for dependencies never got a GTask
+    GHashTableIter iter;
+    gpointer waiting;
+    g_hash_table_iter_init(&iter, loom->waiting_threads);
+    while (g_hash_table_iter_next(&iter, &waiting, NULL))
+        free_loom_active_thread(waiting);
+    g_hash_table_destroy(loom->waiting_threads);
+    g_hash_table_destroy(loom->threads);
+    // the workers are gone, so nothing schedules another tick
+    if (g_atomic_int_get(&loom->progress_scheduled))
+        g_source_remove_by_user_data(loom);
+    g_hash_table_destroy(loom->dirty_groups);
+    g_hash_table_destroy(loom->stats);
+    g_free(loom->name);
+    g_rec_mutex_clear(&loom->lock);
+    g_free(loom);
 }
 
 Loom*
 loom_new(guint max_threads)
+{
+    return loom_new_full(max_threads, LOOM_WORK_STEALING);
+}
+
+Loom*
+loom_new_full(guint max_threads, gboolean work_stealing)
 {
     Loom* loom = g_new0(Loom, 1); // freed by loom_disassemble()
-    if (!loom->pool) {
+    if (!loom->sched) {
         if (max_threads <= 0)
             max_threads = MAX(2, g_get_num_processors() - 1);
         loom->max_threads = max_threads;
         g_print("Creating thread pool with %d threads\n", max_threads);
-        loom->pool = g_thread_pool_new((GFunc)loom_shuttle_wrapper,
-                                       NULL,
-                                       max_threads,
-                                       TRUE, // don't use global queue
-                                       NULL); // freed by loom_disassemble()
+        loom->sched = loom_sched_new(max_threads,
+                                     work_stealing,
+                                     loom_shuttle_wrapper,
+                                     NULL); // freed by loom_disassemble()
 
         loom->running_threads = g_hash_table_new_full(
-          g_str_hash, g_str_equal, g_free, NULL); // freed by loom_disassemble()
+          g_str_hash,
+          g_str_equal,
+          g_free,
+          (GDestroyNotify)g_ptr_array_unref); // freed by loom_disassemble()
+        loom->threads = g_hash_table_new(
+          g_int64_hash, g_int64_equal); // freed by loom_disassemble()
         loom->completed_tags = g_hash_table_new_full(
           g_str_hash, g_str_equal, g_free, NULL); // freed by loom_disassemble()
-        loom->queued_threads = g_queue_new();
+        loom->waiting_threads =
+          g_hash_table_new(NULL, NULL); // freed by loom_disassemble()
+        loom->dirty_groups = g_hash_table_new_full(
+          NULL,
+          NULL,
+          (GDestroyNotify)loom_group_unref,
+          NULL); // freed by loom_disassemble()
+
+        static const guint cap_percents[LOOM_RESOURCE_COUNT] = {
+            LOOM_CPU_CAP_PERCENT,
+            LOOM_IO_CAP_PERCENT,
+            LOOM_SUBPROCESS_CAP_PERCENT,
+            LOOM_ML_CAP_PERCENT,
+        };
+        static const guint weights[LOOM_RESOURCE_COUNT] = {
+            LOOM_CPU_WEIGHT,
+            LOOM_IO_WEIGHT,
+            LOOM_SUBPROCESS_WEIGHT,
+            LOOM_ML_WEIGHT,
+        };
+        for (guint i = 0; i < LOOM_RESOURCE_COUNT; ++i) {
+            LoomResourceClass* rclass = &loom->resources[i];
+            rclass->cap = CLAMP(max_threads * cap_percents[i] / 100,
+                               1,
+                               max_threads);
+            rclass->weight = MAX(weights[i], 1);
+            loom_heap_init(&rclass->held_back); // freed by loom_disassemble()
+        }
 
-        // g_mutex_init(&loom->lock);
+        loom->stats = g_hash_table_new_full(
+          g_str_hash,
+          g_str_equal,
+          g_free,
+          (GDestroyNotify)loom_tag_stats_free); // freed by loom_disassemble()
+        loom->name = g_strdup("loom"); // freed by loom_disassemble()
+
+        g_rec_mutex_init(&loom->lock);
+        g_mutex_lock(&all_looms_mutex);
+        all_looms = g_slist_append(all_looms, loom);
+        g_mutex_unlock(&all_looms_mutex);
     }
     // TODO: error
     return loom;
@@ -371,6 +1497,7 @@ loom_thread_spec_default(void)
     return (LoomThreadSpec){ .tag = "",
                              .dependencies = NULL,
                              .priority = 0,
+                             .resource = LOOM_RESOURCE_CPU,
                              .timeout_ms = 0,
                              .shuttle = NULL,
                              .shuttle_data = NULL,
@@ -378,13 +1505,20 @@ loom_thread_spec_default(void)
                              .knot_data = NULL,
                              .progress = NULL,
                              .task_data_destroy = NULL,
-                             .is_lifo = FALSE };
+                             .is_lifo = FALSE,
+                             .group = NULL,
+                             .after_group = NULL,
+                             .generation = 0 };
 }
 
 Loom*
 loom_get_default(void)
 {
-    if (!global_loom)
+    // shuttles queueing follow-up threads may be the first to ask
+    if (g_once_init_enter(&global_loom_initialized)) {
         global_loom = loom_new(0);
+        loom_set_name(global_loom, "default");
+        g_once_init_leave(&global_loom_initialized, 1);
+    }
     return global_loom;
 }
@@ -2,17 +2,65 @@
 #pragma once
 
 #include "gio/gio.h"
+#include "loom_heap.h"
+#include "loom_sched.h"
 #include <glib.h>
 
+/* Identifies one queued thread, unlike its tag. 0 is never used. */
+typedef guint64 LoomTaskId;
+
+/**
+ * A set of threads that can be waited for and snipped together, e.g. all
+ * threads of one import. A thread is a member from being queued until it is
+ * tied off, so a knot that queues follow-up threads into the group keeps it
+ * from emptying. All threads of a group have to be queued on the same Loom.
+ * Refcounted; threads can join it from any thread, the rest is main thread
+ * only.
+ */
+typedef struct _LoomGroup LoomGroup;
+
+/**
+ * What a thread mostly uses while it runs. Each class runs at most cap threads
+ * of a Loom at once, and classes that compete for a free thread share them by
+ * weight, see config.h, so e.g. an import's paperparser runs can't take every
+ * core from the rest.
+ */
+typedef enum
+{
+    LOOM_RESOURCE_CPU,        // computes, e.g. renders and JSON parsing
+    LOOM_RESOURCE_IO,         // reads or writes files
+    LOOM_RESOURCE_SUBPROCESS, // waits for a light child process
+    LOOM_RESOURCE_ML,         // waits for a model run on the CPU (paperparser)
+    LOOM_RESOURCE_COUNT
+} LoomResource;
+
+typedef struct
+{
+    guint cap;
+    guint weight;
+    guint running;      // handed to the scheduler, shuttle not returned yet
+    LoomHeap held_back; // woven threads waiting for a free thread
+} LoomResourceClass;
+
 typedef struct _Loom
 {
-    GThreadPool* pool;
+    gchar* name; // in telemetry, see loom_dump_stats()
+    LoomSched* sched;
     guint max_threads;
-    GHashTable* running_threads; // tag -> LoomActiveTask*
+    GHashTable* running_threads; // tag -> GPtrArray* of LoomActiveThread*
     GHashTable* completed_tags;  // tag -> GINT_TO_POINTER(TRUE)
-    GQueue* queued_threads;      // Queue of LoomTaskSpec*
-    // gboolean is_lifo;
-    GMutex lock;
+    GHashTable* waiting_threads; // set of threads waiting for dependencies
+    GHashTable* threads;         // id -> LoomActiveThread*, queued or running
+    gsize last_id;               // atomic
+    guint running_count;
+    gpointer submitted; // atomic, LoomActiveThread* stack, see loom.c
+    GHashTable* dirty_groups; // set of LoomGroup* with progress to deliver
+    gint progress_scheduled;  // atomic
+    LoomResourceClass resources[LOOM_RESOURCE_COUNT];
+    guint dispatched; // threads running in any class, at most max_threads
+    gboolean draining; // disassembling, caps no longer hold threads back
+    GHashTable* stats; // tag -> LoomTagStats*, see loom_stats.h
+    GRecMutex lock; // guards the rest, but sched and max_threads
 } Loom;
 
 typedef gpointer (*LoomShuttleFunc)(gpointer shuttle_data, GError** error);
@@ -20,25 +68,41 @@ typedef void (*LoomKnotFunc)(gpointer knot_data,
                              gpointer shuttle_data,
                              gpointer result,
                              GError* error);
-typedef void (*LoomProgressFunc)(gpointer progress_data,
-                                 gpointer worker_data,
-                                 gpointer callback_data,
-                                 GError* error);
+typedef void (*LoomProgressFunc)(gpointer knot_data,
+                                 gpointer shuttle_data,
+                                 gdouble fraction);
+typedef void (*LoomGroupProgressFunc)(LoomGroup* group,
+                                      gdouble fraction,
+                                      gpointer user_data);
+typedef void (*LoomRangeFunc)(gsize begin, gsize end, gpointer user_data);
+typedef void (*LoomReduceFunc)(gsize begin,
+                               gsize end,
+                               gpointer partial,
+                               gpointer user_data);
+typedef void (*LoomCombineFunc)(gpointer result,
+                                gconstpointer partial,
+                                gpointer user_data);
 
 typedef struct
 {
-    const gchar* tag;           // Unique task tag
-    const gchar** dependencies; // NULL-terminated array of tags
+    const gchar* tag;           // Task tag, shared by threads of a kind
+    const gchar** dependencies; // NULL-terminated array of tags, waits while
+                                // any thread with one of them runs
     gint priority; // Lower is higher (kek). GUI threads should be negative, IO
                    // threads non-negative
-    LoomShuttleFunc shuttle; // Runs the thread
+    LoomResource resource; // counts against this class's cap, CPU by default
+    LoomShuttleFunc shuttle; // Runs the thread, may be NULL
     LoomKnotFunc knot;       // Ties off the thread
-    LoomProgressFunc progress;
+    LoomProgressFunc progress; // Gets loom_report_progress(), coalesced
     gpointer shuttle_data; // Passed to shuttle/tie_off
     GDestroyNotify task_data_destroy;
-    guint timeout_ms;   // 0 = no timeout
+    guint timeout_ms;   // 0 = no timeout, else snipped once its shuttle has
+                        // run that long; time spent queued doesn't count
     gpointer knot_data; // Passed to tie_off/progress
     gboolean is_lifo;
+    LoomGroup* group;       // joins this group until tied off
+    LoomGroup* after_group; // waits until this group has no members
+    guint generation;       // see loom_snip_stale()
 } LoomThreadSpec;
 
 /**
@@ -49,7 +113,7 @@ loom_thread_spec_default(void);
 
 /**
  * Returns the default Loom object.
- * If it doesn't exist yet, it is created.
+ * If it doesn't exist yet, it is created. Thread-safe.
  */
 Loom*
 loom_get_default(void);
@@ -61,29 +125,206 @@ loom_get_default(void);
 Loom*
 loom_new(guint max_threads);
 
+/**
+ * Like loom_new(), but picks the scheduler backend instead of using
+ * LOOM_WORK_STEALING from config.h.
+ */
+Loom*
+loom_new_full(guint max_threads, gboolean work_stealing);
+
 /**
  * Runs the given thread_spec on the Loom object.
  *
  * If the thread_spec has dependencies, they are blocked until they are
- * completed. If the thread_spec has a timeout, it is cancelled after the
- * timeout. If the thread_spec has a progress callback, it is called with the
- * progress data. If the thread_spec has a knot callback, it is called when the
- * thread is tied off.
+ * completed. If the thread_spec has a timeout, it is snipped once its shuttle
+ * has run that long and its knot gets G_IO_ERROR_TIMED_OUT instead of
+ * G_IO_ERROR_CANCELLED. If the thread_spec has a progress callback, it is
+ * called with the progress data. If the thread_spec has a knot callback, it is
+ * called when the thread is tied off.
+ * A thread snipped before its shuttle starts never runs it; its knot gets
+ * G_IO_ERROR_CANCELLED. Once started, the shuttle has to check
+ * loom_get_cancellable() itself, and its result or error is passed on as is.
+ * Can be called from any thread, e.g. from a shuttle that queues the next
+ * stage of a pipeline, without blocking. Knots always run on the main thread.
  * @param loom Loom object
  * @param spec LoomThreadSpec struct
- * @param out_cancellable If non-NULL, a pointer to a GCancellable object will
- * be set to the thread's cancellable object.
+ * @param out_cancellable If non-NULL, set to a new reference to the thread's
+ * GCancellable. Cancelling it snips the thread, but one that is still waiting
+ * for dependencies is only dropped once they are done.
+ * Returns the thread's id, or 0 if spec is invalid.
  */
-void
+LoomTaskId
 loom_queue_thread(Loom* loom,
                   const LoomThreadSpec* spec,
                   GCancellable** out_cancellable);
+
+/**
+ * Returns the GCancellable of the thread whose shuttle the calling thread
+ * runs, or NULL outside of a shuttle. Long shuttles should check it between
+ * steps.
+ */
+GCancellable*
+loom_get_cancellable(void);
+
 /**
- * Cancels the thread with the given tag.
+ * Reports how far the calling shuttle has got, from 0 to 1. Lock-free and
+ * cheap enough to call in a loop: reports are coalesced, and the spec's
+ * progress callback and its group's, see loom_group_set_progress_func(), get
+ * the latest one on the main thread at most once every
+ * LOOM_PROGRESS_INTERVAL_MS.
+ */
+void
+loom_report_progress(gdouble fraction);
+
+/**
+ * Sets how many threads of the class may run at once (at least 1, at most
+ * max_threads) and its weight (at least 1) when classes compete for a free
+ * thread. Lowering the cap doesn't stop threads that already run.
+ */
+void
+loom_set_resource_limits(Loom* loom,
+                         LoomResource resource,
+                         guint cap,
+                         guint weight);
+
+/**
+ * Returns how many threads of the class run right now, and sets out_queued,
+ * if non-NULL, to how many are ready but held back by the cap or by busy
+ * workers. Threads waiting for dependencies aren't counted. Thread-safe.
+ */
+guint
+loom_get_occupancy(Loom* loom, LoomResource resource, guint* out_queued);
+
+/**
+ * Returns the class's name for logs, e.g. "io".
+ */
+const gchar*
+loom_resource_get_name(LoomResource resource);
+
+/**
+ * Names the Loom in its telemetry, see loom_dump_stats().
+ */
+void
+loom_set_name(Loom* loom, const gchar* name);
+
+/**
+ * Prints the telemetry of every Loom: how many threads run, are held back
+ * and wait for dependencies right now, and for every tag how many threads
+ * were queued, failed, cancelled or timed out, with histograms of how long
+ * they waited in the Loom (for dependencies, groups and resource caps),
+ * waited for a worker, ran their shuttle and ran their knot. Thread-safe.
+ */
+void
+loom_dump_stats(void);
+
+/**
+ * Writes the telemetry of every Loom to path as JSON, durations in
+ * microseconds. See loom_dump_stats().
+ */
+gboolean
+loom_export_stats(const gchar* path, GError** error);
+
+/**
+ * Cancels the threads with the given tag, waiting or running, see
+ * loom_snip_id(). Main thread only, like the other ways to snip threads.
  */
 void
 loom_snip(Loom* loom, const char* tag);
 
+/**
+ * Like loom_snip(), but only for threads queued with a generation older than
+ * the given one. Callers bump their generation when queued work goes stale,
+ * e.g. renders of a page at the previous zoom level.
+ */
+void
+loom_snip_stale(Loom* loom, const char* tag, guint generation);
+
+/**
+ * Cancels the thread with the given id. If it is still waiting for
+ * dependencies, it is dropped and its knot gets G_IO_ERROR_CANCELLED right
+ * away, otherwise its GCancellable is cancelled.
+ */
+void
+loom_snip_id(Loom* loom, LoomTaskId id);
+
+/**
+ * Returns TRUE if the thread with the given id is queued or running.
+ */
+gboolean
+loom_is_pending(Loom* loom, LoomTaskId id);
+
+LoomGroup*
+loom_group_new(const gchar* name);
+
+LoomGroup*
+loom_group_ref(LoomGroup* group);
+
+void
+loom_group_unref(LoomGroup* group);
+
+/**
+ * Returns the number of threads in the group that are queued or running.
+ */
+guint
+loom_group_get_size(LoomGroup* group);
+
+/**
+ * Has func called on the main thread whenever the group's progress changes,
+ * coalesced like loom_report_progress(). The progress is the share of threads
+ * that have joined the group and are tied off, counting the reports of
+ * running ones, so it can drop when threads join. It is 1 once the group is
+ * empty. Call before queueing threads in the group.
+ */
+void
+loom_group_set_progress_func(LoomGroup* group,
+                             LoomGroupProgressFunc func,
+                             gpointer user_data);
+
+/**
+ * Cancels every member of the group, see loom_snip_id().
+ */
+void
+loom_group_snip(LoomGroup* group);
+
+/**
+ * Calls func on slices [begin, end) of the given range on the Loom's workers
+ * and the calling thread, and returns once all slices are done. Slices start
+ * large and shrink towards the end of the range, so the threads finish
+ * together, but hold at least grain indices (1 if 0).
+ * The calling thread works through slices itself until none are left, so it
+ * never waits for a worker to become free: it can be called from a shuttle,
+ * and func can run a nested loop. Helpers count against the cap of
+ * LOOM_RESOURCE_CPU and the Loom's threads while they run, so with none
+ * free the calling thread runs the whole loop. In func,
+ * loom_get_cancellable() and loom_report_progress() refer to the calling
+ * thread's shuttle, if any.
+ */
+void
+loom_parallel_for(Loom* loom,
+                  gsize begin,
+                  gsize end,
+                  gsize grain,
+                  LoomRangeFunc func,
+                  gpointer user_data);
+
+/**
+ * Like loom_parallel_for(), but reduces the range into result, which holds
+ * result_size bytes and the identity on entry. Every thread that takes part
+ * starts a partial as a copy of the identity and folds its slices into it
+ * with reduce, then combine merges the partials into result in no particular
+ * order.
+ */
+void
+loom_parallel_reduce(Loom* loom,
+                     gsize begin,
+                     gsize end,
+                     gsize grain,
+                     LoomReduceFunc reduce,
+                     LoomCombineFunc combine,
+                     gpointer result,
+                     gsize result_size,
+                     gpointer user_data);
+
 /**
  * Disassembles the Loom object, freeing all memory.
  */
@@ -0,0 +1,260 @@
+/* loom_bench.c */
+#define G_LOG_DOMAIN "loom"
+
+#include "loom_bench.h"
+#include "loom.h"
+
+#include <glib.h>
+#include <stdlib.h>
+
+/* Parser runs mostly wait on the paperparser subprocess; page renders are
+ * short bursts of CPU queued a few at a time while the user scrolls */
+#define BENCH_PARSER_TASKS 64
+#define BENCH_PARSER_US 20000
+#define BENCH_RENDER_TASKS 2000
+#define BENCH_RENDER_US 500
+#define BENCH_RENDER_BURST 8
+#define BENCH_RENDER_GAP_US 8000
+
+/* loom_parallel_reduce() over cheap items (like scoring a paper's year) and
+ * over items of a millisecond (like hashing a PDF), and the cost of a call */
+#define BENCH_FINE_ITEMS (1 << 24)
+#define BENCH_COARSE_ITEMS 256
+#define BENCH_COARSE_US 1000
+#define BENCH_EMPTY_CALLS 10000
+
+typedef struct
+{
+    gint64 queued_at;
+    gint64 latency; // queueing to end of shuttle
+    gint64 work_us;
+    gboolean spin; // burn CPU instead of sleeping
+} BenchTask;
+
+static gpointer
+bench_shuttle(gpointer shuttle_data, GError** error)
+{
+    (void)error;
+    BenchTask* task = shuttle_data;
+    if (task->spin) {
+        gint64 until = g_get_monotonic_time() + task->work_us;
+        while (g_get_monotonic_time() < until)
+            ;
+    } else
+        g_usleep(task->work_us);
+    task->latency = g_get_monotonic_time() - task->queued_at;
+    return NULL;
+}
+
+static void
+bench_knot(gpointer knot_data,
+           gpointer shuttle_data,
+           gpointer result,
+           GError* error)
+{
+    (void)shuttle_data;
+    (void)result;
+    (void)error;
+    gint* remaining = knot_data;
+    (*remaining)--;
+}
+
+static void
+queue_bench_task(Loom* loom,
+                 BenchTask* task,
+                 const gchar* kind,
+                 guint index,
+                 gint priority,
+                 LoomResource resource,
+                 gint* remaining)
+{
+    gchar* tag = g_strdup_printf("bench-%s-%u", kind, index);
+    LoomThreadSpec spec = loom_thread_spec_default();
+    spec.tag = tag;
+    spec.priority = priority;
+    spec.resource = resource;
+    spec.is_lifo = priority < 0;
+    spec.shuttle = bench_shuttle;
+    spec.shuttle_data = task;
+    spec.knot = bench_knot;
+    spec.knot_data = remaining;
+    task->queued_at = g_get_monotonic_time();
+    (*remaining)++;
+    loom_queue_thread(loom, &spec, NULL);
+    g_free(tag);
+}
+
+static gint
+compare_latency(gconstpointer a, gconstpointer b)
+{
+    gint64 x = *(const gint64*)a;
+    gint64 y = *(const gint64*)b;
+    return (x > y) - (x < y);
+}
+
+static double
+percentile_ms(const gint64* sorted, guint count, double fraction)
+{
+    guint i = MIN(count - 1, (guint)(fraction * count));
+    return sorted[i] / 1000.0;
+}
+
+static void
+bench_backend(gboolean work_stealing)
+{
+    BenchTask* parsers = g_new0(BenchTask, BENCH_PARSER_TASKS);
+    BenchTask* renders = g_new0(BenchTask, BENCH_RENDER_TASKS);
+    Loom* loom = loom_new_full(0, work_stealing); // freed by loom_disassemble
+    gint remaining = 0;
+    guint peak_parsers = 0;
+    GTimer* timer = g_timer_new();
+
+    for (guint i = 0; i < BENCH_PARSER_TASKS; ++i) {
+        parsers[i].work_us = BENCH_PARSER_US;
+        queue_bench_task(
+          loom, &parsers[i], "parser", i, 4, LOOM_RESOURCE_ML, &remaining);
+    }
+    for (guint i = 0; i < BENCH_RENDER_TASKS; ++i) {
+        renders[i].work_us = BENCH_RENDER_US;
+        renders[i].spin = TRUE;
+        queue_bench_task(
+          loom, &renders[i], "render", i, -1, LOOM_RESOURCE_CPU, &remaining);
+        if ((i + 1) % BENCH_RENDER_BURST == 0) {
+            peak_parsers =
+              MAX(peak_parsers,
+                  loom_get_occupancy(loom, LOOM_RESOURCE_ML, NULL));
+            while (g_main_context_iteration(NULL, FALSE))
+                ;
+            g_usleep(BENCH_RENDER_GAP_US);
+        }
+    }
+    while (remaining > 0)
+        g_main_context_iteration(NULL, TRUE);
+    double seconds = g_timer_elapsed(timer, NULL);
+
+    gint64* latencies = g_new(gint64, BENCH_RENDER_TASKS);
+    for (guint i = 0; i < BENCH_RENDER_TASKS; ++i)
+        latencies[i] = renders[i].latency;
+    qsort(latencies, BENCH_RENDER_TASKS, sizeof(gint64), compare_latency);
+    g_print("%-14s %u threads: %.0f tasks/s, render latency p50 %.2f ms, "
+            "p99 %.2f ms, max %.2f ms, at most %u parsers at once\n",
+            work_stealing ? "work stealing" : "thread pool",
+            loom->max_threads,
+            (BENCH_PARSER_TASKS + BENCH_RENDER_TASKS) / seconds,
+            percentile_ms(latencies, BENCH_RENDER_TASKS, 0.5),
+            percentile_ms(latencies, BENCH_RENDER_TASKS, 0.99),
+            latencies[BENCH_RENDER_TASKS - 1] / 1000.0,
+            peak_parsers);
+
+    g_free(latencies);
+    g_timer_destroy(timer);
+    loom_disassemble(loom);
+    g_free(renders);
+    g_free(parsers);
+}
+
+static void
+bench_fine_reduce(gsize begin, gsize end, gpointer partial, gpointer user_data)
+{
+    (void)user_data;
+    guint64* sum = partial;
+    for (gsize i = begin; i < end; ++i)
+        *sum += (i * i) ^ (i >> 3);
+}
+
+static void
+bench_coarse_reduce(gsize begin,
+                    gsize end,
+                    gpointer partial,
+                    gpointer user_data)
+{
+    (void)user_data;
+    guint64* sum = partial;
+    for (gsize i = begin; i < end; ++i) {
+        gint64 until = g_get_monotonic_time() + BENCH_COARSE_US;
+        while (g_get_monotonic_time() < until)
+            ;
+        *sum += i;
+    }
+}
+
+static void
+bench_combine(gpointer result, gconstpointer partial, gpointer user_data)
+{
+    (void)user_data;
+    *(guint64*)result += *(const guint64*)partial;
+}
+
+static void
+bench_empty(gsize begin, gsize end, gpointer user_data)
+{
+    (void)begin;
+    (void)end;
+    (void)user_data;
+}
+
+/* Times reduce over items serially and with loom_parallel_reduce() */
+static void
+bench_reduce(Loom* loom, const gchar* what, guint items, LoomReduceFunc reduce)
+{
+    guint64 serial = 0;
+    GTimer* timer = g_timer_new();
+    reduce(0, items, &serial, NULL);
+    double serial_ms = g_timer_elapsed(timer, NULL) * 1000;
+
+    guint64 parallel = 0;
+    g_timer_start(timer);
+    loom_parallel_reduce(loom,
+                         0,
+                         items,
+                         0,
+                         reduce,
+                         bench_combine,
+                         &parallel,
+                         sizeof(parallel),
+                         NULL);
+    double parallel_ms = g_timer_elapsed(timer, NULL) * 1000;
+    g_timer_destroy(timer);
+
+    g_print("%-14s %u items: serial %.2f ms, parallel %.2f ms (%.2fx)%s\n",
+            what,
+            items,
+            serial_ms,
+            parallel_ms,
+            serial_ms / parallel_ms,
+            serial == parallel ? "" : ", WRONG RESULT");
+}
+
+static void
+bench_parallel(void)
+{
+    Loom* loom = loom_new(0); // freed by loom_disassemble
+    bench_reduce(loom, "fine-grained", BENCH_FINE_ITEMS, bench_fine_reduce);
+    bench_reduce(
+      loom, "coarse-grained", BENCH_COARSE_ITEMS, bench_coarse_reduce);
+
+    GTimer* timer = g_timer_new();
+    for (guint i = 0; i < BENCH_EMPTY_CALLS; ++i)
+        loom_parallel_for(loom, 0, loom->max_threads + 1, 1, bench_empty, NULL);
+    g_print("%-14s %.2f us per loop of %u empty items\n",
+            "call overhead",
+            g_timer_elapsed(timer, NULL) * 1e6 / BENCH_EMPTY_CALLS,
+            loom->max_threads + 1);
+    g_timer_destroy(timer);
+    loom_disassemble(loom);
+}
+
+void
+loom_bench_run(void)
+{
+    g_print("Loom: %d parser tasks of %d ms, %d render tasks of %d us "
+            "in bursts of %d\n",
+            BENCH_PARSER_TASKS,
+            BENCH_PARSER_US / 1000,
+            BENCH_RENDER_TASKS,
+            BENCH_RENDER_US,
+            BENCH_RENDER_BURST);
+    bench_backend(FALSE);
+    bench_backend(TRUE);
+    bench_parallel();
+}
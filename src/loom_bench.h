@@ -0,0 +1,16 @@
+/* loom_bench.h */
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * Runs a mixed load of render-like and parser-like tasks on each Loom backend
+ * and prints task throughput and render latency percentiles. For
+ * --bench-loom; drives the default main context itself.
+ */
+void
+loom_bench_run(void);
+
+G_END_DECLS
@@ -0,0 +1,98 @@
+/* loom_deque.c */
+#define G_LOG_DOMAIN "loom"
+
+#include "loom_deque.h"
+
+#include <glib.h>
+
+static LoomDequeRing*
+ring_new(guint size)
+{
+    LoomDequeRing* ring =
+      g_malloc(sizeof(LoomDequeRing) +
+               size * sizeof(gpointer)); // freed by loom_deque_clear()
+    ring->mask = size - 1;
+    return ring;
+}
+
+void
+loom_deque_init(LoomDeque* deque)
+{
+    deque->top = 0;
+    deque->bottom = 0;
+    deque->ring = ring_new(LOOM_DEQUE_INITIAL_SIZE);
+    deque->retired = NULL;
+}
+
+void
+loom_deque_clear(LoomDeque* deque)
+{
+    g_free(deque->ring);
+    g_slist_free_full(deque->retired, g_free);
+    deque->ring = NULL;
+    deque->retired = NULL;
+}
+
+static LoomDequeRing*
+grow(LoomDeque* deque, LoomDequeRing* ring, guint top, guint bottom)
+{
+    LoomDequeRing* bigger = ring_new((ring->mask + 1) * 2);
+    for (guint i = top; i != bottom; ++i)
+        bigger->items[i & bigger->mask] = ring->items[i & ring->mask];
+    deque->retired = g_slist_prepend(deque->retired, ring);
+    g_atomic_pointer_set(&deque->ring, bigger);
+    return bigger;
+}
+
+void
+loom_deque_push(LoomDeque* deque, gpointer task)
+{
+    guint bottom = (guint)g_atomic_int_get(&deque->bottom);
+    guint top = (guint)g_atomic_int_get(&deque->top);
+    LoomDequeRing* ring = deque->ring;
+    if (bottom - top > ring->mask)
+        ring = grow(deque, ring, top, bottom);
+    ring->items[bottom & ring->mask] = task;
+    g_atomic_int_set(&deque->bottom, (gint)(bottom + 1));
+}
+
+gpointer
+loom_deque_pop(LoomDeque* deque)
+{
+    // claim the bottom slot before looking at top, so a thief that takes the
+    // same slot concurrently is caught by the compare-and-exchange below
+    guint bottom = (guint)g_atomic_int_add(&deque->bottom, -1) - 1;
+    guint top = (guint)g_atomic_int_get(&deque->top);
+    gint size = (gint)(bottom - top);
+    if (size < 0) {
+        g_atomic_int_set(&deque->bottom, (gint)(bottom + 1));
+        return NULL;
+    }
+
+    gpointer task = deque->ring->items[bottom & deque->ring->mask];
+    if (size > 0)
+        return task;
+
+    // last task, race the thieves for it
+    if (!g_atomic_int_compare_and_exchange(
+          &deque->top, (gint)top, (gint)(top + 1)))
+        task = NULL;
+    g_atomic_int_set(&deque->bottom, (gint)(bottom + 1));
+    return task;
+}
+
+gpointer
+loom_deque_steal(LoomDeque* deque)
+{
+    guint top = (guint)g_atomic_int_get(&deque->top);
+    guint bottom = (guint)g_atomic_int_get(&deque->bottom);
+    if ((gint)(bottom - top) <= 0)
+        return NULL;
+
+    LoomDequeRing* ring = g_atomic_pointer_get(&deque->ring);
+    gpointer task = ring->items[top & ring->mask];
+    if (!g_atomic_int_compare_and_exchange(
+          &deque->top, (gint)top, (gint)(top + 1)))
+        return NULL;
+    return task;
+}
@@ -0,0 +1,59 @@
+/* loom_deque.h */
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define LOOM_DEQUE_INITIAL_SIZE 64
+
+/* Ring of a Chase-Lev deque, indexed by position & mask */
+typedef struct
+{
+    guint mask;
+    gpointer items[];
+} LoomDequeRing;
+
+/**
+ * Chase-Lev deque with a single owner: the owning thread pushes and pops at
+ * the bottom, any thread steals from the top. Positions only grow and may
+ * wrap around, so they are compared by their difference.
+ */
+typedef struct
+{
+    gint top;            // atomic, next position to steal
+    gint bottom;         // atomic, next position to push
+    LoomDequeRing* ring; // atomic, replaced by the owner when full
+    GSList* retired;     // outgrown rings, thieves may still read them
+} LoomDeque;
+
+void
+loom_deque_init(LoomDeque* deque);
+
+/**
+ * Frees the deque's storage, not the tasks left in it. No thread may use
+ * @deque any more.
+ */
+void
+loom_deque_clear(LoomDeque* deque);
+
+/**
+ * Pushes @task at the bottom, growing the ring if it is full. Owner only.
+ */
+void
+loom_deque_push(LoomDeque* deque, gpointer task);
+
+/**
+ * Takes the newest task, or returns NULL if @deque is empty. Owner only.
+ */
+gpointer
+loom_deque_pop(LoomDeque* deque);
+
+/**
+ * Takes the oldest task. Returns NULL when @deque is empty or when another
+ * thread won the race for it. Any thread.
+ */
+gpointer
+loom_deque_steal(LoomDeque* deque);
+
+G_END_DECLS
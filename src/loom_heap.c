@@ -0,0 +1,109 @@
+/* loom_heap.c */
+#define G_LOG_DOMAIN "loom"
+
+#include "loom_heap.h"
+
+#include <glib.h>
+
+static inline gboolean
+entry_before(const LoomHeapEntry* entry, const LoomHeapEntry* other)
+{
+    if (entry->priority != other->priority)
+        return entry->priority < other->priority;
+    return entry->rank < other->rank;
+}
+
+static void
+sift_up(LoomHeapEntry* entries, guint i)
+{
+    LoomHeapEntry entry = entries[i];
+    while (i > 0) {
+        guint parent = (i - 1) / 2;
+        if (!entry_before(&entry, &entries[parent]))
+            break;
+        entries[i] = entries[parent];
+        i = parent;
+    }
+    entries[i] = entry;
+}
+
+static void
+sift_down(LoomHeapEntry* entries, guint count, guint i)
+{
+    LoomHeapEntry entry = entries[i];
+    for (;;) {
+        guint child = 2 * i + 1;
+        if (child >= count)
+            break;
+        if (child + 1 < count &&
+            entry_before(&entries[child + 1], &entries[child]))
+            child++;
+        if (!entry_before(&entries[child], &entry))
+            break;
+        entries[i] = entries[child];
+        i = child;
+    }
+    entries[i] = entry;
+}
+
+void
+loom_heap_init(LoomHeap* heap)
+{
+    heap->entries = g_array_new(
+      FALSE, FALSE, sizeof(LoomHeapEntry)); // freed by loom_heap_clear()
+}
+
+void
+loom_heap_clear(LoomHeap* heap)
+{
+    if (heap->entries)
+        g_array_free(heap->entries, TRUE);
+    heap->entries = NULL;
+}
+
+void
+loom_heap_push(LoomHeap* heap,
+               gpointer data,
+               gint priority,
+               gint64 order,
+               gboolean lifo)
+{
+    LoomHeapEntry entry = { priority, lifo ? -order : order, data };
+    g_array_append_val(heap->entries, entry);
+    sift_up((LoomHeapEntry*)heap->entries->data, heap->entries->len - 1);
+}
+
+gpointer
+loom_heap_pop(LoomHeap* heap)
+{
+    guint count = heap->entries->len;
+    if (count == 0)
+        return NULL;
+    LoomHeapEntry* entries = (LoomHeapEntry*)heap->entries->data;
+    gpointer data = entries[0].data;
+    entries[0] = entries[count - 1];
+    g_array_set_size(heap->entries, count - 1);
+    if (count > 2)
+        sift_down(entries, count - 1, 0);
+    return data;
+}
+
+const LoomHeapEntry*
+loom_heap_peek(const LoomHeap* heap)
+{
+    if (heap->entries->len == 0)
+        return NULL;
+    return &g_array_index(heap->entries, LoomHeapEntry, 0);
+}
+
+guint
+loom_heap_get_size(const LoomHeap* heap)
+{
+    return heap->entries->len;
+}
+
+gboolean
+loom_heap_entry_before(const LoomHeapEntry* entry, const LoomHeapEntry* other)
+{
+    return entry_before(entry, other);
+}
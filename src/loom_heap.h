@@ -0,0 +1,67 @@
+/* loom_heap.h */
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * Binary min-heap of tasks in Loom order: lower priority values first, then
+ * oldest first, except that a LIFO entry goes before everything pushed before
+ * it at its priority. Not thread-safe.
+ */
+typedef struct
+{
+    gint priority;
+    gint64 rank; // order, negated for LIFO entries
+    gpointer data;
+} LoomHeapEntry;
+
+typedef struct
+{
+    GArray* entries; // LoomHeapEntry
+} LoomHeap;
+
+void
+loom_heap_init(LoomHeap* heap);
+
+/**
+ * Frees the heap's storage, not the entries' data.
+ */
+void
+loom_heap_clear(LoomHeap* heap);
+
+/**
+ * Pushes @data. @order tells entries of equal priority apart and must grow
+ * with every task queued, so a task keeps its place when it is pushed again.
+ */
+void
+loom_heap_push(LoomHeap* heap,
+               gpointer data,
+               gint priority,
+               gint64 order,
+               gboolean lifo);
+
+/**
+ * Removes and returns the first entry's data, or NULL if @heap is empty.
+ */
+gpointer
+loom_heap_pop(LoomHeap* heap);
+
+/**
+ * Returns the first entry, or NULL if @heap is empty.
+ */
+const LoomHeapEntry*
+loom_heap_peek(const LoomHeap* heap);
+
+guint
+loom_heap_get_size(const LoomHeap* heap);
+
+/**
+ * Returns TRUE if @entry goes before @other, e.g. to merge the first entries
+ * of heaps that were pushed with orders from the same sequence.
+ */
+gboolean
+loom_heap_entry_before(const LoomHeapEntry* entry, const LoomHeapEntry* other);
+
+G_END_DECLS
@@ -0,0 +1,307 @@
+/* loom_sched.c */
+#define G_LOG_DOMAIN "loom"
+
+#include "loom_sched.h"
+#include "loom_deque.h"
+#include "loom_heap.h"
+#include "trace.h"
+
+#include <glib.h>
+
+typedef struct
+{
+    LoomSched* sched;
+    gint index;
+    GThread* thread;
+    GRand* rand; // picks victims, only used by the worker
+    LoomDeque deques[LOOM_SCHED_LANES];
+} LoomWorker;
+
+/* Task queued in the GThreadPool backend */
+typedef struct
+{
+    gpointer task;
+    gint priority;
+    guint sequence;
+    gboolean lifo;
+} PoolItem;
+
+struct _LoomSched
+{
+    LoomSchedFunc func;
+    gpointer user_data;
+    guint n_workers;
+
+    GThreadPool* pool; // without work stealing
+    gint sequence;     // atomic, push order of pool items
+
+    LoomWorker* workers;
+    GMutex lock;                           // guards injected and parking
+    GCond wake;                            // signalled when work arrives
+    LoomHeap injected[LOOM_SCHED_LANES];   // pushed from outside the workers
+    gint injected_count[LOOM_SCHED_LANES]; // atomic, peeked without the lock
+    gint64 injected_order;                 // under lock
+    gint pending;                          // atomic, pushed but not taken
+    gint sleeping;                         // atomic, parked workers
+    gboolean stopping;
+};
+
+/* Worker running on this thread, if any */
+static GPrivate current_worker = G_PRIVATE_INIT(NULL);
+
+/* Work stealing backend */
+
+static gpointer
+take_injected(LoomSched* sched, guint lane)
+{
+    if (g_atomic_int_get(&sched->injected_count[lane]) == 0)
+        return NULL;
+    g_mutex_lock(&sched->lock);
+    gpointer task = loom_heap_pop(&sched->injected[lane]);
+    if (task)
+        g_atomic_int_add(&sched->injected_count[lane], -1);
+    g_mutex_unlock(&sched->lock);
+    return task;
+}
+
+static gpointer
+steal_task(LoomSched* sched, LoomWorker* thief, guint lane)
+{
+    if (sched->n_workers < 2)
+        return NULL;
+    guint start = (guint)g_rand_int_range(thief->rand, 0, sched->n_workers);
+    for (guint i = 0; i < sched->n_workers; ++i) {
+        LoomWorker* victim = &sched->workers[(start + i) % sched->n_workers];
+        if (victim == thief)
+            continue;
+        gpointer task = loom_deque_steal(&victim->deques[lane]);
+        if (task)
+            return task;
+    }
+    return NULL;
+}
+
+/* Most urgent lane first: own deque, then the shared queue, then steal */
+static gpointer
+find_task(LoomSched* sched, LoomWorker* worker)
+{
+    for (guint lane = 0; lane < LOOM_SCHED_LANES; ++lane) {
+        gpointer task = loom_deque_pop(&worker->deques[lane]);
+        if (!task)
+            task = take_injected(sched, lane);
+        if (!task)
+            task = steal_task(sched, worker, lane);
+        if (task)
+            return task;
+    }
+    return NULL;
+}
+
+/* Wakes a parked worker. pending is raised before sleeping is read, and
+ * parking workers raise sleeping before they read pending, so one of the two
+ * sides always sees the other. */
+static void
+wake_worker(LoomSched* sched)
+{
+    g_atomic_int_inc(&sched->pending);
+    if (g_atomic_int_get(&sched->sleeping) == 0)
+        return;
+    g_mutex_lock(&sched->lock);
+    g_cond_signal(&sched->wake);
+    g_mutex_unlock(&sched->lock);
+}
+
+static gpointer
+worker_main(gpointer data)
+{
+    LoomWorker* worker = data;
+    LoomSched* sched = worker->sched;
+    g_private_set(&current_worker, worker);
+    TRACE_SET_THREAD_NAME("loom worker");
+
+    for (;;) {
+        gpointer task = find_task(sched, worker);
+        if (task) {
+            g_atomic_int_add(&sched->pending, -1);
+            sched->func(task, sched->user_data);
+            continue;
+        }
+
+        // pending may be > 0 for a moment while a task is being stolen, then
+        // we just look again
+        g_mutex_lock(&sched->lock);
+        g_atomic_int_inc(&sched->sleeping);
+        while (g_atomic_int_get(&sched->pending) == 0 && !sched->stopping)
+            g_cond_wait(&sched->wake, &sched->lock);
+        g_atomic_int_add(&sched->sleeping, -1);
+        gboolean done =
+          sched->stopping && g_atomic_int_get(&sched->pending) == 0;
+        g_mutex_unlock(&sched->lock);
+        if (done)
+            break;
+    }
+    return NULL;
+}
+
+/* GThreadPool backend */
+
+static gint
+compare_pool_items(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    (void)user_data;
+    const PoolItem* item = a;
+    const PoolItem* other = b;
+    if (item->priority != other->priority)
+        return item->priority < other->priority ? -1 : 1;
+    // same priority: oldest first, unless the newer one is LIFO
+    const PoolItem* newer =
+      (gint)(item->sequence - other->sequence) > 0 ? item : other;
+    if (newer->lifo)
+        return newer == item ? -1 : 1;
+    return newer == item ? 1 : -1;
+}
+
+static void
+pool_run(gpointer data, gpointer user_data)
+{
+    PoolItem* item = data;
+    LoomSched* sched = user_data;
+    sched->func(item->task, sched->user_data);
+    g_free(item);
+}
+
+/* Public API */
+
+guint
+loom_sched_get_lane(gint priority)
+{
+    if (priority < 0)
+        return 0;
+    if (priority < LOOM_SCHED_BACKGROUND_PRIORITY)
+        return 1;
+    return 2;
+}
+
+LoomSched*
+loom_sched_new(guint n_workers,
+               gboolean work_stealing,
+               LoomSchedFunc func,
+               gpointer user_data)
+{
+    LoomSched* sched = g_new0(LoomSched, 1); // freed by loom_sched_free()
+    sched->func = func;
+    sched->user_data = user_data;
+    sched->n_workers = MAX(1, n_workers);
+
+    if (!work_stealing) {
+        sched->pool = g_thread_pool_new(pool_run,
+                                        sched,
+                                        sched->n_workers,
+                                        TRUE, // don't use global queue
+                                        NULL); // freed by loom_sched_free()
+        g_thread_pool_set_sort_function(sched->pool, compare_pool_items, NULL);
+        return sched;
+    }
+
+    g_mutex_init(&sched->lock);
+    g_cond_init(&sched->wake);
+    for (guint lane = 0; lane < LOOM_SCHED_LANES; ++lane)
+        loom_heap_init(&sched->injected[lane]);
+    sched->workers = g_new0(LoomWorker,
+                            sched->n_workers); // freed by loom_sched_free()
+    for (guint i = 0; i < sched->n_workers; ++i) {
+        LoomWorker* worker = &sched->workers[i];
+        worker->sched = sched;
+        worker->index = (gint)i;
+        worker->rand = g_rand_new(); // freed by loom_sched_free()
+        for (guint lane = 0; lane < LOOM_SCHED_LANES; ++lane)
+            loom_deque_init(&worker->deques[lane]);
+    }
+    // start only once every deque exists, workers steal from each other
+    for (guint i = 0; i < sched->n_workers; ++i) {
+        gchar* name = g_strdup_printf("loom-worker-%u", i);
+        sched->workers[i].thread = g_thread_new(
+          name, worker_main, &sched->workers[i]); // joined by loom_sched_free()
+        g_free(name);
+    }
+    g_debug("Started %u work-stealing workers", sched->n_workers);
+    return sched;
+}
+
+void
+loom_sched_free(LoomSched* sched)
+{
+    if (!sched)
+        return;
+    if (sched->pool) {
+        g_thread_pool_free(sched->pool, FALSE, TRUE);
+        g_free(sched);
+        return;
+    }
+
+    g_mutex_lock(&sched->lock);
+    sched->stopping = TRUE;
+    g_cond_broadcast(&sched->wake);
+    g_mutex_unlock(&sched->lock);
+    for (guint i = 0; i < sched->n_workers; ++i)
+        g_thread_join(sched->workers[i].thread);
+
+    for (guint i = 0; i < sched->n_workers; ++i) {
+        LoomWorker* worker = &sched->workers[i];
+        for (guint lane = 0; lane < LOOM_SCHED_LANES; ++lane)
+            loom_deque_clear(&worker->deques[lane]);
+        g_rand_free(worker->rand);
+    }
+    g_free(sched->workers);
+    for (guint lane = 0; lane < LOOM_SCHED_LANES; ++lane)
+        loom_heap_clear(&sched->injected[lane]);
+    g_cond_clear(&sched->wake);
+    g_mutex_clear(&sched->lock);
+    g_free(sched);
+}
+
+void
+loom_sched_push(LoomSched* sched, gpointer task, gint priority, gboolean lifo)
+{
+    if (sched->pool) {
+        PoolItem* item = g_new(PoolItem, 1); // freed by pool_run
+        item->task = task;
+        item->priority = priority;
+        item->sequence = (guint)g_atomic_int_add(&sched->sequence, 1);
+        item->lifo = lifo;
+        g_thread_pool_push(sched->pool, item, NULL);
+        return;
+    }
+
+    LoomWorker* worker = g_private_get(&current_worker);
+    if (worker && worker->sched == sched) {
+        // runs next on this worker, which likely has its data in cache
+        loom_deque_push(&worker->deques[loom_sched_get_lane(priority)], task);
+        wake_worker(sched);
+    } else
+        loom_sched_inject(sched, task, priority, lifo);
+}
+
+void
+loom_sched_inject(LoomSched* sched, gpointer task, gint priority, gboolean lifo)
+{
+    if (sched->pool) {
+        loom_sched_push(sched, task, priority, lifo);
+        return;
+    }
+
+    guint lane = loom_sched_get_lane(priority);
+    g_mutex_lock(&sched->lock);
+    loom_heap_push(
+      &sched->injected[lane], task, priority, sched->injected_order++, lifo);
+    g_atomic_int_inc(&sched->injected_count[lane]);
+    g_mutex_unlock(&sched->lock);
+    wake_worker(sched);
+}
+
+gint
+loom_sched_get_worker_index(LoomSched* sched)
+{
+    LoomWorker* worker = g_private_get(&current_worker);
+    return worker && worker->sched == sched ? worker->index : -1;
+}
@@ -0,0 +1,72 @@
+/* loom_sched.h */
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * The worker threads behind a Loom. Tasks are pushed with their Loom priority
+ * and run lane by lane: interactive (priority < 0) before normal before
+ * background (priority >= LOOM_SCHED_BACKGROUND_PRIORITY), so a render never
+ * waits behind a queue of parser runs.
+ * With work stealing, every worker owns a Chase-Lev deque per lane that tasks
+ * pushed from the worker go to, and idle workers steal from random victims.
+ * Tasks pushed from other threads go through a shared priority heap per lane.
+ * Otherwise a GThreadPool sorted by priority runs the tasks.
+ */
+typedef struct _LoomSched LoomSched;
+
+typedef void (*LoomSchedFunc)(gpointer task, gpointer user_data);
+
+#define LOOM_SCHED_LANES 3
+#define LOOM_SCHED_BACKGROUND_PRIORITY 4
+
+/**
+ * Starts @n_workers threads that call @func on every pushed task.
+ */
+LoomSched*
+loom_sched_new(guint n_workers,
+               gboolean work_stealing,
+               LoomSchedFunc func,
+               gpointer user_data);
+
+/**
+ * Runs the queued tasks, stops the workers and frees @sched. Must not be
+ * called from a worker.
+ */
+void
+loom_sched_free(LoomSched* sched);
+
+/**
+ * Queues @task. With @lifo, it runs before older tasks of its lane.
+ * Thread-safe.
+ */
+void
+loom_sched_push(LoomSched* sched, gpointer task, gint priority, gboolean lifo);
+
+/**
+ * Like loom_sched_push(), but always queues @task in its lane's shared heap,
+ * so tasks pushed from a worker keep their order instead of running from the
+ * worker's own deque newest first. Thread-safe.
+ */
+void
+loom_sched_inject(LoomSched* sched,
+                  gpointer task,
+                  gint priority,
+                  gboolean lifo);
+
+/**
+ * Returns the lane tasks of @priority run in, 0 being the most urgent.
+ */
+guint
+loom_sched_get_lane(gint priority);
+
+/**
+ * Returns the index of the calling thread among @sched's workers, or -1 if it
+ * isn't one of them.
+ */
+gint
+loom_sched_get_worker_index(LoomSched* sched);
+
+G_END_DECLS
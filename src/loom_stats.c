@@ -0,0 +1,211 @@
+/* loom_stats.c */
+#define G_LOG_DOMAIN "loom"
+
+#include "loom_stats.h"
+
+#include <glib.h>
+
+#define SUB_COUNT (1u << LOOM_HISTOGRAM_SUB_BITS)
+
+/* Values below 2 * SUB_COUNT get a bucket each. Above, the top
+ * LOOM_HISTOGRAM_SUB_BITS + 1 bits of a value pick its bucket. */
+static guint
+bucket_of(guint64 value)
+{
+    guint bits = g_bit_storage(value);
+    if (bits <= LOOM_HISTOGRAM_SUB_BITS + 1)
+        return (guint)value;
+    guint shift = bits - LOOM_HISTOGRAM_SUB_BITS - 1;
+    return (shift + 1) * SUB_COUNT + (guint)(value >> shift) - SUB_COUNT;
+}
+
+static guint64
+bucket_lowest(guint bucket)
+{
+    if (bucket < 2 * SUB_COUNT)
+        return bucket;
+    guint shift = bucket / SUB_COUNT - 1;
+    return (guint64)(bucket % SUB_COUNT + SUB_COUNT) << shift;
+}
+
+static guint64
+bucket_highest(guint bucket)
+{
+    if (bucket < 2 * SUB_COUNT)
+        return bucket;
+    guint shift = bucket / SUB_COUNT - 1;
+    return bucket_lowest(bucket) + ((guint64)1 << shift) - 1;
+}
+
+void
+loom_histogram_init(LoomHistogram* histogram)
+{
+    histogram->count = 0;
+    histogram->sum = 0;
+    histogram->min = G_MAXUINT64;
+    histogram->max = 0;
+    histogram->buckets = g_array_new(FALSE, TRUE, sizeof(guint32));
+}
+
+void
+loom_histogram_clear(LoomHistogram* histogram)
+{
+    g_array_free(histogram->buckets, TRUE);
+    histogram->buckets = NULL;
+}
+
+void
+loom_histogram_record(LoomHistogram* histogram, guint64 value)
+{
+    guint bucket = bucket_of(value);
+    if (bucket >= histogram->buckets->len)
+        g_array_set_size(histogram->buckets, bucket + 1); // zero-filled
+    g_array_index(histogram->buckets, guint32, bucket)++;
+    histogram->count++;
+    histogram->sum += value;
+    histogram->min = MIN(histogram->min, value);
+    histogram->max = MAX(histogram->max, value);
+}
+
+guint64
+loom_histogram_get_percentile(const LoomHistogram* histogram,
+                              gdouble fraction)
+{
+    if (histogram->count == 0)
+        return 0;
+    guint64 rank = (guint64)(CLAMP(fraction, 0.0, 1.0) * histogram->count);
+    rank = CLAMP(rank, 1, histogram->count);
+    guint64 seen = 0;
+    for (guint i = 0; i < histogram->buckets->len; ++i) {
+        seen += g_array_index(histogram->buckets, guint32, i);
+        if (seen >= rank)
+            return MIN(bucket_highest(i), histogram->max);
+    }
+    return histogram->max;
+}
+
+LoomTagStats*
+loom_tag_stats_new(void)
+{
+    LoomTagStats* stats = g_new0(LoomTagStats, 1); // freed by caller
+    loom_histogram_init(&stats->wait);
+    loom_histogram_init(&stats->sched);
+    loom_histogram_init(&stats->run);
+    loom_histogram_init(&stats->knot);
+    return stats;
+}
+
+void
+loom_tag_stats_free(LoomTagStats* stats)
+{
+    loom_histogram_clear(&stats->wait);
+    loom_histogram_clear(&stats->sched);
+    loom_histogram_clear(&stats->run);
+    loom_histogram_clear(&stats->knot);
+    g_free(stats);
+}
+
+static void
+format_histogram(const LoomHistogram* histogram,
+                 const gchar* what,
+                 GString* out)
+{
+    if (histogram->count == 0)
+        return;
+    g_string_append_printf(
+      out,
+      "    %-5s n %" G_GUINT64_FORMAT ", mean %.2f ms, p50 %.2f ms, "
+      "p90 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+      what,
+      histogram->count,
+      (gdouble)histogram->sum / histogram->count / 1000,
+      loom_histogram_get_percentile(histogram, 0.5) / 1000.0,
+      loom_histogram_get_percentile(histogram, 0.9) / 1000.0,
+      loom_histogram_get_percentile(histogram, 0.99) / 1000.0,
+      histogram->max / 1000.0);
+}
+
+void
+loom_tag_stats_format(const LoomTagStats* stats,
+                      const gchar* tag,
+                      GString* out)
+{
+    g_string_append_printf(out,
+                           "  '%s': %" G_GUINT64_FORMAT
+                           " queued, %" G_GUINT64_FORMAT
+                           " failed, %" G_GUINT64_FORMAT
+                           " cancelled, %" G_GUINT64_FORMAT " timed out\n",
+                           tag,
+                           stats->queued,
+                           stats->failed,
+                           stats->cancelled,
+                           stats->timed_out);
+    format_histogram(&stats->wait, "wait", out);
+    format_histogram(&stats->sched, "sched", out);
+    format_histogram(&stats->run, "run", out);
+    format_histogram(&stats->knot, "knot", out);
+}
+
+static void
+write_histogram(const LoomHistogram* histogram,
+                const gchar* key,
+                JsonWriter* writer)
+{
+    static const struct
+    {
+        const gchar* key;
+        gdouble fraction;
+    } percentiles[] = {
+        { "p50", 0.5 }, { "p90", 0.9 }, { "p99", 0.99 }, { "p999", 0.999 }
+    };
+
+    json_writer_key(writer, key);
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "count");
+    json_writer_int(writer, (gint64)histogram->count);
+    json_writer_key(writer, "sum");
+    json_writer_int(writer, (gint64)histogram->sum);
+    json_writer_key(writer, "min");
+    json_writer_int(writer, histogram->count ? (gint64)histogram->min : 0);
+    json_writer_key(writer, "max");
+    json_writer_int(writer, (gint64)histogram->max);
+    for (guint i = 0; i < G_N_ELEMENTS(percentiles); ++i) {
+        json_writer_key(writer, percentiles[i].key);
+        json_writer_int(writer,
+                        (gint64)loom_histogram_get_percentile(
+                          histogram, percentiles[i].fraction));
+    }
+    json_writer_key(writer, "buckets");
+    json_writer_begin_array(writer);
+    for (guint i = 0; i < histogram->buckets->len; ++i) {
+        guint32 count = g_array_index(histogram->buckets, guint32, i);
+        if (count == 0)
+            continue;
+        json_writer_begin_array(writer);
+        json_writer_int(writer, (gint64)bucket_lowest(i));
+        json_writer_int(writer, count);
+        json_writer_end_array(writer);
+    }
+    json_writer_end_array(writer);
+    json_writer_end_object(writer);
+}
+
+void
+loom_tag_stats_write_json(const LoomTagStats* stats, JsonWriter* writer)
+{
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "queued");
+    json_writer_int(writer, (gint64)stats->queued);
+    json_writer_key(writer, "failed");
+    json_writer_int(writer, (gint64)stats->failed);
+    json_writer_key(writer, "cancelled");
+    json_writer_int(writer, (gint64)stats->cancelled);
+    json_writer_key(writer, "timed_out");
+    json_writer_int(writer, (gint64)stats->timed_out);
+    // durations in microseconds
+    write_histogram(&stats->wait, "wait_us", writer);
+    write_histogram(&stats->sched, "sched_us", writer);
+    write_histogram(&stats->run, "run_us", writer);
+    write_histogram(&stats->knot, "knot_us", writer);
+    json_writer_end_object(writer);
+}
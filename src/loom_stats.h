@@ -0,0 +1,83 @@
+/* loom_stats.h */
+#pragma once
+
+#include "json_stream.h"
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* A histogram keeps exact counts below 2 << LOOM_HISTOGRAM_SUB_BITS and splits
+ * every power of two above that into 1 << LOOM_HISTOGRAM_SUB_BITS buckets, so
+ * any recorded value is known to within about 3% */
+#define LOOM_HISTOGRAM_SUB_BITS 5
+
+/**
+ * HDR-style histogram of durations in microseconds. The bucket array only
+ * grows as far as the largest value recorded. Not thread-safe.
+ */
+typedef struct
+{
+    guint64 count;
+    guint64 sum;
+    guint64 min;
+    guint64 max;
+    GArray* buckets; // guint32 counts
+} LoomHistogram;
+
+void
+loom_histogram_init(LoomHistogram* histogram);
+
+void
+loom_histogram_clear(LoomHistogram* histogram);
+
+void
+loom_histogram_record(LoomHistogram* histogram, guint64 value);
+
+/**
+ * Returns the value that @fraction of the recorded values are at most, as the
+ * upper end of its bucket, or 0 if nothing was recorded.
+ */
+guint64
+loom_histogram_get_percentile(const LoomHistogram* histogram,
+                              gdouble fraction);
+
+/**
+ * Telemetry of the threads queued under one tag. Durations are in
+ * microseconds. Not thread-safe, the Loom's lock guards it.
+ */
+typedef struct
+{
+    LoomHistogram wait;  // queued until handed to the scheduler: dependencies,
+                         // groups and resource caps
+    LoomHistogram sched; // handed to the scheduler until the shuttle starts
+    LoomHistogram run;   // shuttle
+    LoomHistogram knot;  // knot, on the main thread
+    guint64 queued;
+    guint64 failed;    // knot got an error other than the two below
+    guint64 cancelled; // knot got G_IO_ERROR_CANCELLED
+    guint64 timed_out; // knot got G_IO_ERROR_TIMED_OUT from the timeout
+} LoomTagStats;
+
+LoomTagStats*
+loom_tag_stats_new(void);
+
+void
+loom_tag_stats_free(LoomTagStats* stats);
+
+/**
+ * Appends a few human-readable lines on @stats to @out.
+ */
+void
+loom_tag_stats_format(const LoomTagStats* stats,
+                      const gchar* tag,
+                      GString* out);
+
+/**
+ * Writes @stats as a JSON object: the counters, and for every histogram its
+ * count, sum, min, max, a few percentiles and the non-empty buckets as
+ * [lowest value, count] pairs.
+ */
+void
+loom_tag_stats_write_json(const LoomTagStats* stats, JsonWriter* writer);
+
+G_END_DECLS
@@ -2,10 +2,17 @@
 #include "config.h"
 #include "gio/gio.h"
 #include "gui/gui.h"
+#include "load_bench.h"
+#include "loader.h"
 #include "loom.h"
+#include "loom_bench.h"
 #include "paper.h"
+#include "persist.h"
+#include "trace.h"
+#include <glib-unix.h>
 #include <glib.h>
 #include <gtk/gtk.h>
+#include <signal.h>
 
 #define MAX_RESULTS 10
 
@@ -16,6 +23,29 @@ free_options()
     g_free(app_flags.paperparser_path);
     g_free(app_flags.cache_path);
     g_free(app_flags.json_path);
+    g_free(app_flags.export_path);
+    g_free(debug_flags.loom_stats_path);
+}
+
+static void
+export_loom_stats(void)
+{
+    GError* error = NULL;
+    if (!loom_export_stats(debug_flags.loom_stats_path, &error)) {
+        g_warning("Error writing Loom stats: %s\n", error->message);
+        g_clear_error(&error);
+    }
+}
+
+/* kill -USR1 prints where Loom threads spend their time */
+static gboolean
+on_dump_loom_stats(gpointer user_data)
+{
+    (void)user_data;
+    loom_dump_stats();
+    if (debug_flags.loom_stats_path)
+        export_loom_stats();
+    return G_SOURCE_CONTINUE;
 }
 static void
 on_activate(GApplication* app, gpointer user_data)
@@ -38,8 +68,7 @@ on_command_line(GApplication* app,
                 gpointer user_data)
 {
     (void)cmdline;
-    (void)user_data;
-    //PaperDatabase* db = user_data;
+    PaperDatabase* db = user_data;
 
     // GError* error = NULL;
 
@@ -59,24 +88,88 @@ on_command_line(GApplication* app,
         // TODO: implement mock data
     }
 
+    if (debug_flags.bench_loom) {
+        loom_bench_run();
+        return 0;
+    }
+
+    if (debug_flags.bench_json) {
+        load_bench_json();
+        return 0;
+    }
+
+    if (debug_flags.bench_load) {
+        load_bench_files();
+        return 0;
+    }
+
+    if (debug_flags.bench_abstracts) {
+        load_bench_abstracts();
+        return 0;
+    }
+
     /* Actual program logic is happening from here on */
 
+    if (app_flags.compact)
+        db->compress_cache = TRUE;
+    if (app_flags.compress_abstracts)
+        enable_abstract_compression(db);
+
     // load available data into db
     //load_database(db, app_flags.json_path, app_flags.cache_path);
 
     // app flags
-    if (app_flags.import_paths != NULL) {
-        for (int i = 0; app_flags.import_paths[i] != NULL; i++) {
+    if (app_flags.import_paths != NULL || app_flags.export_path != NULL) {
+        GError* error = NULL;
+        int status = 0;
+        load_database(db, app_flags.json_path, app_flags.cache_path);
+        for (int i = 0; app_flags.import_paths && app_flags.import_paths[i];
+             i++) {
             const gchar* path = app_flags.import_paths[i];
-            if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
+            if (is_jsonl_path(path)) {
+                g_print("Importing records: %s\n", path);
+                if (!import_papers_from_jsonl(db, path, &error)) {
+                    g_printerr(
+                      "Error importing %s: %s\n", path, error->message);
+                    g_clear_error(&error);
+                    status = 1;
+                }
+            } else if (g_file_test(path, G_FILE_TEST_IS_DIR)) {
                 g_print("Importing directory: %s\n", path);
                 // import_directory(path);
+                status = 1;
             } else {
                 g_print("Importing file: %s\n", path);
                 // import_file(path);
+                status = 1;
+            }
+        }
+        if (app_flags.export_path) {
+            const gchar* path = app_flags.export_path;
+            PaperSnapshot* snapshot =
+              snapshot_database(db); // freed by free_snapshot()
+            gint exported = snapshot->count;
+            gboolean ok;
+            if (app_flags.append && !is_jsonl_path(path)) {
+                g_set_error(&error,
+                            G_FILE_ERROR,
+                            G_FILE_ERROR_INVAL,
+                            "Can only append to .jsonl or .ndjson files");
+                ok = FALSE;
+            } else if (app_flags.append)
+                ok = append_papers_to_jsonl(snapshot, path, &exported, &error);
+            else
+                ok = write_json_snapshot(snapshot, path, NULL, NULL, &error);
+            if (ok)
+                g_print("Exported %d papers to %s\n", exported, path);
+            else {
+                g_printerr("Error exporting %s: %s\n", path, error->message);
+                g_clear_error(&error);
+                status = 1;
             }
+            free_snapshot(snapshot);
         }
-        return -1;
+        return status;
     }
     g_application_activate(app);
     return 0;
@@ -113,10 +206,23 @@ main(int argc, char** argv)
 
     // Register options
     g_application_add_main_option_entries(G_APPLICATION(app), cmd_options);
+    g_unix_signal_add(SIGUSR1, on_dump_loom_stats, NULL);
+    TRACE_INIT();
 
     /* Run the main GTK loop */
     int status = g_application_run(G_APPLICATION(app), argc, argv);
 
+    /* Write out anything still pending */
+    GError* error = NULL;
+    if (!persist_flush(db, &error)) {
+        g_warning("Error saving database: %s\n", error->message);
+        g_clear_error(&error);
+    }
+
+    if (debug_flags.loom_stats_path)
+        export_loom_stats();
+    TRACE_SHUTDOWN();
+
     /* Cleanup */
     g_object_unref(app);
     // g_thread_pool_free(global_pool, FALSE, TRUE);
@@ -1,53 +1,211 @@
 #define G_LOG_DOMAIN "paper"
 
 #include "paper.h"
+#include "config.h"
 #include "glib.h"
+#include "journal.h"
 #include "loader.h"
-#include "loom.h"
+#include "persist.h"
 #include "serializer.h"
+#include "string_dict.h"
 
+#include <string.h>
+
+StringDict*
+author_dict(void)
+{
+    static StringDict* dict; // lives as long as the process
+    if (g_once_init_enter(&dict))
+        g_once_init_leave(&dict, string_dict_new());
+    return dict;
+}
+
+StringDict*
+keyword_dict(void)
+{
+    static StringDict* dict; // lives as long as the process
+    if (g_once_init_enter(&dict))
+        g_once_init_leave(&dict, string_dict_new());
+    return dict;
+}
+
+/* Interns @count @strings into a new id array, NULL if there are none */
+static guint32*
+intern_strings(StringDict* dict, gchar** strings, gint count)
+{
+    if (count <= 0 || !strings)
+        return NULL;
+    guint32* ids = g_new(guint32, count); // freed by clear_paper_fields()
+    string_dict_intern_many(dict, (const gchar* const*)strings, count, ids);
+    return ids;
+}
+
+/* Moves the abstract of @paper into db->abstract_pool, if @db has one. Call
+ * with @paper locked or detached. Replaced abstracts stay in the pool until
+ * the database is reset. */
+void
+pool_abstract(PaperDatabase* db, Paper* paper)
+{
+    if (!db->abstract_pool || !paper->abstract || paper->is_mapped)
+        return;
+    paper->abstract_ref =
+      text_store_add(db->abstract_pool, paper->abstract) | ABSTRACT_REF_POOLED;
+    g_free(paper->abstract);
+    paper->abstract = NULL;
+}
+
+/* Helper: the store of the lazy abstract @ref, or NULL */
+static TextStore*
+abstract_store(TextStore* text_store, TextStore* abstract_pool, guint64 ref)
+{
+    if (!ref)
+        return NULL;
+    return (ref & ABSTRACT_REF_POOLED) ? abstract_pool : text_store;
+}
+
+/* Adds @paper to db->hash_index, after any other Paper with its hash. Call
+ * with the db write lock held. */
+static void
+index_paper(PaperDatabase* db, Paper* paper)
+{
+    if (!paper->content_hash)
+        return;
+    GPtrArray* papers =
+      g_hash_table_lookup(db->hash_index, &paper->content_hash);
+    if (!papers) {
+        papers = g_ptr_array_new(); // freed by db->hash_index
+        g_hash_table_insert(
+          db->hash_index,
+          g_memdup2(&paper->content_hash, sizeof(paper->content_hash)),
+          papers);
+    }
+    g_ptr_array_add(papers, paper);
+}
+
+/* Removes @paper from db->hash_index, so find_paper_by_hash() returns the
+ * next Paper with its hash, if any. Call with the db write lock held. */
 static void
+unindex_paper(PaperDatabase* db, Paper* paper)
+{
+    if (!paper->content_hash)
+        return;
+    GPtrArray* papers =
+      g_hash_table_lookup(db->hash_index, &paper->content_hash);
+    if (papers && g_ptr_array_remove(papers, paper) && papers->len == 0)
+        g_hash_table_remove(db->hash_index, &paper->content_hash);
+}
+
+/* Adds @paper to db->file_index, returns FALSE if another Paper has its
+ * pdf_file. Papers without one aren't indexed. Call with the db write lock
+ * held. */
+static gboolean
+index_file(PaperDatabase* db, Paper* paper)
+{
+    if (!paper->pdf_file)
+        return TRUE;
+    if (g_hash_table_contains(db->file_index, paper->pdf_file))
+        return FALSE;
+    g_hash_table_insert(db->file_index, g_strdup(paper->pdf_file), paper);
+    return TRUE;
+}
+
+/* Copies the lazy abstract @ref out of @db's stores. reset_database()
+ * replaces them, so the store is looked up under the db read lock and read
+ * with a reference of its own. */
+static gchar*
+dup_stored_abstract(PaperDatabase* db, guint64 ref)
+{
+    TextStore* store = NULL;
+    WITH_DB_READ_LOCK(db, {
+        store = abstract_store(db->text_store, db->abstract_pool, ref);
+        if (store)
+            text_store_ref(store);
+    });
+    if (!store)
+        return NULL;
+    gchar* abstract = text_store_dup(store, ref & ~ABSTRACT_REF_POOLED);
+    text_store_unref(store);
+    return abstract;
+}
+
+/**
+ * Called when the Paper at @index changes or goes away. If it is one of the
+ * records a JSON Lines db->path holds, appending no longer brings the file up
+ * to date and it has to be rewritten.
+ */
+static void
+mark_record_changed(PaperDatabase* db, gint index)
+{
+    if (index < g_atomic_int_get(&db->persisted_count))
+        g_atomic_int_set(&db->persisted_count, -1);
+}
+
+/* Adds @paper to @db, unless a Paper for its pdf_file is there already */
+static gboolean
 add_paper(PaperDatabase* db, Paper* paper)
 {
     g_debug("adding paper\n");
+    gboolean added = FALSE;
     WITH_DB_WRITE_LOCK(db, {
-        if (db->count >= db->capacity) {
-            // make sure it's not zero
-            db->capacity = (db->capacity < 1) ? 1 : db->capacity * 2;
-            db->papers = g_realloc(db->papers,
-                                   sizeof(Paper*) *
-                                     db->capacity); // freed by free_database()
+        added = index_file(db, paper);
+        if (added) {
+            if (db->count >= db->capacity) {
+                // make sure it's not zero
+                db->capacity = (db->capacity < 1) ? 1 : db->capacity * 2;
+                db->papers = g_realloc(
+                  db->papers,
+                  sizeof(Paper*) * db->capacity); // freed by free_database()
+            }
+            db->count++;
+            paper->id_in_db = db->count - 1;
+            paper->owning_db = db;
+            g_debug("adding paper id:%d, capacity:%d, count:%d\n",
+                    paper->id_in_db,
+                    db->capacity,
+                    db->count);
+            db->papers[paper->id_in_db] = paper;
+            journal_queue(db->journal,
+                          journal_encode(JOURNAL_ADD, paper, NULL));
         }
-        db->count++;
-        paper->id_in_db = db->count - 1;
-        g_debug("adding paper id:%d, capacity:%d, count:%d\n",
-                paper->id_in_db,
-                db->capacity,
-                db->count);
-        db->papers[paper->id_in_db] = paper;
     });
+    if (!added)
+        return FALSE;
+    journal_flush(db->journal);
+    persist_mark_dirty(db);
+    return TRUE;
 }
 
+/* Frees the fields @p owns and clears them. Call with the Paper lock held. */
 static void
-free_paper_fields(Paper* p)
+clear_paper_fields(Paper* p)
 {
-    WITH_PAPER_LOCK(p, {
-        if (!p)
-            return;
+    // mapped Papers don't own their strings, they live in the cache
+    if (!p->is_mapped) {
         g_free(p->title);
-        for (int i = 0; i < p->authors_count; i++) {
-            g_free(p->authors[i]);
-        }
-        g_free(p->authors);
-        for (int i = 0; i < p->keyword_count; i++) {
-            g_free(p->keywords[i]);
-        }
-        g_free(p->keywords);
         g_free(p->abstract);
         g_free(p->arxiv_id);
         g_free(p->doi);
         g_free(p->pdf_file);
-    });
+    }
+    p->title = p->abstract = p->arxiv_id = p->doi = p->pdf_file = NULL;
+    string_dict_unref_many(author_dict(), p->author_ids, p->authors_count);
+    string_dict_unref_many(keyword_dict(), p->keyword_ids, p->keyword_count);
+    g_free(p->author_ids);
+    g_free(p->keyword_ids);
+    p->author_ids = NULL;
+    p->authors_count = 0;
+    p->keyword_ids = NULL;
+    p->keyword_count = 0;
+    p->abstract_ref = 0;
+    p->is_mapped = FALSE;
+}
+
+static void
+free_paper_fields(Paper* p)
+{
+    if (!p)
+        return;
+    WITH_PAPER_LOCK(p, { clear_paper_fields(p); });
 }
 
 static void
@@ -61,78 +219,6 @@ free_paper(Paper* p)
     p = NULL;
 }
 
-static gpointer
-write_json_shuttle(gpointer worker_data, GError** error)
-{
-    PaperDatabase* db = worker_data;
-    write_json(db, error);
-    return NULL;
-}
-
-static void
-write_json_knot(gpointer callback_data,
-                gpointer worker_data,
-                gpointer result,
-                GError* error)
-{
-    (void)callback_data;
-    (void)result;
-    (void)worker_data;
-    if (error) {
-        g_warning("Error writing JSON: %s\n", error->message);
-        g_clear_error(&error);
-    }
-}
-
-static gpointer
-write_cache_shuttle(gpointer worker_data, GError** error)
-{
-    PaperDatabase* db = worker_data;
-    write_cache(db, error);
-    return NULL;
-}
-
-static void
-write_cache_knot(gpointer callback_data,
-                 gpointer worker_data,
-                 gpointer result,
-                 GError* error)
-{
-    (void)callback_data;
-    (void)result;
-    (void)worker_data;
-    if (error) {
-        g_warning("Error writing cache: %s\n", error->message);
-        g_clear_error(&error);
-    }
-}
-
-void
-sync_json_and_cache(PaperDatabase* db)
-{
-    Loom* loom = loom_get_default();
-    LoomThreadSpec json_spec = loom_thread_spec_default();
-    json_spec.tag = "write-json";
-    json_spec.shuttle = write_json_shuttle;
-    json_spec.shuttle_data = db;
-    json_spec.knot = write_json_knot;
-    json_spec.priority = 5;
-    static const gchar* json_deps[] = { "parser", NULL };
-    json_spec.dependencies = json_deps;
-
-    LoomThreadSpec cache_spec = loom_thread_spec_default();
-    cache_spec.tag = "write-cache";
-    cache_spec.shuttle = write_cache_shuttle;
-    cache_spec.shuttle_data = db;
-    cache_spec.knot = write_cache_knot;
-    cache_spec.priority = 5;
-    static const gchar* cache_deps[] = { "write-json", "parser", NULL };
-    cache_spec.dependencies = cache_deps;
-
-    loom_queue_thread(loom, &json_spec, NULL);
-    loom_queue_thread(loom, &cache_spec, NULL);
-}
-
 Paper*
 initialize_paper(PaperDatabase* db, const gchar* pdf_file, GError** error)
 {
@@ -145,17 +231,25 @@ initialize_paper(PaperDatabase* db, const gchar* pdf_file, GError** error)
     }
     Paper* paper = g_new0(Paper, 1); // freed by free_paper()
     paper->title = NULL;
-    paper->authors = NULL;
+    paper->author_ids = NULL;
     paper->authors_count = 0;
     paper->year = 0;
     paper->keyword_count = 0;
-    paper->keywords = NULL;
+    paper->keyword_ids = NULL;
     paper->abstract = NULL;
     paper->arxiv_id = NULL;
     paper->doi = NULL;
     paper->pdf_file = g_strdup(pdf_file);
     g_mutex_init(&paper->lock); // freed by free_paper()
-    add_paper(db, paper);
+    if (!add_paper(db, paper)) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_EXIST,
+                    "'%s' is in the database already",
+                    pdf_file);
+        free_paper(paper);
+        return NULL;
+    }
     // Paper belongs to the database now
     return paper;
 }
@@ -175,6 +269,8 @@ create_paper(PaperDatabase* db,
              GError** error)
 {
     Paper* p = initialize_paper(db, pdf_file, error);
+    if (!p)
+        return NULL;
 
     update_paper(p,
                  title,
@@ -191,6 +287,174 @@ create_paper(PaperDatabase* db,
     return p;
 }
 
+/* Creates a detached Paper holding the given fields as they are */
+static Paper*
+new_paper(gchar* title,
+          guint32* author_ids,
+          gint authors_count,
+          gint year,
+          guint32* keyword_ids,
+          gint keyword_count,
+          gchar* abstract,
+          gchar* arxiv_id,
+          gchar* doi,
+          gchar* pdf_file)
+{
+    Paper* paper = g_new0(Paper, 1); // freed by free_paper()
+    paper->id_in_db = -1;
+    paper->title = title;
+    paper->author_ids = author_ids;
+    paper->authors_count = author_ids ? authors_count : 0;
+    paper->year = year;
+    paper->keyword_ids = keyword_ids;
+    paper->keyword_count = keyword_ids ? keyword_count : 0;
+    paper->abstract = abstract;
+    paper->arxiv_id = arxiv_id;
+    paper->doi = doi;
+    paper->pdf_file = pdf_file;
+    g_mutex_init(&paper->lock); // freed by free_paper()
+    return paper;
+}
+
+Paper*
+build_mapped_paper(const gchar* title,
+                   guint32* author_ids,
+                   gint authors_count,
+                   gint year,
+                   guint32* keyword_ids,
+                   gint keyword_count,
+                   guint64 abstract_ref,
+                   const gchar* arxiv_id,
+                   const gchar* doi,
+                   const gchar* pdf_file)
+{
+    // no copies, everything points into the loaded cache
+    Paper* paper = new_paper((gchar*)title,
+                             author_ids, // owned by paper
+                             authors_count,
+                             year,
+                             keyword_ids, // owned by paper
+                             keyword_count,
+                             NULL, // lazy, see abstract_ref
+                             (gchar*)arxiv_id,
+                             (gchar*)doi,
+                             (gchar*)pdf_file);
+    paper->abstract_ref = abstract_ref;
+    paper->is_mapped = TRUE;
+    return paper;
+}
+
+Paper*
+build_paper(gchar* title,
+            gchar** authors,
+            gint authors_count,
+            gint year,
+            gchar** keywords,
+            gint keyword_count,
+            gchar* abstract,
+            gchar* arxiv_id,
+            gchar* doi,
+            gchar* pdf_file)
+{
+    Paper* paper =
+      new_paper(title,
+                intern_strings(author_dict(), authors, authors_count),
+                authors_count,
+                year,
+                intern_strings(keyword_dict(), keywords, keyword_count),
+                keyword_count,
+                abstract,
+                arxiv_id,
+                doi,
+                pdf_file);
+    // the dictionaries keep their own copies
+    for (gint i = 0; authors && i < authors_count; ++i)
+        g_free(authors[i]);
+    g_free(authors);
+    for (gint i = 0; keywords && i < keyword_count; ++i)
+        g_free(keywords[i]);
+    g_free(keywords);
+    return paper;
+}
+
+void
+insert_papers(PaperDatabase* db, Paper** papers, gint count)
+{
+    g_return_if_fail(db != NULL);
+    if (count <= 0)
+        return;
+
+    // still detached, so no locks needed; the records are encoded while the
+    // abstracts are at hand, the journal isn't open while loading
+    GByteArray** records = NULL; // freed below, an add and an update each
+    if (db->journal) {
+        records = g_new0(GByteArray*, 2 * count);
+        for (gint i = 0; i < count; ++i) {
+            Paper* paper = papers[i];
+            g_autofree gchar* abstract = // freed on iteration end
+              paper->abstract || !paper->abstract_ref
+                ? g_strdup(paper->abstract)
+                : dup_stored_abstract(db, paper->abstract_ref);
+            records[2 * i] = journal_encode(JOURNAL_ADD, paper, NULL);
+            records[2 * i + 1] =
+              journal_encode(JOURNAL_UPDATE, paper, abstract);
+        }
+    }
+    for (gint i = 0; i < count; ++i)
+        pool_abstract(db, papers[i]);
+
+    GPtrArray* duplicates = g_ptr_array_new(); // freed below
+    WITH_DB_WRITE_LOCK(db, {
+        if (db->count + count > db->capacity) {
+            while (db->capacity < db->count + count)
+                db->capacity = (db->capacity < 1) ? 1 : db->capacity * 2;
+            db->papers = g_realloc(db->papers,
+                                   sizeof(Paper*) *
+                                     db->capacity); // freed by free_database()
+        }
+        for (gint i = 0; i < count; ++i) {
+            if (!index_file(db, papers[i])) {
+                g_ptr_array_add(duplicates, papers[i]);
+                continue;
+            }
+            papers[i]->id_in_db = db->count++;
+            papers[i]->owning_db = db;
+            db->papers[papers[i]->id_in_db] = papers[i];
+            index_paper(db, papers[i]);
+            if (records) {
+                journal_queue(db->journal, records[2 * i]);
+                journal_queue(db->journal, records[2 * i + 1]);
+                records[2 * i] = records[2 * i + 1] = NULL;
+            }
+        }
+    });
+    g_debug("inserted %d papers, count:%d",
+            count - (gint)duplicates->len,
+            db->count);
+
+    if (records) {
+        // those of the duplicates
+        for (gint i = 0; i < 2 * count; ++i)
+            if (records[i])
+                g_byte_array_unref(records[i]);
+        g_free(records);
+        journal_flush(db->journal);
+    }
+    if (duplicates->len > 0)
+        g_warning("Dropped %u papers for PDFs in the database already\n",
+                  duplicates->len);
+    for (guint i = 0; i < duplicates->len; ++i)
+        free_paper(g_ptr_array_index(duplicates, i));
+    g_ptr_array_free(duplicates, TRUE);
+    persist_mark_dirty(db);
+}
+
+void
+discard_paper(Paper* paper)
+{
+    free_paper(paper);
+}
+
 PaperDatabase*
 create_database(int initial_capacity, gchar* db_path, gchar* db_cache)
 {
@@ -203,11 +467,95 @@ create_database(int initial_capacity, gchar* db_path, gchar* db_cache)
     db->path = g_strdup(db_path);   // freed by free_database()
     db->cache = g_strdup(db_cache); // freed by free_database()
     db->capacity = initial_capacity;
+    db->compress_cache = CACHE_COMPRESS;
+    db->persisted_count = -1; // until load_database() reads path
+    db->hash_index = g_hash_table_new_full(
+      g_int64_hash,
+      g_int64_equal,
+      g_free,
+      (GDestroyNotify)g_ptr_array_unref); // freed by free_database()
+    db->file_index = g_hash_table_new_full(
+      g_str_hash, g_str_equal, g_free, NULL); // freed by free_database()
     g_rw_lock_init(&db->lock); // freed by free_database()
+    if (ABSTRACT_COMPRESS)
+        enable_abstract_compression(db);
 
     return db;
 }
 
+Paper*
+find_paper_by_hash(PaperDatabase* db, guint64 content_hash)
+{
+    g_return_val_if_fail(db != NULL, NULL);
+    Paper* paper = NULL;
+    WITH_DB_READ_LOCK(db, {
+        GPtrArray* papers = g_hash_table_lookup(db->hash_index, &content_hash);
+        if (papers)
+            paper = g_ptr_array_index(papers, 0);
+    });
+    return paper;
+}
+
+Paper*
+find_paper_by_file(PaperDatabase* db, const gchar* pdf_file)
+{
+    g_return_val_if_fail(db != NULL && pdf_file != NULL, NULL);
+    Paper* paper = NULL;
+    WITH_DB_READ_LOCK(
+      db, { paper = g_hash_table_lookup(db->file_index, pdf_file); });
+    return paper;
+}
+
+void
+paper_set_content_hash(Paper* paper, guint64 content_hash)
+{
+    g_return_if_fail(paper != NULL && paper->owning_db != NULL);
+    PaperDatabase* db = paper->owning_db;
+    gboolean changed = FALSE;
+    WITH_DB_WRITE_LOCK(db, {
+        WITH_PAPER_LOCK(paper, {
+            changed = paper->content_hash != content_hash;
+            if (changed) {
+                unindex_paper(db, paper);
+                paper->content_hash = content_hash;
+                index_paper(db, paper);
+                mark_record_changed(db, paper->id_in_db);
+                journal_queue(db->journal,
+                              journal_encode(JOURNAL_HASH, paper, NULL));
+            }
+        });
+    });
+    if (changed) {
+        journal_flush(db->journal);
+        persist_mark_dirty(db);
+    }
+}
+
+void
+enable_abstract_compression(PaperDatabase* db)
+{
+    g_return_if_fail(db != NULL);
+    WITH_DB_WRITE_LOCK(db, {
+        if (!db->abstract_pool)
+            db->abstract_pool = text_store_new_pool(
+              ABSTRACT_POOL_BUDGET_BYTES); // freed by free_database()
+    });
+}
+
+/**
+ * Replays the journal over the loaded snapshot and keeps it open for
+ * appending. Without a journal, every change is saved as a full snapshot.
+ */
+static void
+attach_journal(PaperDatabase* db)
+{
+    GError* error = NULL;
+    if (!journal_load(db, &error)) {
+        g_warning("Error opening journal: %s\n", error->message);
+        g_clear_error(&error);
+    }
+}
+
 // TODO: shold this be async?
 gboolean
 load_database(PaperDatabase* db,
@@ -225,24 +573,56 @@ load_database(PaperDatabase* db,
 
     /* Load from cache or JSON file */
     // TODO: async
-    if (!cache_up_to_date(db->path, db->cache) || !load_cache(db, &error)) {
-        if (error) {
-            g_warning(
-              "Error loading cache '%s': %s\n", cache_path, error->message);
-            g_clear_error(&error);
-        } else
-            g_message("Cache not up to date, attempting to load from JSON.\n");
-        if (!load_papers_from_json(db, &error)) {
-            g_warning(
-              "Error loading JSON '%s': %s\nContinuing with empty database.\n",
-              json_path,
-              error->message);
-            g_clear_error(&error);
+    guint corrupt_chunks = 0;
+    if (cache_up_to_date(db->path, db->cache) &&
+        load_cache(db, &corrupt_chunks, &error)) {
+        if (corrupt_chunks == 0) {
+            // both files are in sync, nothing to write
+            g_atomic_int_set(&db->persisted_count, db->count);
+            attach_journal(db);
+            persist_mark_clean(db);
+            return TRUE;
         }
+        // the JSON has all records, the salvaged ones are only a fallback
+        g_warning("Cache '%s' has %u corrupt chunks, loading from JSON.\n",
+                  db->cache,
+                  corrupt_chunks);
+        reset_database(db);
+    } else if (error) {
+        g_warning(
+          "Error loading cache '%s': %s\n", cache_path, error->message);
+        g_clear_error(&error);
+    } else
+        g_message("Cache not up to date, attempting to load from JSON.\n");
+    if (!load_papers_from_json(db, &error)) {
+        // don't overwrite a JSON we failed to read
+        g_warning("Error loading JSON '%s': %s\n", json_path, error->message);
+        g_clear_error(&error);
+        // drop the batches that were inserted before the error
+        reset_database(db);
+        if (corrupt_chunks > 0 && load_cache(db, &corrupt_chunks, NULL))
+            g_warning("Continuing with %d papers salvaged from the cache.\n",
+                      db->count);
+        else
+            g_warning("Continuing with empty database.\n");
+        attach_journal(db);
+        persist_mark_clean(db);
+        return TRUE;
     }
 
-    /* sync JSON and cache */
-    sync_json_and_cache(db);
+    if (db->abstract_pool) {
+        gsize text_size = 0, stored_size = 0;
+        text_store_get_sizes(db->abstract_pool, &text_size, &stored_size);
+        g_debug("Abstracts take %zu bytes in memory for %zu bytes of text\n",
+                stored_size,
+                text_size);
+    }
+
+    /* JSON is unchanged, only the cache needs rebuilding */
+    g_atomic_int_set(&db->persisted_count, db->count);
+    attach_journal(db);
+    persist_mark_clean(db);
+    sync_cache(db);
     return TRUE;
 }
 
@@ -265,40 +645,42 @@ update_paper(Paper* paper,
         return;
     }
 
+    // built up front, so readers see either the old fields or the new ones;
     // all freed by free_paper()
-    gchar* pdf_file = g_strdup(paper->pdf_file);
-    free_paper_fields(paper);
+    gchar* new_title = g_strdup(title);
+    guint32* author_ids = intern_strings(author_dict(), authors, authors_count);
+    guint32* keyword_ids =
+      intern_strings(keyword_dict(), keywords, keyword_count);
+    gchar* new_abstract = g_strdup(abstract);
+    gchar* new_arxiv_id = g_strdup(arxiv_id);
+    gchar* new_doi = g_strdup(doi);
 
     WITH_PAPER_LOCK(paper, {
-        paper->title = title ? g_strdup(title) : NULL;
-
-        paper->authors_count = (authors_count > 0) ? authors_count : 0;
-        if (paper->authors_count > 0) {
-            paper->authors = g_new0(gchar*, paper->authors_count);
-            for (int i = 0; i < authors_count; i++) {
-                paper->authors[i] = g_strdup(authors[i]);
-            }
-        }
+        // a mapped Paper's pdf_file lives in the cache
+        gchar* pdf_file = g_strdup(paper->pdf_file);
+        clear_paper_fields(paper);
 
+        paper->title = new_title;
+        paper->author_ids = author_ids;
+        paper->authors_count = author_ids ? authors_count : 0;
         paper->year = year ? year : 0;
-
-        paper->keyword_count = keyword_count ? keyword_count : 0;
-        paper->keywords = NULL;
-        if (paper->keyword_count > 0) {
-            paper->keywords = g_new0(gchar*, paper->keyword_count);
-            for (int i = 0; i < keyword_count; i++) {
-                paper->keywords[i] = g_strdup(keywords[i]);
-            }
-        }
-
-        paper->abstract = abstract ? g_strdup(abstract) : NULL;
-
-        paper->arxiv_id = arxiv_id ? g_strdup(arxiv_id) : NULL;
-
-        paper->doi = doi ? g_strdup(doi) : NULL;
-
+        paper->keyword_ids = keyword_ids;
+        paper->keyword_count = keyword_ids ? keyword_count : 0;
+        paper->abstract = new_abstract;
+        if (paper->owning_db)
+            pool_abstract(paper->owning_db, paper);
+        paper->arxiv_id = new_arxiv_id;
+        paper->doi = new_doi;
         paper->pdf_file = pdf_file;
+        if (paper->owning_db)
+            journal_queue(paper->owning_db->journal,
+                          journal_encode(JOURNAL_UPDATE, paper, abstract));
     });
+    if (paper->owning_db) {
+        mark_record_changed(paper->owning_db, paper->id_in_db);
+        journal_flush(paper->owning_db->journal);
+        persist_mark_dirty(paper->owning_db);
+    }
 }
 
 void
@@ -309,12 +691,23 @@ remove_paper(PaperDatabase* db, Paper* paper)
     }
     // move last Paper in db to the spot of the removed one
     WITH_DB_WRITE_LOCK(db, {
+        WITH_PAPER_LOCK(paper, {
+            journal_queue(db->journal,
+                          journal_encode(JOURNAL_REMOVE, paper, NULL));
+        });
+        if (paper->pdf_file &&
+            g_hash_table_lookup(db->file_index, paper->pdf_file) == paper)
+            g_hash_table_remove(db->file_index, paper->pdf_file);
+        unindex_paper(db, paper);
+        mark_record_changed(db, paper->id_in_db);
         db->papers[paper->id_in_db] = db->papers[db->count - 1];
         db->papers[paper->id_in_db]->id_in_db = paper->id_in_db;
         db->papers[db->count - 1] = NULL;
         free_paper(paper);
         db->count--;
     });
+    journal_flush(db->journal);
+    persist_mark_dirty(db);
     return;
 }
 
@@ -332,8 +725,174 @@ reset_database(PaperDatabase* db)
         }
         db->capacity = 1;
         db->count = 0;
+        g_hash_table_remove_all(db->hash_index);
+        g_hash_table_remove_all(db->file_index);
+        mark_record_changed(db, 0);
+        // no mapped Paper left, so the cache mapping can go
+        if (db->cache_map) {
+            g_mapped_file_unref(db->cache_map);
+            db->cache_map = NULL;
+        }
+        g_clear_pointer(&db->cache_blocks, g_ptr_array_unref);
+        g_clear_pointer(&db->text_store, text_store_unref);
+        // start over, dropping the text of the freed Papers
+        if (db->abstract_pool) {
+            text_store_unref(db->abstract_pool);
+            db->abstract_pool = text_store_new_pool(
+              ABSTRACT_POOL_BUDGET_BYTES); // freed by free_database()
+        }
+        journal_queue(db->journal, journal_encode(JOURNAL_RESET, NULL, NULL));
+    });
+    journal_flush(db->journal);
+    persist_mark_dirty(db);
+}
+
+/* Copies @value into @chunk unless it points into the mapped cache */
+static const gchar*
+snapshot_string(GStringChunk* chunk, const Paper* p, const gchar* value)
+{
+    if (!value || p->is_mapped)
+        return value;
+    return g_string_chunk_insert(chunk, value);
+}
+
+/* Copies @ids, with a reference on each so their strings stay valid */
+static guint32*
+snapshot_ids(StringDict* dict, const guint32* ids, gint count)
+{
+    if (count <= 0 || !ids)
+        return NULL;
+    guint32* copy = g_new(guint32, count); // freed by free_snapshot()
+    memcpy(copy, ids, sizeof(guint32) * count);
+    for (gint i = 0; i < count; ++i)
+        string_dict_ref(dict, copy[i]);
+    return copy;
+}
+
+static PaperSnapshot*
+take_snapshot(PaperDatabase* db, gboolean to_persist)
+{
+    g_return_val_if_fail(db != NULL, NULL);
+
+    PaperSnapshot* snapshot =
+      g_new0(PaperSnapshot, 1); // freed by free_snapshot()
+    snapshot->strings =
+      g_string_chunk_new(64 * 1024); // freed by free_snapshot()
+
+    WITH_DB_READ_LOCK(db, {
+        snapshot->generation = g_atomic_int_get(&db->generation);
+        snapshot->count = db->count;
+        snapshot->append_from = -1;
+        // writers are locked out, and snapshots to persist are taken one at
+        // a time, so nothing else touches persisted_count meanwhile
+        if (to_persist) {
+            snapshot->append_from = g_atomic_int_get(&db->persisted_count);
+            g_atomic_int_set(&db->persisted_count, db->count);
+        }
+        snapshot->records =
+          g_new0(PaperRecord, db->count); // freed by free_snapshot()
+        if (db->cache_map)
+            snapshot->cache_map = g_mapped_file_ref(db->cache_map);
+        if (db->cache_blocks)
+            snapshot->cache_blocks = g_ptr_array_ref(db->cache_blocks);
+        if (db->text_store)
+            snapshot->text_store = text_store_ref(db->text_store);
+        if (db->abstract_pool)
+            snapshot->abstract_pool = text_store_ref(db->abstract_pool);
+        for (gint i = 0; i < db->count; ++i) {
+            Paper* p = db->papers[i];
+            PaperRecord* r = &snapshot->records[i];
+            WITH_PAPER_LOCK(p, {
+                r->title = snapshot_string(snapshot->strings, p, p->title);
+                r->author_ids =
+                  snapshot_ids(author_dict(), p->author_ids, p->authors_count);
+                r->authors_count = r->author_ids ? p->authors_count : 0;
+                r->year = p->year;
+                r->keyword_ids = snapshot_ids(
+                  keyword_dict(), p->keyword_ids, p->keyword_count);
+                r->keyword_count = r->keyword_ids ? p->keyword_count : 0;
+                r->abstract =
+                  snapshot_string(snapshot->strings, p, p->abstract);
+                r->abstract_ref = p->abstract_ref;
+                r->arxiv_id =
+                  snapshot_string(snapshot->strings, p, p->arxiv_id);
+                r->doi = snapshot_string(snapshot->strings, p, p->doi);
+                r->pdf_file =
+                  snapshot_string(snapshot->strings, p, p->pdf_file);
+                r->content_hash = p->content_hash;
+            });
+        }
+    });
+    return snapshot;
+}
+
+PaperSnapshot*
+snapshot_database(PaperDatabase* db)
+{
+    return take_snapshot(db, FALSE);
+}
+
+PaperSnapshot*
+snapshot_database_to_persist(PaperDatabase* db)
+{
+    return take_snapshot(db, TRUE);
+}
+
+void
+invalidate_persisted_records(PaperDatabase* db)
+{
+    g_return_if_fail(db != NULL);
+    g_atomic_int_set(&db->persisted_count, -1);
+}
+
+void
+free_snapshot(PaperSnapshot* snapshot)
+{
+    if (!snapshot)
+        return;
+    for (gint i = 0; i < snapshot->count; ++i) {
+        const PaperRecord* r = &snapshot->records[i];
+        string_dict_unref_many(author_dict(), r->author_ids, r->authors_count);
+        string_dict_unref_many(
+          keyword_dict(), r->keyword_ids, r->keyword_count);
+        g_free((guint32*)r->author_ids);
+        g_free((guint32*)r->keyword_ids);
+    }
+    g_free(snapshot->records);
+    g_string_chunk_free(snapshot->strings);
+    if (snapshot->cache_map)
+        g_mapped_file_unref(snapshot->cache_map);
+    if (snapshot->cache_blocks)
+        g_ptr_array_unref(snapshot->cache_blocks);
+    text_store_unref(snapshot->text_store);
+    text_store_unref(snapshot->abstract_pool);
+    g_free(snapshot);
+}
+
+gchar*
+snapshot_dup_abstract(const PaperSnapshot* snapshot, const PaperRecord* record)
+{
+    TextStore* store = abstract_store(
+      snapshot->text_store, snapshot->abstract_pool, record->abstract_ref);
+    if (record->abstract || !store)
+        return g_strdup(record->abstract);
+    return text_store_dup(store, record->abstract_ref & ~ABSTRACT_REF_POOLED);
+}
+
+gchar*
+paper_dup_abstract(Paper* paper)
+{
+    g_return_val_if_fail(paper != NULL, NULL);
+
+    gchar* abstract = NULL;
+    guint64 ref = 0;
+    WITH_PAPER_LOCK(paper, {
+        abstract = g_strdup(paper->abstract);
+        ref = paper->abstract_ref;
     });
-    // TODO: sync json and cache
+    if (!abstract && paper->owning_db)
+        abstract = dup_stored_abstract(paper->owning_db, ref);
+    return abstract;
 }
 
 void
@@ -349,6 +908,16 @@ free_database(PaperDatabase* db)
             g_free(db->papers);
         }
     });
+    journal_close(db->journal);
+    // only safe once no mapped Paper is left
+    if (db->cache_map)
+        g_mapped_file_unref(db->cache_map);
+    if (db->cache_blocks)
+        g_ptr_array_unref(db->cache_blocks);
+    text_store_unref(db->text_store);
+    text_store_unref(db->abstract_pool);
+    g_hash_table_destroy(db->hash_index);
+    g_hash_table_destroy(db->file_index);
     g_free(db->path);
     g_free(db->cache);
     g_rw_lock_clear(&db->lock);
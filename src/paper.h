@@ -1,33 +1,91 @@
 #pragma once
 
+#include "string_dict.h"
+#include "text_store.h"
 #include <glib.h>
 
+typedef struct _PaperDatabase PaperDatabase;
+typedef struct _PaperJournal PaperJournal;
+
 typedef struct
 {
     gint id_in_db;
+    PaperDatabase* owning_db;
     gchar* title;
-    gchar** authors;
+    guint32* author_ids; // in author_dict(), see paper_get_author()
     gint authors_count;
     gint year;
-    gchar** keywords;
+    guint32* keyword_ids; // in keyword_dict(), see paper_get_keyword()
     gint keyword_count;
-    gchar* abstract;
+    gchar* abstract;      // NULL while lazy, see paper_dup_abstract()
+    guint64 abstract_ref; // lazy abstract in owning_db->text_store (or
+                          // abstract_pool, see ABSTRACT_REF_POOLED), or 0
     gchar* arxiv_id;
     gchar* doi;
     gchar* pdf_file;
     GMutex lock;
-    // gchar* hash; // TODO: add hash field for duplicate detection
+    gboolean is_mapped;   // string fields point into db->cache_map or
+                          // db->cache_blocks, not owned
+    guint64 content_hash; // XXH64 of the PDF, 0 if not hashed yet
 } Paper;
 
-typedef struct
+struct _PaperDatabase
 {
     Paper** papers;
     gint count;
     gint capacity;
     gchar* path;
     gchar* cache;
+    GMappedFile* cache_map;   // backs the string fields of mapped Papers
+    GPtrArray* cache_blocks;  // inflated chunks of a compressed cache, ditto
+    TextStore* text_store;    // lazy abstracts of Papers loaded from the cache
+    TextStore* abstract_pool; // deflated abstracts of the other Papers, or
+                              // NULL to keep them plain
+    gboolean compress_cache;  // write the cache compressed, see serializer.c
+    gint generation;          // bumped on every change, see persist.c
+    PaperJournal* journal;    // mutation log next to path, see journal.c
+    GHashTable* hash_index;   // content_hash -> GPtrArray of Paper*, for
+                              // duplicates
+    GHashTable* file_index;   // pdf_file -> Paper*, one Paper per file
+    gint persisted_count;     // leading Papers that a JSON Lines file at path
+                              // holds unchanged, -1 if it must be rewritten
     GRWLock lock;
-} PaperDatabase;
+};
+
+/* Read-only copy of one Paper, see snapshot_database() */
+typedef struct
+{
+    const gchar* title;
+    const guint32* author_ids; // referenced until free_snapshot()
+    gint authors_count;
+    gint year;
+    const guint32* keyword_ids; // likewise
+    gint keyword_count;
+    const gchar* abstract; // NULL while lazy, see snapshot_dup_abstract()
+    guint64 abstract_ref;
+    const gchar* arxiv_id;
+    const gchar* doi;
+    const gchar* pdf_file;
+    guint64 content_hash;
+} PaperRecord;
+
+/* Point-in-time copy of a database that can be written out without locks */
+typedef struct
+{
+    PaperRecord* records;
+    gint count;
+    gint generation;          // db->generation when the snapshot was taken
+    gint append_from;         // records already in a JSON Lines db->path,
+                              // or -1 to write all of them
+    GStringChunk* strings;    // copies of the strings owned by Papers
+    GMappedFile* cache_map;   // keeps the strings of mapped Papers alive
+    GPtrArray* cache_blocks;  // ditto, for a compressed cache
+    TextStore* text_store;    // lazy abstracts of the records
+    TextStore* abstract_pool; // ditto
+} PaperSnapshot;
+
+/* Set in abstract_ref for abstracts in abstract_pool rather than text_store */
+#define ABSTRACT_REF_POOLED (G_GUINT64_CONSTANT(1) << 63)
 
 /* Macros */
 #define WITH_PAPER_LOCK(p, code_block)                                         \
@@ -51,10 +109,34 @@ typedef struct
         g_rw_lock_reader_unlock(&(db)->lock);                                  \
     } while (0)
 
+/**
+ * Process-wide dictionaries of author names and keywords. Papers and
+ * snapshots hold one reference per id they store.
+ */
+StringDict*
+author_dict(void);
+
+StringDict*
+keyword_dict(void);
+
+static inline const gchar*
+paper_get_author(const Paper* paper, gint index)
+{
+    return string_dict_get(author_dict(), paper->author_ids[index]);
+}
+
+static inline const gchar*
+paper_get_keyword(const Paper* paper, gint index)
+{
+    return string_dict_get(keyword_dict(), paper->keyword_ids[index]);
+}
+
 /**
  * Creates an empty Paper struct, adds it to @db,
  * and returns a pointer to it.
  * @db owns the returned Paper.
+ * Returns NULL and sets a G_FILE_ERROR_EXIST error if a Paper for @pdf_file
+ * is in @db already.
  */
 Paper*
 initialize_paper(PaperDatabase* db, const gchar* pdf_file, GError** error);
@@ -79,6 +161,70 @@ create_paper(PaperDatabase* db,
              const gchar* pdf_file,
              GError** error);
 
+/**
+ * Creates a Paper whose string fields borrow the given pointers instead of
+ * copying them, without adding it to a database. Hand it to insert_papers().
+ * The strings must stay valid as long as the database (i.e. live in
+ * db->cache_map or db->cache_blocks).
+ * The abstract stays in db->text_store at @abstract_ref (0 for none) until
+ * it is read with paper_dup_abstract().
+ * The Paper takes ownership of the @author_ids and @keyword_ids arrays and
+ * the dictionary references they hold. The first update_paper() replaces the
+ * borrowed strings with owned copies.
+ */
+Paper*
+build_mapped_paper(const gchar* title,
+                   guint32* author_ids,
+                   gint authors_count,
+                   gint year,
+                   guint32* keyword_ids,
+                   gint keyword_count,
+                   guint64 abstract_ref,
+                   const gchar* arxiv_id,
+                   const gchar* doi,
+                   const gchar* pdf_file);
+
+/**
+ * Creates a Paper that takes ownership of the given strings and arrays
+ * without adding it to a database. Hand it to insert_papers(), or free it
+ * with discard_paper().
+ * Authors and keywords are interned right away and their strings freed.
+ */
+Paper*
+build_paper(gchar* title,
+            gchar** authors,
+            gint authors_count,
+            gint year,
+            gchar** keywords,
+            gint keyword_count,
+            gchar* abstract,
+            gchar* arxiv_id,
+            gchar* doi,
+            gchar* pdf_file);
+
+/**
+ * Moves the abstract of a Paper from build_paper() into @db's abstract pool,
+ * if it has one. insert_papers() does that as well; loaders that hold on to
+ * many Papers before inserting them call it early, so the plain text is
+ * freed while they still allocate.
+ */
+void
+pool_abstract(PaperDatabase* db, Paper* paper);
+
+/**
+ * Appends @count Papers from build_paper() to @db in order, taking the
+ * database lock once. Papers whose pdf_file is in @db already are dropped.
+ * @db owns the Papers afterwards, the @papers array stays with the caller.
+ */
+void
+insert_papers(PaperDatabase* db, Paper** papers, gint count);
+
+/**
+ * Frees a Paper from build_paper() that was never inserted.
+ */
+void
+discard_paper(Paper* paper);
+
 /**
  * Creates a PaperDatabase struct with the given initial capacity, json path and
  * cache path, returns pointer to it.
@@ -87,6 +233,32 @@ create_paper(PaperDatabase* db,
 PaperDatabase*
 create_database(int initial_capacity, gchar* path, gchar* cache);
 
+/**
+ * Returns the Paper in @db whose PDF has @content_hash, or NULL.
+ */
+Paper*
+find_paper_by_hash(PaperDatabase* db, guint64 content_hash);
+
+/**
+ * Returns the Paper in @db for the PDF at @pdf_file, or NULL.
+ */
+Paper*
+find_paper_by_file(PaperDatabase* db, const gchar* pdf_file);
+
+/**
+ * Records @content_hash as the hash of the PDF of @paper, which belongs to a
+ * database, and indexes it for find_paper_by_hash().
+ */
+void
+paper_set_content_hash(Paper* paper, guint64 content_hash);
+
+/**
+ * Keeps the abstracts of Papers inserted from now on deflated in memory, see
+ * text_store_new_pool(). Abstracts loaded from the cache stay there anyway.
+ */
+void
+enable_abstract_compression(PaperDatabase* db);
+
 /**
  * Loads a PaperDatabase from the given json_path and cache_path into @db.
  * On failure, returns FALSE. Handles errors internally.
@@ -98,13 +270,6 @@ load_database(PaperDatabase* db,
               const gchar* json_path,
               const gchar* cache_path);
 
-/**
- * Asynchronously write the database out as JSON to db->path and cache to
- * db->cache.
- */
-void
-sync_json_and_cache(PaperDatabase* db);
-
 /**
  * Updates @paper with the given non-null parameters.
  */
@@ -134,6 +299,50 @@ remove_paper(PaperDatabase* db, Paper* paper);
 void
 reset_database(PaperDatabase* db);
 
+/**
+ * Copies the current contents of @db into a new PaperSnapshot.
+ * Strings of mapped Papers are borrowed from db->cache_map and
+ * db->cache_blocks (which the snapshot keeps references on), all others are
+ * copied. Locks are only held while copying. Lazy abstracts stay lazy.
+ * Free with free_snapshot().
+ */
+PaperSnapshot*
+snapshot_database(PaperDatabase* db);
+
+/**
+ * Like snapshot_database(), for writing to db->path: append_from is set to
+ * the records the file holds already, and the snapshot's records are assumed
+ * to be there from now on. If they don't make it, call
+ * invalidate_persisted_records().
+ */
+PaperSnapshot*
+snapshot_database_to_persist(PaperDatabase* db);
+
+/**
+ * Marks db->path as out of date after a failed write of a snapshot from
+ * snapshot_database_to_persist(), so the next one rewrites it.
+ */
+void
+invalidate_persisted_records(PaperDatabase* db);
+
+/**
+ * Returns a copy of the abstract of @record, which belongs to @snapshot,
+ * reading it from the cache if it is lazy. Free with g_free().
+ */
+gchar*
+snapshot_dup_abstract(const PaperSnapshot* snapshot, const PaperRecord* record);
+
+void
+free_snapshot(PaperSnapshot* snapshot);
+
+/**
+ * Returns a copy of the abstract of @paper, or NULL if it has none.
+ * Abstracts of Papers loaded from the cache are only read from it here, the
+ * first time they are needed. Free with g_free().
+ */
+gchar*
+paper_dup_abstract(Paper* paper);
+
 /**
  * Frees a PaperDatabase struct and all its Papers.
  */
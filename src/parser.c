@@ -5,11 +5,14 @@
 #include "parser.h"
 #include "cJSON/cJSON.h"
 #include "config.h"
+#include "hash.h"
 #include "loom.h"
 #include "paper.h"
+#include "trace.h"
 
 #include <gio/gio.h>
 #include <glib.h>
+#include <glib/gstdio.h>
 #include <limits.h>
 #include <unistd.h>
 
@@ -87,6 +90,7 @@ run_paperparser_on_pdf(const gchar* pdf_path,
     gchar* argv[] = { parser_path, (gchar*)pdf_path, NULL };
     g_autofree gchar* stderr_buf = NULL;
     gint exit_status = 0;
+    TRACE_BEGIN("parser", "paperparser");
     gboolean success = g_spawn_sync(NULL,
                                     argv,
                                     NULL,
@@ -97,6 +101,7 @@ run_paperparser_on_pdf(const gchar* pdf_path,
                                     &stderr_buf,
                                     &exit_status,
                                     error);
+    TRACE_END("parser", "paperparser");
     // g_autofree gchar* cmd = g_strdup_printf(
     //   "%s '%s'", parser_path, pdf_path); // freed before function return
     // gint exit_status = 0;
@@ -186,7 +191,10 @@ populate_metadata(Paper* p, cJSON* spans, GError** error)
  * @db owns the returned Paper.
  */
 static Paper*
-parser_run(PaperDatabase* db, const gchar* pdf_path, GError** error)
+parser_run(PaperDatabase* db,
+           const gchar* pdf_path,
+           guint64 content_hash,
+           GError** error)
 {
     // g_print("-run start-");
     g_autofree gchar* stdout_buf = NULL;
@@ -224,6 +232,8 @@ parser_run(PaperDatabase* db, const gchar* pdf_path, GError** error)
 
     Paper* p = initialize_paper(
       db, pdf_path, error); // owned by @db, freed by free_paper()
+    if (p && content_hash)
+        paper_set_content_hash(p, content_hash);
 
     /* Populate metadata */
     gboolean success = populate_metadata(p, spans, error);
@@ -239,8 +249,13 @@ typedef struct
 {
     gchar* pdf_path;
     PaperDatabase* db;
+    guint64 content_hash; // 0 unless run by async_import_pdf()
 } AsyncParserRunData;
 
+// content hash -> path of a PDF async_import_pdf() is parsing, main thread
+// only
+static GHashTable* importing_hashes = NULL;
+
 typedef struct
 {
     gpointer user_data;
@@ -267,6 +282,12 @@ parser_task_callback(gpointer callback_data,
         db = run_data->db;
     g_debug("error: %s\n", error ? error->message : "<NULL>");
     data->callback(db, paper, data->user_data, error);
+    // a different file with the same hash may hold the entry
+    if (run_data->content_hash &&
+        g_strcmp0(
+          g_hash_table_lookup(importing_hashes, &run_data->content_hash),
+          run_data->pdf_path) == 0)
+        g_hash_table_remove(importing_hashes, &run_data->content_hash);
 
     //// data->pdf_path was hard copied into p->pdf_file
     //// in initialize_paper(), so it needs to be freed here.
@@ -298,24 +319,27 @@ parser_task_worker(gpointer worker_data, GError** error)
         return NULL; // caller handles error
     }
 
-    Paper* p = parser_run(data->db, data->pdf_path, error);
+    Paper* p =
+      parser_run(data->db, data->pdf_path, data->content_hash, error);
     return p; // caller handles error
 }
 
-/**
- * Takes ownership of pdf_path.
- */
-void
-async_parser_run(PaperDatabase* db,
-                 gchar* pdf_path,
-                 void (*callback)(PaperDatabase*, Paper*, gpointer, GError*),
-                 gpointer user_data)
+/* Queues paperparser on @pdf_path, whose content hash is @content_hash if
+ * known, in @group if non-NULL. Takes ownership of @pdf_path. */
+static void
+queue_parser(PaperDatabase* db,
+             gchar* pdf_path,
+             guint64 content_hash,
+             LoomGroup* group,
+             void (*callback)(PaperDatabase*, Paper*, gpointer, GError*),
+             gpointer user_data)
 {
     AsyncParserRunData* worker_data =
       g_new0(AsyncParserRunData, 1); // freed by callback
     worker_data->pdf_path =
       pdf_path; // freed by callback (worker_data is not returned to *callback)
     worker_data->db = db;
+    worker_data->content_hash = content_hash;
     AsyncParserCallbackData* callback_data =
       g_new0(AsyncParserCallbackData, 1); // freed by callback
     callback_data->callback = callback;
@@ -330,6 +354,438 @@ async_parser_run(PaperDatabase* db,
     spec.knot = parser_task_callback;
     spec.knot_data = callback_data;
     spec.priority = 4;
+    spec.resource = LOOM_RESOURCE_ML;
+    spec.group = group;
 
     loom_queue_thread(loom, &spec, NULL);
 }
+
+/**
+ * Takes ownership of pdf_path.
+ */
+void
+async_parser_run(PaperDatabase* db,
+                 gchar* pdf_path,
+                 void (*callback)(PaperDatabase*, Paper*, gpointer, GError*),
+                 gpointer user_data)
+{
+    queue_parser(db, pdf_path, 0, NULL, callback, user_data);
+}
+
+/* Import: PDFs are hashed on the Loom pool first, and only those whose
+ * content isn't in the database yet go on to paperparser. Everything but
+ * the hashing runs on the main thread. */
+
+#define BACKFILL_TAG "import-backfill"
+#define BACKFILL_SIZES_TAG "import-backfill-sizes"
+
+typedef struct
+{
+    PaperDatabase* db;
+    gchar* pdf_path;
+    guint64 content_hash;
+    guint64 size;
+    LoomGroup* group; // NULL or a reference
+    void (*callback)(PaperDatabase*, Paper*, gpointer, GError*);
+    gpointer user_data;
+    gchar* compared_with;  // file with the same hash compared last, or NULL
+    gboolean same_content; // whether compared_with has the same bytes
+} ImportData;
+
+/* Papers imported before content hashing, hashed once on the first import
+ * so their files are recognized too */
+typedef struct
+{
+    PaperDatabase* db;
+    GPtrArray* pdf_files;
+    guint64* hashes; // per pdf_file, 0 if it can't be read
+} BackfillData;
+
+/* Sizes of the files the backfill hashes, stat'ed first so that only
+ * imports of a file with one of these sizes have to wait for it */
+typedef struct
+{
+    GPtrArray* pdf_files;
+    GHashTable* sizes; // owned guint64s, handed to backfill.sizes
+} BackfillSizesData;
+
+/* Backfill state, main thread only */
+static struct
+{
+    gboolean queued;
+    gboolean running;   // hashes aren't in the database yet
+    GHashTable* sizes;  // see BackfillSizesData, NULL until known
+    GPtrArray* waiting; // ImportData that may be copies of unhashed Papers
+} backfill = { 0 };
+
+static void
+check_import(ImportData* data);
+
+/* Runs the duplicate check again for the imports that waited on the
+ * backfill, those that still match wait on */
+static void
+recheck_waiting_imports(void)
+{
+    GPtrArray* waiting = backfill.waiting;
+    backfill.waiting = g_ptr_array_new(); // freed once the backfill is done
+    for (guint i = 0; i < waiting->len; ++i)
+        check_import(g_ptr_array_index(waiting, i));
+    g_ptr_array_free(waiting, TRUE);
+    if (!backfill.running)
+        g_clear_pointer(&backfill.waiting, g_ptr_array_unref);
+}
+
+static gpointer
+backfill_sizes_shuttle(gpointer shuttle_data, GError** error)
+{
+    (void)error; // missing files are never hashed, nothing waits for them
+    BackfillSizesData* data = shuttle_data;
+    for (guint i = 0; i < data->pdf_files->len; ++i) {
+        GStatBuf st;
+        if (g_stat(g_ptr_array_index(data->pdf_files, i), &st) != 0)
+            continue;
+        guint64* size = g_new(guint64, 1); // freed by data->sizes
+        *size = st.st_size;
+        g_hash_table_add(data->sizes, size);
+    }
+    return data;
+}
+
+static void
+backfill_sizes_knot(gpointer knot_data,
+                    gpointer shuttle_data,
+                    gpointer result,
+                    GError* error)
+{
+    (void)knot_data;
+    (void)result;
+    if (error)
+        g_error_free(error);
+    BackfillSizesData* data = shuttle_data;
+    g_debug("%u sizes among the files to backfill\n",
+            g_hash_table_size(data->sizes));
+    if (backfill.running) {
+        backfill.sizes = data->sizes; // freed by backfill_knot()
+        recheck_waiting_imports();
+    } else
+        g_hash_table_destroy(data->sizes);
+    g_ptr_array_free(data->pdf_files, TRUE);
+    g_free(data);
+}
+
+static gpointer
+backfill_shuttle(gpointer shuttle_data, GError** error)
+{
+    (void)error; // missing files just stay unhashed
+    BackfillData* data = shuttle_data;
+    for (guint i = 0; i < data->pdf_files->len; ++i) {
+        hash_file(g_ptr_array_index(data->pdf_files, i),
+                  &data->hashes[i],
+                  NULL,
+                  NULL);
+        loom_report_progress((gdouble)(i + 1) / data->pdf_files->len);
+    }
+    return data;
+}
+
+static void
+backfill_knot(gpointer knot_data,
+              gpointer shuttle_data,
+              gpointer result,
+              GError* error)
+{
+    (void)knot_data;
+    (void)result;
+    if (error)
+        g_error_free(error);
+    BackfillData* data = shuttle_data;
+    GHashTable* hashes = g_hash_table_new(
+      g_str_hash, g_str_equal); // pdf_file -> index + 1, freed before return
+    for (guint i = 0; i < data->pdf_files->len; ++i)
+        if (data->hashes[i])
+            g_hash_table_insert(hashes,
+                                g_ptr_array_index(data->pdf_files, i),
+                                GUINT_TO_POINTER(i + 1));
+
+    // Papers are only removed on the main thread, so they outlive the lock
+    GPtrArray* papers = g_ptr_array_new(); // freed before return
+    GArray* indices =
+      g_array_new(FALSE, FALSE, sizeof(guint)); // freed before return
+    WITH_DB_READ_LOCK(data->db, {
+        for (gint i = 0; i < data->db->count; ++i) {
+            Paper* p = data->db->papers[i];
+            guint index = p->content_hash || !p->pdf_file
+                            ? 0
+                            : GPOINTER_TO_UINT(
+                                g_hash_table_lookup(hashes, p->pdf_file));
+            if (index) {
+                g_ptr_array_add(papers, p);
+                index--;
+                g_array_append_val(indices, index);
+            }
+        }
+    });
+    for (guint i = 0; i < papers->len; ++i)
+        paper_set_content_hash(
+          g_ptr_array_index(papers, i),
+          data->hashes[g_array_index(indices, guint, i)]);
+    g_debug("Hashed %u of %u existing PDFs\n",
+            papers->len,
+            data->pdf_files->len);
+
+    g_array_free(indices, TRUE);
+    g_ptr_array_free(papers, TRUE);
+    g_hash_table_destroy(hashes);
+    g_ptr_array_free(data->pdf_files, TRUE);
+    g_free(data->hashes);
+    g_free(data);
+
+    // the waiting imports can be told apart from the library now
+    backfill.running = FALSE;
+    g_clear_pointer(&backfill.sizes, g_hash_table_destroy);
+    recheck_waiting_imports();
+}
+
+/* Queues the backfill on the first import if any Paper lacks a content
+ * hash, in that import's @group, so it shows in its progress. Imports don't
+ * depend on it: check_import() holds back only those that may be copies of
+ * a Paper it hashes. */
+static void
+queue_backfill(PaperDatabase* db, LoomGroup* group)
+{
+    if (backfill.queued)
+        return;
+    backfill.queued = TRUE;
+
+    GPtrArray* pdf_files =
+      g_ptr_array_new_with_free_func(g_free); // freed by backfill_knot()
+    GPtrArray* stat_files =
+      g_ptr_array_new_with_free_func(g_free); // freed by backfill_sizes_knot()
+    WITH_DB_READ_LOCK(db, {
+        for (gint i = 0; i < db->count; ++i) {
+            const gchar* pdf_file = db->papers[i]->pdf_file;
+            if (db->papers[i]->content_hash || !pdf_file)
+                continue;
+            g_ptr_array_add(pdf_files, g_strdup(pdf_file));
+            g_ptr_array_add(stat_files, g_strdup(pdf_file));
+        }
+    });
+    if (pdf_files->len == 0) {
+        g_ptr_array_free(pdf_files, TRUE);
+        g_ptr_array_free(stat_files, TRUE);
+        return;
+    }
+    backfill.running = TRUE;
+    backfill.waiting = g_ptr_array_new(); // freed by recheck_waiting_imports()
+
+    BackfillSizesData* sizes =
+      g_new0(BackfillSizesData, 1); // freed by backfill_sizes_knot()
+    sizes->pdf_files = stat_files;
+    sizes->sizes = g_hash_table_new_full(
+      g_int64_hash, g_int64_equal, g_free, NULL); // ditto, or backfill_knot()
+    LoomThreadSpec spec = loom_thread_spec_default();
+    spec.tag = BACKFILL_SIZES_TAG;
+    spec.shuttle = backfill_sizes_shuttle;
+    spec.shuttle_data = sizes;
+    spec.knot = backfill_sizes_knot;
+    spec.priority = 4; // before the hashing, it decides who waits for it
+    spec.resource = LOOM_RESOURCE_IO;
+    spec.group = group;
+    loom_queue_thread(loom_get_default(), &spec, NULL);
+
+    BackfillData* data = g_new0(BackfillData, 1); // freed by backfill_knot()
+    data->db = db;
+    data->pdf_files = pdf_files;
+    data->hashes =
+      g_new0(guint64, pdf_files->len); // freed by backfill_knot()
+    spec.tag = BACKFILL_TAG;
+    spec.shuttle = backfill_shuttle;
+    spec.shuttle_data = data;
+    spec.knot = backfill_knot;
+    spec.priority = 3;
+    loom_queue_thread(loom_get_default(), &spec, NULL);
+}
+
+static void
+free_import_data(ImportData* data)
+{
+    if (data->group)
+        loom_group_unref(data->group);
+    g_free(data->compared_with);
+    g_free(data);
+}
+
+static gpointer
+import_hash_shuttle(gpointer shuttle_data, GError** error)
+{
+    ImportData* data = shuttle_data;
+    if (!hash_file(data->pdf_path, &data->content_hash, &data->size, error))
+        return NULL; // caller handles error
+    return data;
+}
+
+static gpointer
+import_compare_shuttle(gpointer shuttle_data, GError** error)
+{
+    ImportData* data = shuttle_data;
+    if (!files_equal(
+          data->pdf_path, data->compared_with, &data->same_content, error))
+        return NULL; // caller handles error
+    return data;
+}
+
+static void
+import_compare_knot(gpointer knot_data,
+                    gpointer shuttle_data,
+                    gpointer result,
+                    GError* error)
+{
+    (void)knot_data;
+    (void)result;
+    ImportData* data = shuttle_data;
+    if (error) {
+        // most likely the other copy is gone, so the hash is all we have
+        g_debug("Can't compare '%s' to '%s', going by its hash: %s\n",
+                data->pdf_path,
+                data->compared_with,
+                error->message);
+        g_error_free(error);
+        data->same_content = TRUE;
+    }
+    check_import(data);
+}
+
+/* Compares the file of @data to @candidate, which has the same hash, on the
+ * Loom pool, then checks @data again. Takes ownership of @candidate. */
+static void
+queue_compare(ImportData* data, gchar* candidate)
+{
+    g_free(data->compared_with);
+    data->compared_with = candidate;
+    LoomThreadSpec spec = loom_thread_spec_default();
+    spec.tag = "import-compare";
+    spec.group = data->group;
+    spec.shuttle = import_compare_shuttle;
+    spec.shuttle_data = data;
+    spec.knot = import_compare_knot;
+    spec.priority = 3;
+    spec.resource = LOOM_RESOURCE_IO;
+    loom_queue_thread(loom_get_default(), &spec, NULL);
+}
+
+/* Hands @data on to the parser unless its content is in the library or
+ * being imported already. A file with the same hash is compared byte by byte
+ * first, so only a real copy is skipped. While the backfill runs, files the
+ * size of one it hashes wait for it. */
+static void
+check_import(ImportData* data)
+{
+    // also catches copies within the same import that are still parsing
+    Paper* existing = find_paper_by_hash(data->db, data->content_hash);
+    const gchar* importing =
+      g_hash_table_lookup(importing_hashes, &data->content_hash);
+    gchar* candidate = NULL; // freed below, or by queue_compare()
+    if (existing)
+        WITH_PAPER_LOCK(existing,
+                        { candidate = g_strdup(existing->pdf_file); });
+    else
+        candidate = g_strdup(importing);
+    gboolean duplicate = existing || importing;
+    if (duplicate && candidate && g_strcmp0(candidate, data->pdf_path) != 0) {
+        if (g_strcmp0(candidate, data->compared_with) != 0) {
+            queue_compare(data, candidate);
+            return;
+        }
+        duplicate = data->same_content;
+        if (!duplicate)
+            g_debug("'%s' only shares its hash with '%s'\n",
+                    data->pdf_path,
+                    candidate);
+    }
+    g_free(candidate);
+    if (duplicate) {
+        g_debug("Skipping '%s', its content is already imported\n",
+                data->pdf_path);
+        data->callback(data->db,
+                       existing,
+                       data->user_data,
+                       g_error_new(G_FILE_ERROR,
+                                   G_FILE_ERROR_EXIST,
+                                   "'%s' is already in the library",
+                                   data->pdf_path));
+        g_free(data->pdf_path);
+        free_import_data(data);
+        return;
+    }
+    gboolean may_be_unhashed =
+      !backfill.sizes || g_hash_table_contains(backfill.sizes, &data->size);
+    if (backfill.running && may_be_unhashed) {
+        g_debug("'%s' waits for the backfill\n", data->pdf_path);
+        g_ptr_array_add(backfill.waiting, data);
+        return;
+    }
+
+    if (!g_hash_table_contains(importing_hashes, &data->content_hash)) {
+        guint64* key = g_new(guint64, 1); // freed by importing_hashes
+        *key = data->content_hash;
+        g_hash_table_insert(
+          importing_hashes,
+          key,
+          g_strdup(data->pdf_path)); // freed by importing_hashes
+    }
+    queue_parser(data->db,
+                 data->pdf_path, // freed by the parser callback
+                 data->content_hash,
+                 data->group,
+                 data->callback,
+                 data->user_data);
+    free_import_data(data);
+}
+
+static void
+import_hash_knot(gpointer knot_data,
+                 gpointer shuttle_data,
+                 gpointer result,
+                 GError* error)
+{
+    (void)knot_data;
+    (void)result;
+    ImportData* data = shuttle_data;
+    if (error) {
+        data->callback(data->db, NULL, data->user_data, error);
+        g_free(data->pdf_path);
+        free_import_data(data);
+        return;
+    }
+    check_import(data);
+}
+
+void
+async_import_pdf(PaperDatabase* db,
+                 gchar* pdf_path,
+                 LoomGroup* group,
+                 void (*callback)(PaperDatabase*, Paper*, gpointer, GError*),
+                 gpointer user_data)
+{
+    if (!importing_hashes)
+        importing_hashes = g_hash_table_new_full(
+          g_int64_hash, g_int64_equal, g_free, g_free); // lives for the process
+
+    ImportData* data = g_new0(ImportData, 1); // freed by check_import()
+    data->db = db;
+    data->pdf_path = pdf_path; // handed on to the parser, or freed
+    data->group = group ? loom_group_ref(group) : NULL;
+    data->callback = callback;
+    data->user_data = user_data;
+    queue_backfill(db, group);
+
+    LoomThreadSpec spec = loom_thread_spec_default();
+    spec.tag = "import-hash";
+    spec.group = group;
+    spec.shuttle = import_hash_shuttle;
+    spec.shuttle_data = data;
+    spec.knot = import_hash_knot;
+    spec.priority = 3;
+    spec.resource = LOOM_RESOURCE_IO;
+    loom_queue_thread(loom_get_default(), &spec, NULL);
+}
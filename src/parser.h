@@ -1,6 +1,7 @@
 /* parser.h */
 #pragma once
 
+#include "loom.h"
 #include "paper.h"
 #include <glib.h>
 
@@ -33,4 +34,21 @@ async_parser_run(PaperDatabase* db,
                  void (*callback)(PaperDatabase*, Paper*, gpointer, GError*),
                  gpointer user_data);
 
+/**
+ * Like async_parser_run(), but hashes @pdf_path on the Loom pool first and
+ * skips paperparser if a Paper in @db, or an import still running, has the
+ * same content: the same hash, and the same bytes where both files can be
+ * read. For such a duplicate, `callback` gets the existing Paper (or
+ * NULL if it is still being parsed) and a G_FILE_ERROR_EXIST error.
+ * If @group is non-NULL, the import's threads join it, so waiting for the
+ * group waits until every callback ran.
+ * Must be called from the main thread.
+ */
+void
+async_import_pdf(PaperDatabase* db,
+                 gchar* pdf_path,
+                 LoomGroup* group,
+                 void (*callback)(PaperDatabase*, Paper*, gpointer, GError*),
+                 gpointer user_data);
+
 G_END_DECLS
@@ -0,0 +1,451 @@
+/* persist.c */
+#define G_LOG_DOMAIN "persist"
+
+#include "persist.h"
+#include "config.h"
+#include "hash.h"
+#include "journal.h"
+#include "loader.h"
+#include "loom.h"
+#include "paper.h"
+#include "serializer.h"
+#include "trace.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdint.h>
+
+/* Scheduler state, only touched on the main thread */
+static struct
+{
+    gint persisted_generation; // generation that is on disk
+    gint64 first_request_time; // first unserved request, 0 if none
+    guint quiet_source_id;     // pending debounce timeout
+    gboolean in_flight;        // write-json/write-cache are queued
+    gboolean pending;          // a request came in while in flight
+    guint jobs;                // queued or running, cache-only ones too
+    gboolean flushing;         // persist_flush() writes, don't start jobs
+} scheduler = { 0 };
+
+/*
+ * One persistence run: a single snapshot of the database, written out as
+ * JSON and cache by two workers in parallel. The cache is written unbound
+ * (without the JSON hash); whichever worker finishes last binds it to the
+ * JSON the other one hashed while streaming and moves it into place.
+ */
+typedef struct
+{
+    PaperDatabase* db;
+    PaperSnapshot* snapshot; // shared by both writers, freed with the job
+    gboolean cache_only;     // JSON on disk is current, just rebuild the cache
+    gboolean compacting;     // folds the journal into this snapshot
+    gint writers_running;    // atomic, the last one commits the cache
+    gint failed;             // atomic
+    uint64_t json_size;      // of the JSON just written
+    uint64_t json_hash;
+    gchar* cache_tmp_path; // unbound cache, see write_cache_unbound()
+    guint knots_pending;   // main thread only
+    GTimer* timer;
+} PersistJob;
+
+static void
+free_persist_job(PersistJob* job)
+{
+    free_snapshot(job->snapshot);
+    g_free(job->cache_tmp_path);
+    g_timer_destroy(job->timer);
+    g_free(job);
+}
+
+/**
+ * Called by each writer when done; the last one binds the cache to the new
+ * JSON and commits it. A cache for a JSON that failed to write is dropped.
+ */
+static void
+finish_writer(PersistJob* job, GError** error)
+{
+    if (!g_atomic_int_dec_and_test(&job->writers_running))
+        return;
+    if (!job->cache_tmp_path)
+        return;
+    if (g_atomic_int_get(&job->failed)) {
+        g_unlink(job->cache_tmp_path);
+        return;
+    }
+    if (job->cache_only &&
+        !hash_file(job->db->path, &job->json_hash, &job->json_size, NULL))
+        g_debug("No JSON at %s, cache will be treated as stale\n",
+                job->db->path);
+    if (!commit_cache(job->cache_tmp_path,
+                      job->db->cache,
+                      job->json_size,
+                      job->json_hash,
+                      error))
+        g_atomic_int_set(&job->failed, TRUE);
+}
+
+static gpointer
+write_json_shuttle(gpointer worker_data, GError** error)
+{
+    PersistJob* job = worker_data;
+    TRACE_BEGIN("persist", "write_json");
+    if (!write_json_snapshot(job->snapshot,
+                             job->db->path,
+                             &job->json_size,
+                             &job->json_hash,
+                             error))
+        g_atomic_int_set(&job->failed, TRUE);
+    TRACE_END("persist", "write_json");
+    finish_writer(job, error);
+    return NULL;
+}
+
+static gpointer
+write_cache_shuttle(gpointer worker_data, GError** error)
+{
+    PersistJob* job = worker_data;
+    TRACE_BEGIN("persist", "write_cache");
+    job->cache_tmp_path = write_cache_unbound(
+      job->snapshot, job->db->cache, job->db->compress_cache, error);
+    TRACE_END("persist", "write_cache");
+    if (!job->cache_tmp_path)
+        g_atomic_int_set(&job->failed, TRUE);
+    finish_writer(job, error);
+    return NULL;
+}
+
+/**
+ * Runs on the main thread once both writers of @job are tied off.
+ */
+static void
+finish_job(PersistJob* job)
+{
+    gboolean failed = g_atomic_int_get(&job->failed);
+    if (!failed)
+        g_message("Persisted %d papers (%s) in %.3f s\n",
+                  job->snapshot->count,
+                  job->cache_only ? "cache" : "JSON and cache",
+                  g_timer_elapsed(job->timer, NULL));
+
+    // cache-only jobs don't make the JSON any cleaner
+    if (!failed && !job->cache_only)
+        scheduler.persisted_generation = job->snapshot->generation;
+    else if (!job->cache_only)
+        invalidate_persisted_records(job->db);
+    // the journaled records are in the snapshot now; on failure they are
+    // kept and replayed on the next start
+    if (!failed && job->compacting)
+        journal_finish_compaction(job->db->journal);
+
+    // serve requests that came in while writing
+    PaperDatabase* db = job->db;
+    gboolean cache_only = job->cache_only;
+    free_persist_job(job);
+    scheduler.jobs--;
+    if (!cache_only) {
+        scheduler.in_flight = FALSE;
+        if (scheduler.pending && !scheduler.flushing) {
+            scheduler.pending = FALSE;
+            sync_json_and_cache(db);
+        }
+    }
+}
+
+static void
+write_knot(gpointer callback_data,
+           gpointer worker_data,
+           gpointer result,
+           GError* error)
+{
+    (void)result;
+    const gchar* what = callback_data;
+    PersistJob* job = worker_data;
+    if (error) {
+        g_warning("Error writing %s: %s\n", what, error->message);
+        g_clear_error(&error);
+    }
+    if (--job->knots_pending == 0)
+        finish_job(job);
+}
+
+static void
+queue_writer(PersistJob* job,
+             const gchar* tag,
+             LoomShuttleFunc shuttle,
+             const gchar* what)
+{
+    LoomThreadSpec spec = loom_thread_spec_default();
+    spec.tag = tag;
+    spec.shuttle = shuttle;
+    spec.shuttle_data = job;
+    spec.knot = write_knot;
+    spec.knot_data = (gpointer)what;
+    spec.priority = 5;
+    spec.resource = LOOM_RESOURCE_IO;
+    loom_queue_thread(loom_get_default(), &spec, NULL);
+}
+
+static gpointer
+snapshot_shuttle(gpointer worker_data, GError** error)
+{
+    (void)error;
+    PersistJob* job = worker_data;
+    job->timer = g_timer_new(); // freed by free_persist_job()
+    job->snapshot = job->cache_only ? snapshot_database(job->db)
+                                    : snapshot_database_to_persist(job->db);
+    return NULL;
+}
+
+/**
+ * Hands the snapshot to the writers, in parallel.
+ */
+static void
+snapshot_knot(gpointer callback_data,
+              gpointer worker_data,
+              gpointer result,
+              GError* error)
+{
+    (void)callback_data;
+    (void)result;
+    (void)error;
+    PersistJob* job = worker_data;
+    g_debug("Took snapshot of %d papers in %.3f s\n",
+            job->snapshot->count,
+            g_timer_elapsed(job->timer, NULL));
+
+    job->writers_running = job->knots_pending = job->cache_only ? 1 : 2;
+    if (!job->cache_only)
+        queue_writer(job, "write-json", write_json_shuttle, "JSON");
+    queue_writer(job, "write-cache", write_cache_shuttle, "cache");
+}
+
+/**
+ * Starts @job: snapshot once no parser is running and the previous run is
+ * done, then write.
+ */
+static void
+queue_persist_job(PersistJob* job)
+{
+    scheduler.jobs++;
+    LoomThreadSpec spec = loom_thread_spec_default();
+    spec.tag = "persist-snapshot";
+    spec.shuttle = snapshot_shuttle;
+    spec.shuttle_data = job;
+    spec.knot = snapshot_knot;
+    spec.priority = 5;
+    static const gchar* deps[] = {
+        "parser", "persist-snapshot", "write-json", "write-cache", NULL
+    };
+    spec.dependencies = deps;
+
+    loom_queue_thread(loom_get_default(), &spec, NULL);
+}
+
+/**
+ * Returns TRUE if @db's changes are safe in its journal and it is still
+ * small enough that a snapshot isn't worth writing yet.
+ */
+static gboolean
+journal_covers_changes(PaperDatabase* db)
+{
+    if (!db->journal)
+        return FALSE;
+    gsize size = journal_size(db->journal);
+    if (size >= JOURNAL_COMPACT_BYTES)
+        return FALSE;
+    g_debug("Changes are journaled (%zu bytes), no snapshot needed\n", size);
+    return TRUE;
+}
+
+/**
+ * Moves the journal aside for the snapshot about to be written.
+ * Returns TRUE if the snapshot should drop it once written.
+ */
+static gboolean
+begin_compaction(PaperDatabase* db)
+{
+    if (!db->journal)
+        return FALSE;
+    GError* error = NULL;
+    if (!journal_begin_compaction(db->journal, &error)) {
+        g_warning("Error compacting journal: %s\n", error->message);
+        g_clear_error(&error);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/**
+ * Snapshots @db and writes JSON and cache from it, unless nothing changed or
+ * the changes are still cheap to keep in the journal.
+ */
+static void
+persist_now(PaperDatabase* db)
+{
+    scheduler.first_request_time = 0;
+    if (scheduler.flushing)
+        return;
+    if (g_atomic_int_get(&db->generation) == scheduler.persisted_generation) {
+        g_debug("Database unchanged, skipping write\n");
+        return;
+    }
+    if (scheduler.in_flight) {
+        scheduler.pending = TRUE;
+        return;
+    }
+    if (journal_covers_changes(db))
+        return;
+    scheduler.in_flight = TRUE;
+
+    PersistJob* job = g_new0(PersistJob, 1); // freed by finish_job()
+    job->db = db;
+    job->compacting = begin_compaction(db);
+    queue_persist_job(job);
+}
+
+static gboolean
+on_persist_quiet(gpointer user_data)
+{
+    scheduler.quiet_source_id = 0;
+    persist_now(user_data);
+    return G_SOURCE_REMOVE;
+}
+
+/* Public API */
+
+void
+persist_mark_dirty(PaperDatabase* db)
+{
+    g_atomic_int_inc(&db->generation);
+}
+
+void
+persist_mark_clean(PaperDatabase* db)
+{
+    scheduler.persisted_generation = g_atomic_int_get(&db->generation);
+}
+
+void
+sync_json_and_cache(PaperDatabase* db)
+{
+    if (scheduler.flushing)
+        return;
+    gint64 now = g_get_monotonic_time();
+    if (!scheduler.first_request_time)
+        scheduler.first_request_time = now;
+
+    // debounce: every request restarts the quiet period...
+    if (scheduler.quiet_source_id)
+        g_source_remove(scheduler.quiet_source_id);
+    scheduler.quiet_source_id = 0;
+
+    // ...but a steady stream of requests must not starve the write
+    if (now - scheduler.first_request_time >=
+        (gint64)PERSIST_MAX_INTERVAL_MS * 1000) {
+        persist_now(db);
+        return;
+    }
+    scheduler.quiet_source_id =
+      g_timeout_add(PERSIST_QUIET_MS, on_persist_quiet, db);
+}
+
+static void
+group_done_knot(gpointer callback_data,
+                gpointer worker_data,
+                gpointer result,
+                GError* error)
+{
+    (void)worker_data;
+    (void)result;
+    PaperDatabase* db = callback_data;
+    if (error) {
+        g_debug("Not persisting: %s\n", error->message);
+        g_clear_error(&error);
+        return;
+    }
+    // the group's changes are written now, no need to wait for quiet
+    if (scheduler.quiet_source_id) {
+        g_source_remove(scheduler.quiet_source_id);
+        scheduler.quiet_source_id = 0;
+    }
+    persist_now(db);
+}
+
+void
+sync_json_and_cache_after(PaperDatabase* db, LoomGroup* group)
+{
+    LoomThreadSpec spec = loom_thread_spec_default();
+    spec.tag = "persist-after-group";
+    spec.knot = group_done_knot;
+    spec.knot_data = db;
+    spec.after_group = group;
+    loom_queue_thread(loom_get_default(), &spec, NULL);
+}
+
+void
+sync_cache(PaperDatabase* db)
+{
+    if (scheduler.flushing)
+        return;
+    PersistJob* job = g_new0(PersistJob, 1); // freed by finish_job()
+    job->db = db;
+    job->cache_only = TRUE; // doesn't touch the scheduler
+    queue_persist_job(job);
+}
+
+/**
+ * Runs the main loop until every queued job is finished. Jobs read @db on
+ * workers, and an older write-json finishing late would replace a newer JSON.
+ */
+static void
+wait_for_jobs(void)
+{
+    if (scheduler.jobs > 0)
+        g_debug("Waiting for %u persistence jobs\n", scheduler.jobs);
+    while (scheduler.jobs > 0)
+        g_main_context_iteration(NULL, TRUE);
+}
+
+gboolean
+persist_flush(PaperDatabase* db, GError** error)
+{
+    scheduler.flushing = TRUE;
+    if (scheduler.quiet_source_id) {
+        g_source_remove(scheduler.quiet_source_id);
+        scheduler.quiet_source_id = 0;
+    }
+    wait_for_jobs();
+    gint generation = g_atomic_int_get(&db->generation);
+    if (generation == scheduler.persisted_generation)
+        return TRUE;
+    if (journal_covers_changes(db))
+        return journal_sync(db->journal, error);
+
+    g_debug("Flushing database on shutdown\n");
+    GTimer* timer = g_timer_new(); // freed before return
+    gboolean compacting = begin_compaction(db);
+    PaperSnapshot* snapshot =
+      snapshot_database_to_persist(db); // freed by free_snapshot()
+    uint64_t json_size = 0;
+    uint64_t json_hash = 0;
+    gchar* cache_tmp_path = NULL; // freed before return
+    gboolean ok =
+      write_json_snapshot(
+        snapshot, db->path, &json_size, &json_hash, error) &&
+      (cache_tmp_path = write_cache_unbound(
+         snapshot, db->cache, db->compress_cache, error)) &&
+      commit_cache(cache_tmp_path, db->cache, json_size, json_hash, error);
+    if (ok) {
+        if (compacting)
+            journal_finish_compaction(db->journal);
+        scheduler.persisted_generation = snapshot->generation;
+        g_message("Persisted %d papers (JSON and cache) in %.3f s\n",
+                  snapshot->count,
+                  g_timer_elapsed(timer, NULL));
+    } else
+        invalidate_persisted_records(db);
+    g_free(cache_tmp_path);
+    free_snapshot(snapshot);
+    g_timer_destroy(timer);
+    return ok;
+}
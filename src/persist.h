@@ -0,0 +1,61 @@
+/* persist.h */
+#pragma once
+
+#include "loom.h"
+#include "paper.h"
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * Marks @db as changed by bumping its generation. Thread-safe, called by every
+ * mutation in paper.c.
+ */
+void
+persist_mark_dirty(PaperDatabase* db);
+
+/**
+ * Marks the current state of @db as the one on disk, e.g. right after
+ * loading it.
+ */
+void
+persist_mark_clean(PaperDatabase* db);
+
+/**
+ * Requests that the database is written out as JSON to db->path and cache to
+ * db->cache. Bursts of requests are coalesced into one write after
+ * PERSIST_QUIET_MS without requests, or at the latest PERSIST_MAX_INTERVAL_MS
+ * after the first one. Nothing is written if @db hasn't changed, or if its
+ * changes are in the journal and it is below JOURNAL_COMPACT_BYTES; otherwise
+ * the write compacts the journal into the new snapshot.
+ * Both files are written in parallel from one snapshot of @db.
+ * Must be called from the main thread.
+ */
+void
+sync_json_and_cache(PaperDatabase* db);
+
+/**
+ * Like sync_json_and_cache(), but writes once, right after every thread in
+ * @group is tied off, e.g. all threads of an import.
+ * Must be called from the main thread.
+ */
+void
+sync_json_and_cache_after(PaperDatabase* db, LoomGroup* group);
+
+/**
+ * Asynchronously rewrites only the cache, e.g. after a cold load from JSON.
+ */
+void
+sync_cache(PaperDatabase* db);
+
+/**
+ * Synchronously writes out pending changes, cancelling any scheduled write.
+ * Waits for queued and running writes first, so @db may be freed once it
+ * returns, and no later request starts another one. Changes that fit in the
+ * journal are only synced to disk. Call on shutdown.
+ * Returns FALSE and sets *error if writing failed.
+ */
+gboolean
+persist_flush(PaperDatabase* db, GError** error);
+
+G_END_DECLS
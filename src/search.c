@@ -1,6 +1,9 @@
 #define G_LOG_DOMAIN "search"
 
 #include "search.h"
+#include "config.h"
+#include "loom.h"
+#include "trace.h"
 #include <glib.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -67,11 +70,12 @@ contains_keyword(const gchar* field, const gchar* keyword)
  * simple relevance score
  */
 static gint
-score_paper(const Paper* paper,
+score_paper(Paper* paper,
             gchar keywords[MAX_KEYWORDS][MAX_KEYWORD_LEN],
             gint kw_count)
 {
     gint score = 0;
+    gboolean matched[MAX_KEYWORDS] = { FALSE };
     // printf("Scoring paper: %s...", paper->title ? paper->title : "NULL
     // title");
     gchar yearbuf[12];
@@ -82,8 +86,6 @@ score_paper(const Paper* paper,
         char* kw = keywords[i];
         if (contains_keyword(paper->title, kw))
             score += 5 * strlen(kw);
-        if (contains_keyword(paper->abstract, kw))
-            score += 1 * strlen(kw);
         if (contains_keyword(paper->arxiv_id, kw) ||
             contains_keyword(paper->doi, kw))
             score += 10 * strlen(kw);
@@ -91,16 +93,29 @@ score_paper(const Paper* paper,
         if (contains_keyword(yearbuf, kw))
             score += 10 * strlen(kw);
         for (int j = 0; j < paper->authors_count; j++) {
-            if (paper->authors[j] && contains_keyword(paper->authors[j], kw))
+            if (contains_keyword(paper_get_author(paper, j), kw))
                 score += 10 * strlen(kw);
         }
         for (int j = 0; j < paper->keyword_count; ++j)
-            if (contains_keyword(paper->keywords[j], keywords[i]))
+            if (contains_keyword(paper_get_keyword(paper, j), keywords[i]))
                 score += 3 * strlen(kw);
-        if (preScore == score) {
-            score = 0;
-            break;
+        matched[i] = preScore != score;
+    }
+    if (kw_count == 0)
+        return 0;
+
+    // last, as it may have to be faulted in from the cache; every match
+    // still counts, so it is read once for all keywords
+    g_autofree gchar* abstract =
+      paper_dup_abstract(paper); // freed on function return
+    for (int i = 0; i < kw_count; ++i) {
+        char* kw = keywords[i];
+        if (contains_keyword(abstract, kw)) {
+            score += 1 * strlen(kw);
+            matched[i] = TRUE;
         }
+        if (!matched[i])
+            return 0;
     }
     // printf(" score: %i\n", score);
     return score;
@@ -112,6 +127,26 @@ typedef struct
     gint score;
 } ScoredResult;
 
+typedef struct
+{
+    Paper** papers;
+    gchar (*keywords)[MAX_KEYWORD_LEN];
+    gint kw_count;
+    gint* scores;
+} ScoreJob;
+
+/**
+ * scores papers [@begin, @end) of a #ScoreJob, on a Loom worker or the caller
+ */
+static void
+score_range(gsize begin, gsize end, gpointer user_data)
+{
+    ScoreJob* job = user_data;
+    for (gsize i = begin; i < end; ++i)
+        job->scores[i] =
+          score_paper(job->papers[i], job->keywords, job->kw_count);
+}
+
 /**
  * comparison for sort
  */
@@ -133,8 +168,10 @@ search_papers(PaperDatabase* db,
               const Paper** results,
               gint max_results)
 {
+    TRACE_BEGIN("search", "search_papers");
     gchar keywords[MAX_KEYWORDS][MAX_KEYWORD_LEN];
     gint kw_count = tokenize_query(query, keywords);
+    GTimer* timer = g_timer_new(); // freed before return
 
     // growable ptr array to be auto cleaned up with g_free()
     GPtrArray* array = g_ptr_array_new_with_free_func(g_free);
@@ -143,8 +180,18 @@ search_papers(PaperDatabase* db,
     //WITH_DB_READ_LOCK(db, {
         Paper** papers = db->papers;
 
+        // papers are scored independently, abstracts faulting in on the way
+        gint* scores = g_new(gint, paper_count); // freed after collecting
+        ScoreJob job = { papers, keywords, kw_count, scores };
+        loom_parallel_for(loom_get_default(),
+                          0,
+                          paper_count,
+                          SEARCH_SCORE_GRAIN,
+                          score_range,
+                          &job);
+
         for (int i = 0; i < paper_count; ++i) {
-            gint score = score_paper(papers[i], keywords, kw_count);
+            gint score = scores[i];
             if (score > 0) {
                 ScoredResult* sr = g_new(ScoredResult, 1); // freed before return
                 sr->paper = papers[i];
@@ -152,6 +199,7 @@ search_papers(PaperDatabase* db,
                 g_ptr_array_add(array, sr); // christ, glib arrays are nice
             }
         }
+        g_free(scores);
 
         g_ptr_array_sort(array, compare_results); // (wraps qsort)
         limit =
@@ -164,5 +212,11 @@ search_papers(PaperDatabase* db,
 
     g_ptr_array_free(array, TRUE); // free the array and the ScoredResults
 
+    // abstracts dominate: how long they take to fault in or inflate
+    g_debug("Scored %d papers in %.3f ms\n",
+            paper_count,
+            g_timer_elapsed(timer, NULL) * 1000);
+    g_timer_destroy(timer);
+    TRACE_END("search", "search_papers");
     return limit;
 }
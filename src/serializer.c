@@ -1,112 +1,700 @@
 /* serializer.c */
+#define _POSIX_C_SOURCE 200809L // for fsync(), pwrite()
 #define G_LOG_DOMAIN "serializer"
 
 #include "serializer.h"
+#include "config.h"
+#include "hash.h"
+#include "loom.h"
 #include "paper.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <gio/gio.h>
 #include <glib.h>
+#include <glib/gstdio.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
 
+/* Held by the loaders from mapping the cache until they replaced a missing
+ * one with an empty file, and by commit_cache() around its rename */
 static GMutex cache_mutex;
 
-/* Helper: append a length-prefixed string to a GByteArray */
+/*
+ * Cache layout (native endianness, all offsets in bytes):
+ *
+ *   CacheHeader                      at 0
+ *   CacheRecord[record_count]        at header.records_offset
+ *   CacheChunk[chunk_count]          at header.chunks_offset
+ *   string heap                      at header.heap_offset
+ *   text heap                        at header.text_offset
+ *   dictionary                       at header.dict_offset
+ *
+ * Every string is stored NUL-terminated in the heap and referenced by its
+ * offset from the heap start; offset 0 means NULL. This lets load_cache()
+ * mmap the file and point Paper fields straight into the mapping.
+ *
+ * Authors and keywords are stored once, in the dictionary: a table of
+ * author_count + keyword_count offsets (from the dictionary start) to their
+ * NUL-terminated strings, authors first. Records list them as arrays of
+ * uint32_t indices into the author or keyword part of that table, stored in
+ * the heap. On load each entry is interned into author_dict() or
+ * keyword_dict() once, and records only map indices to ids.
+ *
+ * Abstracts live in the separate text heap, addressed the same way. It isn't
+ * touched on load: its ranges become the blocks of db->text_store and are
+ * only read, verified against their own checksum, when an abstract is.
+ *
+ * Records are grouped into chunks of CACHE_CHUNK_RECORDS. The heap data of a
+ * chunk is contiguous and checksummed together with its records, so chunks
+ * can be verified and decoded independently, in parallel.
+ *
+ * With CACHE_CODEC_ZLIB each chunk's heap and text ranges are stored deflated,
+ * one zlib stream each, and inflated into their own buffers when needed.
+ * Offsets still refer to the uncompressed heaps, whose ranges only exist
+ * chunk by chunk. That trades load time for a file a fraction of the size.
+ *
+ * The header also records size and XXH64 of the JSON file the cache was
+ * written for, so cache_up_to_date() can tell exactly whether it is stale.
+ */
+#define CACHE_MAGIC "PPCACHE"
+#define CACHE_VERSION 7
+#define CACHE_CHUNK_RECORDS 4096
+
+#define CACHE_CODEC_NONE 0
+#define CACHE_CODEC_ZLIB 1
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_count;
+    uint64_t records_offset;
+    uint64_t heap_offset;
+    uint64_t heap_size;
+    uint64_t json_size;
+    uint64_t json_hash;
+    uint32_t chunk_count;
+    uint32_t codec; // CACHE_CODEC_*
+    uint64_t chunks_offset;
+    uint64_t text_offset;
+    uint64_t text_size;
+    uint64_t dict_offset;
+    uint64_t dict_size;
+    uint32_t author_count;
+    uint32_t keyword_count;
+    uint64_t dict_checksum; // XXH64 of the dictionary
+} CacheHeader;
+
+/* Records [first_record, first_record + record_count) and the heap range
+ * [heap_start, heap_end) holding their strings, stored as stored_size bytes
+ * at stored_offset in the file's heap. Likewise for their abstracts in the
+ * text heap. */
+typedef struct
+{
+    uint32_t first_record;
+    uint32_t record_count;
+    uint64_t heap_start;
+    uint64_t heap_end;
+    uint64_t stored_offset; // heap_start unless compressed
+    uint64_t stored_size;
+    uint64_t checksum; // XXH64 of the records followed by the stored bytes
+    uint64_t text_start;
+    uint64_t text_end;
+    uint64_t text_stored_offset; // text_start unless compressed
+    uint64_t text_stored_size;
+    uint64_t text_checksum; // XXH64 of the stored text
+} CacheChunk;
+
+typedef struct
+{
+    int32_t year;
+    uint32_t authors_count;
+    uint32_t keyword_count;
+    uint32_t reserved;
+    uint64_t title;
+    uint64_t authors;  // heap offset of uint32_t[authors_count]
+    uint64_t keywords; // heap offset of uint32_t[keyword_count]
+    uint64_t abstract; // text heap offset
+    uint64_t arxiv_id;
+    uint64_t doi;
+    uint64_t pdf_file;
+    uint64_t content_hash; // of the PDF, 0 if unknown
+} CacheRecord;
+
+/* Helper: append a NUL-terminated string to the heap, return its offset */
+static uint64_t
+append_string_to_heap(GByteArray* heap, const char* s)
+{
+    if (!s)
+        return 0;
+    uint64_t offset = heap->len;
+    g_byte_array_append(heap, (const guint8*)s, (guint)strlen(s) + 1);
+    return offset;
+}
+
+/* Helper: pad the heap to a multiple of 8 bytes */
 static void
-append_string_to_buffer(GByteArray* buffer, const char* s)
+align_heap(GByteArray* heap)
 {
-    uint32_t len = s ? (uint32_t)strlen(s) : 0;
-    g_byte_array_append(buffer, (const guint8*)&len, sizeof(len));
-    if (len)
-        g_byte_array_append(buffer, (const guint8*)s, len);
+    static const guint8 padding[8] = { 0 };
+    if (heap->len % 8)
+        g_byte_array_append(heap, padding, 8 - heap->len % 8);
 }
 
-/* Helper: read a length-prefixed string from data blob */
+/* Dictionary ids used by one cache, numbered in order of first use */
+typedef struct
+{
+    GHashTable* indices; // id + 1 -> index + 1
+    GArray* ids;         // index -> id
+} CacheDict;
+
+static void
+cache_dict_init(CacheDict* dict)
+{
+    dict->indices = g_hash_table_new(g_direct_hash, g_direct_equal);
+    dict->ids = g_array_new(FALSE, FALSE, sizeof(guint32));
+}
+
+static void
+cache_dict_clear(CacheDict* dict)
+{
+    g_hash_table_destroy(dict->indices);
+    g_array_free(dict->ids, TRUE);
+}
+
+/* Helper: append @ids as an array of @dict indices, return its offset */
+static uint64_t
+append_id_array_to_heap(GByteArray* heap,
+                        CacheDict* dict,
+                        const guint32* ids,
+                        int count)
+{
+    if (count <= 0)
+        return 0;
+    // keep the array aligned inside the mapping
+    align_heap(heap);
+    uint64_t offset = heap->len;
+    for (int i = 0; i < count; ++i) {
+        gpointer key = GUINT_TO_POINTER(ids[i] + 1);
+        uint32_t index = GPOINTER_TO_UINT(
+          g_hash_table_lookup(dict->indices, key)); // index + 1
+        if (index == 0) {
+            g_array_append_val(dict->ids, ids[i]);
+            index = dict->ids->len;
+            g_hash_table_insert(dict->indices, key, GUINT_TO_POINTER(index));
+        }
+        index--;
+        g_byte_array_append(heap, (const guint8*)&index, sizeof(index));
+    }
+    return offset;
+}
+
+/* Helper: append the strings of @dict's ids to the dictionary @section,
+ * filling in their entries of the offset table at its start from @first on.
+ * Appending moves section->data, so the table is looked up every time. */
+static void
+append_dict_strings(GByteArray* section,
+                    guint first,
+                    StringDict* strings,
+                    const CacheDict* dict)
+{
+    for (guint i = 0; i < dict->ids->len; ++i) {
+        const gchar* s =
+          string_dict_get(strings, g_array_index(dict->ids, guint32, i));
+        ((uint64_t*)(void*)section->data)[first + i] = section->len;
+        g_byte_array_append(section, (const guint8*)s, (guint)strlen(s) + 1);
+    }
+}
+
+/* The heap range of one chunk: offsets [start, end) are found at data */
+typedef struct
+{
+    const gchar* data;
+    uint64_t start;
+    uint64_t end;
+} HeapWindow;
+
+/* Helper: resolve a heap offset to a string inside the chunk's window */
 static gboolean
-read_string_from_data(const guchar* data,
-                      gsize length,
-                      gsize* offset,
-                      gchar** out)
+heap_string(const HeapWindow* window, uint64_t offset, const gchar** out)
 {
-    if (*offset + sizeof(uint32_t) > length)
+    // the mapped heap and every inflated block are NUL-terminated (see
+    // load_cache() and decode_cache_chunk()), so any in-bounds offset yields
+    // a terminated string
+    if (offset == 0) {
+        *out = NULL;
+        return TRUE;
+    }
+    if (offset < window->start || offset >= window->end)
         return FALSE;
-    uint32_t len;
-    memcpy(&len, data + *offset, sizeof(len));
-    *offset += sizeof(len);
-    if (*offset + len > length)
+    *out = window->data + (offset - window->start);
+    return TRUE;
+}
+
+/* Helper: resolve a heap offset to an array of dictionary indices below
+ * @limit */
+static gboolean
+heap_index_array(const HeapWindow* window,
+                 uint64_t offset,
+                 uint32_t count,
+                 uint32_t limit,
+                 const uint32_t** out)
+{
+    *out = NULL;
+    if (count == 0)
+        return TRUE;
+    if (offset < window->start || offset > window->end ||
+        (window->end - offset) / sizeof(uint32_t) < count)
         return FALSE;
-    if (len > 0) {
-        *out =
-          g_strndup((const gchar*)(data + *offset), len); // caller owns out
-    } else {
-        *out = NULL;
+    const gchar* data = window->data + (offset - window->start);
+    if ((uintptr_t)data % sizeof(uint32_t))
+        return FALSE;
+    const uint32_t* indices = (const uint32_t*)data;
+    for (uint32_t i = 0; i < count; ++i)
+        if (indices[i] >= limit)
+            return FALSE;
+    *out = indices;
+    return TRUE;
+}
+
+/* Helper: map validated @indices to ids through @map, referencing each */
+static guint32*
+map_indices(StringDict* dict,
+            const guint32* map,
+            const uint32_t* indices,
+            uint32_t count)
+{
+    if (count == 0)
+        return NULL;
+    guint32* ids = g_new(guint32, count); // owned by the Paper
+    for (uint32_t i = 0; i < count; ++i) {
+        ids[i] = map[indices[i]];
+        string_dict_ref(dict, ids[i]);
     }
-    *offset += len;
+    return ids;
+}
+
+/* Helper: store @heap's range [start, end) onto @stored, deflated if
+ * @compress, and report where it went */
+static gboolean
+store_range(GByteArray* stored,
+            const GByteArray* heap,
+            gboolean compress,
+            uint64_t start,
+            uint64_t end,
+            uint64_t* out_offset,
+            uint64_t* out_size)
+{
+    if (!compress) {
+        // stored is the heap itself
+        *out_offset = start;
+        *out_size = end - start;
+        return TRUE;
+    }
+    uLong length = end - start;
+    uLongf size = compressBound(length);
+    guint offset = stored->len;
+    g_byte_array_set_size(stored, offset + size);
+    if (compress2(stored->data + offset,
+                  &size,
+                  heap->data + start,
+                  length,
+                  CACHE_COMPRESSION_LEVEL) != Z_OK) {
+        g_byte_array_set_size(stored, offset);
+        return FALSE;
+    }
+    g_byte_array_set_size(stored, offset + size);
+    *out_offset = offset;
+    *out_size = size;
     return TRUE;
 }
 
+/* Helper: checksum of a chunk's records and stored heap range */
+static uint64_t
+chunk_checksum(const CacheRecord* records,
+               uint32_t record_count,
+               const gchar* stored,
+               gsize stored_size)
+{
+    Xxh64State state;
+    xxh64_init(&state, 0);
+    xxh64_update(&state, records, sizeof(CacheRecord) * record_count);
+    xxh64_update(&state, stored, stored_size);
+    return xxh64_digest(&state);
+}
+
 bool
 cache_up_to_date(const char* json_path, const char* cache_path)
 {
-    struct stat js, cs;
-    return (stat(cache_path, &cs) == 0 && stat(json_path, &js) == 0 &&
-            cs.st_mtime >= js.st_mtime);
+    CacheHeader header;
+    FILE* f = fopen(cache_path, "rb"); // closed before return
+    if (!f)
+        return FALSE;
+    gboolean read = fread(&header, sizeof(header), 1, f) == 1;
+    fclose(f);
+    if (!read || memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+        header.version != CACHE_VERSION)
+        return FALSE;
+
+    // the size check catches most edits without reading the JSON
+    struct stat js;
+    if (stat(json_path, &js) != 0 || (uint64_t)js.st_size != header.json_size)
+        return FALSE;
+
+    uint64_t json_hash = 0;
+    if (!hash_file(json_path, &json_hash, NULL, NULL))
+        return FALSE;
+    return json_hash == header.json_hash;
+}
+
+/* Writes all of @data to @fd, retrying short writes */
+static gboolean
+write_all(int fd, const void* data, gsize length)
+{
+    const guint8* p = data;
+    while (length > 0) {
+        gssize n = write(fd, p, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return FALSE;
+        p += n;
+        length -= n;
+    }
+    return TRUE;
+}
+
+gchar*
+write_cache_unbound(const PaperSnapshot* snapshot,
+                    const gchar* cache_path,
+                    gboolean compress,
+                    GError** error)
+{
+    g_debug("Writing %scache for %s\n",
+            compress ? "compressed " : "",
+            cache_path);
+    GTimer* timer = g_timer_new();            // freed before return
+    GByteArray* records = g_byte_array_new(); // freed before return
+    GByteArray* heap = g_byte_array_new();    // freed before return
+    GByteArray* text = g_byte_array_new();    // freed before return
+    // what goes into the file: the heaps themselves, or their chunks deflated
+    GByteArray* stored =
+      compress ? g_byte_array_new() : heap; // freed before return
+    GByteArray* text_stored =
+      compress ? g_byte_array_new() : text; // freed before return
+    // offset 0 is reserved for NULL
+    static const guint8 nul = 0;
+    g_byte_array_append(heap, &nul, 1);
+    g_byte_array_append(text, &nul, 1);
+    if (compress) {
+        g_byte_array_append(stored, &nul, 1);
+        g_byte_array_append(text_stored, &nul, 1);
+    }
+
+    CacheDict authors, keywords;
+    cache_dict_init(&authors);
+    cache_dict_init(&keywords);
+
+    gboolean ok = TRUE;
+    uint32_t count = (uint32_t)snapshot->count;
+    GArray* chunks =
+      g_array_new(FALSE, TRUE, sizeof(CacheChunk)); // freed before return
+    for (uint32_t first = 0; ok && first < count;
+         first += CACHE_CHUNK_RECORDS) {
+        CacheChunk chunk = { 0 };
+        chunk.first_record = first;
+        chunk.record_count = MIN(CACHE_CHUNK_RECORDS, count - first);
+        // keeps offset arrays aligned in blocks inflated on their own
+        align_heap(heap);
+        chunk.heap_start = heap->len;
+        chunk.text_start = text->len;
+        for (uint32_t i = first; i < first + chunk.record_count; ++i) {
+            const PaperRecord* p = &snapshot->records[i];
+            CacheRecord record = { 0 };
+            record.year = (int32_t)p->year;
+            record.title = append_string_to_heap(heap, p->title);
+            record.authors_count = (uint32_t)p->authors_count;
+            record.authors = append_id_array_to_heap(
+              heap, &authors, p->author_ids, p->authors_count);
+            record.keyword_count = (uint32_t)p->keyword_count;
+            record.keywords = append_id_array_to_heap(
+              heap, &keywords, p->keyword_ids, p->keyword_count);
+            g_autofree gchar* abstract = // freed at the end of the iteration
+              snapshot_dup_abstract(snapshot, p);
+            record.abstract = append_string_to_heap(text, abstract);
+            record.arxiv_id = append_string_to_heap(heap, p->arxiv_id);
+            record.doi = append_string_to_heap(heap, p->doi);
+            record.pdf_file = append_string_to_heap(heap, p->pdf_file);
+            record.content_hash = p->content_hash;
+            g_byte_array_append(
+              records, (const guint8*)&record, sizeof(record));
+        }
+        chunk.heap_end = heap->len;
+        chunk.text_end = text->len;
+        ok = store_range(stored,
+                         heap,
+                         compress,
+                         chunk.heap_start,
+                         chunk.heap_end,
+                         &chunk.stored_offset,
+                         &chunk.stored_size) &&
+             store_range(text_stored,
+                         text,
+                         compress,
+                         chunk.text_start,
+                         chunk.text_end,
+                         &chunk.text_stored_offset,
+                         &chunk.text_stored_size);
+        if (!ok)
+            break;
+        chunk.checksum =
+          chunk_checksum((const CacheRecord*)records->data + first,
+                         chunk.record_count,
+                         (const gchar*)stored->data + chunk.stored_offset,
+                         chunk.stored_size);
+        chunk.text_checksum =
+          xxh64(text_stored->data + chunk.text_stored_offset,
+                chunk.text_stored_size,
+                0);
+        g_array_append_val(chunks, chunk);
+    }
+    if (!ok) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_NOMEM,
+                    "Failed to compress cache for %s",
+                    cache_path);
+        if (compress) {
+            g_byte_array_unref(stored);
+            g_byte_array_unref(text_stored);
+        }
+        g_byte_array_unref(records);
+        g_array_unref(chunks);
+        g_byte_array_unref(heap);
+        g_byte_array_unref(text);
+        cache_dict_clear(&authors);
+        cache_dict_clear(&keywords);
+        g_timer_destroy(timer);
+        return NULL;
+    }
+
+    // the snapshot holds references on all ids, so their strings are valid
+    uint32_t author_count = authors.ids->len;
+    uint32_t keyword_count = keywords.ids->len;
+    gsize table_size = sizeof(uint64_t) * (author_count + keyword_count);
+    GByteArray* dict = g_byte_array_sized_new(
+      (guint)table_size); // freed before return
+    g_byte_array_set_size(dict, (guint)table_size);
+    append_dict_strings(dict, 0, author_dict(), &authors);
+    append_dict_strings(dict, author_count, keyword_dict(), &keywords);
+    cache_dict_clear(&authors);
+    cache_dict_clear(&keywords);
+
+    // json_size and json_hash are filled in by commit_cache()
+    CacheHeader header = { 0 };
+    memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.record_count = count;
+    header.records_offset = sizeof(CacheHeader);
+    header.chunk_count = chunks->len;
+    header.codec = compress ? CACHE_CODEC_ZLIB : CACHE_CODEC_NONE;
+    header.chunks_offset = header.records_offset + records->len;
+    header.heap_offset =
+      header.chunks_offset + sizeof(CacheChunk) * chunks->len;
+    header.heap_size = stored->len;
+    header.text_offset = header.heap_offset + stored->len;
+    header.text_size = text_stored->len;
+    // the offset table is read in place, keep it aligned
+    header.dict_offset = (header.text_offset + text_stored->len + 7) & ~7ull;
+    header.dict_size = dict->len;
+    header.author_count = author_count;
+    header.keyword_count = keyword_count;
+    header.dict_checksum = xxh64(dict->data, dict->len, 0);
+
+    /* Write header, records and heap to a temporary file */
+    static const guint8 padding[8] = { 0 };
+    gsize padding_size =
+      header.dict_offset - header.text_offset - text_stored->len;
+    gchar* tmp_path =
+      g_strdup_printf("%s.XXXXXX", cache_path); // owned by caller
+    int fd = g_mkstemp_full(tmp_path, O_RDWR | O_CLOEXEC, 0666);
+    ok = fd >= 0 && write_all(fd, &header, sizeof(header)) &&
+         write_all(fd, records->data, records->len) &&
+         write_all(fd, chunks->data, sizeof(CacheChunk) * chunks->len) &&
+         write_all(fd, stored->data, stored->len) &&
+         write_all(fd, text_stored->data, text_stored->len) &&
+         write_all(fd, padding, padding_size) &&
+         write_all(fd, dict->data, dict->len);
+    if (!ok)
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Failed to write cache for %s: %s",
+                    cache_path,
+                    g_strerror(errno));
+    if (fd >= 0) {
+        close(fd);
+        if (!ok)
+            g_unlink(tmp_path);
+    }
+    if (ok)
+        g_debug("Wrote %u cache chunks, %u of %u heap and %u of %u text bytes "
+                "stored, %u authors and %u keywords, in %.3f s\n",
+                chunks->len,
+                stored->len,
+                heap->len,
+                text_stored->len,
+                text->len,
+                author_count,
+                keyword_count,
+                g_timer_elapsed(timer, NULL));
+    if (compress) {
+        g_byte_array_unref(stored);
+        g_byte_array_unref(text_stored);
+    }
+    g_byte_array_unref(records);
+    g_array_unref(chunks);
+    g_byte_array_unref(heap);
+    g_byte_array_unref(text);
+    g_byte_array_unref(dict);
+    g_timer_destroy(timer);
+    if (!ok) {
+        g_free(tmp_path);
+        return NULL;
+    }
+    return tmp_path;
 }
 
 bool
-write_cache(const PaperDatabase* db, GError** error)
+commit_cache(const gchar* tmp_path,
+             const gchar* cache_path,
+             uint64_t json_size,
+             uint64_t json_hash,
+             GError** error)
 {
-    g_debug("Writing cache to %s\n", db->cache);
+    int fd = g_open(tmp_path, O_WRONLY | O_CLOEXEC, 0);
+    gboolean ok =
+      fd >= 0 &&
+      pwrite(fd,
+             &json_size,
+             sizeof(json_size),
+             offsetof(CacheHeader, json_size)) == sizeof(json_size) &&
+      pwrite(fd,
+             &json_hash,
+             sizeof(json_hash),
+             offsetof(CacheHeader, json_hash)) == sizeof(json_hash) &&
+      fsync(fd) == 0;
+    if (fd >= 0)
+        close(fd);
+
+    /* Swap in the new file */
+    // the old file stays alive for as long as it is mapped. The rename is
+    // atomic on its own, the lock keeps a loader that found no cache from
+    // writing its empty one over the file renamed in meanwhile
     g_mutex_lock(&cache_mutex);
-    /* Build a binary buffer of cache contents */
-    GByteArray* buffer = g_byte_array_new(); // freed before return
-/* Helper to append raw data */
-#define APPEND(data) g_byte_array_append(buffer, (guint8*)&(data), sizeof(data))
-
-    /* Number of entries */
-    uint32_t count = (uint32_t)db->count;
-    APPEND(count);
-
-    for (int i = 0; i < db->count; ++i) {
-        const Paper* p = db->papers[i];
-        /* Year */
-        uint32_t year = (uint32_t)p->year;
-        APPEND(year);
-
-        append_string_to_buffer(buffer, p->title);
-
-        /* Authors array */
-        uint32_t ac = (uint32_t)p->authors_count;
-        APPEND(ac);
-        for (int j = 0; j < p->authors_count; ++j)
-            append_string_to_buffer(buffer, p->authors[j]);
-
-        /* Keywords array */
-        uint32_t kc = (uint32_t)p->keyword_count;
-        APPEND(kc);
-        for (int j = 0; j < p->keyword_count; ++j)
-            append_string_to_buffer(buffer, p->keywords[j]);
-
-        /* Other fields */
-        append_string_to_buffer(buffer, p->abstract);
-        append_string_to_buffer(buffer, p->arxiv_id);
-        append_string_to_buffer(buffer, p->doi);
-        append_string_to_buffer(buffer, p->pdf_file);
+    ok = ok && g_rename(tmp_path, cache_path) == 0;
+    g_mutex_unlock(&cache_mutex);
+    if (!ok) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    g_file_error_from_errno(errno),
+                    "Failed to commit cache %s: %s",
+                    cache_path,
+                    g_strerror(errno));
+        g_unlink(tmp_path);
+        return FALSE;
     }
-#undef APPEND
+    g_debug("Successfully wrote cache to %s\n", cache_path);
+    return TRUE;
+}
 
-    /* Write buffer atomically to cache file */
-    if (!g_file_set_contents(
-          db->cache, (const char*)buffer->data, buffer->len, error)) {
-        g_byte_array_unref(buffer);
-        g_mutex_unlock(&cache_mutex);
+bool
+write_cache_snapshot(const PaperSnapshot* snapshot,
+                     const gchar* json_path,
+                     const gchar* cache_path,
+                     gboolean compress,
+                     GError** error)
+{
+    g_autofree gchar* tmp_path = // freed on function return
+      write_cache_unbound(snapshot, cache_path, compress, error);
+    if (!tmp_path)
+        return FALSE;
+
+    // bind the cache to the JSON currently on disk
+    uint64_t json_size = 0;
+    uint64_t json_hash = 0;
+    if (!hash_file(json_path, &json_hash, &json_size, NULL))
+        g_debug("No JSON at %s, cache will be treated as stale\n", json_path);
+    return commit_cache(tmp_path, cache_path, json_size, json_hash, error);
+}
+
+bool
+write_cache(const PaperDatabase* db, GError** error)
+{
+    PaperSnapshot* snapshot =
+      snapshot_database((PaperDatabase*)db); // freed by free_snapshot()
+    gboolean ok = write_cache_snapshot(
+      snapshot, db->path, db->cache, db->compress_cache, error);
+    free_snapshot(snapshot);
+    return ok;
+}
+
+static gboolean
+read_cache_header(const gchar* path,
+                  const gchar* data,
+                  gsize length,
+                  CacheHeader* header,
+                  GError** error)
+{
+    if (length < sizeof(CacheHeader)) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_FAILED,
+                    "Cache '%s' is too small (%zu bytes)",
+                    path,
+                    length);
+        return FALSE;
+    }
+    memcpy(header, data, sizeof(CacheHeader));
+    if (memcmp(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 ||
+        header->version != CACHE_VERSION ||
+        (header->codec != CACHE_CODEC_NONE &&
+         header->codec != CACHE_CODEC_ZLIB)) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_FAILED,
+                    "Cache '%s' has an unknown format",
+                    path);
+        return FALSE;
+    }
+    if (header->records_offset % 8 || header->records_offset > length ||
+        (length - header->records_offset) / sizeof(CacheRecord) <
+          header->record_count ||
+        header->heap_offset > length ||
+        header->heap_size > length - header->heap_offset ||
+        header->heap_size == 0 || header->text_offset > length ||
+        header->text_size > length - header->text_offset ||
+        header->dict_offset % 8 || header->dict_offset > length ||
+        header->dict_size > length - header->dict_offset ||
+        header->dict_size / sizeof(uint64_t) <
+          (uint64_t)header->author_count + header->keyword_count ||
+        header->chunks_offset % 8 ||
+        header->chunks_offset > length ||
+        (length - header->chunks_offset) / sizeof(CacheChunk) <
+          header->chunk_count) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_FAILED,
+                    "Cache '%s' is truncated",
+                    path);
         return FALSE;
     }
-    g_byte_array_unref(buffer);
-    g_mutex_unlock(&cache_mutex);
-    g_debug("Successfully wrote cache to %s\n", db->cache);
     return TRUE;
 }
 
@@ -121,180 +709,406 @@ load_cache_count(const PaperDatabase* db, GError** error)
 
     g_mutex_lock(&cache_mutex);
 
-    g_autofree gchar* data = NULL; // freed on function return
-    gsize length = 0;
-    if (!g_file_get_contents(db->cache, &data, &length, error)) {
+    GMappedFile* map =
+      g_mapped_file_new(db->cache, FALSE, error); // freed before return
+    if (!map) {
         // if cache is missing create empty cache file
         if (error && *error &&
             g_error_matches(*error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
             g_clear_error(error);
             g_file_set_contents(db->cache, "", 0, NULL);
-            g_mutex_unlock(&cache_mutex);
-            return 0;
         }
         g_mutex_unlock(&cache_mutex);
         return 0;
     }
-    // check if file is too small
-    if (length < sizeof(uint32_t)) {
-        g_mutex_unlock(&cache_mutex);
-        return 0;
-    }
 
-    uint32_t count;
-    memcpy(&count, data, sizeof(count)); // stack-allocated
+    CacheHeader header;
+    gboolean valid = read_cache_header(db->cache,
+                                       g_mapped_file_get_contents(map),
+                                       g_mapped_file_get_length(map),
+                                       &header,
+                                       error);
+    g_mapped_file_unref(map);
     g_mutex_unlock(&cache_mutex);
-    return (int)count;
+    return valid ? (int)header.record_count : 0;
+}
+
+/* A validated, mapped cache file */
+typedef struct
+{
+    const CacheRecord* records;
+    const CacheChunk* chunks;
+    const gchar* heap;
+    uint64_t heap_size;
+    uint32_t codec;
+    const guint32* author_ids; // per dictionary index
+    uint32_t author_count;
+    const guint32* keyword_ids; // per dictionary index
+    uint32_t keyword_count;
+} CacheView;
+
+/* Shared by the chunk decoders of one load */
+typedef struct
+{
+    const CacheView* view;
+    GPtrArray** batches; // per chunk, NULL if the chunk is corrupt
+    gchar** blocks;      // per chunk, inflated heap range if compressed
+} CacheLoad;
+
+/**
+ * Verifies chunk @index of @view and decodes its records into detached mapped
+ * Papers. Returns NULL if the chunk is corrupt.
+ * For a compressed cache, *out_block receives the inflated heap range the
+ * Papers point into, otherwise NULL.
+ */
+static GPtrArray*
+decode_cache_chunk(const CacheView* view, guint index, gchar** out_block)
+{
+    *out_block = NULL;
+    const CacheChunk* chunk = &view->chunks[index];
+    const CacheRecord* records = view->records + chunk->first_record;
+    const gchar* stored = view->heap + chunk->stored_offset;
+    if (chunk_checksum(
+          records, chunk->record_count, stored, chunk->stored_size) !=
+        chunk->checksum)
+        return NULL;
+
+    HeapWindow window = { stored, chunk->heap_start, chunk->heap_end };
+    gchar* block = NULL; // handed to the caller on success
+    if (view->codec == CACHE_CODEC_ZLIB) {
+        uLongf length = chunk->heap_end - chunk->heap_start;
+        // the extra NUL terminates strings running off the end of the range
+        block = g_malloc(length + 1);
+        if (uncompress((Bytef*)block,
+                       &length,
+                       (const Bytef*)stored,
+                       chunk->stored_size) != Z_OK ||
+            length != chunk->heap_end - chunk->heap_start) {
+            g_free(block);
+            return NULL;
+        }
+        block[length] = '\0';
+        window.data = block;
+    }
+
+    GPtrArray* papers =
+      g_ptr_array_sized_new(chunk->record_count); // owned by the caller
+    for (uint32_t i = 0; i < chunk->record_count; ++i) {
+        const CacheRecord* r = &records[i];
+        const gchar *title, *arxiv_id, *doi, *pdf_file;
+        const uint32_t *authors, *keywords;
+        gboolean valid =
+          heap_string(&window, r->title, &title) &&
+          (r->abstract == 0 || (r->abstract >= chunk->text_start &&
+                                r->abstract < chunk->text_end)) &&
+          heap_string(&window, r->arxiv_id, &arxiv_id) &&
+          heap_string(&window, r->doi, &doi) &&
+          heap_string(&window, r->pdf_file, &pdf_file) && pdf_file &&
+          heap_index_array(&window,
+                           r->authors,
+                           r->authors_count,
+                           view->author_count,
+                           &authors) &&
+          heap_index_array(&window,
+                           r->keywords,
+                           r->keyword_count,
+                           view->keyword_count,
+                           &keywords);
+        if (!valid) {
+            g_ptr_array_set_free_func(papers, (GDestroyNotify)discard_paper);
+            g_ptr_array_free(papers, TRUE);
+            g_free(block);
+            return NULL;
+        }
+        Paper* paper =
+          build_mapped_paper(title, // borrowed from the mapping
+                             map_indices(author_dict(),
+                                         view->author_ids,
+                                         authors,
+                                         r->authors_count),
+                             (gint)r->authors_count,
+                             (gint)r->year,
+                             map_indices(keyword_dict(),
+                                         view->keyword_ids,
+                                         keywords,
+                                         r->keyword_count),
+                             (gint)r->keyword_count,
+                             r->abstract, // lazy
+                             arxiv_id,
+                             doi,
+                             pdf_file);
+        paper->content_hash = r->content_hash;
+        g_ptr_array_add(papers, paper);
+    }
+    *out_block = block;
+    return papers;
+}
+
+/* Corrupt chunks are reported by load_cache() */
+static void
+decode_cache_range(gsize begin, gsize end, gpointer user_data)
+{
+    CacheLoad* load = user_data;
+    for (gsize i = begin; i < end; ++i)
+        load->batches[i] =
+          decode_cache_chunk(load->view, (guint)i, &load->blocks[i]);
+}
+
+/**
+ * Decodes all chunks of @view into @batches (and @blocks, see
+ * decode_cache_chunk()), spreading them over the Loom pool with
+ * loom_parallel_for().
+ */
+static void
+decode_cache_chunks(const CacheView* view,
+                    guint chunk_count,
+                    GPtrArray** batches,
+                    gchar** blocks)
+{
+    CacheLoad load = { view, batches, blocks };
+    loom_parallel_for(
+      loom_get_default(), 0, chunk_count, 1, decode_cache_range, &load);
+}
+
+/* Helper: whether the range [start, end), stored as @stored_size bytes at
+ * @stored_offset, fits a region of @region_size bytes */
+static gboolean
+stored_range_valid(uint64_t start,
+                   uint64_t end,
+                   uint64_t stored_offset,
+                   uint64_t stored_size,
+                   uint64_t region_size,
+                   gboolean compressed)
+{
+    if (start > end || stored_offset > region_size ||
+        stored_size > region_size - stored_offset)
+        return FALSE;
+    if (!compressed)
+        return stored_offset == start && stored_size == end - start;
+    // deflate expands at most 1032:1, anything more is a bad table
+    return end - start <= stored_size * 1032;
+}
+
+/* Helper: verify the dictionary of a mapped cache and intern its entries.
+ * Returns the ids, authors first, each holding one reference, or NULL. */
+static guint32*
+load_cache_dict(const gchar* data, const CacheHeader* header)
+{
+    const gchar* dict = data + header->dict_offset;
+    uint32_t count = header->author_count + header->keyword_count;
+    if (xxh64(dict, header->dict_size, 0) != header->dict_checksum ||
+        (header->dict_size > 0 && dict[header->dict_size - 1] != '\0'))
+        return NULL;
+    const uint64_t* table = (const uint64_t*)dict;
+    const gchar** strings =
+      g_new(const gchar*, MAX(count, 1)); // freed before return
+    for (uint32_t i = 0; i < count; ++i) {
+        // the table itself is no string
+        if (table[i] < sizeof(uint64_t) * count ||
+            table[i] >= header->dict_size) {
+            g_free(strings);
+            return NULL;
+        }
+        strings[i] = dict + table[i];
+    }
+    guint32* ids = g_new(guint32, MAX(count, 1)); // owned by the caller
+    string_dict_intern_many(
+      author_dict(), strings, (gint)header->author_count, ids);
+    string_dict_intern_many(keyword_dict(),
+                            strings + header->author_count,
+                            (gint)header->keyword_count,
+                            ids + header->author_count);
+    g_free(strings);
+    return ids;
 }
 
 bool
-load_cache(PaperDatabase* db, GError** error)
+load_cache(PaperDatabase* db, guint* out_corrupt_chunks, GError** error)
 {
     g_return_val_if_fail(db != NULL, FALSE);
 
+    if (out_corrupt_chunks)
+        *out_corrupt_chunks = 0;
+    if (db->cache_map) {
+        g_set_error(error,
+                    G_FILE_ERROR,
+                    G_FILE_ERROR_EXIST,
+                    "Cache '%s' is already loaded",
+                    db->cache);
+        return FALSE;
+    }
+
     g_mutex_lock(&cache_mutex);
-    g_autofree gchar* data = NULL; // freed on function return
-    gsize length = 0;
-    if (!g_file_get_contents(db->cache, &data, &length, error)) {
+    GTimer* timer = g_timer_new(); // freed before return
+    GMappedFile* map = g_mapped_file_new(
+      db->cache, FALSE, error); // kept in db->cache_map on success
+    if (!map) {
         if (error && *error &&
             g_error_matches(*error, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
             // g_clear_error(error);
             /* Create empty cache file */
             g_file_set_contents(db->cache, "", 0, NULL);
-            g_mutex_unlock(&cache_mutex);
-            return FALSE;
         }
-        // g_file_get_contents() alredy set error for I/O
+        // g_mapped_file_new() alredy set error for I/O
         g_mutex_unlock(&cache_mutex);
+        g_timer_destroy(timer);
         return FALSE;
     }
-    if (length < sizeof(uint32_t)) {
+
+    const gchar* data = g_mapped_file_get_contents(map);
+    gsize length = g_mapped_file_get_length(map);
+    CacheHeader header;
+    if (!read_cache_header(db->cache, data, length, &header, error)) {
+        g_mapped_file_unref(map);
+        g_mutex_unlock(&cache_mutex);
+        g_timer_destroy(timer);
+        return FALSE;
+    }
+    if (header.record_count == 0) {
         g_set_error(error,
                     G_FILE_ERROR,
                     G_FILE_ERROR_FAILED,
-                    "Cache '%s' is too small (%zu bytes)",
-                    db->cache,
-                    length);
+                    "Count is zero, nothing read.");
+        g_mapped_file_unref(map);
         g_mutex_unlock(&cache_mutex);
+        g_timer_destroy(timer);
         return FALSE;
     }
 
-    const guchar* blob = (const guchar*)data;
-    gsize offset = 0;
+    CacheView view = { 0 };
+    view.records = (const CacheRecord*)(data + header.records_offset);
+    view.chunks = (const CacheChunk*)(data + header.chunks_offset);
+    view.heap = data + header.heap_offset;
+    view.heap_size = header.heap_size;
+    view.codec = header.codec;
 
-    // walk through blob and read entries
-    uint32_t count;
-    memcpy(&count, blob + offset, sizeof(count));
-    offset += sizeof(count);
-    if (count == 0) {
+    // a terminated heap makes every in-bounds offset a valid C string, and
+    // the chunks must tile the records in order
+    gboolean compressed = header.codec != CACHE_CODEC_NONE;
+    gboolean valid = compressed || view.heap[header.heap_size - 1] == '\0';
+    uint32_t next_record = 0;
+    for (uint32_t i = 0; valid && i < header.chunk_count; ++i) {
+        const CacheChunk* chunk = &view.chunks[i];
+        valid = chunk->first_record == next_record &&
+                chunk->record_count <= header.record_count - next_record &&
+                stored_range_valid(chunk->heap_start,
+                                   chunk->heap_end,
+                                   chunk->stored_offset,
+                                   chunk->stored_size,
+                                   header.heap_size,
+                                   compressed) &&
+                stored_range_valid(chunk->text_start,
+                                   chunk->text_end,
+                                   chunk->text_stored_offset,
+                                   chunk->text_stored_size,
+                                   header.text_size,
+                                   compressed);
+        next_record += chunk->record_count;
+    }
+    // every chunk refers to the dictionary, there is no loading around it
+    guint32* dict_ids = // freed before return, references dropped with it
+      valid && next_record == header.record_count
+        ? load_cache_dict(data, &header)
+        : NULL;
+    if (!dict_ids) {
         g_set_error(error,
                     G_FILE_ERROR,
                     G_FILE_ERROR_FAILED,
-                    "Count is zero, nothing read.");
+                    "Cache '%s' has a corrupted chunk table, string heap or "
+                    "dictionary",
+                    db->cache);
+        g_mapped_file_unref(map);
         g_mutex_unlock(&cache_mutex);
+        g_timer_destroy(timer);
         return FALSE;
     }
+    db->cache_map = map; // freed by free_database()
+    view.author_ids = dict_ids;
+    view.author_count = header.author_count;
+    view.keyword_ids = dict_ids + header.author_count;
+    view.keyword_count = header.keyword_count;
 
-    for (uint32_t i = 0; i < count; ++i) {
-        if (offset + sizeof(uint32_t) > length)
-            break;
-        uint32_t year;
-        memcpy(&year, blob + offset, sizeof(year));
-        offset += sizeof(year);
-
-        gchar* title = NULL;
-        if (!read_string_from_data(
-              blob, length, &offset, &title)) // freed before return
-            break;
-
-        /* Authors */
-        if (offset + sizeof(uint32_t) > length)
-            break;
-        uint32_t ac;
-        memcpy(&ac, blob + offset, sizeof(ac));
-        offset += sizeof(ac);
-        int authors_count = (int)ac;
-        gchar** authors = NULL;
-        if (authors_count > 0) {
-            authors = g_new0(gchar*, authors_count); // freed before return
-            for (int j = 0; j < authors_count; ++j) {
-                if (!read_string_from_data(blob,
-                                           length,
-                                           &offset,
-                                           &authors[j])) // freed before return
-                    break;
-            }
-        }
-
-        /* Keywords */
-        if (offset + sizeof(uint32_t) > length)
-            break;
-        uint32_t kc;
-        memcpy(&kc, blob + offset, sizeof(kc));
-        offset += sizeof(kc);
-        int keyword_count = (int)kc;
-        gchar** keywords = NULL;
-        if (keyword_count > 0) {
-            keywords = g_new0(gchar*, keyword_count); // freed before return
-            for (int j = 0; j < keyword_count; ++j) {
-                if (!read_string_from_data(blob,
-                                           length,
-                                           &offset,
-                                           &keywords[j])) // freed before return
-                    break;
-            }
-        }
+    /* Abstracts stay in the file until they are read */
+    TextBlock* text_blocks =
+      g_new(TextBlock, MAX(header.chunk_count, 1)); // freed before return
+    guint text_block_count = 0;
+    for (uint32_t i = 0; i < header.chunk_count; ++i) {
+        const CacheChunk* chunk = &view.chunks[i];
+        if (chunk->text_start == chunk->text_end)
+            continue;
+        TextBlock* block = &text_blocks[text_block_count++];
+        block->start = chunk->text_start;
+        block->end = chunk->text_end;
+        block->stored =
+          data + header.text_offset + chunk->text_stored_offset;
+        block->stored_size = chunk->text_stored_size;
+        block->checksum = chunk->text_checksum;
+    }
+    db->text_store = text_store_new(map,
+                                    text_blocks,
+                                    text_block_count,
+                                    compressed,
+                                    TEXT_STORE_BUDGET_BYTES);
+    g_free(text_blocks);
 
-        gchar* abstract = NULL;
-        read_string_from_data(
-          blob, length, &offset, &abstract); // freed before return
-        gchar* arxiv_id = NULL;
-        read_string_from_data(
-          blob, length, &offset, &arxiv_id); // freed before return
-        gchar* doi = NULL;
-        read_string_from_data(
-          blob, length, &offset, &doi); // freed before return
-        gchar* pdf_file = NULL;
-        read_string_from_data(
-          blob, length, &offset, &pdf_file); // freed before return
-
-        Paper* p = create_paper(db, // hard copies values, so need free all
-                                title,
-                                authors,
-                                authors_count,
-                                (int)year,
-                                keywords,
-                                keyword_count,
-                                abstract,
-                                arxiv_id,
-                                doi,
-                                pdf_file,
-                                error);
-        // TODO: handle corrupted cache
-        /* Cleanup locals */
-        g_free(title);
-        if (authors) {
-            for (int j = 0; j < authors_count; ++j)
-                g_free(authors[j]);
-            g_free(authors);
-        }
-        if (keywords) {
-            for (int j = 0; j < keyword_count; ++j)
-                g_free(keywords[j]);
-            g_free(keywords);
-        }
-        g_free(abstract);
-        g_free(arxiv_id);
-        g_free(doi);
-        g_free(pdf_file);
+    /* Decode chunks in parallel, then insert them in order */
+    GPtrArray** batches =
+      g_new0(GPtrArray*, header.chunk_count); // freed before return
+    gchar** blocks =
+      g_new0(gchar*, header.chunk_count); // moved to db->cache_blocks
+    decode_cache_chunks(&view, header.chunk_count, batches, blocks);
+    if (compressed) {
+        db->cache_blocks = g_ptr_array_new_with_free_func(
+          g_free); // freed by free_database()
+        for (uint32_t i = 0; i < header.chunk_count; ++i)
+            if (blocks[i])
+                g_ptr_array_add(db->cache_blocks, blocks[i]);
+    }
+    g_free(blocks);
 
-        if (!p) {
-            g_mutex_unlock(&cache_mutex);
-            return FALSE;
+    guint corrupt = 0;
+    guint total = 0;
+    for (uint32_t i = 0; i < header.chunk_count; ++i) {
+        if (batches[i])
+            total += batches[i]->len;
+        else {
+            g_warning("Cache '%s': chunk %u (records %u-%u) is corrupt\n",
+                      db->cache,
+                      i,
+                      view.chunks[i].first_record,
+                      view.chunks[i].first_record +
+                        view.chunks[i].record_count - 1);
+            corrupt++;
         }
-
     }
+    Paper** papers = g_new(Paper*, MAX(total, 1)); // freed before return
+    guint n = 0;
+    for (uint32_t i = 0; i < header.chunk_count; ++i) {
+        if (!batches[i])
+            continue;
+        for (guint j = 0; j < batches[i]->len; ++j)
+            papers[n++] = g_ptr_array_index(batches[i], j);
+        g_ptr_array_free(batches[i], TRUE);
+    }
+    insert_papers(db, papers, n);
+    g_free(papers);
+    g_free(batches);
+    // the Papers took their own references
+    string_dict_unref_many(
+      author_dict(), dict_ids, (gint)header.author_count);
+    string_dict_unref_many(keyword_dict(),
+                           dict_ids + header.author_count,
+                           (gint)header.keyword_count);
+    g_free(dict_ids);
 
     g_mutex_unlock(&cache_mutex);
+    g_debug("Loaded %u papers from %u %scache chunks in %.3f s\n",
+            n,
+            header.chunk_count - corrupt,
+            compressed ? "compressed " : "",
+            g_timer_elapsed(timer, NULL));
+    g_timer_destroy(timer);
+    if (out_corrupt_chunks)
+        *out_corrupt_chunks = corrupt;
     return TRUE;
 }
@@ -4,29 +4,77 @@
 #include "paper.h"
 #include <glib.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 G_BEGIN_DECLS
 
 /**
- * Check if the cache file is newer than the JSON file.
- * Returns TRUE if cache exists and its modification time >= JSON's.
+ * Check if the cache file was written for the current JSON file.
+ * Returns TRUE if the cache header is valid and the JSON file's size and
+ * XXH64 match the ones recorded in it.
  */
 bool
 cache_up_to_date(const char* json_path, const char* cache_path);
 
 /**
- * Write the in-memory PaperDatabase to a binary cache file.
+ * Write the in-memory PaperDatabase to a binary cache file, recording size
+ * and hash of the JSON file currently at db->path. Compressed if
+ * db->compress_cache is set.
  * On error, returns FALSE and sets *error.
  */
 bool
 write_cache(const PaperDatabase* db, GError** error);
 
+/**
+ * Write @snapshot to a new temporary cache file next to @cache_path, with the
+ * JSON size and hash left blank. Pass the result to commit_cache().
+ * With @compress, each chunk's strings are deflated: a smaller file that takes
+ * longer to load.
+ * No database locks are taken.
+ * Returns the temporary path (caller frees), or NULL and sets *error.
+ */
+gchar*
+write_cache_unbound(const PaperSnapshot* snapshot,
+                    const gchar* cache_path,
+                    gboolean compress,
+                    GError** error);
+
+/**
+ * Records @json_size and @json_hash in the header of the cache at @tmp_path,
+ * syncs it and renames it over @cache_path.
+ * On error, removes @tmp_path, returns FALSE and sets *error.
+ */
+bool
+commit_cache(const gchar* tmp_path,
+             const gchar* cache_path,
+             uint64_t json_size,
+             uint64_t json_hash,
+             GError** error);
+
+/**
+ * Write @snapshot to a binary cache file at @cache_path, recording size and
+ * hash of the JSON file at @json_path, see write_cache_unbound().
+ * No database locks are taken.
+ * On error, returns FALSE and sets *error.
+ */
+bool
+write_cache_snapshot(const PaperSnapshot* snapshot,
+                     const gchar* json_path,
+                     const gchar* cache_path,
+                     gboolean compress,
+                     GError** error);
+
 /**
  * Load papers from the binary cache file into the database.
+ * The cache is memory-mapped and kept in db->cache_map; the loaded Papers point
+ * straight into the mapping until they are updated. Chunks of a compressed
+ * cache are inflated into db->cache_blocks instead.
+ * Chunks are verified and decoded in parallel. Corrupt chunks are skipped and
+ * counted in *out_corrupt_chunks (optional); the rest is still loaded.
  * On success returns TRUE; FALSE on error (sets *error) or if cache is empty.
  */
 bool
-load_cache(PaperDatabase* db, GError** error);
+load_cache(PaperDatabase* db, guint* out_corrupt_chunks, GError** error);
 
 /**
  * Return the number of entries in the cache, or 0 if empty/error.
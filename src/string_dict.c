@@ -0,0 +1,191 @@
+/* string_dict.c */
+#define G_LOG_DOMAIN "string_dict"
+
+#include "string_dict.h"
+
+#include <glib.h>
+
+/* Entries live in fixed-size segments that never move, so the string of an
+ * id can be read without the lock while other threads intern more */
+#define DICT_SEGMENT_BITS 14
+#define DICT_SEGMENT_SIZE (1u << DICT_SEGMENT_BITS)
+#define DICT_MAX_SEGMENTS (1u << (32 - DICT_SEGMENT_BITS))
+
+typedef struct
+{
+    gchar* string; // NULL while the id is free
+    gint refcount; // atomic
+} DictEntry;
+
+struct _StringDict
+{
+    DictEntry** segments; // DICT_MAX_SEGMENTS, allocated as needed
+    GMutex lock;          // guards everything below and entry removal
+    GHashTable* ids;      // entry string -> id + 1
+    guint32 next_id;      // every id below was handed out at least once
+    GArray* free_ids;     // removed ids, reused first
+    guint count;
+};
+
+static inline DictEntry*
+entry_at(StringDict* dict, guint32 id)
+{
+    DictEntry* segment =
+      g_atomic_pointer_get(&dict->segments[id >> DICT_SEGMENT_BITS]);
+    return &segment[id & (DICT_SEGMENT_SIZE - 1)];
+}
+
+static guint32
+intern_locked(StringDict* dict, const gchar* string)
+{
+    guint32 id = GPOINTER_TO_UINT(g_hash_table_lookup(dict->ids, string));
+    if (id > 0) {
+        // may resurrect an entry whose last reference is being dropped,
+        // string_dict_unref() checks again under the lock
+        g_atomic_int_inc(&entry_at(dict, id - 1)->refcount);
+        return id - 1;
+    }
+
+    if (dict->free_ids->len > 0) {
+        id = g_array_index(dict->free_ids, guint32, dict->free_ids->len - 1);
+        g_array_set_size(dict->free_ids, dict->free_ids->len - 1);
+    } else {
+        id = dict->next_id++;
+        guint32 segment = id >> DICT_SEGMENT_BITS;
+        if (!dict->segments[segment])
+            g_atomic_pointer_set(
+              &dict->segments[segment],
+              g_new0(DictEntry,
+                     DICT_SEGMENT_SIZE)); // freed by string_dict_free()
+    }
+    DictEntry* entry = entry_at(dict, id);
+    entry->string = g_strdup(string); // freed when the entry is removed
+    g_atomic_int_set(&entry->refcount, 1);
+    g_hash_table_insert(dict->ids, entry->string, GUINT_TO_POINTER(id + 1));
+    dict->count++;
+    return id;
+}
+
+StringDict*
+string_dict_new(void)
+{
+    StringDict* dict = g_new0(StringDict, 1); // freed by string_dict_free()
+    dict->segments =
+      g_new0(DictEntry*, DICT_MAX_SEGMENTS); // freed by string_dict_free()
+    g_mutex_init(&dict->lock);
+    dict->ids = g_hash_table_new(g_str_hash, g_str_equal);
+    dict->free_ids = g_array_new(FALSE, FALSE, sizeof(guint32));
+    return dict;
+}
+
+void
+string_dict_free(StringDict* dict)
+{
+    if (!dict)
+        return;
+    for (guint32 id = 0; id < dict->next_id; ++id)
+        g_free(entry_at(dict, id)->string);
+    for (guint32 i = 0; i < DICT_MAX_SEGMENTS && dict->segments[i]; ++i)
+        g_free(dict->segments[i]);
+    g_free(dict->segments);
+    g_hash_table_destroy(dict->ids);
+    g_array_free(dict->free_ids, TRUE);
+    g_mutex_clear(&dict->lock);
+    g_free(dict);
+}
+
+guint32
+string_dict_intern(StringDict* dict, const gchar* string)
+{
+    g_mutex_lock(&dict->lock);
+    guint32 id = intern_locked(dict, string ? string : "");
+    g_mutex_unlock(&dict->lock);
+    return id;
+}
+
+void
+string_dict_intern_many(StringDict* dict,
+                        const gchar* const* strings,
+                        gint count,
+                        guint32* out_ids)
+{
+    g_mutex_lock(&dict->lock);
+    for (gint i = 0; i < count; ++i)
+        out_ids[i] = intern_locked(dict, strings[i] ? strings[i] : "");
+    g_mutex_unlock(&dict->lock);
+}
+
+void
+string_dict_ref(StringDict* dict, guint32 id)
+{
+    g_atomic_int_inc(&entry_at(dict, id)->refcount);
+}
+
+void
+string_dict_unref(StringDict* dict, guint32 id)
+{
+    DictEntry* entry = entry_at(dict, id);
+    if (!g_atomic_int_dec_and_test(&entry->refcount))
+        return;
+
+    g_mutex_lock(&dict->lock);
+    // skip if it was interned again, or removed by a racing unref already
+    if (g_atomic_int_get(&entry->refcount) == 0 && entry->string) {
+        g_hash_table_remove(dict->ids, entry->string);
+        g_free(entry->string);
+        entry->string = NULL;
+        g_array_append_val(dict->free_ids, id);
+        dict->count--;
+    }
+    g_mutex_unlock(&dict->lock);
+}
+
+void
+string_dict_unref_many(StringDict* dict, const guint32* ids, gint count)
+{
+    for (gint i = 0; i < count; ++i)
+        string_dict_unref(dict, ids[i]);
+}
+
+const gchar*
+string_dict_get(StringDict* dict, guint32 id)
+{
+    return entry_at(dict, id)->string;
+}
+
+gboolean
+string_dict_lookup(StringDict* dict, const gchar* string, guint32* out_id)
+{
+    g_mutex_lock(&dict->lock);
+    guint32 id = GPOINTER_TO_UINT(g_hash_table_lookup(dict->ids, string));
+    g_mutex_unlock(&dict->lock);
+    if (id == 0)
+        return FALSE;
+    if (out_id)
+        *out_id = id - 1;
+    return TRUE;
+}
+
+guint
+string_dict_get_count(StringDict* dict)
+{
+    g_mutex_lock(&dict->lock);
+    guint count = dict->count;
+    g_mutex_unlock(&dict->lock);
+    return count;
+}
+
+void
+string_dict_foreach(StringDict* dict, StringDictFunc func, gpointer user_data)
+{
+    g_mutex_lock(&dict->lock);
+    for (guint32 id = 0; id < dict->next_id; ++id) {
+        DictEntry* entry = entry_at(dict, id);
+        if (entry->string)
+            func(id,
+                 entry->string,
+                 (guint)g_atomic_int_get(&entry->refcount),
+                 user_data);
+    }
+    g_mutex_unlock(&dict->lock);
+}
@@ -0,0 +1,90 @@
+/* string_dict.h */
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/**
+ * Interned strings with compact 32-bit ids, e.g. author names shared by many
+ * Papers. Every holder of an id owns one reference on it; an entry is removed
+ * and its id reused once the last reference is gone, so equal strings have
+ * equal ids only while they are referenced.
+ * Thread-safe. Reading the string of an id you hold a reference on takes no
+ * lock.
+ */
+typedef struct _StringDict StringDict;
+
+typedef void (*StringDictFunc)(guint32 id,
+                               const gchar* string,
+                               guint refcount,
+                               gpointer user_data);
+
+StringDict*
+string_dict_new(void);
+
+void
+string_dict_free(StringDict* dict);
+
+/**
+ * Returns the id of @string, adding it if needed, and takes a reference on
+ * it.
+ */
+guint32
+string_dict_intern(StringDict* dict, const gchar* string);
+
+/**
+ * Interns @count @strings into @out_ids under one lock, see
+ * string_dict_intern().
+ */
+void
+string_dict_intern_many(StringDict* dict,
+                        const gchar* const* strings,
+                        gint count,
+                        guint32* out_ids);
+
+/**
+ * Takes another reference on @id, which must be held already.
+ */
+void
+string_dict_ref(StringDict* dict, guint32 id);
+
+/**
+ * Drops a reference on @id, removing the entry with the last one.
+ */
+void
+string_dict_unref(StringDict* dict, guint32 id);
+
+/**
+ * Drops one reference on each of @count @ids.
+ */
+void
+string_dict_unref_many(StringDict* dict, const guint32* ids, gint count);
+
+/**
+ * Returns the string of @id, valid as long as a reference on @id is held.
+ */
+const gchar*
+string_dict_get(StringDict* dict, guint32 id);
+
+/**
+ * Looks @string up without taking a reference. Returns FALSE if it isn't
+ * interned.
+ */
+gboolean
+string_dict_lookup(StringDict* dict, const gchar* string, guint32* out_id);
+
+/**
+ * Returns the number of distinct strings in @dict.
+ */
+guint
+string_dict_get_count(StringDict* dict);
+
+/**
+ * Calls @func for every entry, under the lock: @func must not call back into
+ * @dict. Useful as the vocabulary for faceting.
+ */
+void
+string_dict_foreach(StringDict* dict, StringDictFunc func, gpointer user_data);
+
+G_END_DECLS
@@ -0,0 +1,510 @@
+/* text_store.c */
+#define _DEFAULT_SOURCE // for madvise()
+#define G_LOG_DOMAIN "text_store"
+
+#include "text_store.h"
+#include "hash.h"
+
+#include <glib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/* pools seal their text into deflated blocks of about this size */
+#define POOL_BLOCK_BYTES (32 * 1024)
+/* text a pool keeps plain until it has trained its dictionary on it */
+#define POOL_SAMPLE_BYTES (1024 * 1024)
+/* zlib only looks back 32 KiB, longer dictionaries are wasted */
+#define POOL_DICTIONARY_BYTES (32 * 1024 - 262)
+
+typedef enum
+{
+    BLOCK_UNVERIFIED,
+    BLOCK_VERIFIED,
+    BLOCK_CORRUPT,
+} BlockState;
+
+typedef struct
+{
+    TextBlock spec;
+    BlockState state;
+    gchar* data;       // text of a resident compressed block, else NULL
+    gchar* owned;      // stored bytes of a pool block, spec.stored points here
+    gboolean resident; // in the LRU
+    gboolean loading;  // being verified or inflated, see fault_in_block()
+    GList link;        // in store->lru, data points back at this block
+} StoreBlock;
+
+struct _TextStore
+{
+    gint ref_count;    // atomic
+    GMappedFile* map;  // NULL for a pool
+    GPtrArray* blocks; // StoreBlock*, sorted by offset
+    gboolean compressed;
+    GMutex lock;  // guards everything below, the blocks and their states
+    GCond loaded; // signalled when a block is done loading
+    GQueue lru;   // resident blocks, most recently used first
+    gsize resident;
+    gsize budget;
+    gsize text_size;   // bytes of text in blocks
+    gsize stored_size; // bytes of blocks as stored
+    // pools only
+    GString* tail;       // text from tail_start on, not sealed yet
+    uint64_t tail_start; // offset of the first byte in tail
+    gchar* dictionary;   // preset dictionary of all blocks, NULL until trained
+    gsize dictionary_size;
+};
+
+static void
+free_block(StoreBlock* block)
+{
+    g_free(block->data);
+    g_free(block->owned);
+    g_free(block);
+}
+
+/* Helper: the block holding @offset, or NULL */
+static StoreBlock*
+find_block(const TextStore* store, uint64_t offset)
+{
+    guint lo = 0, hi = store->blocks->len;
+    while (lo < hi) {
+        guint mid = lo + (hi - lo) / 2;
+        StoreBlock* block = g_ptr_array_index(store->blocks, mid);
+        if (offset < block->spec.start)
+            hi = mid;
+        else if (offset >= block->spec.end)
+            lo = mid + 1;
+        else
+            return block;
+    }
+    return NULL;
+}
+
+/* Helper: drop @block from memory. Mapped text is only handed back to the
+ * kernel, it is read from the file again when needed. */
+static void
+evict_block(TextStore* store, StoreBlock* block)
+{
+    g_queue_unlink(&store->lru, &block->link);
+    block->resident = FALSE;
+    store->resident -= block->spec.end - block->spec.start;
+    if (block->data) {
+        g_free(block->data);
+        block->data = NULL;
+        return;
+    }
+    // only whole pages inside the block, neighbours may still be in use
+    gsize page = (gsize)sysconf(_SC_PAGESIZE);
+    guintptr first = ((guintptr)block->spec.stored + page - 1) & ~(page - 1);
+    guintptr last =
+      ((guintptr)block->spec.stored + block->spec.stored_size) & ~(page - 1);
+    if (last > first)
+        madvise((void*)first, last - first, MADV_DONTNEED);
+}
+
+/* Helper: deflate @length bytes of @text with an optional preset
+ * @dictionary. Returns the stream, or NULL if zlib fails. */
+static gchar*
+deflate_text(const gchar* dictionary,
+             gsize dictionary_size,
+             const gchar* text,
+             gsize length,
+             gsize* out_size)
+{
+    z_stream zs = { 0 };
+    if (deflateInit(&zs, Z_BEST_SPEED) != Z_OK)
+        return NULL;
+    if (dictionary &&
+        deflateSetDictionary(
+          &zs, (const Bytef*)dictionary, (uInt)dictionary_size) != Z_OK) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    uLong bound = deflateBound(&zs, length);
+    gchar* stored = g_malloc(bound); // owned by the caller
+    zs.next_in = (Bytef*)text;
+    zs.avail_in = (uInt)length;
+    zs.next_out = (Bytef*)stored;
+    zs.avail_out = (uInt)bound;
+    int status = deflate(&zs, Z_FINISH);
+    *out_size = zs.total_out;
+    deflateEnd(&zs);
+    if (status != Z_STREAM_END) {
+        g_free(stored);
+        return NULL;
+    }
+    return g_realloc(stored, MAX(*out_size, 1));
+}
+
+/* Helper: inflate @block into @length bytes at @out */
+static gboolean
+inflate_block(const TextStore* store,
+              const StoreBlock* block,
+              gchar* out,
+              gsize length)
+{
+    z_stream zs = { 0 };
+    if (inflateInit(&zs) != Z_OK)
+        return FALSE;
+    zs.next_in = (Bytef*)block->spec.stored;
+    zs.avail_in = (uInt)block->spec.stored_size;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = (uInt)length;
+    int status = inflate(&zs, Z_FINISH);
+    if (status == Z_NEED_DICT && store->dictionary &&
+        inflateSetDictionary(&zs,
+                             (const Bytef*)store->dictionary,
+                             (uInt)store->dictionary_size) == Z_OK)
+        status = inflate(&zs, Z_FINISH);
+    gboolean ok = status == Z_STREAM_END && zs.total_out == length;
+    inflateEnd(&zs);
+    return ok;
+}
+
+/* Helper: verify and, if compressed, inflate @block. Called with the lock
+ * held, which is dropped meanwhile so faults of other blocks go on in
+ * parallel; concurrent faults of the same block wait for the first one. */
+static gboolean
+fault_in_block(TextStore* store, StoreBlock* block)
+{
+    while (block->loading)
+        g_cond_wait(&store->loaded, &store->lock);
+    if (block->state == BLOCK_CORRUPT)
+        return FALSE;
+    gboolean verify = block->state == BLOCK_UNVERIFIED;
+    gboolean inflate = store->compressed && !block->data;
+    if (!verify && !inflate)
+        return TRUE;
+
+    // not resident, so nothing evicts it; the spec never changes
+    block->loading = TRUE;
+    g_mutex_unlock(&store->lock);
+    gboolean ok = !verify || xxh64(block->spec.stored,
+                                   block->spec.stored_size,
+                                   0) == block->spec.checksum;
+    if (!ok)
+        g_warning("Text block at %" G_GUINT64_FORMAT
+                  " is corrupt, its abstracts are lost\n",
+                  block->spec.start);
+    gchar* data = NULL;
+    if (ok && inflate) {
+        gsize length = block->spec.end - block->spec.start;
+        data = g_malloc(length + 1); // freed by evict_block()
+        ok = inflate_block(store, block, data, length);
+        if (ok)
+            data[length] = '\0';
+        else {
+            g_warning("Text block at %" G_GUINT64_FORMAT
+                      " doesn't inflate, its abstracts are lost\n",
+                      block->spec.start);
+            g_clear_pointer(&data, g_free);
+        }
+    }
+    g_mutex_lock(&store->lock);
+
+    block->state = ok ? BLOCK_VERIFIED : BLOCK_CORRUPT;
+    block->data = data;
+    block->loading = FALSE;
+    g_cond_broadcast(&store->loaded);
+    return ok;
+}
+
+typedef struct
+{
+    const gchar* word;
+    gsize length;
+    gsize score; // bytes the word covers in the sample
+} DictionaryWord;
+
+static gint
+compare_words(gconstpointer a, gconstpointer b)
+{
+    const DictionaryWord* wa = a;
+    const DictionaryWord* wb = b;
+    return wa->score < wb->score ? 1 : wa->score > wb->score ? -1 : 0;
+}
+
+/* Helper: build the preset dictionary from the words that cover the most
+ * of @sample. zlib finds matches at the end of the dictionary cheapest, so
+ * the most valuable words go last. */
+static gchar*
+train_dictionary(const gchar* sample, gsize length, gsize* out_size)
+{
+    GHashTable* counts = g_hash_table_new_full(
+      g_str_hash, g_str_equal, g_free, NULL); // freed before return
+    for (gsize i = 0; i < length;) {
+        // words are runs of letters and digits, any non-ASCII byte included
+        gsize start = i;
+        while (i < length &&
+               (g_ascii_isalnum(sample[i]) || (guchar)sample[i] >= 0x80))
+            i++;
+        if (i - start >= 3) {
+            // with the separator that follows, which is usually a space
+            gchar* word = g_strndup(sample + start, i - start + (i < length));
+            gpointer count = g_hash_table_lookup(counts, word);
+            g_hash_table_replace(
+              counts, word, GUINT_TO_POINTER(GPOINTER_TO_UINT(count) + 1));
+        }
+        if (i == start)
+            i++;
+    }
+
+    GArray* words = g_array_new(
+      FALSE, FALSE, sizeof(DictionaryWord)); // freed before return
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, counts);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        guint count = GPOINTER_TO_UINT(value);
+        if (count < 2)
+            continue;
+        DictionaryWord w = { key, strlen(key), 0 };
+        w.score = w.length * count;
+        g_array_append_val(words, w);
+    }
+    g_array_sort(words, compare_words);
+
+    guint selected = 0;
+    gsize size = 0;
+    while (selected < words->len &&
+           size + g_array_index(words, DictionaryWord, selected).length <=
+             POOL_DICTIONARY_BYTES)
+        size += g_array_index(words, DictionaryWord, selected++).length;
+    gchar* dictionary = g_malloc(MAX(size, 1)); // owned by the caller
+    gsize offset = 0;
+    for (guint i = selected; i-- > 0;) {
+        const DictionaryWord* w = &g_array_index(words, DictionaryWord, i);
+        memcpy(dictionary + offset, w->word, w->length);
+        offset += w->length;
+    }
+    g_array_free(words, TRUE);
+    g_hash_table_destroy(counts);
+    *out_size = size;
+    return dictionary;
+}
+
+/* Helper: seal [from, to) of the pool tail into a deflated block */
+static gboolean
+seal_block(TextStore* store, gsize from, gsize to)
+{
+    gsize stored_size = 0;
+    gchar* stored = deflate_text(store->dictionary,
+                                 store->dictionary_size,
+                                 store->tail->str + from,
+                                 to - from,
+                                 &stored_size); // freed by free_block()
+    if (!stored)
+        return FALSE;
+    StoreBlock* block = g_new0(StoreBlock, 1); // freed by free_block()
+    block->spec.start = store->tail_start + from;
+    block->spec.end = store->tail_start + to;
+    block->spec.stored = stored;
+    block->spec.stored_size = stored_size;
+    // never left memory, nothing to verify
+    block->state = BLOCK_VERIFIED;
+    block->owned = stored;
+    block->link.data = block;
+    g_ptr_array_add(store->blocks, block);
+    store->text_size += to - from;
+    store->stored_size += stored_size;
+    return TRUE;
+}
+
+/* Helper: seal whole blocks off the pool tail, cutting after the string
+ * that crosses POOL_BLOCK_BYTES. Text that doesn't deflate stays plain. */
+static void
+seal_tail(TextStore* store)
+{
+    GString* tail = store->tail;
+    gsize from = 0;
+    while (tail->len - from >= POOL_BLOCK_BYTES) {
+        // every string in the tail is terminated, so there is a NUL
+        const gchar* nul = memchr(tail->str + from + POOL_BLOCK_BYTES - 1,
+                                  '\0',
+                                  tail->len - from - POOL_BLOCK_BYTES + 1);
+        gsize to = nul - tail->str + 1;
+        if (!seal_block(store, from, to))
+            break;
+        from = to;
+    }
+    g_string_erase(tail, 0, from);
+    store->tail_start += from;
+}
+
+/* Helper: train the pool dictionary on the tail and report what it buys */
+static void
+train_pool(TextStore* store)
+{
+    GTimer* timer = g_timer_new(); // freed before return
+    store->dictionary = train_dictionary(
+      store->tail->str,
+      store->tail->len,
+      &store->dictionary_size); // freed by text_store_unref()
+    gdouble train_time = g_timer_elapsed(timer, NULL);
+
+    // the sample deflated in one go, as a baseline for the blocks below
+    gsize plain_size = 0;
+    g_free(deflate_text(
+      NULL, 0, store->tail->str, store->tail->len, &plain_size));
+    gsize sample_size = store->tail->len;
+    g_timer_start(timer);
+    seal_tail(store);
+    g_debug("Trained a %zu byte dictionary on %zu bytes of text in %.3f s: "
+            "blocks deflate to %.1f%% (%.1f%% without it) in %.3f s\n",
+            store->dictionary_size,
+            sample_size,
+            train_time,
+            100.0 * store->stored_size / MAX(store->text_size, 1),
+            100.0 * plain_size / MAX(sample_size, 1),
+            g_timer_elapsed(timer, NULL));
+    g_timer_destroy(timer);
+}
+
+static TextStore*
+store_new(gboolean compressed, gsize budget)
+{
+    TextStore* store = g_new0(TextStore, 1); // freed by text_store_unref()
+    store->ref_count = 1;
+    store->blocks = g_ptr_array_new_with_free_func(
+      (GDestroyNotify)free_block); // freed by text_store_unref()
+    store->compressed = compressed;
+    store->budget = budget;
+    g_mutex_init(&store->lock);
+    g_cond_init(&store->loaded);
+    g_queue_init(&store->lru);
+    return store;
+}
+
+TextStore*
+text_store_new(GMappedFile* map,
+               const TextBlock* blocks,
+               guint block_count,
+               gboolean compressed,
+               gsize budget)
+{
+    TextStore* store = store_new(compressed, budget);
+    store->map = g_mapped_file_ref(map); // released by text_store_unref()
+    for (guint i = 0; i < block_count; ++i) {
+        StoreBlock* block = g_new0(StoreBlock, 1); // freed by free_block()
+        block->spec = blocks[i];
+        block->link.data = block;
+        g_ptr_array_add(store->blocks, block);
+        store->text_size += blocks[i].end - blocks[i].start;
+        store->stored_size += blocks[i].stored_size;
+    }
+    return store;
+}
+
+TextStore*
+text_store_new_pool(gsize budget)
+{
+    TextStore* store = store_new(TRUE, budget);
+    store->tail = g_string_new(NULL); // freed by text_store_unref()
+    // offset 0 is reserved for none
+    store->tail_start = 1;
+    return store;
+}
+
+TextStore*
+text_store_ref(TextStore* store)
+{
+    g_atomic_int_inc(&store->ref_count);
+    return store;
+}
+
+void
+text_store_unref(TextStore* store)
+{
+    if (!store || !g_atomic_int_dec_and_test(&store->ref_count))
+        return;
+    g_ptr_array_unref(store->blocks);
+    if (store->map)
+        g_mapped_file_unref(store->map);
+    if (store->tail)
+        g_string_free(store->tail, TRUE);
+    g_free(store->dictionary);
+    g_mutex_clear(&store->lock);
+    g_cond_clear(&store->loaded);
+    g_free(store);
+}
+
+uint64_t
+text_store_add(TextStore* store, const gchar* text)
+{
+    g_return_val_if_fail(store != NULL && store->tail != NULL, 0);
+    g_return_val_if_fail(text != NULL, 0);
+
+    g_mutex_lock(&store->lock);
+    uint64_t offset = store->tail_start + store->tail->len;
+    g_string_append_len(store->tail, text, (gssize)strlen(text) + 1);
+    if (store->dictionary)
+        seal_tail(store);
+    else if (store->tail->len >= POOL_SAMPLE_BYTES)
+        train_pool(store);
+    g_mutex_unlock(&store->lock);
+    return offset;
+}
+
+gchar*
+text_store_dup(TextStore* store, uint64_t offset)
+{
+    g_return_val_if_fail(store != NULL, NULL);
+
+    g_mutex_lock(&store->lock);
+    if (store->tail && offset >= store->tail_start) {
+        gsize start = offset - store->tail_start;
+        gchar* copy =
+          start < store->tail->len ? g_strdup(store->tail->str + start) : NULL;
+        g_mutex_unlock(&store->lock);
+        return copy;
+    }
+    StoreBlock* block = find_block(store, offset);
+    if (!block || !fault_in_block(store, block)) {
+        g_mutex_unlock(&store->lock);
+        return NULL;
+    }
+    if (block->resident)
+        g_queue_unlink(&store->lru, &block->link);
+    else {
+        block->resident = TRUE;
+        store->resident += block->spec.end - block->spec.start;
+    }
+    g_queue_push_head_link(&store->lru, &block->link);
+
+    // copy before evicting, the block itself may be over budget
+    const gchar* text = block->data ? block->data : block->spec.stored;
+    gsize start = offset - block->spec.start;
+    gsize length = block->spec.end - block->spec.start;
+    const gchar* end = memchr(text + start, '\0', length - start);
+    gchar* copy = end ? g_strndup(text + start, end - (text + start)) : NULL;
+
+    while (store->resident > store->budget && store->lru.length > 1)
+        evict_block(store, store->lru.tail->data);
+    g_mutex_unlock(&store->lock);
+    return copy;
+}
+
+gsize
+text_store_get_resident(TextStore* store)
+{
+    g_return_val_if_fail(store != NULL, 0);
+    g_mutex_lock(&store->lock);
+    gsize resident = store->resident;
+    g_mutex_unlock(&store->lock);
+    return resident;
+}
+
+void
+text_store_get_sizes(TextStore* store, gsize* out_text, gsize* out_stored)
+{
+    g_return_if_fail(store != NULL);
+    g_mutex_lock(&store->lock);
+    gsize tail = store->tail ? store->tail->len : 0;
+    if (out_text)
+        *out_text = store->text_size + tail;
+    if (out_stored)
+        *out_stored = store->stored_size + tail + store->dictionary_size;
+    g_mutex_unlock(&store->lock);
+}
@@ -0,0 +1,82 @@
+/* text_store.h */
+#pragma once
+
+#include <glib.h>
+#include <stdint.h>
+
+G_BEGIN_DECLS
+
+/**
+ * Large text fields (abstracts) that stay in the cache file until someone
+ * reads them. Text is addressed by its offset in the cache's text heap; the
+ * heap is split into blocks that are verified, and inflated if compressed, on
+ * first access. Inflated blocks are kept in an LRU under a memory budget.
+ * A pool, see text_store_new_pool(), keeps text added at runtime deflated in
+ * memory the same way.
+ * Thread-safe, refcounted.
+ */
+typedef struct _TextStore TextStore;
+
+/* Text offsets [start, end) stored as stored_size bytes at stored */
+typedef struct
+{
+    uint64_t start;
+    uint64_t end;
+    const gchar* stored; // inside the mapping
+    uint64_t stored_size;
+    uint64_t checksum; // XXH64 (seed 0) of the stored bytes
+} TextBlock;
+
+/**
+ * Creates a store over @block_count @blocks (copied, sorted by offset) that
+ * point into @map, which the store keeps a reference on. With @compressed,
+ * every block is a zlib stream of end - start bytes.
+ */
+TextStore*
+text_store_new(GMappedFile* map,
+               const TextBlock* blocks,
+               guint block_count,
+               gboolean compressed,
+               gsize budget);
+
+/**
+ * Creates an empty in-memory store that text_store_add() appends to. The
+ * first megabyte of text stays plain and trains a preset dictionary, after
+ * that text is sealed into deflated blocks that share it.
+ */
+TextStore*
+text_store_new_pool(gsize budget);
+
+TextStore*
+text_store_ref(TextStore* store);
+
+void
+text_store_unref(TextStore* store);
+
+/**
+ * Appends a copy of @text to the pool @store and returns its offset.
+ */
+uint64_t
+text_store_add(TextStore* store, const gchar* text);
+
+/**
+ * Returns a copy of the string at @offset, faulting its block in if needed,
+ * or NULL if @offset is unknown or its block is corrupt. Free with g_free().
+ */
+gchar*
+text_store_dup(TextStore* store, uint64_t offset);
+
+/**
+ * Returns how many bytes of text the store keeps in memory right now.
+ */
+gsize
+text_store_get_resident(TextStore* store);
+
+/**
+ * Returns how many bytes of text @store holds and how many it takes as
+ * stored, in the file or, for a pool, in memory.
+ */
+void
+text_store_get_sizes(TextStore* store, gsize* out_text, gsize* out_stored);
+
+G_END_DECLS
@@ -0,0 +1,257 @@
+/* trace.c */
+#define G_LOG_DOMAIN "trace"
+
+#include "trace.h"
+
+#ifdef PP_TRACE
+
+#include "config.h"
+#include "json_stream.h"
+
+#include <glib-unix.h>
+#include <glib.h>
+#include <signal.h>
+
+typedef struct
+{
+    gint64 ts; // monotonic
+    const gchar* category;
+    const gchar* name;
+    guint64 id; // async events only
+    gchar phase; // 'B', 'E', 'b' or 'e', as in the trace event format
+} TraceEvent;
+
+/* Written only by its thread. An event is published by bumping head after it
+ * is in place, so a reader that saw head can copy the events before it, and
+ * tell by head afterwards which of them were overwritten while it copied. */
+typedef struct
+{
+    guint tid;
+    gchar* name;     // under rings_mutex
+    gboolean in_use; // under rings_mutex, FALSE once its thread exited
+    guint head;      // atomic, events ever recorded
+    TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+/* Rings are kept once their thread exits, their events are still wanted, and
+ * are handed on to the next new thread */
+static GPtrArray* rings = NULL; // TraceRing*, under rings_mutex
+static GMutex rings_mutex;
+
+static void
+release_ring(gpointer data)
+{
+    TraceRing* ring = data;
+    g_mutex_lock(&rings_mutex);
+    ring->in_use = FALSE;
+    g_mutex_unlock(&rings_mutex);
+}
+
+static GPrivate current_ring = G_PRIVATE_INIT(release_ring);
+
+static TraceRing*
+get_ring(void)
+{
+    TraceRing* ring = g_private_get(&current_ring);
+    if (ring)
+        return ring;
+
+    g_mutex_lock(&rings_mutex);
+    if (!rings)
+        rings = g_ptr_array_new(); // lives for the process
+    for (guint i = 0; i < rings->len && !ring; ++i) {
+        TraceRing* retired = g_ptr_array_index(rings, i);
+        if (!retired->in_use)
+            ring = retired;
+    }
+    if (!ring) {
+        ring = g_new0(TraceRing, 1); // lives for the process
+        ring->tid = rings->len + 1;
+        g_ptr_array_add(rings, ring);
+    }
+    ring->in_use = TRUE;
+    g_free(ring->name);
+    ring->name = g_strdup_printf("thread %u", ring->tid);
+    g_mutex_unlock(&rings_mutex);
+    g_private_set(&current_ring, ring);
+    return ring;
+}
+
+static void
+record(gchar phase, const gchar* category, const gchar* name, guint64 id)
+{
+    TraceRing* ring = get_ring();
+    guint head = g_atomic_int_get(&ring->head);
+    TraceEvent* event = &ring->events[head % TRACE_RING_EVENTS];
+    event->ts = g_get_monotonic_time();
+    event->category = category;
+    event->name = name;
+    event->id = id;
+    event->phase = phase;
+    g_atomic_int_set(&ring->head, head + 1);
+}
+
+void
+trace_begin(const gchar* category, const gchar* name)
+{
+    record('B', category, name, 0);
+}
+
+void
+trace_end(const gchar* category, const gchar* name)
+{
+    record('E', category, name, 0);
+}
+
+void
+trace_async_begin(const gchar* category, const gchar* name, guint64 id)
+{
+    record('b', category, name, id);
+}
+
+void
+trace_async_end(const gchar* category, const gchar* name, guint64 id)
+{
+    record('e', category, name, id);
+}
+
+void
+trace_set_thread_name(const gchar* name)
+{
+    TraceRing* ring = get_ring();
+    g_mutex_lock(&rings_mutex);
+    g_free(ring->name);
+    ring->name = g_strdup(name);
+    g_mutex_unlock(&rings_mutex);
+}
+
+static void
+write_event(JsonWriter* writer, guint tid, const TraceEvent* event)
+{
+    gchar phase[2] = { event->phase, '\0' };
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "name");
+    json_writer_string(writer, event->name);
+    json_writer_key(writer, "cat");
+    json_writer_string(writer, event->category);
+    json_writer_key(writer, "ph");
+    json_writer_string(writer, phase);
+    json_writer_key(writer, "ts");
+    json_writer_int(writer, event->ts);
+    json_writer_key(writer, "pid");
+    json_writer_int(writer, 1);
+    json_writer_key(writer, "tid");
+    json_writer_int(writer, tid);
+    if (event->phase == 'b' || event->phase == 'e') {
+        gchar id[19];
+        g_snprintf(id, sizeof(id), "0x%" G_GINT64_MODIFIER "x", event->id);
+        json_writer_key(writer, "id");
+        json_writer_string(writer, id);
+    }
+    json_writer_end_object(writer);
+}
+
+static void
+write_thread_name(JsonWriter* writer, guint tid, const gchar* name)
+{
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "name");
+    json_writer_string(writer, "thread_name");
+    json_writer_key(writer, "ph");
+    json_writer_string(writer, "M");
+    json_writer_key(writer, "pid");
+    json_writer_int(writer, 1);
+    json_writer_key(writer, "tid");
+    json_writer_int(writer, tid);
+    json_writer_key(writer, "args");
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "name");
+    json_writer_string(writer, name);
+    json_writer_end_object(writer);
+    json_writer_end_object(writer);
+}
+
+/**
+ * Writes the events of @ring that weren't overwritten while we read them.
+ * Positions may wrap around, so they are compared by their difference.
+ */
+static void
+write_ring(JsonWriter* writer, TraceRing* ring, TraceEvent* copy)
+{
+    guint head = g_atomic_int_get(&ring->head);
+    guint count = MIN(head, TRACE_RING_EVENTS);
+    guint first = head - count;
+    for (guint i = 0; i < count; ++i)
+        copy[i] = ring->events[(first + i) % TRACE_RING_EVENTS];
+    // the slot at the new head may be half written
+    guint intact = g_atomic_int_get(&ring->head) + 1 - TRACE_RING_EVENTS;
+    for (guint i = 0; i < count; ++i)
+        if ((gint)(first + i - intact) >= 0)
+            write_event(writer, ring->tid, &copy[i]);
+}
+
+static gboolean
+write_to_string(gpointer sink, const gchar* data, gsize length)
+{
+    g_string_append_len(sink, data, length);
+    return TRUE;
+}
+
+gboolean
+trace_export(const gchar* path, GError** error)
+{
+    GString* json = g_string_new(NULL); // freed before return
+    TraceEvent* copy =
+      g_new(TraceEvent, TRACE_RING_EVENTS); // freed before return
+    JsonWriter* writer = // freed by json_writer_finish()
+      json_writer_new_with_func(write_to_string, json);
+    json_writer_begin_object(writer);
+    json_writer_key(writer, "displayTimeUnit");
+    json_writer_string(writer, "ms");
+    json_writer_key(writer, "traceEvents");
+    json_writer_begin_array(writer);
+    g_mutex_lock(&rings_mutex);
+    for (guint i = 0; rings && i < rings->len; ++i) {
+        TraceRing* ring = g_ptr_array_index(rings, i);
+        write_thread_name(writer, ring->tid, ring->name);
+        write_ring(writer, ring, copy);
+    }
+    g_mutex_unlock(&rings_mutex);
+    json_writer_end_array(writer);
+    json_writer_end_object(writer);
+
+    gboolean ok = json_writer_finish(writer, NULL, NULL, error) &&
+                  g_file_set_contents(path, json->str, json->len, error);
+    if (ok)
+        g_message("Wrote trace to %s\n", path);
+    g_free(copy);
+    g_string_free(json, TRUE);
+    return ok;
+}
+
+void
+trace_shutdown(void)
+{
+    GError* error = NULL;
+    if (!trace_export(TRACE_PATH, &error)) {
+        g_warning("Error writing trace: %s\n", error->message);
+        g_clear_error(&error);
+    }
+}
+
+static gboolean
+on_export_trace(gpointer user_data)
+{
+    (void)user_data;
+    trace_shutdown();
+    return G_SOURCE_CONTINUE;
+}
+
+void
+trace_init(void)
+{
+    trace_set_thread_name("main");
+    g_unix_signal_add(SIGUSR2, on_export_trace, NULL);
+}
+
+#endif
@@ -0,0 +1,75 @@
+/* trace.h */
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Timeline tracing for chrome://tracing and Perfetto. Built with PP_TRACE
+ * defined (make trace), every thread records its events into a ring buffer of
+ * its own that keeps the last TRACE_RING_EVENTS of them, and all rings are
+ * written out as trace event JSON to TRACE_PATH on exit and on SIGUSR2.
+ * Without PP_TRACE the macros compile to nothing, arguments included, so they
+ * may be passed things that cost, like g_intern_string().
+ * Categories and names have to outlive the trace: literals or interned
+ * strings.
+ */
+#ifdef PP_TRACE
+
+/* Begins a slice on the calling thread, ended by the next trace_end() */
+void
+trace_begin(const gchar* category, const gchar* name);
+
+void
+trace_end(const gchar* category, const gchar* name);
+
+/* Begins a slice of its own track that may end on another thread, matched by
+ * category, name and id */
+void
+trace_async_begin(const gchar* category, const gchar* name, guint64 id);
+
+void
+trace_async_end(const gchar* category, const gchar* name, guint64 id);
+
+/* Names the calling thread's track, copies @name */
+void
+trace_set_thread_name(const gchar* name);
+
+/* Names the calling thread "main" and exports the trace on SIGUSR2 */
+void
+trace_init(void);
+
+/**
+ * Writes the events still in the rings to @path as trace event JSON.
+ * Thread-safe, events recorded meanwhile may or may not be included.
+ */
+gboolean
+trace_export(const gchar* path, GError** error);
+
+/* Exports the trace to TRACE_PATH, logging failures */
+void
+trace_shutdown(void);
+
+#define TRACE_BEGIN(category, name) trace_begin(category, name)
+#define TRACE_END(category, name) trace_end(category, name)
+#define TRACE_ASYNC_BEGIN(category, name, id)                                 \
+    trace_async_begin(category, name, id)
+#define TRACE_ASYNC_END(category, name, id) trace_async_end(category, name, id)
+#define TRACE_SET_THREAD_NAME(name) trace_set_thread_name(name)
+#define TRACE_INIT() trace_init()
+#define TRACE_SHUTDOWN() trace_shutdown()
+
+#else
+
+#define TRACE_BEGIN(category, name) ((void)0)
+#define TRACE_END(category, name) ((void)0)
+#define TRACE_ASYNC_BEGIN(category, name, id) ((void)0)
+#define TRACE_ASYNC_END(category, name, id) ((void)0)
+#define TRACE_SET_THREAD_NAME(name) ((void)0)
+#define TRACE_INIT() ((void)0)
+#define TRACE_SHUTDOWN() ((void)0)
+
+#endif
+
+G_END_DECLS
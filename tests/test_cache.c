@@ -0,0 +1,235 @@
+/* test_cache.c */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include "paper.h"
+#include "serializer.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+
+#define PAPERS 5000 // more than one chunk of the cache
+#define AUTHORS 50
+#define KEYWORDS 10
+#define VERSION_OFFSET 8 // after the magic, see CacheHeader
+
+typedef struct
+{
+    gchar* dir;
+    gchar* json_path; // whatever the cache was written for
+    gchar* cache_path;
+    PaperDatabase* db;
+} CacheFixture;
+
+/* Papers with every field set or left NULL in some of them */
+static void
+fill_database(PaperDatabase* db)
+{
+    for (gint i = 0; i < PAPERS; ++i) {
+        gchar* authors[] = { g_strdup_printf("Author %d", i % AUTHORS),
+                             g_strdup_printf("Author %d", (i + 1) % AUTHORS) };
+        gchar* keywords[] = { g_strdup_printf("keyword %d", i % KEYWORDS) };
+        gchar* title = g_strdup_printf("Paper %d", i);
+        gchar* abstract =
+          i % 5 ? g_strdup_printf("Abstract of paper %d.", i) : NULL;
+        gchar* arxiv_id = i % 2 ? NULL : g_strdup_printf("2401.%05d", i);
+        gchar* doi = i % 3 ? NULL : g_strdup_printf("10.1000/%d", i);
+        gchar* pdf_file = g_strdup_printf("/papers/%d.pdf", i);
+        Paper* paper = create_paper(db,
+                                    title,
+                                    authors,
+                                    i % 7 ? G_N_ELEMENTS(authors) : 0,
+                                    1990 + i % 30,
+                                    keywords,
+                                    G_N_ELEMENTS(keywords),
+                                    abstract,
+                                    arxiv_id,
+                                    doi,
+                                    pdf_file,
+                                    NULL);
+        if (i % 4 == 0)
+            paper_set_content_hash(paper, (guint64)i + 1);
+        for (gsize j = 0; j < G_N_ELEMENTS(authors); ++j)
+            g_free(authors[j]);
+        g_free(keywords[0]);
+        g_free(title);
+        g_free(abstract);
+        g_free(arxiv_id);
+        g_free(doi);
+        g_free(pdf_file);
+    }
+}
+
+static int
+setup(void** state)
+{
+    CacheFixture* fixture = g_new0(CacheFixture, 1); // freed by teardown()
+    fixture->dir = g_dir_make_tmp("test_cache_XXXXXX", NULL);
+    if (!fixture->dir)
+        return -1;
+    fixture->json_path = g_build_filename(fixture->dir, "ppdb.json", NULL);
+    fixture->cache_path = g_build_filename(fixture->dir, "ppdb.cache", NULL);
+    if (!g_file_set_contents(fixture->json_path, "[]\n", -1, NULL))
+        return -1;
+    fixture->db =
+      create_database(PAPERS, fixture->json_path, fixture->cache_path);
+    fill_database(fixture->db);
+    *state = fixture;
+    return 0;
+}
+
+static int
+teardown(void** state)
+{
+    CacheFixture* fixture = *state;
+    free_database(fixture->db);
+    g_remove(fixture->cache_path);
+    g_remove(fixture->json_path);
+    g_rmdir(fixture->dir);
+    g_free(fixture->cache_path);
+    g_free(fixture->json_path);
+    g_free(fixture->dir);
+    g_free(fixture);
+    return 0;
+}
+
+static void
+write_test_cache(CacheFixture* fixture, gboolean compress)
+{
+    PaperSnapshot* snapshot = snapshot_database(fixture->db); // freed below
+    GError* error = NULL;
+    assert_true(write_cache_snapshot(snapshot,
+                                     fixture->json_path,
+                                     fixture->cache_path,
+                                     compress,
+                                     &error));
+    assert_null(error);
+    free_snapshot(snapshot);
+}
+
+static void
+assert_papers_equal(Paper* expected, Paper* actual)
+{
+    assert_string_equal(actual->title, expected->title);
+    assert_int_equal(actual->year, expected->year);
+    assert_int_equal(actual->authors_count, expected->authors_count);
+    for (gint i = 0; i < expected->authors_count; ++i)
+        assert_string_equal(paper_get_author(actual, i),
+                            paper_get_author(expected, i));
+    assert_int_equal(actual->keyword_count, expected->keyword_count);
+    for (gint i = 0; i < expected->keyword_count; ++i)
+        assert_string_equal(paper_get_keyword(actual, i),
+                            paper_get_keyword(expected, i));
+    if (expected->arxiv_id)
+        assert_string_equal(actual->arxiv_id, expected->arxiv_id);
+    else
+        assert_null(actual->arxiv_id);
+    if (expected->doi)
+        assert_string_equal(actual->doi, expected->doi);
+    else
+        assert_null(actual->doi);
+    assert_string_equal(actual->pdf_file, expected->pdf_file);
+    assert_true(actual->content_hash == expected->content_hash);
+
+    gchar* expected_abstract = paper_dup_abstract(expected); // freed below
+    gchar* actual_abstract = paper_dup_abstract(actual);     // ditto
+    if (expected_abstract)
+        assert_string_equal(actual_abstract, expected_abstract);
+    else
+        assert_null(actual_abstract);
+    g_free(expected_abstract);
+    g_free(actual_abstract);
+}
+
+static void
+assert_round_trip(CacheFixture* fixture, gboolean compress)
+{
+    write_test_cache(fixture, compress);
+    assert_true(cache_up_to_date(fixture->json_path, fixture->cache_path));
+
+    PaperDatabase* loaded =
+      create_database(1, fixture->json_path, fixture->cache_path);
+    guint corrupt_chunks = 0;
+    GError* error = NULL;
+    assert_true(load_cache(loaded, &corrupt_chunks, &error));
+    assert_null(error);
+    assert_int_equal(corrupt_chunks, 0);
+    assert_int_equal(load_cache_count(loaded, NULL), PAPERS);
+    assert_int_equal(loaded->count, PAPERS);
+    for (gint i = 0; i < PAPERS; ++i)
+        assert_papers_equal(fixture->db->papers[i], loaded->papers[i]);
+    assert_ptr_equal(find_paper_by_hash(loaded, 1), loaded->papers[0]);
+    free_database(loaded);
+}
+
+static void
+test_round_trip(void** state)
+{
+    assert_round_trip(*state, FALSE);
+}
+
+static void
+test_round_trip_compressed(void** state)
+{
+    assert_round_trip(*state, TRUE);
+}
+
+static void
+test_stale_when_json_changes(void** state)
+{
+    CacheFixture* fixture = *state;
+    write_test_cache(fixture, FALSE);
+    // same size, different bytes
+    assert_true(g_file_set_contents(fixture->json_path, "{}\n", -1, NULL));
+    assert_false(cache_up_to_date(fixture->json_path, fixture->cache_path));
+}
+
+static void
+test_other_version_is_rejected(void** state)
+{
+    CacheFixture* fixture = *state;
+    write_test_cache(fixture, FALSE);
+
+    gchar* contents = NULL; // freed below
+    gsize length = 0;
+    assert_true(
+      g_file_get_contents(fixture->cache_path, &contents, &length, NULL));
+    guint32 version = 0;
+    memcpy(&version, contents + VERSION_OFFSET, sizeof(version));
+    assert_int_equal(version, 7);
+    version--;
+    memcpy(contents + VERSION_OFFSET, &version, sizeof(version));
+    assert_true(
+      g_file_set_contents(fixture->cache_path, contents, length, NULL));
+    g_free(contents);
+
+    assert_false(cache_up_to_date(fixture->json_path, fixture->cache_path));
+    PaperDatabase* loaded =
+      create_database(1, fixture->json_path, fixture->cache_path);
+    GError* error = NULL;
+    assert_false(load_cache(loaded, NULL, &error));
+    assert_non_null(error);
+    g_error_free(error);
+    assert_int_equal(loaded->count, 0);
+    free_database(loaded);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_round_trip, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_round_trip_compressed, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_stale_when_json_changes, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_other_version_is_rejected, setup, teardown),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
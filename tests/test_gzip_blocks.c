@@ -0,0 +1,215 @@
+/* test_gzip_blocks.c */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include "config.h"
+#include "gzip_blocks.h"
+#include "loader.h"
+#include "paper.h"
+
+#include <fcntl.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define ABSTRACT_BYTES 4096
+// enough uncompressed JSON for load_papers_parallel()
+#define PAPERS (JSON_PARALLEL_LOAD_BYTES / ABSTRACT_BYTES + 100)
+
+typedef struct
+{
+    gchar* dir;
+    gchar* path;
+    PaperDatabase* db;
+} GzipFixture;
+
+static void
+fill_database(PaperDatabase* db)
+{
+    gchar* filler = g_strnfill(ABSTRACT_BYTES, 'a'); // freed below
+    for (gint i = 0; i < PAPERS; ++i) {
+        gchar* title = g_strdup_printf("Paper %d", i);          // freed below
+        gchar* abstract = g_strdup_printf("%d %s", i, filler);  // ditto
+        gchar* pdf_file = g_strdup_printf("/papers/%d.pdf", i); // ditto
+        create_paper(db,
+                     title,
+                     NULL,
+                     0,
+                     2000 + i % 25,
+                     NULL,
+                     0,
+                     abstract,
+                     NULL,
+                     NULL,
+                     pdf_file,
+                     NULL);
+        g_free(title);
+        g_free(abstract);
+        g_free(pdf_file);
+    }
+    g_free(filler);
+}
+
+static int
+setup(void** state)
+{
+    GzipFixture* fixture = g_new0(GzipFixture, 1); // freed by teardown()
+    fixture->dir = g_dir_make_tmp("test_gzip_blocks_XXXXXX", NULL);
+    if (!fixture->dir)
+        return -1;
+    fixture->path = g_build_filename(fixture->dir, "ppdb.json.gz", NULL);
+    fixture->db = create_database(PAPERS, fixture->path, NULL);
+    fill_database(fixture->db);
+    *state = fixture;
+    return 0;
+}
+
+static int
+teardown(void** state)
+{
+    GzipFixture* fixture = *state;
+    free_database(fixture->db);
+    g_remove(fixture->path);
+    g_rmdir(fixture->dir);
+    g_free(fixture->path);
+    g_free(fixture->dir);
+    g_free(fixture);
+    return 0;
+}
+
+static void
+write_database(GzipFixture* fixture)
+{
+    GError* error = NULL;
+    assert_true(write_json(fixture->db, &error));
+    assert_null(error);
+}
+
+static void
+assert_loads_everything(GzipFixture* fixture)
+{
+    PaperDatabase* loaded = create_database(1, fixture->path, NULL);
+    GError* error = NULL;
+    assert_true(load_papers_from_json(loaded, &error));
+    assert_null(error);
+    assert_int_equal(loaded->count, PAPERS);
+    for (gint i = 0; i < PAPERS; i += PAPERS / 7) {
+        Paper* paper = loaded->papers[i];
+        assert_string_equal(paper->title, fixture->db->papers[i]->title);
+        gchar* expected = // freed below
+          paper_dup_abstract(fixture->db->papers[i]);
+        gchar* actual = paper_dup_abstract(paper); // ditto
+        assert_string_equal(actual, expected);
+        g_free(expected);
+        g_free(actual);
+    }
+    free_database(loaded);
+}
+
+static void
+test_index_covers_file(void** state)
+{
+    GzipFixture* fixture = *state;
+    write_database(fixture);
+
+    int fd = g_open(fixture->path, O_RDONLY, 0);
+    assert_true(fd >= 0);
+    GArray* blocks = g_array_new(FALSE, FALSE, sizeof(GzipBlock));
+    goffset end = 0;
+    gboolean blocked = FALSE;
+    GError* error = NULL;
+    assert_true(gzip_blocks_read_index(
+      fd, fixture->path, blocks, &end, &blocked, &error));
+    close(fd);
+    GStatBuf st;
+    assert_int_equal(g_stat(fixture->path, &st), 0);
+    assert_true(blocked);
+    assert_int_equal(end, st.st_size);
+    assert_true(blocks->len > JSON_PARALLEL_LOAD_BYTES / GZIP_BLOCK_BYTES);
+
+    gsize inflated = 0;
+    for (guint i = 0; i < blocks->len; ++i) {
+        GzipBlock* block = &g_array_index(blocks, GzipBlock, i);
+        assert_int_equal(block->inflated_offset, inflated);
+        assert_true(block->inflated_length <= GZIP_BLOCK_BYTES);
+        inflated += block->inflated_length;
+    }
+    g_array_unref(blocks);
+}
+
+static void
+test_parallel_load(void** state)
+{
+    GzipFixture* fixture = *state;
+    write_database(fixture);
+    assert_loads_everything(fixture);
+}
+
+static void
+test_plain_gzip_is_streamed(void** state)
+{
+    GzipFixture* fixture = *state;
+    write_database(fixture);
+
+    // the same JSON in one gzip stream, as written before blocks
+    gzFile in = gzopen(fixture->path, "rb");
+    assert_non_null(in);
+    GString* json = g_string_new(NULL); // freed below
+    gchar buffer[65536];
+    int n;
+    while ((n = gzread(in, buffer, sizeof(buffer))) > 0)
+        g_string_append_len(json, buffer, n);
+    gzclose(in);
+    gzFile out = gzopen(fixture->path, "wb");
+    assert_non_null(out);
+    assert_int_equal(gzwrite(out, json->str, json->len), json->len);
+    gzclose(out);
+    g_string_free(json, TRUE);
+
+    assert_false(gzip_blocks_is_blocked(fixture->path));
+    assert_loads_everything(fixture);
+}
+
+static void
+test_corrupted_block_fails(void** state)
+{
+    GzipFixture* fixture = *state;
+    write_database(fixture);
+
+    // flip a byte in the deflate data of a block in the middle
+    gchar* contents = NULL; // freed below
+    gsize length = 0;
+    assert_true(g_file_get_contents(fixture->path, &contents, &length, NULL));
+    contents[length / 2] ^= 0x5a;
+    assert_true(g_file_set_contents(fixture->path, contents, length, NULL));
+    g_free(contents);
+
+    PaperDatabase* loaded = create_database(1, fixture->path, NULL);
+    GError* error = NULL;
+    assert_false(load_papers_from_json(loaded, &error));
+    assert_non_null(error);
+    g_error_free(error);
+    assert_int_equal(loaded->count, 0);
+    free_database(loaded);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(
+          test_index_covers_file, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_parallel_load, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_plain_gzip_is_streamed, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_corrupted_block_fails, setup, teardown),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
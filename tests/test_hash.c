@@ -0,0 +1,160 @@
+/* test_hash.c */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include "hash.h"
+#include "paper.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+// spans a few of hash_file()'s read chunks, and ends inside one
+#define FILE_BYTES (1024 * 1024 + 123)
+
+typedef struct
+{
+    gchar* dir;
+    gchar* path_a;
+    gchar* path_b;
+    guint8* data;
+} HashFixture;
+
+static int
+setup(void** state)
+{
+    HashFixture* fixture = g_new0(HashFixture, 1); // freed by teardown()
+    fixture->dir = g_dir_make_tmp("test_hash_XXXXXX", NULL);
+    if (!fixture->dir)
+        return -1;
+    fixture->path_a = g_build_filename(fixture->dir, "a.pdf", NULL);
+    fixture->path_b = g_build_filename(fixture->dir, "b.pdf", NULL);
+    fixture->data = g_malloc(FILE_BYTES); // freed by teardown()
+    for (gsize i = 0; i < FILE_BYTES; ++i)
+        fixture->data[i] = (guint8)(i * 2654435761u >> 24);
+    *state = fixture;
+    return 0;
+}
+
+static int
+teardown(void** state)
+{
+    HashFixture* fixture = *state;
+    g_remove(fixture->path_a);
+    g_remove(fixture->path_b);
+    g_rmdir(fixture->dir);
+    g_free(fixture->path_a);
+    g_free(fixture->path_b);
+    g_free(fixture->dir);
+    g_free(fixture->data);
+    g_free(fixture);
+    return 0;
+}
+
+static void
+write_file(const gchar* path, const guint8* data, gsize length)
+{
+    assert_true(g_file_set_contents(path, (const gchar*)data, length, NULL));
+}
+
+static void
+test_hash_file_matches_one_shot(void** state)
+{
+    HashFixture* fixture = *state;
+    write_file(fixture->path_a, fixture->data, FILE_BYTES);
+
+    uint64_t hash = 0;
+    uint64_t size = 0;
+    GError* error = NULL;
+    assert_true(hash_file(fixture->path_a, &hash, &size, &error));
+    assert_null(error);
+    assert_int_equal(size, FILE_BYTES);
+    assert_true(hash == xxh64(fixture->data, FILE_BYTES, 0));
+
+    assert_false(hash_file(fixture->path_b, &hash, &size, &error));
+    assert_true(g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_NOENT));
+    g_error_free(error);
+}
+
+static void
+test_files_equal(void** state)
+{
+    HashFixture* fixture = *state;
+    gboolean equal = FALSE;
+    GError* error = NULL;
+    write_file(fixture->path_a, fixture->data, FILE_BYTES);
+    write_file(fixture->path_b, fixture->data, FILE_BYTES);
+    assert_true(files_equal(fixture->path_a, fixture->path_b, &equal, &error));
+    assert_true(equal);
+
+    // differing in the last chunk only
+    fixture->data[FILE_BYTES - 1] ^= 1;
+    write_file(fixture->path_b, fixture->data, FILE_BYTES);
+    assert_true(files_equal(fixture->path_a, fixture->path_b, &equal, &error));
+    assert_false(equal);
+
+    // a prefix of the other
+    write_file(fixture->path_b, fixture->data, FILE_BYTES - 1);
+    assert_true(files_equal(fixture->path_a, fixture->path_b, &equal, &error));
+    assert_false(equal);
+    assert_null(error);
+
+    g_remove(fixture->path_b);
+    assert_false(files_equal(fixture->path_a, fixture->path_b, &equal, &error));
+    assert_non_null(error);
+    g_error_free(error);
+}
+
+static Paper*
+add_paper_with_hash(PaperDatabase* db, const gchar* pdf_file, guint64 hash)
+{
+    Paper* paper = create_paper(db,
+                                (gchar*)pdf_file,
+                                NULL,
+                                0,
+                                2000,
+                                NULL,
+                                0,
+                                NULL,
+                                NULL,
+                                NULL,
+                                (gchar*)pdf_file,
+                                NULL);
+    assert_non_null(paper);
+    paper_set_content_hash(paper, hash);
+    return paper;
+}
+
+static void
+test_hash_index_keeps_duplicates(void** state)
+{
+    (void)state;
+    PaperDatabase* db = create_database(4, NULL, NULL);
+    Paper* first = add_paper_with_hash(db, "/papers/1.pdf", 42);
+    Paper* second = add_paper_with_hash(db, "/papers/2.pdf", 42);
+    add_paper_with_hash(db, "/papers/3.pdf", 7);
+    assert_ptr_equal(find_paper_by_hash(db, 42), first);
+
+    // the copy takes over once the first is gone
+    remove_paper(db, first);
+    assert_ptr_equal(find_paper_by_hash(db, 42), second);
+    paper_set_content_hash(second, 43);
+    assert_null(find_paper_by_hash(db, 42));
+    assert_ptr_equal(find_paper_by_hash(db, 43), second);
+    free_database(db);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(
+          test_hash_file_matches_one_shot, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_files_equal, setup, teardown),
+        cmocka_unit_test(test_hash_index_keeps_duplicates),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,304 @@
+/* test_journal.c */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include "config.h"
+#include "journal.h"
+#include "paper.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#define CONTENT_HASH G_GUINT64_CONSTANT(0x1234abcd5678ef00)
+
+typedef struct
+{
+    gchar* dir;
+    gchar* path; // db->path, never written, the journal sits next to it
+    gchar* journal_path;
+} JournalFixture;
+
+static int
+setup(void** state)
+{
+    JournalFixture* fixture = g_new0(JournalFixture, 1); // freed by teardown()
+    fixture->dir = g_dir_make_tmp("test_journal_XXXXXX", NULL);
+    if (!fixture->dir)
+        return -1;
+    fixture->path = g_build_filename(fixture->dir, "ppdb.json", NULL);
+    fixture->journal_path = g_strconcat(fixture->path, JOURNAL_SUFFIX, NULL);
+    *state = fixture;
+    return 0;
+}
+
+static int
+teardown(void** state)
+{
+    JournalFixture* fixture = *state;
+    g_remove(fixture->journal_path);
+    g_rmdir(fixture->dir);
+    g_free(fixture->journal_path);
+    g_free(fixture->path);
+    g_free(fixture->dir);
+    g_free(fixture);
+    return 0;
+}
+
+/* Returns a database with the journal at @fixture replayed into it */
+static PaperDatabase*
+open_database(const JournalFixture* fixture)
+{
+    PaperDatabase* db = create_database(1, fixture->path, NULL);
+    GError* error = NULL;
+    assert_true(journal_load(db, &error));
+    assert_null(error);
+    assert_non_null(db->journal);
+    return db;
+}
+
+static void
+close_database(PaperDatabase* db)
+{
+    GError* error = NULL;
+    assert_true(journal_sync(db->journal, &error));
+    free_database(db); // closes the journal
+}
+
+static Paper*
+find_paper(PaperDatabase* db, const gchar* pdf_file)
+{
+    for (gint i = 0; i < db->count; ++i)
+        if (g_strcmp0(db->papers[i]->pdf_file, pdf_file) == 0)
+            return db->papers[i];
+    return NULL;
+}
+
+static Paper*
+add_test_paper(PaperDatabase* db, gchar* title, const gchar* pdf_file)
+{
+    gchar* authors[] = { "Ada Lovelace", "Alan Turing" };
+    gchar* keywords[] = { "journal" };
+    Paper* paper = create_paper(db,
+                                title,
+                                authors,
+                                G_N_ELEMENTS(authors),
+                                2024,
+                                keywords,
+                                G_N_ELEMENTS(keywords),
+                                "An abstract.",
+                                "2401.00001",
+                                NULL,
+                                pdf_file,
+                                NULL);
+    assert_non_null(paper);
+    return paper;
+}
+
+/* Returns a detached Paper for insert_papers() */
+static Paper*
+build_test_paper(const gchar* title, const gchar* pdf_file)
+{
+    return build_paper(g_strdup(title),
+                       NULL,
+                       0,
+                       2024,
+                       NULL,
+                       0,
+                       NULL,
+                       NULL,
+                       NULL,
+                       g_strdup(pdf_file));
+}
+
+/* Writes a journal with add, update, hash and remove records */
+static void
+write_mutations(const JournalFixture* fixture)
+{
+    PaperDatabase* db = open_database(fixture);
+    Paper* kept = add_test_paper(db, "Kept", "/papers/kept.pdf");
+    Paper* updated = add_test_paper(db, "Draft", "/papers/updated.pdf");
+    Paper* removed = add_test_paper(db, "Removed", "/papers/removed.pdf");
+    gchar* authors[] = { "Grace Hopper" };
+    update_paper(updated,
+                 "Final",
+                 authors,
+                 G_N_ELEMENTS(authors),
+                 2025,
+                 NULL,
+                 0,
+                 "A new abstract.",
+                 NULL,
+                 "10.1000/final",
+                 NULL);
+    paper_set_content_hash(kept, CONTENT_HASH);
+    remove_paper(db, removed);
+    close_database(db);
+}
+
+static void
+assert_mutations_replayed(PaperDatabase* db)
+{
+    assert_int_equal(db->count, 2);
+    assert_null(find_paper(db, "/papers/removed.pdf"));
+
+    Paper* kept = find_paper(db, "/papers/kept.pdf");
+    assert_non_null(kept);
+    assert_string_equal(kept->title, "Kept");
+    assert_int_equal(kept->authors_count, 2);
+    assert_string_equal(paper_get_author(kept, 1), "Alan Turing");
+    assert_int_equal(kept->keyword_count, 1);
+    assert_string_equal(paper_get_keyword(kept, 0), "journal");
+    assert_string_equal(kept->arxiv_id, "2401.00001");
+    assert_true(kept->content_hash == CONTENT_HASH);
+    assert_ptr_equal(find_paper_by_hash(db, CONTENT_HASH), kept);
+
+    Paper* updated = find_paper(db, "/papers/updated.pdf");
+    assert_non_null(updated);
+    assert_string_equal(updated->title, "Final");
+    assert_int_equal(updated->year, 2025);
+    assert_int_equal(updated->authors_count, 1);
+    assert_string_equal(paper_get_author(updated, 0), "Grace Hopper");
+    assert_int_equal(updated->keyword_count, 0);
+    assert_string_equal(updated->doi, "10.1000/final");
+    gchar* abstract = paper_dup_abstract(updated); // freed below
+    assert_string_equal(abstract, "A new abstract.");
+    g_free(abstract);
+}
+
+static void
+test_replay_restores_mutations(void** state)
+{
+    JournalFixture* fixture = *state;
+    write_mutations(fixture);
+
+    PaperDatabase* db = open_database(fixture);
+    assert_mutations_replayed(db);
+    close_database(db);
+}
+
+static void
+test_replay_is_idempotent(void** state)
+{
+    JournalFixture* fixture = *state;
+    write_mutations(fixture);
+
+    // replayed over a database that has all of it already
+    PaperDatabase* db = open_database(fixture);
+    journal_close(db->journal);
+    db->journal = NULL;
+    GError* error = NULL;
+    assert_true(journal_load(db, &error));
+    assert_mutations_replayed(db);
+    close_database(db);
+}
+
+static void
+test_torn_tail_is_dropped(void** state)
+{
+    JournalFixture* fixture = *state;
+    write_mutations(fixture);
+    GStatBuf st;
+    assert_int_equal(g_stat(fixture->journal_path, &st), 0);
+    goffset valid_size = st.st_size;
+
+    // half a record header, as left by a crash in the middle of a write
+    FILE* file = g_fopen(fixture->journal_path, "ab");
+    assert_non_null(file);
+    const guint8 torn[6] = { JOURNAL_UPDATE, 0, 0, 0, 0xff, 0xff };
+    assert_int_equal(fwrite(torn, 1, sizeof(torn), file), sizeof(torn));
+    fclose(file);
+
+    PaperDatabase* db = open_database(fixture);
+    assert_mutations_replayed(db);
+    assert_int_equal(journal_size(db->journal), valid_size);
+    // new records follow the valid ones
+    add_test_paper(db, "Late", "/papers/late.pdf");
+    close_database(db);
+
+    db = open_database(fixture);
+    assert_int_equal(db->count, 3);
+    assert_non_null(find_paper(db, "/papers/late.pdf"));
+    close_database(db);
+}
+
+static void
+test_corrupted_record_stops_replay(void** state)
+{
+    JournalFixture* fixture = *state;
+    PaperDatabase* db = open_database(fixture);
+    add_test_paper(db, "First", "/papers/first.pdf");
+    gsize first_size = journal_size(db->journal);
+    add_test_paper(db, "Second", "/papers/second.pdf");
+    close_database(db);
+
+    // flip a byte in the payload of the first record after the first paper
+    gchar* contents = NULL; // freed below
+    gsize length = 0;
+    assert_true(
+      g_file_get_contents(fixture->journal_path, &contents, &length, NULL));
+    assert_true(length > first_size + 32);
+    contents[first_size + 24] ^= 0x5a;
+    assert_true(
+      g_file_set_contents(fixture->journal_path, contents, length, NULL));
+    g_free(contents);
+
+    db = open_database(fixture);
+    assert_int_equal(db->count, 1);
+    assert_string_equal(db->papers[0]->title, "First");
+    assert_int_equal(journal_size(db->journal), first_size);
+    close_database(db);
+}
+
+static void
+test_duplicate_file_is_refused(void** state)
+{
+    JournalFixture* fixture = *state;
+    PaperDatabase* db = open_database(fixture);
+    Paper* first = add_test_paper(db, "First", "/papers/same.pdf");
+    GError* error = NULL;
+    assert_null(initialize_paper(db, "/papers/same.pdf", &error));
+    assert_true(g_error_matches(error, G_FILE_ERROR, G_FILE_ERROR_EXIST));
+    g_clear_error(&error);
+
+    // a batch with the same file is dropped, the rest goes in
+    Paper* batch[] = {
+        build_test_paper("Copy", "/papers/same.pdf"),
+        build_test_paper("Other", "/papers/other.pdf"),
+    };
+    insert_papers(db, batch, G_N_ELEMENTS(batch));
+    assert_int_equal(db->count, 2);
+    assert_ptr_equal(find_paper_by_file(db, "/papers/same.pdf"), first);
+    remove_paper(db, first);
+    close_database(db);
+
+    // removing it didn't take the refused copies' records along
+    db = open_database(fixture);
+    assert_int_equal(db->count, 1);
+    assert_null(find_paper_by_file(db, "/papers/same.pdf"));
+    Paper* other = find_paper_by_file(db, "/papers/other.pdf");
+    assert_non_null(other);
+    assert_string_equal(other->title, "Other");
+    close_database(db);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(
+          test_replay_restores_mutations, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_replay_is_idempotent, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_torn_tail_is_dropped, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_corrupted_record_stops_replay, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_duplicate_file_is_refused, setup, teardown),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
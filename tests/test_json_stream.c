@@ -0,0 +1,248 @@
+/* test_json_stream.c */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include "json_stream.h"
+
+#include <glib.h>
+#include <string.h>
+
+/* Reads one byte per call, so every token straddles buffer refills */
+typedef struct
+{
+    const gchar* data;
+    gsize length;
+    gsize offset;
+} TrickleSource;
+
+static gssize
+read_trickle(gpointer source, gchar* buffer, gsize size)
+{
+    TrickleSource* trickle = source;
+    if (trickle->offset == trickle->length || size == 0)
+        return 0;
+    buffer[0] = trickle->data[trickle->offset++];
+    return 1;
+}
+
+static void
+expect_token(JsonReader* reader, JsonToken expected)
+{
+    GError* error = NULL;
+    JsonToken token = json_reader_next(reader, &error);
+    if (error)
+        fail_msg("unexpected error: %s", error->message);
+    assert_int_equal(token, expected);
+}
+
+static void
+expect_string(JsonReader* reader, JsonToken expected, const gchar* text)
+{
+    expect_token(reader, expected);
+    gsize length = 0;
+    const gchar* string = json_reader_get_string(reader, &length);
+    assert_int_equal(length, strlen(text));
+    assert_string_equal(string, text);
+}
+
+static void
+expect_number(JsonReader* reader, gdouble value)
+{
+    expect_token(reader, JSON_TOKEN_NUMBER);
+    assert_float_equal(json_reader_get_number(reader), value, 1e-9);
+}
+
+static void
+check_document(JsonReader* reader)
+{
+    expect_token(reader, JSON_TOKEN_BEGIN_OBJECT);
+    expect_string(reader, JSON_TOKEN_KEY, "papers");
+    expect_token(reader, JSON_TOKEN_BEGIN_ARRAY);
+    expect_number(reader, 1);
+    expect_number(reader, -2.5e3);
+    expect_number(reader, 0.125);
+    expect_string(reader, JSON_TOKEN_STRING, "tab\there \"quoted\" \\");
+    expect_string(reader, JSON_TOKEN_STRING, "caf\xc3\xa9 \xf0\x9f\x98\x80");
+    expect_token(reader, JSON_TOKEN_TRUE);
+    expect_token(reader, JSON_TOKEN_FALSE);
+    expect_token(reader, JSON_TOKEN_NULL);
+    expect_token(reader, JSON_TOKEN_END_ARRAY);
+    expect_string(reader, JSON_TOKEN_KEY, "empty");
+    expect_token(reader, JSON_TOKEN_BEGIN_OBJECT);
+    expect_token(reader, JSON_TOKEN_END_OBJECT);
+    expect_token(reader, JSON_TOKEN_END_OBJECT);
+    expect_token(reader, JSON_TOKEN_EOF);
+}
+
+static const gchar document[] =
+  " {\"papers\": [1, -2.5e3, 0.125,\n"
+  "  \"tab\\there \\\"quoted\\\" \\\\\",\n"
+  "  \"caf\\u00e9 \\ud83d\\ude00\", true, false, null],\n"
+  "  \"empty\" : {} }\n";
+
+static void
+test_tokens(void** state)
+{
+    (void)state;
+    JsonReader* reader = // freed below
+      json_reader_new_from_data(document, strlen(document));
+    check_document(reader);
+    json_reader_free(reader);
+}
+
+static void
+test_tokens_across_refills(void** state)
+{
+    (void)state;
+    TrickleSource source = { document, strlen(document), 0 };
+    JsonReader* reader = json_reader_new(read_trickle, &source); // freed below
+    check_document(reader);
+    json_reader_free(reader);
+}
+
+static void
+test_string_longer_than_buffer(void** state)
+{
+    (void)state;
+    gsize length = 3 * JSON_READER_BUFFER_SIZE + 17;
+    gchar* text = g_strnfill(length, 'x'); // freed below
+    gchar* json = g_strdup_printf("[\"%s\", \"%s\"]", text, text); // ditto
+    FILE* file = tmpfile(); // closed below
+    assert_non_null(file);
+    assert_int_equal(fwrite(json, 1, strlen(json), file), strlen(json));
+    rewind(file);
+
+    JsonReader* reader = json_reader_new_from_file(file); // freed below
+    expect_token(reader, JSON_TOKEN_BEGIN_ARRAY);
+    expect_string(reader, JSON_TOKEN_STRING, text);
+    gchar* copy = json_reader_dup_string(reader); // freed below
+    assert_string_equal(copy, text);
+    expect_string(reader, JSON_TOKEN_STRING, text);
+    expect_token(reader, JSON_TOKEN_END_ARRAY);
+    expect_token(reader, JSON_TOKEN_EOF);
+    json_reader_free(reader);
+    fclose(file);
+    g_free(copy);
+    g_free(json);
+    g_free(text);
+}
+
+static void
+test_skip(void** state)
+{
+    (void)state;
+    const gchar* json =
+      "[{\"a\": [1, {\"b\": \"]\"}], \"c\": null}, 42, \"s\"]";
+    JsonReader* reader = // freed below
+      json_reader_new_from_data(json, strlen(json));
+    GError* error = NULL;
+    expect_token(reader, JSON_TOKEN_BEGIN_ARRAY);
+    expect_token(reader, JSON_TOKEN_BEGIN_OBJECT);
+    assert_true(json_reader_skip(reader, JSON_TOKEN_BEGIN_OBJECT, &error));
+    expect_number(reader, 42);
+    assert_true(json_reader_skip(reader, JSON_TOKEN_NUMBER, &error));
+    expect_string(reader, JSON_TOKEN_STRING, "s");
+    expect_token(reader, JSON_TOKEN_END_ARRAY);
+    expect_token(reader, JSON_TOKEN_EOF);
+    json_reader_free(reader);
+}
+
+static void
+test_sequences(void** state)
+{
+    (void)state;
+    const gchar* lines = "{\"id\": 1}\n{\"id\": 2}\n\n";
+    JsonReader* reader = // freed below
+      json_reader_new_from_data(lines, strlen(lines));
+    json_reader_set_sequence(reader, FALSE);
+    for (gint id = 1; id <= 2; ++id) {
+        expect_token(reader, JSON_TOKEN_BEGIN_OBJECT);
+        expect_string(reader, JSON_TOKEN_KEY, "id");
+        expect_number(reader, id);
+        expect_token(reader, JSON_TOKEN_END_OBJECT);
+    }
+    expect_token(reader, JSON_TOKEN_EOF);
+    json_reader_free(reader);
+
+    // a slice of an array's elements
+    const gchar* slice = "1, [2], 3";
+    reader = json_reader_new_from_data(slice, strlen(slice));
+    json_reader_set_sequence(reader, TRUE);
+    expect_number(reader, 1);
+    expect_token(reader, JSON_TOKEN_BEGIN_ARRAY);
+    expect_number(reader, 2);
+    expect_token(reader, JSON_TOKEN_END_ARRAY);
+    expect_number(reader, 3);
+    expect_token(reader, JSON_TOKEN_EOF);
+    json_reader_free(reader);
+}
+
+static void
+test_empty_input(void** state)
+{
+    (void)state;
+    // an empty file is an empty database, see load_papers_from_json()
+    JsonReader* reader = json_reader_new_from_data("", 0); // freed below
+    expect_token(reader, JSON_TOKEN_EOF);
+    json_reader_free(reader);
+}
+
+/* Reads @json to the end, returns TRUE if it failed with an error set */
+static gboolean
+is_rejected(const gchar* json)
+{
+    JsonReader* reader = // freed below
+      json_reader_new_from_data(json, strlen(json));
+    GError* error = NULL;
+    JsonToken token;
+    do
+        token = json_reader_next(reader, &error);
+    while (token != JSON_TOKEN_ERROR && token != JSON_TOKEN_EOF);
+    json_reader_free(reader);
+    gboolean rejected = token == JSON_TOKEN_ERROR && error != NULL;
+    g_clear_error(&error);
+    return rejected;
+}
+
+static void
+test_malformed_input(void** state)
+{
+    (void)state;
+    const gchar* malformed[] = {
+        "[",        "[1,]",         "[,1]",      "[1 2]",   "{\"a\" 1}",
+        "{\"a\":1,}", "{1: 2}",       "[1]]",      "[1] 2",   "\"open",
+        "\"\\x\"",    "\"\\ud83d x\"", "[\"a\":1]", "{\"a\"}", "tru",
+        "nul",      "-",            "[1, 2",
+    };
+    for (gsize i = 0; i < G_N_ELEMENTS(malformed); ++i)
+        if (!is_rejected(malformed[i]))
+            fail_msg("accepted '%s'", malformed[i]);
+
+    // nesting deeper than the reader tracks
+    gchar* open = g_strnfill(JSON_READER_MAX_DEPTH + 1, '[');  // freed below
+    gchar* close = g_strnfill(JSON_READER_MAX_DEPTH + 1, ']'); // ditto
+    gchar* deep = g_strconcat(open, close, NULL);              // ditto
+    assert_true(is_rejected(deep));
+    g_free(deep);
+    g_free(close);
+    g_free(open);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_tokens),
+        cmocka_unit_test(test_tokens_across_refills),
+        cmocka_unit_test(test_string_longer_than_buffer),
+        cmocka_unit_test(test_skip),
+        cmocka_unit_test(test_sequences),
+        cmocka_unit_test(test_empty_input),
+        cmocka_unit_test(test_malformed_input),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,173 @@
+/* test_jsonl.c */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include "loader.h"
+#include "paper.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PAPERS 10
+#define TORN_LINE "{\"title\": \"Cut short\", \"pdf_file\": \"/pap"
+
+typedef struct
+{
+    gchar* dir;
+    gchar* path;
+} JsonlFixture;
+
+static int
+setup(void** state)
+{
+    JsonlFixture* fixture = g_new0(JsonlFixture, 1); // freed by teardown()
+    fixture->dir = g_dir_make_tmp("test_jsonl_XXXXXX", NULL);
+    if (!fixture->dir)
+        return -1;
+    *state = fixture;
+    return 0;
+}
+
+static int
+teardown(void** state)
+{
+    JsonlFixture* fixture = *state;
+    if (fixture->path)
+        g_remove(fixture->path);
+    g_rmdir(fixture->dir);
+    g_free(fixture->path);
+    g_free(fixture->dir);
+    g_free(fixture);
+    return 0;
+}
+
+/* Returns a database with papers [0, @count), not written anywhere */
+static PaperDatabase*
+make_library(const gchar* path, gint count)
+{
+    PaperDatabase* db = create_database(count, (gchar*)path, NULL);
+    for (gint i = 0; i < count; ++i) {
+        gchar* title = g_strdup_printf("Paper %d", i);          // freed below
+        gchar* pdf_file = g_strdup_printf("/papers/%d.pdf", i); // ditto
+        create_paper(db,
+                     title,
+                     NULL,
+                     0,
+                     2000 + i,
+                     NULL,
+                     0,
+                     NULL,
+                     NULL,
+                     NULL,
+                     pdf_file,
+                     NULL);
+        g_free(title);
+        g_free(pdf_file);
+    }
+    return db;
+}
+
+/* Appends the papers of a @count paper library that @path doesn't have */
+static gint
+append_library(const gchar* path, gint count)
+{
+    PaperDatabase* db = make_library(path, count);
+    PaperSnapshot* snapshot = snapshot_database(db); // freed below
+    gint appended = -1;
+    GError* error = NULL;
+    assert_true(append_papers_to_jsonl(snapshot, path, &appended, &error));
+    assert_null(error);
+    free_snapshot(snapshot);
+    free_database(db);
+    return appended;
+}
+
+static gint
+load_count(const gchar* path)
+{
+    PaperDatabase* db = create_database(1, (gchar*)path, NULL);
+    GError* error = NULL;
+    assert_true(load_papers_from_json(db, &error));
+    assert_null(error);
+    gint count = db->count;
+    free_database(db);
+    return count;
+}
+
+static void
+append_bytes(const gchar* path, const gchar* data, gsize length)
+{
+    FILE* file = g_fopen(path, "ab");
+    assert_non_null(file);
+    assert_int_equal(fwrite(data, 1, length, file), length);
+    fclose(file);
+}
+
+static void
+test_torn_line_is_dropped(void** state)
+{
+    JsonlFixture* fixture = *state;
+    fixture->path = g_build_filename(fixture->dir, "ppdb.jsonl", NULL);
+    assert_int_equal(append_library(fixture->path, PAPERS), PAPERS);
+    append_bytes(fixture->path, TORN_LINE, strlen(TORN_LINE));
+
+    assert_int_equal(load_count(fixture->path), PAPERS);
+}
+
+static void
+test_append_cuts_torn_line(void** state)
+{
+    JsonlFixture* fixture = *state;
+    fixture->path = g_build_filename(fixture->dir, "ppdb.jsonl", NULL);
+    assert_int_equal(append_library(fixture->path, PAPERS), PAPERS);
+    append_bytes(fixture->path, TORN_LINE, strlen(TORN_LINE));
+
+    assert_int_equal(append_library(fixture->path, PAPERS + 2), 2);
+    assert_int_equal(load_count(fixture->path), PAPERS + 2);
+    gchar* contents = NULL; // freed below
+    gsize length = 0;
+    assert_true(g_file_get_contents(fixture->path, &contents, &length, NULL));
+    assert_null(strstr(contents, "Cut short"));
+    assert_true(length > 0 && contents[length - 1] == '\n');
+    g_free(contents);
+}
+
+static void
+test_torn_gzip_member(void** state)
+{
+    JsonlFixture* fixture = *state;
+    fixture->path = g_build_filename(fixture->dir, "ppdb.jsonl.gz", NULL);
+    assert_int_equal(append_library(fixture->path, PAPERS), PAPERS);
+    GStatBuf st;
+    assert_int_equal(g_stat(fixture->path, &st), 0);
+    goffset first_member = st.st_size;
+    assert_int_equal(append_library(fixture->path, 2 * PAPERS), PAPERS);
+
+    // cut the second member short
+    assert_int_equal(g_stat(fixture->path, &st), 0);
+    assert_int_equal(truncate(fixture->path, (first_member + st.st_size) / 2),
+                     0);
+    assert_int_equal(load_count(fixture->path), PAPERS);
+
+    assert_int_equal(append_library(fixture->path, 2 * PAPERS), PAPERS);
+    assert_int_equal(load_count(fixture->path), 2 * PAPERS);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(
+          test_torn_line_is_dropped, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_append_cuts_torn_line, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_torn_gzip_member, setup, teardown),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
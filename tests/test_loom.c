@@ -0,0 +1,391 @@
+/* test_loom.c */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include "loom.h"
+
+#include <gio/gio.h>
+#include <glib.h>
+
+#define THREADS 4
+#define GROUP_THREADS 8
+#define CAPPED_THREADS 6
+#define TIMEOUT_MS 50
+#define RANGE 100000
+
+/* What one queued thread did, checked once it is tied off */
+typedef struct
+{
+    Loom* loom;
+    gint* gate;         // atomic, the shuttle waits while it is 0, or NULL
+    gint* sequence;     // atomic, shared by the threads of a test
+    gint* concurrent;   // atomic, shuttles of the test running right now
+    gint* max_concurrent;
+    gint sleep_ms;
+    gboolean ran;       // the shuttle started
+    gint finished_at;   // sequence number once the shuttle returned
+    gint tied_off;      // knot calls
+    GError* error;      // that the knot got
+    gboolean knot_unlocked; // another thread could lock the Loom meanwhile
+} Probe;
+
+static gpointer
+probe_shuttle(gpointer shuttle_data, GError** error)
+{
+    Probe* probe = shuttle_data;
+    probe->ran = TRUE;
+    if (probe->concurrent) {
+        gint now = g_atomic_int_add(probe->concurrent, 1) + 1;
+        gint max = g_atomic_int_get(probe->max_concurrent);
+        while (now > max && !g_atomic_int_compare_and_exchange(
+                              probe->max_concurrent, max, now))
+            max = g_atomic_int_get(probe->max_concurrent);
+    }
+    gint64 until = g_get_monotonic_time() + probe->sleep_ms * 1000;
+    while ((probe->gate && !g_atomic_int_get(probe->gate)) ||
+           g_get_monotonic_time() < until) {
+        if (g_cancellable_set_error_if_cancelled(loom_get_cancellable(), error))
+            break;
+        g_usleep(1000);
+    }
+    if (probe->concurrent)
+        g_atomic_int_add(probe->concurrent, -1);
+    if (probe->sequence)
+        probe->finished_at = g_atomic_int_add(probe->sequence, 1) + 1;
+    return probe;
+}
+
+static gpointer
+try_lock_loom(gpointer data)
+{
+    Loom* loom = data;
+    if (!g_rec_mutex_trylock(&loom->lock))
+        return GINT_TO_POINTER(FALSE);
+    g_rec_mutex_unlock(&loom->lock);
+    return GINT_TO_POINTER(TRUE);
+}
+
+static void
+probe_knot(gpointer knot_data,
+           gpointer shuttle_data,
+           gpointer result,
+           GError* error)
+{
+    (void)knot_data;
+    (void)result;
+    Probe* probe = shuttle_data;
+    probe->tied_off++;
+    probe->error = error;
+    GThread* thread = g_thread_new("try-lock", try_lock_loom, probe->loom);
+    probe->knot_unlocked = GPOINTER_TO_INT(g_thread_join(thread));
+}
+
+static LoomThreadSpec
+probe_spec(Probe* probe, const gchar* tag)
+{
+    LoomThreadSpec spec = loom_thread_spec_default();
+    spec.tag = tag;
+    spec.shuttle = probe_shuttle;
+    spec.shuttle_data = probe;
+    spec.knot = probe_knot;
+    return spec;
+}
+
+static LoomTaskId
+queue_probe(Loom* loom, Probe* probe, const gchar* tag)
+{
+    probe->loom = loom;
+    LoomThreadSpec spec = probe_spec(probe, tag);
+    return loom_queue_thread(loom, &spec, NULL);
+}
+
+static void
+wait_for(Probe* probes, guint count)
+{
+    for (guint i = 0; i < count; ++i)
+        while (probes[i].tied_off == 0)
+            g_main_context_iteration(NULL, TRUE);
+}
+
+static void
+assert_cancelled_unlocked(Probe* probe)
+{
+    assert_int_equal(probe->tied_off, 1);
+    assert_false(probe->ran);
+    assert_true(
+      g_error_matches(probe->error, G_IO_ERROR, G_IO_ERROR_CANCELLED));
+    assert_true(probe->knot_unlocked);
+    g_clear_error(&probe->error);
+}
+
+static void
+test_snip_runs_knot_unlocked(void** state)
+{
+    Loom* loom = *state;
+    gint gate = 0;
+    Probe blocker = { .gate = &gate };
+    queue_probe(loom, &blocker, "block");
+
+    const gchar* deps[] = { "block", NULL };
+    Probe waiting[3] = { { 0 } };
+    LoomTaskId ids[3];
+    for (guint i = 0; i < 3; ++i) {
+        LoomThreadSpec spec = probe_spec(&waiting[i], "wait");
+        spec.dependencies = deps;
+        spec.generation = i;
+        waiting[i].loom = loom;
+        ids[i] = loom_queue_thread(loom, &spec, NULL);
+    }
+
+    // each way to snip gives the knot the cancellation before returning
+    loom_snip_id(loom, ids[0]);
+    assert_cancelled_unlocked(&waiting[0]);
+    loom_snip_stale(loom, "wait", 2);
+    assert_cancelled_unlocked(&waiting[1]);
+    assert_true(loom_is_pending(loom, ids[2]));
+    loom_snip(loom, "wait");
+    assert_cancelled_unlocked(&waiting[2]);
+    assert_false(loom_is_pending(loom, ids[2]));
+
+    // the DAG still frees the snipped nodes once the blocker is done
+    g_atomic_int_set(&gate, 1);
+    wait_for(&blocker, 1);
+    assert_null(blocker.error);
+    assert_true(blocker.ran);
+}
+
+static void
+test_timeout(void** state)
+{
+    Loom* loom = *state;
+    gint gate = 0; // never opens
+    Probe probe = { .gate = &gate, .loom = loom };
+    LoomThreadSpec spec = probe_spec(&probe, "slow");
+    spec.timeout_ms = TIMEOUT_MS;
+    loom_queue_thread(loom, &spec, NULL);
+    wait_for(&probe, 1);
+    assert_true(probe.ran);
+    assert_true(g_error_matches(probe.error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT));
+    g_clear_error(&probe.error);
+}
+
+static void
+test_dependencies_wait(void** state)
+{
+    Loom* loom = *state;
+    gint sequence = 0;
+    Probe first = { .sequence = &sequence, .sleep_ms = 30 };
+    Probe second = { .sequence = &sequence, .loom = loom };
+    queue_probe(loom, &first, "first");
+    const gchar* deps[] = { "first", NULL };
+    LoomThreadSpec spec = probe_spec(&second, "second");
+    spec.dependencies = deps;
+    loom_queue_thread(loom, &spec, NULL);
+    wait_for(&second, 1);
+    wait_for(&first, 1);
+    assert_int_equal(first.finished_at, 1);
+    assert_int_equal(second.finished_at, 2);
+}
+
+static void
+test_group_orders_and_snips(void** state)
+{
+    Loom* loom = *state;
+    gint sequence = 0;
+    LoomGroup* group = loom_group_new("test-group"); // freed below
+    Probe members[GROUP_THREADS] = { { 0 } };
+    for (guint i = 0; i < GROUP_THREADS; ++i) {
+        LoomThreadSpec spec = probe_spec(&members[i], "member");
+        members[i].loom = loom;
+        members[i].sequence = &sequence;
+        members[i].sleep_ms = 5;
+        spec.group = group;
+        loom_queue_thread(loom, &spec, NULL);
+    }
+    Probe after = { .sequence = &sequence, .loom = loom };
+    LoomThreadSpec spec = probe_spec(&after, "after");
+    spec.after_group = group;
+    loom_queue_thread(loom, &spec, NULL);
+    wait_for(&after, 1);
+    wait_for(members, GROUP_THREADS);
+    assert_int_equal(after.finished_at, GROUP_THREADS + 1);
+    assert_int_equal(loom_group_get_size(group), 0);
+
+    // members still waiting are dropped at once, running ones cancelled
+    gint gate = 0;
+    Probe blocker = { .gate = &gate };
+    queue_probe(loom, &blocker, "block");
+    const gchar* deps[] = { "block", NULL };
+    Probe waiting[2] = { { 0 } };
+    for (guint i = 0; i < 2; ++i) {
+        LoomThreadSpec member = probe_spec(&waiting[i], "member");
+        waiting[i].loom = loom;
+        member.dependencies = deps;
+        member.group = group;
+        loom_queue_thread(loom, &member, NULL);
+    }
+    assert_int_equal(loom_group_get_size(group), 2);
+    loom_group_snip(group);
+    assert_int_equal(loom_group_get_size(group), 0);
+    for (guint i = 0; i < 2; ++i)
+        assert_cancelled_unlocked(&waiting[i]);
+    g_atomic_int_set(&gate, 1);
+    wait_for(&blocker, 1);
+    loom_group_unref(group);
+}
+
+static void
+mark_range(gsize begin, gsize end, gpointer user_data)
+{
+    gint* marks = user_data;
+    for (gsize i = begin; i < end; ++i)
+        g_atomic_int_inc(&marks[i]);
+}
+
+static void
+sum_range(gsize begin, gsize end, gpointer partial, gpointer user_data)
+{
+    (void)user_data;
+    for (gsize i = begin; i < end; ++i)
+        *(guint64*)partial += i;
+}
+
+static void
+add_sums(gpointer result, gconstpointer partial, gpointer user_data)
+{
+    (void)user_data;
+    *(guint64*)result += *(const guint64*)partial;
+}
+
+static void
+test_parallel_for(void** state)
+{
+    Loom* loom = *state;
+    gint* marks = g_new0(gint, RANGE); // freed below
+    loom_parallel_for(loom, 0, RANGE, 16, mark_range, marks);
+    for (gsize i = 0; i < RANGE; ++i)
+        if (marks[i] != 1)
+            fail_msg("index %zu visited %d times", i, marks[i]);
+    g_free(marks);
+
+    guint64 sum = 0;
+    loom_parallel_reduce(
+      loom, 0, RANGE, 16, sum_range, add_sums, &sum, sizeof(sum), NULL);
+    assert_true(sum == (guint64)RANGE * (RANGE - 1) / 2);
+}
+
+/* Threads that ran slices of a loop, and the most CPU threads seen running */
+typedef struct
+{
+    Loom* loom;
+    GMutex lock;
+    GHashTable* threads;
+    guint max_occupancy;
+} SliceLog;
+
+static void
+log_slice(gsize begin, gsize end, gpointer user_data)
+{
+    (void)begin;
+    (void)end;
+    SliceLog* log = user_data;
+    guint occupancy = loom_get_occupancy(log->loom, LOOM_RESOURCE_CPU, NULL);
+    g_mutex_lock(&log->lock);
+    g_hash_table_add(log->threads, g_thread_self());
+    log->max_occupancy = MAX(log->max_occupancy, occupancy);
+    g_mutex_unlock(&log->lock);
+    g_usleep(100);
+}
+
+static void
+test_parallel_for_respects_cap(void** state)
+{
+    Loom* loom = *state;
+    loom_set_resource_limits(loom, LOOM_RESOURCE_CPU, 2, 1);
+    gint gate = 0;
+    Probe blocker = { .gate = &gate };
+    queue_probe(loom, &blocker, "block");
+    while (loom_get_occupancy(loom, LOOM_RESOURCE_CPU, NULL) == 0)
+        g_usleep(1000);
+
+    // one CPU thread is left, so one helper at most
+    SliceLog log = { .loom = loom };
+    g_mutex_init(&log.lock);
+    log.threads = g_hash_table_new(NULL, NULL); // freed below
+    loom_parallel_for(loom, 0, 1000, 1, log_slice, &log);
+    assert_true(g_hash_table_size(log.threads) <= 2);
+    assert_true(log.max_occupancy <= 2);
+    g_hash_table_destroy(log.threads);
+    g_mutex_clear(&log.lock);
+
+    // the helper gives its thread back once it returns
+    gint64 deadline = g_get_monotonic_time() + G_USEC_PER_SEC;
+    while (loom_get_occupancy(loom, LOOM_RESOURCE_CPU, NULL) > 1 &&
+           g_get_monotonic_time() < deadline)
+        g_usleep(1000);
+    assert_int_equal(loom_get_occupancy(loom, LOOM_RESOURCE_CPU, NULL), 1);
+    g_atomic_int_set(&gate, 1);
+    wait_for(&blocker, 1);
+}
+
+static void
+test_resource_cap(void** state)
+{
+    Loom* loom = *state;
+    loom_set_resource_limits(loom, LOOM_RESOURCE_IO, 1, 1);
+    gint concurrent = 0;
+    gint max_concurrent = 0;
+    Probe probes[CAPPED_THREADS] = { { 0 } };
+    for (guint i = 0; i < CAPPED_THREADS; ++i) {
+        probes[i].loom = loom;
+        probes[i].concurrent = &concurrent;
+        probes[i].max_concurrent = &max_concurrent;
+        probes[i].sleep_ms = 5;
+        LoomThreadSpec spec = probe_spec(&probes[i], "capped");
+        spec.resource = LOOM_RESOURCE_IO;
+        loom_queue_thread(loom, &spec, NULL);
+    }
+    guint queued = 0;
+    assert_true(loom_get_occupancy(loom, LOOM_RESOURCE_IO, &queued) <= 1);
+    wait_for(probes, CAPPED_THREADS);
+    assert_int_equal(max_concurrent, 1);
+    assert_int_equal(loom_get_occupancy(loom, LOOM_RESOURCE_IO, &queued), 0);
+    assert_int_equal(queued, 0);
+}
+
+static int
+setup(void** state)
+{
+    *state = loom_new(THREADS);
+    return 0;
+}
+
+static int
+teardown(void** state)
+{
+    loom_disassemble(*state);
+    return 0;
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(
+          test_snip_runs_knot_unlocked, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_timeout, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_dependencies_wait, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_group_orders_and_snips, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_parallel_for, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_parallel_for_respects_cap, setup, teardown),
+        cmocka_unit_test_setup_teardown(test_resource_cap, setup, teardown),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
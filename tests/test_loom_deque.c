@@ -0,0 +1,125 @@
+/* test_loom_deque.c */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include "loom_deque.h"
+
+#include <glib.h>
+
+#define THIEVES 3
+#define ROUNDS 200
+// per round, enough to grow the ring a few times
+#define TASKS_PER_ROUND (LOOM_DEQUE_INITIAL_SIZE * 9)
+#define TASKS (ROUNDS * TASKS_PER_ROUND)
+
+/* Tasks are 1-based indices into taken, so none is NULL */
+typedef struct
+{
+    LoomDeque deque;
+    gint* taken;     // atomic, how often each task was taken
+    gint owner_done; // atomic
+} RaceState;
+
+static void
+test_order_and_growth(void** state)
+{
+    (void)state;
+    LoomDeque deque;
+    loom_deque_init(&deque);
+    gint n = LOOM_DEQUE_INITIAL_SIZE * 4 + 3;
+    for (gint i = 1; i <= n; ++i)
+        loom_deque_push(&deque, GINT_TO_POINTER(i));
+    assert_true(deque.retired != NULL);
+
+    // oldest from the top, newest from the bottom
+    assert_int_equal(GPOINTER_TO_INT(loom_deque_steal(&deque)), 1);
+    assert_int_equal(GPOINTER_TO_INT(loom_deque_steal(&deque)), 2);
+    assert_int_equal(GPOINTER_TO_INT(loom_deque_pop(&deque)), n);
+    for (gint i = n - 1; i >= 3; --i)
+        assert_int_equal(GPOINTER_TO_INT(loom_deque_pop(&deque)), i);
+    assert_null(loom_deque_pop(&deque));
+    assert_null(loom_deque_steal(&deque));
+
+    // still usable once empty
+    loom_deque_push(&deque, GINT_TO_POINTER(7));
+    assert_int_equal(GPOINTER_TO_INT(loom_deque_steal(&deque)), 7);
+    assert_null(loom_deque_pop(&deque));
+    loom_deque_clear(&deque);
+}
+
+static void
+take(RaceState* race, gpointer task)
+{
+    gint index = GPOINTER_TO_INT(task) - 1;
+    assert_true(index >= 0 && index < TASKS);
+    g_atomic_int_inc(&race->taken[index]);
+}
+
+static gpointer
+thief_main(gpointer data)
+{
+    RaceState* race = data;
+    for (;;) {
+        gboolean done = g_atomic_int_get(&race->owner_done);
+        gpointer task = loom_deque_steal(&race->deque);
+        if (task)
+            take(race, task);
+        else if (done)
+            break;
+    }
+    return NULL;
+}
+
+static void
+test_steal_races(void** state)
+{
+    (void)state;
+    RaceState race = { 0 };
+    loom_deque_init(&race.deque);
+    race.taken = g_new0(gint, TASKS); // freed below
+    GThread* thieves[THIEVES];
+    for (gint i = 0; i < THIEVES; ++i)
+        thieves[i] = g_thread_new("thief", thief_main, &race);
+
+    // the owner pushes a round, then pops half of it back while the thieves
+    // steal from the other end, so the last task is raced for often
+    gint next = 1;
+    for (gint round = 0; round < ROUNDS; ++round) {
+        for (gint i = 0; i < TASKS_PER_ROUND; ++i)
+            loom_deque_push(&race.deque, GINT_TO_POINTER(next++));
+        for (gint i = 0; i < TASKS_PER_ROUND / 2; ++i) {
+            gpointer task = loom_deque_pop(&race.deque);
+            if (!task)
+                break;
+            take(&race, task);
+        }
+    }
+    gpointer task;
+    while ((task = loom_deque_pop(&race.deque)))
+        take(&race, task);
+    g_atomic_int_set(&race.owner_done, TRUE);
+    for (gint i = 0; i < THIEVES; ++i)
+        g_thread_join(thieves[i]);
+
+    // every task exactly once, none lost or duplicated by a race
+    for (gint i = 0; i < TASKS; ++i)
+        if (race.taken[i] != 1)
+            fail_msg("task %d taken %d times", i + 1, race.taken[i]);
+    assert_null(loom_deque_steal(&race.deque));
+    g_free(race.taken);
+    loom_deque_clear(&race.deque);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test(test_order_and_growth),
+        cmocka_unit_test(test_steal_races),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
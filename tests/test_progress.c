@@ -0,0 +1,177 @@
+/* test_progress.c */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include "config.h"
+#include "loom.h"
+
+#include <glib.h>
+
+#define REPORTS 200    // per thread
+#define REPORT_US 500  // between reports
+#define GROUP_THREADS 8
+#define DELIVERY_TIMEOUT_US (G_USEC_PER_SEC)
+
+typedef struct
+{
+    GThread* main_thread;
+    gint remaining;  // threads not tied off
+    guint calls;     // progress callbacks
+    guint off_main;  // progress callbacks not on the main thread
+    gboolean monotonic;
+    gdouble last;
+} ProgressLog;
+
+static gpointer
+reporting_shuttle(gpointer shuttle_data, GError** error)
+{
+    (void)shuttle_data;
+    (void)error;
+    for (guint i = 1; i <= REPORTS; ++i) {
+        loom_report_progress((gdouble)i / REPORTS);
+        g_usleep(REPORT_US);
+    }
+    return NULL;
+}
+
+static void
+count_knot(gpointer knot_data,
+           gpointer shuttle_data,
+           gpointer result,
+           GError* error)
+{
+    (void)shuttle_data;
+    (void)result;
+    ProgressLog* log = knot_data;
+    g_clear_error(&error);
+    log->remaining--;
+}
+
+static void
+log_fraction(ProgressLog* log, gdouble fraction)
+{
+    log->calls++;
+    if (g_thread_self() != log->main_thread)
+        log->off_main++;
+    if (fraction < log->last || fraction < 0.0 || fraction > 1.0)
+        log->monotonic = FALSE;
+    log->last = fraction;
+}
+
+static void
+log_thread_progress(gpointer knot_data, gpointer shuttle_data, gdouble fraction)
+{
+    (void)shuttle_data;
+    log_fraction(knot_data, fraction);
+}
+
+static void
+log_group_progress(LoomGroup* group, gdouble fraction, gpointer user_data)
+{
+    (void)group;
+    log_fraction(user_data, fraction);
+}
+
+static void
+log_init(ProgressLog* log)
+{
+    *log = (ProgressLog){ .main_thread = g_thread_self(), .monotonic = TRUE };
+}
+
+static void
+queue_reporter(Loom* loom, ProgressLog* log, LoomGroup* group)
+{
+    LoomThreadSpec spec = loom_thread_spec_default();
+    spec.tag = "test-progress";
+    spec.shuttle = reporting_shuttle;
+    spec.knot = count_knot;
+    spec.knot_data = log;
+    spec.progress = group ? NULL : log_thread_progress;
+    spec.group = group;
+    log->remaining++;
+    loom_queue_thread(loom, &spec, NULL);
+}
+
+/* Callbacks run at most once a tick, so there can't be more than this */
+static guint
+max_deliveries(gint64 started_at)
+{
+    gint64 elapsed_ms = (g_get_monotonic_time() - started_at) / 1000;
+    return (guint)(elapsed_ms / LOOM_PROGRESS_INTERVAL_MS) + 1;
+}
+
+static void
+test_thread_reports_are_coalesced(void** state)
+{
+    Loom* loom = *state;
+    ProgressLog log;
+    log_init(&log);
+    gint64 started_at = g_get_monotonic_time();
+    queue_reporter(loom, &log, NULL);
+    while (log.remaining > 0)
+        g_main_context_iteration(NULL, TRUE);
+
+    assert_true(log.calls > 0);
+    assert_true(log.calls < REPORTS);
+    assert_true(log.calls <= max_deliveries(started_at));
+    assert_int_equal(log.off_main, 0);
+    assert_true(log.monotonic);
+}
+
+static void
+test_group_progress_reaches_one(void** state)
+{
+    Loom* loom = *state;
+    ProgressLog log;
+    log_init(&log);
+    LoomGroup* group = loom_group_new("test-progress"); // freed below
+    loom_group_set_progress_func(group, log_group_progress, &log);
+    gint64 started_at = g_get_monotonic_time();
+    // all join before the first tick, so the progress can't drop
+    for (guint i = 0; i < GROUP_THREADS; ++i)
+        queue_reporter(loom, &log, group);
+    while (log.remaining > 0)
+        g_main_context_iteration(NULL, TRUE);
+    // the last tick comes after the last thread is tied off
+    gint64 deadline = g_get_monotonic_time() + DELIVERY_TIMEOUT_US;
+    while (log.last < 1.0 && g_get_monotonic_time() < deadline)
+        g_main_context_iteration(NULL, FALSE);
+
+    assert_true(log.calls > 1);
+    assert_true(log.calls <= max_deliveries(started_at));
+    assert_int_equal(log.off_main, 0);
+    assert_true(log.monotonic);
+    assert_true(log.last == 1.0);
+    assert_int_equal(loom_group_get_size(group), 0);
+    loom_group_unref(group);
+}
+
+static int
+setup(void** state)
+{
+    *state = loom_new(4);
+    return 0;
+}
+
+static int
+teardown(void** state)
+{
+    loom_disassemble(*state);
+    return 0;
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(
+          test_thread_reports_are_coalesced, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_group_progress_reaches_one, setup, teardown),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
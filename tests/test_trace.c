@@ -0,0 +1,194 @@
+/* test_trace.c */
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <cmocka.h>
+
+#include "cJSON/cJSON.h"
+#include "config.h"
+#include "trace.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#define ASYNC_ID 42
+
+typedef struct
+{
+    gchar* dir;
+    gchar* path;
+} TraceFixture;
+
+static int
+setup(void** state)
+{
+    TraceFixture* fixture = g_new0(TraceFixture, 1); // freed by teardown()
+    fixture->dir = g_dir_make_tmp("test_trace_XXXXXX", NULL);
+    if (!fixture->dir)
+        return -1;
+    fixture->path = g_build_filename(fixture->dir, "trace.json", NULL);
+    *state = fixture;
+    return 0;
+}
+
+static int
+teardown(void** state)
+{
+    TraceFixture* fixture = *state;
+    g_remove(fixture->path);
+    g_rmdir(fixture->dir);
+    g_free(fixture->path);
+    g_free(fixture->dir);
+    g_free(fixture);
+    return 0;
+}
+
+/* Exports the trace and returns its traceEvents array, root in @out_root */
+static cJSON*
+export_events(const gchar* path, cJSON** out_root)
+{
+    GError* error = NULL;
+    assert_true(trace_export(path, &error));
+    assert_null(error);
+
+    gchar* contents = NULL; // freed below
+    assert_true(g_file_get_contents(path, &contents, NULL, NULL));
+    *out_root = cJSON_Parse(contents);
+    g_free(contents);
+    assert_non_null(*out_root);
+    cJSON* events = cJSON_GetObjectItem(*out_root, "traceEvents");
+    assert_true(cJSON_IsArray(events));
+    return events;
+}
+
+static const gchar*
+get_string(const cJSON* event, const gchar* key)
+{
+    const cJSON* item = cJSON_GetObjectItem(event, key);
+    return cJSON_IsString(item) ? item->valuestring : NULL;
+}
+
+/* Returns the tid of the track named @name, or -1 */
+static gint
+find_track(const cJSON* events, const gchar* name)
+{
+    const cJSON* event = NULL;
+    cJSON_ArrayForEach(event, events)
+    {
+        if (g_strcmp0(get_string(event, "ph"), "M") != 0)
+            continue;
+        const cJSON* args = cJSON_GetObjectItem(event, "args");
+        if (g_strcmp0(get_string(args, "name"), name) == 0)
+            return cJSON_GetObjectItem(event, "tid")->valueint;
+    }
+    return -1;
+}
+
+/* Counts the events of @tid with the given name and phase */
+static guint
+count_events(const cJSON* events, gint tid, const gchar* name, const gchar* ph)
+{
+    guint count = 0;
+    const cJSON* event = NULL;
+    cJSON_ArrayForEach(event, events)
+    {
+        if (cJSON_GetObjectItem(event, "tid")->valueint == tid &&
+            g_strcmp0(get_string(event, "name"), name) == 0 &&
+            g_strcmp0(get_string(event, "ph"), ph) == 0)
+            count++;
+    }
+    return count;
+}
+
+static gpointer
+worker_thread(gpointer data)
+{
+    (void)data;
+    trace_set_thread_name("test worker");
+    trace_begin("test", "inner");
+    trace_async_begin("test", "job", ASYNC_ID);
+    trace_end("test", "inner");
+    return NULL;
+}
+
+static void
+test_export_slices_per_thread(void** state)
+{
+    TraceFixture* fixture = *state;
+    trace_set_thread_name("test main");
+    trace_begin("test", "outer");
+    g_thread_join(g_thread_new("test worker", worker_thread, NULL));
+    // the async slice ends on another thread than it began
+    trace_async_end("test", "job", ASYNC_ID);
+    trace_end("test", "outer");
+
+    cJSON* root = NULL;
+    cJSON* events = export_events(fixture->path, &root);
+    gint main_tid = find_track(events, "test main");
+    gint worker_tid = find_track(events, "test worker");
+    assert_true(main_tid > 0);
+    assert_true(worker_tid > 0);
+    assert_int_not_equal(main_tid, worker_tid);
+
+    assert_int_equal(count_events(events, main_tid, "outer", "B"), 1);
+    assert_int_equal(count_events(events, main_tid, "outer", "E"), 1);
+    assert_int_equal(count_events(events, worker_tid, "inner", "B"), 1);
+    assert_int_equal(count_events(events, worker_tid, "inner", "E"), 1);
+    assert_int_equal(count_events(events, worker_tid, "job", "b"), 1);
+    assert_int_equal(count_events(events, main_tid, "job", "e"), 1);
+
+    const cJSON* event = NULL;
+    cJSON_ArrayForEach(event, events)
+    {
+        if (g_strcmp0(get_string(event, "name"), "job") == 0)
+            assert_string_equal(get_string(event, "id"), "0x2a");
+        if (g_strcmp0(get_string(event, "name"), "outer") == 0) {
+            assert_string_equal(get_string(event, "cat"), "test");
+            assert_true(cJSON_IsNumber(cJSON_GetObjectItem(event, "ts")));
+        }
+    }
+    cJSON_Delete(root);
+}
+
+static gpointer
+flooding_thread(gpointer data)
+{
+    (void)data;
+    trace_set_thread_name("test flood");
+    for (guint i = 0; i < 10; ++i)
+        trace_begin("test", "early");
+    for (guint i = 0; i < TRACE_RING_EVENTS; ++i)
+        trace_begin("test", "late");
+    return NULL;
+}
+
+static void
+test_ring_keeps_latest_events(void** state)
+{
+    TraceFixture* fixture = *state;
+    g_thread_join(g_thread_new("test flood", flooding_thread, NULL));
+
+    cJSON* root = NULL;
+    cJSON* events = export_events(fixture->path, &root);
+    gint tid = find_track(events, "test flood");
+    assert_true(tid > 0);
+    assert_int_equal(count_events(events, tid, "early", "B"), 0);
+    // the oldest slot is skipped too, it may be half overwritten
+    assert_int_equal(count_events(events, tid, "late", "B"),
+                     TRACE_RING_EVENTS - 1);
+    cJSON_Delete(root);
+}
+
+int
+main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(
+          test_export_slices_per_thread, setup, teardown),
+        cmocka_unit_test_setup_teardown(
+          test_ring_keeps_latest_events, setup, teardown),
+    };
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}